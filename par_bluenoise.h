@@ -96,11 +96,14 @@ float* par_bluenoise_generate(
     par_bluenoise_context* ctx, float density, int* npts);
 
 // Generates an ordered sequence of tuples with the specified sequence length.
-// This is slower than the other "generate" method because it uses a dumb
-// backtracking method to determine a reasonable density value, and it
-// automatically sorts the output by rank.  The dims argument must be 2 or more;
-// it represents the desired stride (in floats) between consecutive verts in the
-// returned data buffer.
+// Tiles are visited in order of the density at which they first contribute
+// points, so the result matches what "generate" would produce at the smallest
+// density that yields npts points.  The output is sorted by that
+// density, which makes every prefix a valid blue noise set.  The dims argument
+// must be 2 or more; it represents the desired stride (in floats) between
+// consecutive verts in the returned data buffer.  If dims is 3 or more, the
+// third component holds the index of the point.  Returns null if the density
+// function is too sparse to produce npts points above the float resolution.
 float* par_bluenoise_generate_exact(
     par_bluenoise_context* ctx, int npts, int dims);
 
@@ -108,6 +111,17 @@ float* par_bluenoise_generate_exact(
 // replaces the 3rd component with an index.
 void par_bluenoise_sort_by_rank(float* pts, int npts);
 
+// Set this to 1 to generate independent subtiles concurrently, which uses
+// pthreads.  The output is identical to the single-threaded output.
+#ifndef PAR_BLUENOISE_THREADS
+#define PAR_BLUENOISE_THREADS 0
+#endif
+
+// Number of threads used by generate, or 0 to match the core count.
+#ifndef PAR_BLUENOISE_NTHREADS
+#define PAR_BLUENOISE_NTHREADS 0
+#endif
+
 #ifndef PAR_PI
 #define PAR_PI (3.14159265359)
 #define PAR_MIN(a, b) (a > b ? b : a)
@@ -138,6 +152,14 @@ void par_bluenoise_sort_by_rank(float* pts, int npts);
 #include <assert.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <limits.h>
+
+#if PAR_BLUENOISE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #define PAR_MINI(a, b) ((a < b) ? a : b)
 #define PAR_MAXI(a, b) ((a > b) ? a : b)
@@ -153,6 +175,24 @@ typedef struct {
     float rank;
 } par_vec3;
 
+// Pending tile in generate_exact, keyed by the density that reaches it.
+typedef struct {
+    float density;
+    float x, y;
+    int level;
+    int tile;
+} par_visit;
+
+// Destination for generated points.  Tiles deeper than maxlevel are skipped,
+// and the buffer grows on demand if its capacity is less than maxpoints.
+typedef struct {
+    par_vec3* points;
+    int npoints;
+    int maxpoints;
+    int capacity;
+    int maxlevel;
+} par_sink;
+
 typedef struct {
     int n, e, s, w;
     int nsubtiles, nsubdivs, npoints, nsubpts;
@@ -176,32 +216,118 @@ struct par_bluenoise_context_s {
     int window_width;
     int window_height;
     int abridged;
+    int minpoints;
+    par_visit* visits;
+    int maxvisits;
+    unsigned char* mipdata;
+    unsigned char* mips[32];
+    int mipwidths[32];
+    int nmips;
 };
 
+// Maps a point in [0, 1] to the lower-left texel of its bilinear footprint.
+static void density_texel(par_bluenoise_context const* ctx, float x, float y,
+    int* ix, int* iy, float* fx, float* fy)
+{
+    int width = ctx->density_width;
+    int height = ctx->density_height;
+    int extent = PAR_MAXI(width, height);
+    float tx = (x - 0.5f) * extent + width / 2 - 0.5f;
+    float ty = (0.5f - y) * extent + height / 2 - 0.5f;
+    *ix = PAR_CLAMP((int) floorf(tx), 0, width - 2);
+    *iy = PAR_CLAMP((int) floorf(ty), 0, height - 2);
+    *fx = PAR_CLAMP(tx - *ix, 0.0f, 1.0f);
+    *fy = PAR_CLAMP(ty - *iy, 0.0f, 1.0f);
+}
+
 static float sample_density(par_bluenoise_context* ctx, float x, float y)
 {
-    unsigned char* density = ctx->density;
+    unsigned char const* density = ctx->density;
     if (!density) {
         return 1;
     }
+    int ix, iy;
+    float fx, fy;
+    density_texel(ctx, x, y, &ix, &iy, &fx, &fy);
+    unsigned char const* row0 = density + iy * ctx->density_width + ix;
+    unsigned char const* row1 = row0 + ctx->density_width;
+    float a = row0[0] + (row0[1] - row0[0]) * fx;
+    float b = row1[0] + (row1[1] - row1[0]) * fx;
+    return (a + (b - a) * fy) * (1.0f / 255.0f);
+}
+
+// Returns an upper bound for sample_density over the given rectangle by
+// reading at most four texels from the max pyramid.
+static float max_density(par_bluenoise_context* ctx, float left, float bottom,
+    float size)
+{
+    if (!ctx->density) {
+        return 1;
+    }
+    int ix0, iy0, ix1, iy1;
+    float fx, fy;
+    density_texel(ctx, left, bottom + size, &ix0, &iy0, &fx, &fy);
+    density_texel(ctx, left + size, bottom, &ix1, &iy1, &fx, &fy);
+    ix1++;
+    iy1++;
+    int level = 0;
+    while (level < ctx->nmips - 1 && ((ix1 >> level) - (ix0 >> level) > 1 ||
+        (iy1 >> level) - (iy0 >> level) > 1)) {
+        level++;
+    }
+    unsigned char const* mip = ctx->mips[level];
+    int width = ctx->mipwidths[level];
+    int result = 0;
+    for (int j = iy0 >> level; j <= iy1 >> level; j++) {
+        for (int i = ix0 >> level; i <= ix1 >> level; i++) {
+            result = PAR_MAXI(result, mip[j * width + i]);
+        }
+    }
+    return result * (1.0f / 255.0f);
+}
+
+// Builds a pyramid in which each texel holds the maximum of four texels from
+// the level below, ending with a single texel.
+static void build_mips(par_bluenoise_context* ctx)
+{
     int width = ctx->density_width;
     int height = ctx->density_height;
-    y = 1 - y;
-    x -= 0.5;
-    y -= 0.5;
-    float tx = x * PAR_MAXI(width, height);
-    float ty = y * PAR_MAXI(width, height);
-    x += 0.5;
-    y += 0.5;
-    tx += width / 2;
-    ty += height / 2;
-    int ix = PAR_CLAMP((int) tx, 0, width - 2);
-    int iy = PAR_CLAMP((int) ty, 0, height - 2);
-    return density[iy * width + ix] / 255.0f;
+    int total = 0;
+    for (int w = width, h = height; w > 1 || h > 1;) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        total += w * h;
+    }
+    free(ctx->mipdata);
+    ctx->mipdata = PAR_MALLOC(unsigned char, PAR_MAXI(total, 1));
+    ctx->mips[0] = ctx->density;
+    ctx->mipwidths[0] = width;
+    ctx->nmips = 1;
+    unsigned char* dst = ctx->mipdata;
+    while ((width > 1 || height > 1) && ctx->nmips < 32) {
+        unsigned char const* src = ctx->mips[ctx->nmips - 1];
+        int mwidth = (width + 1) / 2;
+        int mheight = (height + 1) / 2;
+        for (int j = 0; j < mheight; j++) {
+            int j0 = j * 2, j1 = PAR_MINI(j * 2 + 1, height - 1);
+            for (int i = 0; i < mwidth; i++) {
+                int i0 = i * 2, i1 = PAR_MINI(i * 2 + 1, width - 1);
+                int a = PAR_MAXI(src[j0 * width + i0], src[j0 * width + i1]);
+                int b = PAR_MAXI(src[j1 * width + i0], src[j1 * width + i1]);
+                dst[j * mwidth + i] = PAR_MAXI(a, b);
+            }
+        }
+        ctx->mips[ctx->nmips] = dst;
+        ctx->mipwidths[ctx->nmips] = mwidth;
+        ctx->nmips++;
+        dst += mwidth * mheight;
+        width = mwidth;
+        height = mheight;
+    }
 }
 
-static void recurse_tile(
-    par_bluenoise_context* ctx, par_tile* tile, float x, float y, int level)
+static void recurse_tile(par_bluenoise_context* ctx, par_sink* sink,
+    par_tile* tile, float x, float y, int level)
 {
     float left = ctx->left, right = ctx->right;
     float top = ctx->top, bottom = ctx->bottom;
@@ -210,10 +336,19 @@ static void recurse_tile(
     if (x + tileSize < left || x > right || y + tileSize < bottom || y > top) {
         return;
     }
+    if (sink->npoints >= sink->maxpoints) {
+        return;
+    }
     float depth = powf(ctx->nsubtiles, 2 * level);
     float threshold = mag / depth * ctx->global_density - tile->npoints;
     int ntests = PAR_MINI(tile->nsubpts, threshold);
     float factor = 1.f / mag * depth / ctx->global_density;
+
+    // Every point in this subtree has a threshold of at least minpoints times
+    // the factor, so we can skip it when the density is too low everywhere.
+    if (max_density(ctx, x, y, tileSize) < ctx->minpoints * factor) {
+        return;
+    }
     for (int i = 0; i < ntests; i++) {
         float px = x + tile->subpts[i].x * tileSize;
         float py = y + tile->subpts[i].y * tileSize;
@@ -223,16 +358,21 @@ static void recurse_tile(
         if (sample_density(ctx, px, py) < (i + tile->npoints) * factor) {
             continue;
         }
-        ctx->points[ctx->npoints].x = px - 0.5;
-        ctx->points[ctx->npoints].y = py - 0.5;
-        ctx->points[ctx->npoints].rank = (level + 1) + i * factor;
-        ctx->npoints++;
-        if (ctx->npoints >= ctx->maxpoints) {
+        if (sink->npoints == sink->capacity) {
+            sink->capacity = PAR_MAXI(256, sink->capacity * 2);
+            sink->points = PAR_REALLOC(par_vec3, sink->points,
+                sink->capacity);
+        }
+        par_vec3* dst = sink->points + sink->npoints++;
+        dst->x = px - 0.5;
+        dst->y = py - 0.5;
+        dst->rank = (level + 1) + i * factor;
+        if (sink->npoints >= sink->maxpoints) {
             return;
         }
     }
     const float scale = tileSize / ctx->nsubtiles;
-    if (threshold <= tile->nsubpts) {
+    if (threshold <= tile->nsubpts || level >= sink->maxlevel) {
         return;
     }
     level++;
@@ -240,11 +380,198 @@ static void recurse_tile(
         for (int tx = 0; tx < ctx->nsubtiles; tx++) {
             int tileIndex = tile->subdivs[0][ty * ctx->nsubtiles + tx];
             par_tile* subtile = &ctx->tiles[tileIndex];
-            recurse_tile(ctx, subtile, x + tx * scale, y + ty * scale, level);
+            recurse_tile(ctx, sink, subtile, x + tx * scale, y + ty * scale,
+                level);
         }
     }
 }
 
+#if PAR_BLUENOISE_THREADS
+
+// Subtree of the tile hierarchy that can be generated independently.  Tasks
+// are listed in depth-first order, so concatenating their output reproduces
+// the serial ordering.  Tiles above the split level are emitted by tasks
+// that do not recurse.
+typedef struct {
+    par_tile* tile;
+    float x, y;
+    int level;
+    int recurse;
+    int thread;
+    int begin;
+    int end;
+} par_task;
+
+typedef struct {
+    par_bluenoise_context* ctx;
+    par_task* tasks;
+    int ntasks;
+    int capacity;
+    int next;
+    int budget;
+    pthread_mutex_t lock;
+} par_schedule;
+
+typedef struct {
+    par_schedule* schedule;
+    par_sink sink;
+    int index;
+} par_worker;
+
+// Mirrors the control flow of recurse_tile without generating points, and
+// returns the number of recursive tasks.
+static int plan_tile(par_schedule* schedule, par_tile* tile, float x, float y,
+    int level, int splitlevel)
+{
+    par_bluenoise_context* ctx = schedule->ctx;
+    float tileSize = 1.f / powf(ctx->nsubtiles, level);
+    if (x + tileSize < ctx->left || x > ctx->right ||
+        y + tileSize < ctx->bottom || y > ctx->top) {
+        return 0;
+    }
+    if (schedule->ntasks == schedule->capacity) {
+        schedule->capacity = PAR_MAXI(64, schedule->capacity * 2);
+        schedule->tasks = PAR_REALLOC(par_task, schedule->tasks,
+            schedule->capacity);
+    }
+    par_task* task = schedule->tasks + schedule->ntasks++;
+    task->tile = tile;
+    task->x = x;
+    task->y = y;
+    task->level = level;
+    task->recurse = level == splitlevel;
+    if (task->recurse) {
+        return 1;
+    }
+    float depth = powf(ctx->nsubtiles, 2 * level);
+    float factor = 1.f / ctx->mag * depth / ctx->global_density;
+    if (max_density(ctx, x, y, tileSize) < ctx->minpoints * factor) {
+        schedule->ntasks--;
+        return 0;
+    }
+    float threshold = ctx->mag / depth * ctx->global_density - tile->npoints;
+    if (threshold <= tile->nsubpts) {
+        return 0;
+    }
+    const float scale = tileSize / ctx->nsubtiles;
+    int nrecursive = 0;
+    level++;
+    for (int ty = 0; ty < ctx->nsubtiles; ty++) {
+        for (int tx = 0; tx < ctx->nsubtiles; tx++) {
+            int tileIndex = tile->subdivs[0][ty * ctx->nsubtiles + tx];
+            par_tile* subtile = &ctx->tiles[tileIndex];
+            nrecursive += plan_tile(schedule, subtile, x + tx * scale,
+                y + ty * scale, level, splitlevel);
+        }
+    }
+    return nrecursive;
+}
+
+static void* generate_tasks(void* arg)
+{
+    par_worker* worker = (par_worker*) arg;
+    par_schedule* schedule = worker->schedule;
+    par_bluenoise_context* ctx = schedule->ctx;
+    par_sink* sink = &worker->sink;
+    int nproduced = 0;
+    while (1) {
+        pthread_mutex_lock(&schedule->lock);
+        schedule->budget -= nproduced;
+        int t = schedule->next++;
+        int budget = schedule->budget;
+        pthread_mutex_unlock(&schedule->lock);
+        if (t >= schedule->ntasks) {
+            break;
+        }
+
+        // Tasks are claimed in order, so every finished task precedes this
+        // one and the budget left by them bounds what can survive truncation.
+        par_task* task = schedule->tasks + t;
+        task->thread = worker->index;
+        task->begin = task->end = sink->npoints;
+        nproduced = 0;
+        if (budget <= 0) {
+            continue;
+        }
+        sink->maxpoints = sink->npoints + budget;
+        sink->maxlevel = task->recurse ? INT_MAX : task->level;
+        recurse_tile(ctx, sink, task->tile, task->x, task->y, task->level);
+        task->end = sink->npoints;
+        nproduced = task->end - task->begin;
+    }
+    return 0;
+}
+
+// Splits the hierarchy deep enough to keep every thread busy, then generates
+// the subtrees concurrently and concatenates them.  Returns false if there is
+// not enough parallelism to be worthwhile.
+static int generate_parallel(par_bluenoise_context* ctx, par_sink* sink)
+{
+    int nthreads = PAR_BLUENOISE_NTHREADS;
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads <= 1) {
+        return 0;
+    }
+    par_schedule schedule = {0};
+    schedule.ctx = ctx;
+    int nrecursive = 0, splitlevel = 0;
+    for (int level = 1; level < 8 && nrecursive < nthreads * 4; level++) {
+        schedule.ntasks = 0;
+        int n = plan_tile(&schedule, &ctx->tiles[0], 0, 0, 0, level);
+        if (n <= nrecursive) {
+            break;
+        }
+        nrecursive = n;
+        splitlevel = level;
+    }
+    schedule.ntasks = 0;
+    plan_tile(&schedule, &ctx->tiles[0], 0, 0, 0, splitlevel);
+    if (nrecursive < 2) {
+        PAR_FREE(schedule.tasks);
+        return 0;
+    }
+    nthreads = PAR_MINI(nthreads, nrecursive);
+    schedule.budget = sink->maxpoints - sink->npoints;
+    pthread_mutex_init(&schedule.lock, 0);
+    par_worker* workers = PAR_CALLOC(par_worker, nthreads);
+    pthread_t* threads = PAR_MALLOC(pthread_t, nthreads);
+    int nlaunched = 1;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].schedule = &schedule;
+        workers[i].index = i;
+    }
+    for (; nlaunched < nthreads; nlaunched++) {
+        if (pthread_create(threads + nlaunched, 0, generate_tasks,
+            workers + nlaunched)) {
+            break;
+        }
+    }
+    generate_tasks(workers);
+    for (int i = 1; i < nlaunched; i++) {
+        pthread_join(threads[i], 0);
+    }
+    for (int t = 0; t < schedule.ntasks; t++) {
+        par_task const* task = schedule.tasks + t;
+        par_vec3 const* src = workers[task->thread].sink.points + task->begin;
+        int n = PAR_MINI(task->end - task->begin,
+            sink->maxpoints - sink->npoints);
+        memcpy(sink->points + sink->npoints, src, n * sizeof(par_vec3));
+        sink->npoints += n;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        PAR_FREE(workers[i].sink.points);
+    }
+    PAR_FREE(threads);
+    PAR_FREE(workers);
+    PAR_FREE(schedule.tasks);
+    pthread_mutex_destroy(&schedule.lock);
+    return 1;
+}
+
+#endif
+
 void par_bluenoise_set_window(par_bluenoise_context* ctx, int width, int height)
 {
     ctx->window_width = width;
@@ -301,7 +628,19 @@ float* par_bluenoise_generate(
             break;
         }
     }
-    recurse_tile(ctx, &ctx->tiles[0], 0, 0, 0);
+    par_sink sink;
+    sink.points = ctx->points;
+    sink.npoints = ctx->npoints;
+    sink.maxpoints = sink.capacity = ctx->maxpoints;
+    sink.maxlevel = INT_MAX;
+    int done = 0;
+#if PAR_BLUENOISE_THREADS
+    done = sink.npoints < sink.maxpoints && generate_parallel(ctx, &sink);
+#endif
+    if (!done) {
+        recurse_tile(ctx, &sink, &ctx->tiles[0], 0, 0, 0);
+    }
+    ctx->npoints = sink.npoints;
     *npts = ctx->npoints;
     return &ctx->points->x;
 }
@@ -322,6 +661,10 @@ static par_bluenoise_context* par_bluenoise_create(
     ctx->points = PAR_MALLOC(par_vec3, maxpts);
     ctx->density = 0;
     ctx->abridged = 0;
+    ctx->visits = 0;
+    ctx->maxvisits = 0;
+    ctx->mipdata = 0;
+    ctx->nmips = 0;
     par_bluenoise_set_window(ctx, 1024, 768);
     par_bluenoise_set_viewport(ctx, -.5, -.5, .5, .5);
 
@@ -383,6 +726,10 @@ static par_bluenoise_context* par_bluenoise_create(
             tiles[i].subpts = tiles[0].subpts;
         }
     }
+    ctx->minpoints = tiles[0].npoints;
+    for (int i = 1; i < ntiles; i++) {
+        ctx->minpoints = PAR_MINI(ctx->minpoints, tiles[i].npoints);
+    }
     free(buf);
     return ctx;
 }
@@ -403,6 +750,7 @@ void par_bluenoise_density_from_gray(par_bluenoise_context* ctx,
 {
     ctx->density_width = width;
     ctx->density_height = height;
+    free(ctx->density);
     ctx->density = PAR_MALLOC(unsigned char, width * height);
     unsigned char* dst = ctx->density;
     for (int j = 0; j < height; j++) {
@@ -411,6 +759,7 @@ void par_bluenoise_density_from_gray(par_bluenoise_context* ctx,
             pixels += bpp;
         }
     }
+    build_mips(ctx);
 }
 
 void par_bluenoise_density_from_color(par_bluenoise_context* ctx,
@@ -420,6 +769,7 @@ void par_bluenoise_density_from_color(par_bluenoise_context* ctx,
     unsigned int bkgd = background_color;
     ctx->density_width = width;
     ctx->density_height = height;
+    free(ctx->density);
     ctx->density = PAR_MALLOC(unsigned char, width * height);
     unsigned char* dst = ctx->density;
     unsigned int mask = 0x000000ffu;
@@ -441,6 +791,7 @@ void par_bluenoise_density_from_color(par_bluenoise_context* ctx,
             pixels += bpp;
         }
     }
+    build_mips(ctx);
 }
 
 void par_bluenoise_free(par_bluenoise_context* ctx)
@@ -458,6 +809,8 @@ void par_bluenoise_free(par_bluenoise_context* ctx)
     }
     free(ctx->tiles);
     free(ctx->density);
+    free(ctx->mipdata);
+    free(ctx->visits);
 }
 
 int cmp(const void* a, const void* b)
@@ -482,55 +835,255 @@ void par_bluenoise_sort_by_rank(float* floats, int npts)
     }
 }
 
+// Partially sorts the points such that the first n have the lowest ranks,
+// and returns the highest rank among them.
+static float par_bluenoise__select(par_vec3* pts, int npts, int n)
+{
+    int lo = 0, hi = npts - 1;
+    while (lo < hi) {
+        float pivot = pts[(lo + hi) / 2].rank;
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (pts[i].rank < pivot) {
+                i++;
+            }
+            while (pts[j].rank > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                PAR_SWAP(par_vec3, pts[i], pts[j]);
+                i++;
+                j--;
+            }
+        }
+        if (n - 1 <= j) {
+            hi = j;
+        } else if (n - 1 >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    float result = pts[0].rank;
+    for (int i = 1; i < n; i++) {
+        result = PAR_MAX(result, pts[i].rank);
+    }
+    return result;
+}
+
+// Sorts points by their non-negative rank using the given scratch space, which
+// must have room for npts points.
+static void par_bluenoise__radix(par_vec3* pts, par_vec3* scratch, int npts)
+{
+    for (int shift = 0; shift < 32; shift += 8) {
+        int offsets[257] = {0};
+        for (int i = 0; i < npts; i++) {
+            uint32_t key;
+            memcpy(&key, &pts[i].rank, 4);
+            offsets[((key >> shift) & 0xff) + 1]++;
+        }
+        for (int b = 0; b < 256; b++) {
+            offsets[b + 1] += offsets[b];
+        }
+        for (int i = 0; i < npts; i++) {
+            uint32_t key;
+            memcpy(&key, &pts[i].rank, 4);
+            scratch[offsets[(key >> shift) & 0xff]++] = pts[i];
+        }
+        PAR_SWAP(par_vec3*, pts, scratch);
+    }
+}
+
+static void par_bluenoise__push(par_bluenoise_context* ctx, int* nvisits,
+    par_visit visit)
+{
+    if (*nvisits == ctx->maxvisits) {
+        ctx->maxvisits = PAR_MAXI(64, ctx->maxvisits * 2);
+        ctx->visits = PAR_REALLOC(par_visit, ctx->visits, ctx->maxvisits);
+    }
+    par_visit* visits = ctx->visits;
+    int i = (*nvisits)++;
+    while (i > 0 && visits[(i - 1) / 2].density > visit.density) {
+        visits[i] = visits[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    visits[i] = visit;
+}
+
+static par_visit par_bluenoise__pop(par_bluenoise_context* ctx, int* nvisits)
+{
+    par_visit* visits = ctx->visits;
+    par_visit result = visits[0];
+    par_visit last = visits[--(*nvisits)];
+    int n = *nvisits, i = 0;
+    while (1) {
+        int child = i * 2 + 1;
+        if (child >= n) {
+            break;
+        }
+        float d0 = visits[child].density;
+        if (child + 1 < n && visits[child + 1].density < d0) {
+            child++;
+        }
+        if (visits[child].density >= last.density) {
+            break;
+        }
+        visits[i] = visits[child];
+        i = child;
+    }
+    if (n > 0) {
+        visits[i] = last;
+    }
+    return result;
+}
+
 float* par_bluenoise_generate_exact(
     par_bluenoise_context* ctx, int npts, int stride)
 {
     assert(stride >= 2);
-    int maxpoints = npts * 2;
+    int maxsubpts = 0;
+    for (int t = 0; t < ctx->ntiles; t++) {
+        maxsubpts = PAR_MAXI(maxsubpts, ctx->tiles[t].nsubpts);
+    }
+    int maxpoints = PAR_MAXI(npts * 2 + maxsubpts, (npts * stride + 2) / 3);
+    maxpoints = PAR_MAXI(maxpoints, ctx->tiles[0].npoints);
     if (ctx->maxpoints < maxpoints) {
         free(ctx->points);
         ctx->maxpoints = maxpoints;
         ctx->points = PAR_MALLOC(par_vec3, maxpoints);
     }
-    int ngenerated = 0;
-    int nprevious = 0;
-    int ndesired = npts;
-    float density = 2048;
-    while (ngenerated < ndesired) {
-        par_bluenoise_generate(ctx, density, &ngenerated);
+    if (npts <= 0) {
+        return &ctx->points->x;
+    }
 
-        // Might be paranoid, but break if something fishy is going on:
-        if (ngenerated == nprevious) {
-            return 0;
+    // Candidates are gathered with the smallest global density at which they
+    // would be generated, which is stored in the rank field.  Whenever the
+    // buffer fills up, only the npts lowest candidates are kept.
+    par_vec3* pts = ctx->points;
+    int ncandidates = 0;
+    float cutoff = FLT_MAX;
+    float left = ctx->left, right = ctx->right;
+    float top = ctx->top, bottom = ctx->bottom;
+    float mag = ctx->mag;
+    par_tile const* tile = &ctx->tiles[0];
+    for (int i = 0; i < tile->npoints; i++) {
+        float px = tile->points[i].x;
+        float py = tile->points[i].y;
+        if (px < left || px > right || py < bottom || py > top) {
+            continue;
+        }
+        float sample = sample_density(ctx, px, py);
+        if (sample > 0) {
+            pts[ncandidates].x = px - 0.5;
+            pts[ncandidates].y = py - 0.5;
+            pts[ncandidates].rank = (i + 1) / mag / sample;
+            ncandidates++;
         }
+    }
 
-        // Perform crazy heuristic to approach a nice density:
-        if (ndesired / ngenerated >= 2) {
-            density *= 2;
-        } else {
-            density += density / 10;
-        }
-
-        nprevious = ngenerated;
-    }
-    par_bluenoise_sort_by_rank(&ctx->points->x, ngenerated);
-    if (stride != 3) {
-        int nbytes = sizeof(float) * stride * ndesired;
-        float* pts = PAR_MALLOC(float, stride * ndesired);
-        float* dst = pts;
-        const float* src = &ctx->points->x;
-        for (int i = 0; i < ndesired; i++, src++) {
-            *dst++ = *src++;
-            *dst++ = *src++;
-            if (stride > 3) {
-                *dst++ = *src;
-                dst += stride - 3;
+    // Expand tiles in order of the density at which recurse_tile would first
+    // visit them, and stop once no pending tile can improve the selection.
+    // Tiles smaller than the spacing of floats near 1 cannot hold distinct
+    // points, which bounds the depth of the search.
+    int maxlevel = 0;
+    while (powf(ctx->nsubtiles, maxlevel + 1) * FLT_EPSILON < 1) {
+        maxlevel++;
+    }
+    int nvisits = 0;
+    par_visit root = {0, 0, 0, 0, 0};
+    par_bluenoise__push(ctx, &nvisits, root);
+    while (nvisits > 0 && ctx->visits[0].density < cutoff) {
+        if (ncandidates + maxsubpts > npts * 2 + maxsubpts) {
+            cutoff = par_bluenoise__select(pts, ncandidates, npts);
+            ncandidates = npts;
+            continue;
+        }
+        par_visit visit = par_bluenoise__pop(ctx, &nvisits);
+        float x = visit.x, y = visit.y;
+        tile = &ctx->tiles[visit.tile];
+        float tileSize = 1.f / powf(ctx->nsubtiles, visit.level);
+        if (x + tileSize < left || x > right || y + tileSize < bottom ||
+            y > top) {
+            continue;
+        }
+        float maxsample = max_density(ctx, x, y, tileSize);
+        if (maxsample <= 0) {
+            continue;
+        }
+        float depth = powf(ctx->nsubtiles, 2 * visit.level);
+        float factor = depth / mag;
+        for (int i = 0; i < tile->nsubpts; i++) {
+            float density = (i + tile->npoints) * factor;
+            if (density >= cutoff * maxsample) {
+                break;
+            }
+            float px = x + tile->subpts[i].x * tileSize;
+            float py = y + tile->subpts[i].y * tileSize;
+            if (px < left || px > right || py < bottom || py > top) {
+                continue;
+            }
+            // Subpoints are also limited by the truncated test count in
+            // recurse_tile, which matters where the density is saturated.
+            float sample = sample_density(ctx, px, py);
+            density = PAR_MAX(density / sample,
+                (i + 1 + tile->npoints) * factor);
+            density = PAR_MAX(visit.density, density);
+            if (sample > 0 && density < cutoff) {
+                pts[ncandidates].x = px - 0.5;
+                pts[ncandidates].y = py - 0.5;
+                pts[ncandidates].rank = density;
+                ncandidates++;
+            }
+        }
+        par_visit child;
+        child.density = (tile->nsubpts + tile->npoints) * factor;
+        child.density = PAR_MAX(visit.density, child.density);
+        child.level = visit.level + 1;
+
+        // As in recurse_tile, no point below this tile can rank lower than
+        // minpoints times the factor of the children over the maximum density.
+        float minchild = ctx->minpoints * factor * ctx->nsubtiles *
+            ctx->nsubtiles;
+        if (child.density >= cutoff || minchild >= cutoff * maxsample ||
+            child.level > maxlevel) {
+            continue;
+        }
+        const float scale = tileSize / ctx->nsubtiles;
+        for (int ty = 0; ty < ctx->nsubtiles; ty++) {
+            for (int tx = 0; tx < ctx->nsubtiles; tx++) {
+                child.tile = tile->subdivs[0][ty * ctx->nsubtiles + tx];
+                child.x = x + tx * scale;
+                child.y = y + ty * scale;
+                par_bluenoise__push(ctx, &nvisits, child);
             }
         }
-        memcpy(ctx->points, pts, nbytes);
-        free(pts);
     }
-    return &ctx->points->x;
+    if (ncandidates < npts) {
+        return 0;
+    }
+    par_bluenoise__select(pts, ncandidates, npts);
+    par_bluenoise__radix(pts, pts + npts, npts);
+    for (int i = 0; i < npts; i++) {
+        pts[i].rank = i;
+    }
+
+    // Spread the points out to the requested stride, in place.
+    float* dst = &pts->x;
+    if (stride == 2) {
+        for (int i = 0; i < npts; i++) {
+            par_vec3 pt = pts[i];
+            dst[i * 2] = pt.x;
+            dst[i * 2 + 1] = pt.y;
+        }
+    } else if (stride > 3) {
+        for (int i = npts - 1; i >= 0; i--) {
+            par_vec3 pt = pts[i];
+            dst[i * stride] = pt.x;
+            dst[i * stride + 1] = pt.y;
+            dst[i * stride + 2] = pt.rank;
+        }
+    }
+    return dst;
 }
 
 #undef PAR_MINI
@@ -152,6 +152,19 @@ PAR_BUBBLES_INT par_bubbles_lowest_common_ancestor(par_bubbles_t const* bubbles,
 par_bubbles_t* par_bubbles_hpack_local(PAR_BUBBLES_INT* nodes,
     PAR_BUBBLES_INT nnodes);
 
+// Refreshes a diagram created by hpack_local after the hierarchy has changed,
+// producing the same result as a full re-pack.  The "nodes" array may have
+// grown or shrunk, and "edited" lists every node that was added, re-parented,
+// or removed from the end of the list.  Only the parents of edited nodes and
+// their ancestors are re-packed.
+void par_bubbles_hpack_local_update(par_bubbles_t* bubbles,
+    PAR_BUBBLES_INT* nodes, PAR_BUBBLES_INT nnodes,
+    PAR_BUBBLES_INT const* edited, PAR_BUBBLES_INT nedited);
+
+// Returns the list of disks that changed during the most recent update.
+void par_bubbles_get_moved(par_bubbles_t const* bubbles,
+    PAR_BUBBLES_INT** pmoved, PAR_BUBBLES_INT* nmoved);
+
 // Similar to par_bubbles_cull, but takes a root node rather than an AABB,
 // and returns a result within the local coordinate system of the new root.
 // In other words, the new root will have radius 1, centered at (0,0).  The
@@ -160,6 +173,32 @@ par_bubbles_t* par_bubbles_cull_local(par_bubbles_t const* src,
     PAR_BUBBLES_FLT const* aabb, PAR_BUBBLES_FLT minradius,
     PAR_BUBBLES_INT root, par_bubbles_t* dst);
 
+// Flattened copy of the subtree at a given root, stored in depth-first order
+// with subtree sizes so that per-frame culling can skip entire branches
+// without recursion.  Culling produces spans rather than copies of disks;
+// each span is a (begin, end) pair of preorder indices and "ids" maps these
+// indices back to node ids.  Private data is attached after the public fields.
+typedef struct {
+    PAR_BUBBLES_INT count;        // number of nodes in the preorder copy
+    PAR_BUBBLES_INT* ids;         // node id for each preorder index
+    PAR_BUBBLES_INT* spans;       // populated by par_bubbles_cull_preorder
+    PAR_BUBBLES_INT nspans;
+} par_bubbles_preorder_t;
+
+// Builds the preorder copy using the current filter.  The root key and
+// coordinate system behave as they do in cull_local.
+par_bubbles_preorder_t* par_bubbles_preorder_local(par_bubbles_t const* src,
+    PAR_BUBBLES_INT root);
+
+// Equivalent to cull_local, but does not allocate memory after the first
+// frame, returns immediately if the view is unchanged, and only visits nodes
+// that straddle the viewport boundary or the minradius threshold.  Subtrees
+// that are entirely visible are emitted as a single span.
+void par_bubbles_cull_preorder(par_bubbles_preorder_t* preorder,
+    PAR_BUBBLES_FLT const* aabb, PAR_BUBBLES_FLT minradius);
+
+void par_bubbles_free_preorder(par_bubbles_preorder_t*);
+
 // Finds the smallest node in the given bubble diagram that completely encloses
 // the given axis-aligned bounding box (min xy, max xy).  The AABB coordinates
 // are expressed in the local coordinate system of the given root node.
@@ -182,6 +221,16 @@ bool par_bubbles_transform_local(par_bubbles_t const* bubbles,
 void par_bubbles_export_local(par_bubbles_t const* bubbles,
     PAR_BUBBLES_INT idx, char const* filename);
 
+// Writes the disks and the hierarchy to a versioned binary file whose arrays
+// are aligned so that they can be mapped directly into memory.  The file uses
+// native byte order and the current PAR_BUBBLES_FLT and PAR_BUBBLES_INT types.
+bool par_bubbles_save(par_bubbles_t const* bubbles, char const* filename);
+
+// Maps a file created by par_bubbles_save without copying or re-packing.  The
+// result is read-only; it can be culled, picked, and queried, but must not be
+// passed to functions that modify it.  Returns null if the file is invalid.
+par_bubbles_t* par_bubbles_load(char const* filename);
+
 typedef enum {
     PAR_BUBBLES_FILTER_DEFAULT,
     PAR_BUBBLES_FILTER_DISCARD_LAST_CHILD,
@@ -203,6 +252,16 @@ typedef enum {
 // effect of this is subtle, since overall layout is obviously circular.
 void par_bubbles_set_orientation(par_bubbles_orientation );
 
+// Set this to 1 to pack sibling subtrees concurrently, which uses pthreads.
+#ifndef PAR_BUBBLES_THREADS
+#define PAR_BUBBLES_THREADS 0
+#endif
+
+// Number of threads used by hpack, or 0 to match the core count.
+#ifndef PAR_BUBBLES_NTHREADS
+#define PAR_BUBBLES_NTHREADS 0
+#endif
+
 #ifndef PAR_PI
 #define PAR_PI (3.14159265359)
 #define PAR_MIN(a, b) (a > b ? b : a)
@@ -235,8 +294,21 @@ void par_bubbles_set_orientation(par_bubbles_orientation );
 #include <stdio.h>
 #include <stdlib.h>
 #include <float.h>
+#include <string.h>
 #include <assert.h>
 
+#if PAR_BUBBLES_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 static par_bubbles_orientation par_bubbles__ostate = PAR_BUBBLES_HORIZONTAL;
 
 typedef struct {
@@ -244,6 +316,30 @@ typedef struct {
     PARINT next;
 } par_bubbles__node;
 
+// Hierarchical spatial hash over the circles that have been placed during
+// flat packing.  Cells double in size at each level, and each circle lives
+// in the finest level whose cells are at least as wide as the circle, so
+// large circles touch at most four cells no matter how mixed the radii are.
+// Each level also keeps a list of its circles for queries that would visit
+// more cells than the level has circles.
+#define PAR_BUBBLES__GRID_LEVELS 32
+
+typedef struct {
+    PARINT* heads;   // first entry for each bucket, or -1
+    PARINT* entries; // list of 2-tuples (circle, next entry)
+    PARINT nentries;
+    PARINT capacity;
+    PARINT nbuckets;
+    PARFLT cellsize; // cell size at level 0
+    PARINT* links;   // next circle in the same level, or -1
+    PARINT nlinks;
+    PARINT levelheads[PAR_BUBBLES__GRID_LEVELS];
+    PARINT levelcounts[PAR_BUBBLES__GRID_LEVELS];
+} par_bubbles__grid;
+
+// Flat layouts with fewer circles than this walk the chain without a grid.
+#define PAR_BUBBLES__GRID_MIN 64
+
 typedef struct {
     PARFLT* xyr;                 // results array
     PARINT count;                // client-provided count
@@ -258,6 +354,12 @@ typedef struct {
     PARINT maxwidth;
     PARINT capacity;
     par_bubbles_filter filter;
+    par_bubbles__grid grid;
+    PARFLT* weights;             // unscaled radii, used by hpack_local_update
+    PARINT* moved;
+    PARINT nmoved;
+    void* mapping;               // populated by par_bubbles_load
+    size_t mapsize;
 } par_bubbles__t;
 
 static PARFLT par_bubbles__len2(PARFLT const* a)
@@ -273,7 +375,9 @@ static void par_bubbles__initgraph(par_bubbles__t* bubbles)
         nchildren[parents[i]]++;
     }
     PARINT c = 0;
-    bubbles->graph_heads = PAR_CALLOC(PARINT, bubbles->count * 2);
+    bubbles->maxwidth = 0;
+    bubbles->graph_heads = PAR_REALLOC(PARINT, bubbles->graph_heads,
+        bubbles->count * 2);
     bubbles->graph_tails = bubbles->graph_heads + bubbles->count;
     for (PARINT i = 0; i < bubbles->count; i++) {
         bubbles->maxwidth = PAR_MAX(bubbles->maxwidth, nchildren[i]);
@@ -281,7 +385,8 @@ static void par_bubbles__initgraph(par_bubbles__t* bubbles)
         c += nchildren[i];
     }
     bubbles->graph_heads[0] = bubbles->graph_tails[0] = 1;
-    bubbles->graph_children = PAR_MALLOC(PARINT, c);
+    bubbles->graph_children = PAR_REALLOC(PARINT, bubbles->graph_children,
+        PAR_MAX(c, 1));
     for (PARINT i = 1; i < bubbles->count; i++) {
         PARINT parent = parents[i];
         bubbles->graph_children[bubbles->graph_tails[parent]++] = i;
@@ -365,11 +470,194 @@ static PARINT par_bubbles__collide(par_bubbles__t* bubbles, PARINT ci,
     return 0;
 }
 
+static void par_bubbles__grid_init(par_bubbles__t* bubbles)
+{
+    par_bubbles__grid* grid = &bubbles->grid;
+    PARINT nbuckets = 1;
+    while (nbuckets < bubbles->count * 2) {
+        nbuckets *= 2;
+    }
+    if (grid->nbuckets < nbuckets) {
+        grid->heads = PAR_REALLOC(PARINT, grid->heads, nbuckets);
+    }
+    grid->nbuckets = nbuckets;
+    for (PARINT i = 0; i < nbuckets; i++) {
+        grid->heads[i] = -1;
+    }
+    grid->nentries = 0;
+    if (grid->nlinks < bubbles->count) {
+        grid->links = PAR_REALLOC(PARINT, grid->links, bubbles->count);
+        grid->nlinks = bubbles->count;
+    }
+    for (int level = 0; level < PAR_BUBBLES__GRID_LEVELS; level++) {
+        grid->levelheads[level] = -1;
+        grid->levelcounts[level] = 0;
+    }
+
+    // Level 0 cells are twice the mean radius wide, which keeps the number of
+    // cells visited low for typical radius distributions.
+    PARFLT sum = 0;
+    for (PARINT i = 0; i < bubbles->count; i++) {
+        sum += bubbles->radiuses[i];
+    }
+    grid->cellsize = 2 * sum / bubbles->count;
+    if (!(grid->cellsize > 0)) {
+        grid->cellsize = 1;
+    }
+}
+
+static int par_bubbles__grid_level(par_bubbles__grid const* grid, PARFLT r)
+{
+    int level = 0;
+    PARFLT cs = grid->cellsize;
+    while (cs < 2 * r && level < PAR_BUBBLES__GRID_LEVELS - 1) {
+        cs *= 2;
+        level++;
+    }
+    return level;
+}
+
+static PARINT par_bubbles__grid_bucket(par_bubbles__grid const* grid,
+    int64_t ix, int64_t iy, int level)
+{
+    uint64_t h = (uint64_t) ix * 73856093u ^ (uint64_t) iy * 19349663u ^
+        (uint64_t) level * 83492791u;
+    return (PARINT) (h & (uint64_t) (grid->nbuckets - 1));
+}
+
+static void par_bubbles__grid_insert(par_bubbles__t* bubbles, PARINT ci)
+{
+    par_bubbles__grid* grid = &bubbles->grid;
+    PARFLT const* xyr = bubbles->xyr + ci * 3;
+    int level = par_bubbles__grid_level(grid, xyr[2]);
+    grid->links[ci] = grid->levelheads[level];
+    grid->levelheads[level] = ci;
+    grid->levelcounts[level]++;
+    PARFLT cs = ldexp(grid->cellsize, level);
+    int64_t x0 = floor((xyr[0] - xyr[2]) / cs);
+    int64_t x1 = floor((xyr[0] + xyr[2]) / cs);
+    int64_t y0 = floor((xyr[1] - xyr[2]) / cs);
+    int64_t y1 = floor((xyr[1] + xyr[2]) / cs);
+    for (int64_t iy = y0; iy <= y1; iy++) {
+        for (int64_t ix = x0; ix <= x1; ix++) {
+            if (grid->nentries == grid->capacity) {
+                grid->capacity = PAR_MAX(64, grid->capacity * 2);
+                grid->entries = PAR_REALLOC(PARINT, grid->entries,
+                    grid->capacity * 2);
+            }
+            PARINT bucket = par_bubbles__grid_bucket(grid, ix, iy, level);
+            PARINT entry = grid->nentries++;
+            grid->entries[entry * 2] = ci;
+            grid->entries[entry * 2 + 1] = grid->heads[bucket];
+            grid->heads[bucket] = entry;
+        }
+    }
+}
+
+static bool par_bubbles__grid_test(par_bubbles__t const* bubbles, PARINT i,
+    PARFLT const* ci_xyr)
+{
+    PARFLT const* i_xyr = bubbles->xyr + i * 3;
+    PARFLT dx = i_xyr[0] - ci_xyr[0];
+    PARFLT dy = i_xyr[1] - ci_xyr[1];
+    PARFLT dr = i_xyr[2] + ci_xyr[2];
+    return 0.999 * dr * dr > dx * dx + dy * dy;
+}
+
+// Returns true if any circle on the chain collides with "ci".  Circles that
+// have left the chain are marked with a "next" of -1, and are unlinked from
+// the grid when a query comes across them, so that pockets where the packer
+// keeps discarding circles do not slow down later queries.
+static bool par_bubbles__grid_collides(par_bubbles__t* bubbles, PARINT ci)
+{
+    par_bubbles__grid* grid = &bubbles->grid;
+    par_bubbles__node const* chain = bubbles->chain;
+    PARFLT const* ci_xyr = bubbles->xyr + ci * 3;
+    for (int level = 0; level < PAR_BUBBLES__GRID_LEVELS; level++) {
+        if (grid->levelcounts[level] == 0) {
+            continue;
+        }
+        PARFLT cs = ldexp(grid->cellsize, level);
+        int64_t x0 = floor((ci_xyr[0] - ci_xyr[2]) / cs);
+        int64_t x1 = floor((ci_xyr[0] + ci_xyr[2]) / cs);
+        int64_t y0 = floor((ci_xyr[1] - ci_xyr[2]) / cs);
+        int64_t y1 = floor((ci_xyr[1] + ci_xyr[2]) / cs);
+        if ((double) (x1 - x0 + 1) * (y1 - y0 + 1) >
+            grid->levelcounts[level]) {
+            PARINT* link = grid->levelheads + level;
+            while (*link != -1) {
+                PARINT i = *link;
+                if (chain[i].next == -1) {
+                    *link = grid->links[i];
+                    grid->levelcounts[level]--;
+                    continue;
+                }
+                if (par_bubbles__grid_test(bubbles, i, ci_xyr)) {
+                    return true;
+                }
+                link = grid->links + i;
+            }
+            continue;
+        }
+        for (int64_t iy = y0; iy <= y1; iy++) {
+            for (int64_t ix = x0; ix <= x1; ix++) {
+                PARINT* link = grid->heads +
+                    par_bubbles__grid_bucket(grid, ix, iy, level);
+                while (*link != -1) {
+                    PARINT i = grid->entries[*link * 2];
+                    if (chain[i].next == -1) {
+                        *link = grid->entries[*link * 2 + 1];
+                        continue;
+                    }
+                    if (par_bubbles__grid_test(bubbles, i, ci_xyr)) {
+                        return true;
+                    }
+                    link = grid->entries + *link * 2 + 1;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Walks forward from "cn" and backward from "cm" in lockstep, which finds the
+// same collisions as par_bubbles__collide but only visits nodes that are about
+// to be removed from the chain.  Returns step counts that make the caller
+// choose the same direction.
+static PARINT par_bubbles__collide_both(par_bubbles__t const* bubbles,
+    PARINT ci, PARINT cm, PARINT cn, PARINT* cj_f, PARINT* cj_b,
+    PARINT* nbsteps)
+{
+    PARFLT const* ci_xyr = bubbles->xyr + ci * 3;
+    par_bubbles__node const* chain = bubbles->chain;
+    PARINT f = cn, b = cm;
+    for (PARINT nsteps = 1; nsteps < bubbles->count; ++nsteps) {
+        f = chain[f].next;
+        b = chain[b].prev;
+        for (int pass = 0; pass < 2; pass++) {
+            PARINT i = pass ? b : f;
+            PARFLT const* i_xyr = bubbles->xyr + i * 3;
+            PARFLT dx = i_xyr[0] - ci_xyr[0];
+            PARFLT dy = i_xyr[1] - ci_xyr[1];
+            PARFLT dr = i_xyr[2] + ci_xyr[2];
+            if (0.999 * dr * dr > dx * dx + dy * dy) {
+                *cj_f = *cj_b = i;
+                *nbsteps = nsteps;
+                return nsteps + pass;
+            }
+        }
+    }
+    return 0;
+}
+
 static void par_bubbles__packflat(par_bubbles__t* bubbles)
 {
     PARFLT const* radii = bubbles->radiuses;
     PARFLT* xyr = bubbles->xyr;
     par_bubbles__node* chain = bubbles->chain;
+    if (bubbles->npacked == bubbles->count) {
+        return;
+    }
 
     // Find the circle closest to the origin, known as "Cm" in the paper.
     PARINT cm = 0;
@@ -386,6 +674,16 @@ static void par_bubbles__packflat(par_bubbles__t* bubbles)
     // In the paper, "Cn" is always the node that follows "Cm".
     PARINT ci, cn = chain[cm].next;
 
+    // Large layouts use a spatial hash to quickly reject placements that
+    // don't collide, which would otherwise require walking the entire chain.
+    bool usegrid = bubbles->count >= PAR_BUBBLES__GRID_MIN;
+    if (usegrid) {
+        par_bubbles__grid_init(bubbles);
+        for (PARINT i = 0; i < bubbles->npacked; i++) {
+            par_bubbles__grid_insert(bubbles, i);
+        }
+    }
+
     for (ci = bubbles->npacked; ci < bubbles->count; ) {
         PARFLT* ci_xyr = xyr + ci * 3;
         ci_xyr[2] = radii[ci];
@@ -394,23 +692,39 @@ static void par_bubbles__packflat(par_bubbles__t* bubbles)
         par_bubbles_touch_two_disks(ci_xyr, cn_xyr, cm_xyr);
 
         // Check for a collision.  In the paper, "Cj" is the intersecting node.
-        PARINT cj_f;
-        PARINT nfsteps = par_bubbles__collide(bubbles, ci, cn, &cj_f, +1);
+        PARINT cj_f, cj_b, nfsteps, nbsteps;
+        if (!usegrid) {
+            nfsteps = par_bubbles__collide(bubbles, ci, cn, &cj_f, +1);
+        } else if (par_bubbles__grid_collides(bubbles, ci)) {
+            nfsteps = par_bubbles__collide_both(bubbles, ci, cm, cn, &cj_f,
+                &cj_b, &nbsteps);
+        } else {
+            nfsteps = 0;
+        }
         if (!nfsteps) {
             chain[cm].next = ci;
             chain[ci].prev = cm;
             chain[ci].next = cn;
             chain[cn].prev = ci;
+            if (usegrid) {
+                par_bubbles__grid_insert(bubbles, ci);
+            }
             cm = ci++;
             continue;
         }
 
         // Search backwards for a collision, in case it is closer.
-        PARINT cj_b;
-        PARINT nbsteps = par_bubbles__collide(bubbles, ci, cm, &cj_b, -1);
+        if (!usegrid) {
+            nbsteps = par_bubbles__collide(bubbles, ci, cm, &cj_b, -1);
+        }
 
         // Intersection occurred after Cn.
         if (nfsteps <= nbsteps) {
+            for (PARINT i = cn; usegrid && i != cj_f; ) {
+                PARINT next = chain[i].next;
+                chain[i].next = -1;
+                i = next;
+            }
             cn = cj_f;
             chain[cm].next = cn;
             chain[cn].prev = cm;
@@ -418,6 +732,9 @@ static void par_bubbles__packflat(par_bubbles__t* bubbles)
         }
 
         // Intersection occurred before Cm.
+        for (PARINT i = cm; usegrid && i != cj_b; i = chain[i].prev) {
+            chain[i].next = -1;
+        }
         cm = cj_b;
         chain[cm].next = cn;
         chain[cn].prev = cm;
@@ -655,11 +972,25 @@ void par_bubbles_touch_three_disks(PARFLT const* xyr1, PARFLT const* xyr2,
 void par_bubbles_free_result(par_bubbles_t* pubbub)
 {
     par_bubbles__t* bubbles = (par_bubbles__t*) pubbub;
+    if (bubbles->mapping) {
+        #ifdef _WIN32
+        PAR_FREE(bubbles->mapping);
+        #else
+        munmap(bubbles->mapping, bubbles->mapsize);
+        #endif
+        PAR_FREE(bubbles);
+        return;
+    }
     PAR_FREE(bubbles->graph_children);
     PAR_FREE(bubbles->graph_heads);
     PAR_FREE(bubbles->chain);
     PAR_FREE(bubbles->xyr);
     PAR_FREE(bubbles->ids);
+    PAR_FREE(bubbles->grid.heads);
+    PAR_FREE(bubbles->grid.entries);
+    PAR_FREE(bubbles->grid.links);
+    PAR_FREE(bubbles->weights);
+    PAR_FREE(bubbles->moved);
     PAR_FREE(bubbles);
 }
 
@@ -678,28 +1009,43 @@ par_bubbles_t* par_bubbles_pack(PARFLT const* radiuses, PARINT nradiuses)
 }
 
 // Assigns a radius to every node according to its number of descendants.
-void par_bubbles__generate_radii(par_bubbles__t* bubbles,
-    par_bubbles__t* worker, PARINT parent)
+// Nodes are visited in reverse breadth-first order, so children come first.
+static void par_bubbles__generate_radii(par_bubbles__t* bubbles)
 {
-    PARINT head = bubbles->graph_heads[parent];
-    PARINT tail = bubbles->graph_tails[parent];
-    PARINT nchildren = tail - head;
-    PARINT pr = parent * 3 + 2;
-    bubbles->xyr[pr] = 1;
-    if (nchildren == 0) {
-        return;
+    PARINT* order = PAR_MALLOC(PARINT, bubbles->count);
+    PARINT norder = 0, nvisited = 0;
+    order[norder++] = 0;
+    while (nvisited < norder) {
+        PARINT parent = order[nvisited++];
+        PARINT head = bubbles->graph_heads[parent];
+        PARINT tail = bubbles->graph_tails[parent];
+        for (PARINT cindex = head; cindex != tail; cindex++) {
+            order[norder++] = bubbles->graph_children[cindex];
+        }
     }
-    for (PARINT cindex = head; cindex != tail; cindex++) {
-        PARINT child = bubbles->graph_children[cindex];
-        par_bubbles__generate_radii(bubbles, worker, child);
-        bubbles->xyr[pr] += bubbles->xyr[child * 3 + 2];
+    for (PARINT i = norder - 1; i >= 0; i--) {
+        PARINT parent = order[i];
+        PARINT head = bubbles->graph_heads[parent];
+        PARINT tail = bubbles->graph_tails[parent];
+        PARINT pr = parent * 3 + 2;
+        bubbles->xyr[pr] = 1;
+        if (head == tail) {
+            continue;
+        }
+        for (PARINT cindex = head; cindex != tail; cindex++) {
+            PARINT child = bubbles->graph_children[cindex];
+            bubbles->xyr[pr] += bubbles->xyr[child * 3 + 2];
+        }
+        // The following square root seems to produce a nicer, more
+        // space-filling, distribution of radiuses  in randomly-generated trees.
+        bubbles->xyr[pr] = sqrtf(bubbles->xyr[pr]);
     }
-    // The following square root seems to produce a nicer, more space-filling,
-    // distribution of radiuses  in randomly-generated trees.
-    bubbles->xyr[pr] = sqrtf(bubbles->xyr[pr]);
+    PAR_FREE(order);
 }
 
-void par_bubbles__hpack(par_bubbles__t* bubbles, par_bubbles__t* worker,
+// Packs the children of the given node, which must already have its final
+// position and radius.
+static void par_bubbles__hpack(par_bubbles__t* bubbles, par_bubbles__t* worker,
     PARINT parent, bool local)
 {
     PARINT head = bubbles->graph_heads[parent];
@@ -781,12 +1127,123 @@ void par_bubbles__hpack(par_bubbles__t* bubbles, par_bubbles__t* worker,
         dst[1] = ty + scale * (src[1] - cy);
         dst[2] = scale * (src[2] - scaled_padding);
     }
+}
 
-    // Recursion.  TODO: It might be better to use our own stack here.
-    for (PARINT cindex = head; cindex != tail; cindex++) {
-        par_bubbles__hpack(bubbles, worker, bubbles->graph_children[cindex],
-            local);
+static par_bubbles__t* par_bubbles__create_worker(PARINT maxwidth)
+{
+    par_bubbles__t* worker = PAR_CALLOC(par_bubbles__t, 1);
+    worker->radiuses = PAR_MALLOC(PARFLT, maxwidth);
+    worker->chain = PAR_MALLOC(par_bubbles__node, maxwidth);
+    worker->xyr = PAR_MALLOC(PARFLT, 3 * maxwidth);
+    return worker;
+}
+
+static void par_bubbles__free_worker(par_bubbles__t* worker)
+{
+    PAR_FREE((PARFLT*) worker->radiuses);
+    par_bubbles_free_result((par_bubbles_t*) worker);
+}
+
+// Nodes whose children are ready to be packed live on a shared stack.  Each
+// node only depends on its own disk, so the result is the same regardless of
+// which thread packs it or when.
+typedef struct {
+    par_bubbles__t* bubbles;
+    bool local;
+    PARINT* stack;
+    PARINT nstack;
+    int nbusy;
+#if PAR_BUBBLES_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} par_bubbles__scheduler;
+
+static void* par_bubbles__hpack_tasks(void* arg)
+{
+    par_bubbles__scheduler* sched = (par_bubbles__scheduler*) arg;
+    par_bubbles__t* bubbles = sched->bubbles;
+    par_bubbles__t* worker = par_bubbles__create_worker(bubbles->maxwidth);
+#if PAR_BUBBLES_THREADS
+    pthread_mutex_lock(&sched->lock);
+#endif
+    while (1) {
+#if PAR_BUBBLES_THREADS
+        while (sched->nstack == 0 && sched->nbusy > 0) {
+            pthread_cond_wait(&sched->cond, &sched->lock);
+        }
+#endif
+        if (sched->nstack == 0) {
+            break;
+        }
+        PARINT parent = sched->stack[--sched->nstack];
+        sched->nbusy++;
+#if PAR_BUBBLES_THREADS
+        pthread_mutex_unlock(&sched->lock);
+#endif
+        par_bubbles__hpack(bubbles, worker, parent, sched->local);
+        PARINT head = bubbles->graph_heads[parent];
+        PARINT tail = bubbles->graph_tails[parent];
+#if PAR_BUBBLES_THREADS
+        pthread_mutex_lock(&sched->lock);
+#endif
+        for (PARINT cindex = tail - 1; cindex >= head; cindex--) {
+            PARINT child = bubbles->graph_children[cindex];
+            if (bubbles->graph_heads[child] != bubbles->graph_tails[child]) {
+                sched->stack[sched->nstack++] = child;
+            }
+        }
+        sched->nbusy--;
+#if PAR_BUBBLES_THREADS
+        pthread_cond_broadcast(&sched->cond);
+#endif
     }
+#if PAR_BUBBLES_THREADS
+    pthread_mutex_unlock(&sched->lock);
+#endif
+    par_bubbles__free_worker(worker);
+    return 0;
+}
+
+// Packs the entire hierarchy using an explicit stack rather than recursion.
+static void par_bubbles__hpack_all(par_bubbles__t* bubbles, bool local)
+{
+    par_bubbles__scheduler sched;
+    sched.bubbles = bubbles;
+    sched.local = local;
+    sched.stack = PAR_MALLOC(PARINT, bubbles->count);
+    sched.nstack = 0;
+    sched.nbusy = 0;
+    if (bubbles->graph_heads[0] != bubbles->graph_tails[0]) {
+        sched.stack[sched.nstack++] = 0;
+    }
+#if PAR_BUBBLES_THREADS
+    int nthreads = PAR_BUBBLES_NTHREADS;
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    nthreads = PAR_CLAMP(nthreads, 1, bubbles->count / 1024 + 1);
+    pthread_mutex_init(&sched.lock, 0);
+    pthread_cond_init(&sched.cond, 0);
+    pthread_t* threads = PAR_MALLOC(pthread_t, nthreads);
+    int nlaunched = 0;
+    for (; nlaunched < nthreads - 1; nlaunched++) {
+        if (pthread_create(threads + nlaunched, 0, par_bubbles__hpack_tasks,
+            &sched)) {
+            break;
+        }
+    }
+    par_bubbles__hpack_tasks(&sched);
+    for (int i = 0; i < nlaunched; i++) {
+        pthread_join(threads[i], 0);
+    }
+    PAR_FREE(threads);
+    pthread_cond_destroy(&sched.cond);
+    pthread_mutex_destroy(&sched.lock);
+#else
+    par_bubbles__hpack_tasks(&sched);
+#endif
+    PAR_FREE(sched.stack);
 }
 
 par_bubbles_t* par_bubbles_hpack_circle(PARINT* nodes, PARINT nnodes,
@@ -799,16 +1256,11 @@ par_bubbles_t* par_bubbles_hpack_circle(PARINT* nodes, PARINT nnodes,
         bubbles->chain = PAR_MALLOC(par_bubbles__node, nnodes);
         bubbles->xyr = PAR_MALLOC(PARFLT, 3 * nnodes);
         par_bubbles__initgraph(bubbles);
-        par_bubbles__t* worker = PAR_CALLOC(par_bubbles__t, 1);
-        worker->radiuses = PAR_MALLOC(PARFLT, bubbles->maxwidth);
-        worker->chain = PAR_MALLOC(par_bubbles__node, bubbles->maxwidth);
-        worker->xyr = PAR_MALLOC(PARFLT, 3 * bubbles->maxwidth);
-        par_bubbles__generate_radii(bubbles, worker, 0);
+        par_bubbles__generate_radii(bubbles);
         bubbles->xyr[0] = 0;
         bubbles->xyr[1] = 0;
         bubbles->xyr[2] = radius;
-        par_bubbles__hpack(bubbles, worker, 0, false);
-        par_bubbles_free_result((par_bubbles_t*) worker);
+        par_bubbles__hpack_all(bubbles, false);
     }
     return (par_bubbles_t*) bubbles;
 }
@@ -1052,6 +1504,186 @@ void par_bubbles_export_local(par_bubbles_t const* bubbles,
     par_bubbles_free_result(clone);
 }
 
+#define PAR_BUBBLES__MAGIC "PARB"
+#define PAR_BUBBLES__VERSION 1
+#define PAR_BUBBLES__ALIGN 64
+
+// Offsets are measured from the start of the file, or zero for missing arrays.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t fltsize;
+    uint32_t intsize;
+    uint64_t count;
+    uint64_t nchildren;
+    uint64_t xyr;
+    uint64_t parents;
+    uint64_t heads;
+    uint64_t tails;
+    uint64_t children;
+} par_bubbles__header;
+
+static uint64_t par_bubbles__align(uint64_t offset)
+{
+    uint64_t mask = PAR_BUBBLES__ALIGN - 1;
+    return (offset + mask) & ~mask;
+}
+
+static bool par_bubbles__write_array(FILE* file, uint64_t* offset,
+    void const* data, uint64_t nbytes)
+{
+    static char const zeros[PAR_BUBBLES__ALIGN] = {0};
+    uint64_t padding = par_bubbles__align(*offset) - *offset;
+    if (fwrite(zeros, 1, padding, file) != padding) {
+        return false;
+    }
+    *offset += padding + nbytes;
+    return fwrite(data, 1, nbytes, file) == nbytes;
+}
+
+bool par_bubbles_save(par_bubbles_t const* pbubbles, char const* filename)
+{
+    par_bubbles__t const* src = (par_bubbles__t const*) pbubbles;
+    uint64_t count = src->count;
+    bool hierarchy = count > 0 && src->graph_heads && src->graph_parents;
+    par_bubbles__header header = {{0}};
+    memcpy(header.magic, PAR_BUBBLES__MAGIC, 4);
+    header.version = PAR_BUBBLES__VERSION;
+    header.fltsize = sizeof(PARFLT);
+    header.intsize = sizeof(PARINT);
+    header.count = count;
+    for (uint64_t i = 0; hierarchy && i < count; i++) {
+        header.nchildren = PAR_MAX(header.nchildren,
+            (uint64_t) src->graph_tails[i]);
+    }
+    uint64_t fltarray = count * 3 * sizeof(PARFLT);
+    uint64_t intarray = count * sizeof(PARINT);
+    uint64_t childarray = header.nchildren * sizeof(PARINT);
+    uint64_t offset = sizeof(header);
+    header.xyr = offset = par_bubbles__align(offset);
+    offset += fltarray;
+    if (hierarchy) {
+        header.parents = offset = par_bubbles__align(offset);
+        offset += intarray;
+        header.heads = offset = par_bubbles__align(offset);
+        offset += intarray;
+        header.tails = offset = par_bubbles__align(offset);
+        offset += intarray;
+        header.children = offset = par_bubbles__align(offset);
+    }
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    offset = sizeof(header);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        par_bubbles__write_array(file, &offset, src->xyr, fltarray);
+    if (ok && hierarchy) {
+        ok = par_bubbles__write_array(file, &offset, src->graph_parents,
+            intarray) &&
+            par_bubbles__write_array(file, &offset, src->graph_heads,
+            intarray) &&
+            par_bubbles__write_array(file, &offset, src->graph_tails,
+            intarray) &&
+            par_bubbles__write_array(file, &offset, src->graph_children,
+            childarray);
+    }
+    return (fclose(file) == 0) && ok;
+}
+
+static bool par_bubbles__check_array(par_bubbles__header const* header,
+    uint64_t offset, uint64_t nbytes, uint64_t filesize)
+{
+    return offset % PAR_BUBBLES__ALIGN == 0 && offset >= sizeof(*header) &&
+        offset <= filesize && nbytes <= filesize - offset;
+}
+
+par_bubbles_t* par_bubbles_load(char const* filename)
+{
+    void* mapping = 0;
+    uint64_t filesize;
+    #ifdef _WIN32
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    filesize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    mapping = PAR_MALLOC(char, PAR_MAX(filesize, 1));
+    if (fread(mapping, 1, filesize, file) != filesize) {
+        filesize = 0;
+    }
+    fclose(file);
+    #else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    filesize = fstat(fd, &st) ? 0 : (uint64_t) st.st_size;
+    if (filesize >= sizeof(par_bubbles__header)) {
+        mapping = mmap(0, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+        mapping = mapping == MAP_FAILED ? 0 : mapping;
+    }
+    close(fd);
+    if (!mapping) {
+        return 0;
+    }
+    #endif
+
+    par_bubbles__header const* header = (par_bubbles__header const*) mapping;
+    char const* base = (char const*) mapping;
+    uint64_t count = 0, fltarray = 0, intarray = 0, childarray = 0;
+    bool ok = filesize >= sizeof(*header) &&
+        !memcmp(header->magic, PAR_BUBBLES__MAGIC, 4) &&
+        header->version == PAR_BUBBLES__VERSION &&
+        header->fltsize == sizeof(PARFLT) &&
+        header->intsize == sizeof(PARINT);
+    if (ok) {
+        count = header->count;
+        fltarray = count * 3 * sizeof(PARFLT);
+        intarray = count * sizeof(PARINT);
+        childarray = header->nchildren * sizeof(PARINT);
+        ok = count <= filesize && header->nchildren <= filesize &&
+            par_bubbles__check_array(header, header->xyr, fltarray, filesize);
+    }
+    if (ok && header->heads) {
+        ok = par_bubbles__check_array(header, header->parents, intarray,
+            filesize) &&
+            par_bubbles__check_array(header, header->heads, intarray,
+            filesize) &&
+            par_bubbles__check_array(header, header->tails, intarray,
+            filesize) &&
+            par_bubbles__check_array(header, header->children, childarray,
+            filesize);
+    }
+    if (!ok) {
+        #ifdef _WIN32
+        PAR_FREE(mapping);
+        #else
+        munmap(mapping, filesize);
+        #endif
+        return 0;
+    }
+    par_bubbles__t* bubbles = PAR_CALLOC(par_bubbles__t, 1);
+    bubbles->mapping = mapping;
+    bubbles->mapsize = filesize;
+    bubbles->count = count;
+    bubbles->xyr = (PARFLT*) (base + header->xyr);
+    if (header->heads) {
+        bubbles->graph_parents = (PARINT const*) (base + header->parents);
+        bubbles->graph_heads = (PARINT*) (base + header->heads);
+        bubbles->graph_tails = (PARINT*) (base + header->tails);
+        bubbles->graph_children = (PARINT*) (base + header->children);
+    }
+    return (par_bubbles_t*) bubbles;
+}
+
+#undef PAR_BUBBLES__MAGIC
+#undef PAR_BUBBLES__VERSION
+#undef PAR_BUBBLES__ALIGN
+
 void par_bubbles_set_filter(par_bubbles_t* bubbles, par_bubbles_filter f)
 {
     par_bubbles__t* src = (par_bubbles__t*) bubbles;
@@ -1138,6 +1770,183 @@ par_bubbles_t* par_bubbles_cull_local(par_bubbles_t const* psrc,
     return pdst;
 }
 
+typedef struct {
+    PARINT count;
+    PARINT* ids;
+    PARINT* spans;
+    PARINT nspans;
+    PARINT spancapacity;
+    PARFLT* x;                   // disks relative to their parent
+    PARFLT* y;
+    PARFLT* r;
+    PARFLT* smallest;            // smallest descendant relative to the node
+    PARINT* skip;                // preorder index past the end of the subtree
+    PARINT* depth;
+    PARFLT* xforms;              // transform stack, indexed by depth
+    PARFLT aabb[4];              // view used for the current spans
+    PARFLT viewradius;
+    bool culled;
+    bool bounded;
+} par_bubbles__preorder;
+
+par_bubbles_preorder_t* par_bubbles_preorder_local(par_bubbles_t const* psrc,
+    PARINT root)
+{
+    par_bubbles__t const* src = (par_bubbles__t const*) psrc;
+    par_bubbles__preorder* pre = PAR_CALLOC(par_bubbles__preorder, 1);
+    if (src->count == 0) {
+        return (par_bubbles_preorder_t*) pre;
+    }
+    PARINT capacity = src->count;
+    pre->ids = PAR_MALLOC(PARINT, capacity);
+    pre->x = PAR_MALLOC(PARFLT, capacity);
+    pre->y = PAR_MALLOC(PARFLT, capacity);
+    pre->r = PAR_MALLOC(PARFLT, capacity);
+    pre->smallest = PAR_MALLOC(PARFLT, capacity);
+    pre->skip = PAR_MALLOC(PARINT, capacity);
+    pre->depth = PAR_MALLOC(PARINT, capacity);
+
+    // Walk the tree with an explicit stack of (node, parent index) pairs,
+    // pushing children in reverse to preserve their order.
+    PARINT* stack = PAR_MALLOC(PARINT, capacity * 2);
+    PARINT* parents = PAR_MALLOC(PARINT, capacity);
+    PARINT nstack = 0, maxdepth = 0;
+    stack[nstack++] = root;
+    stack[nstack++] = -1;
+    while (nstack > 0) {
+        PARINT parent = stack[--nstack];
+        PARINT node = stack[--nstack];
+        PARINT i = pre->count++;
+        PARFLT const* xyr = src->xyr + node * 3;
+        pre->ids[i] = node;
+        pre->x[i] = parent < 0 ? 0 : xyr[0];
+        pre->y[i] = parent < 0 ? 0 : xyr[1];
+        pre->r[i] = parent < 0 ? 1 : xyr[2];
+        pre->smallest[i] = FLT_MAX;
+        pre->depth[i] = parent < 0 ? 0 : pre->depth[parent] + 1;
+        maxdepth = PAR_MAX(maxdepth, pre->depth[i]);
+        parents[i] = parent;
+        PARINT head = src->graph_heads[node];
+        PARINT tail = src->graph_tails[node];
+        if (src->filter == PAR_BUBBLES_FILTER_DISCARD_LAST_CHILD) {
+            tail--;
+        } else if (src->filter == PAR_BUBBLES_FILTER_KEEP_ONLY_LAST_CHILD) {
+            head = PAR_MAX(head, tail - 1);
+        }
+        for (PARINT cindex = tail - 1; cindex >= head; cindex--) {
+            stack[nstack++] = src->graph_children[cindex];
+            stack[nstack++] = i;
+        }
+    }
+
+    // Accumulate subtree extents and minimum radii from the bottom up.
+    for (PARINT i = 0; i < pre->count; i++) {
+        pre->skip[i] = i + 1;
+    }
+    for (PARINT i = pre->count - 1; i > 0; i--) {
+        PARINT parent = parents[i];
+        PARFLT r = pre->r[i] * PAR_MIN(1, pre->smallest[i]);
+        pre->smallest[parent] = PAR_MIN(pre->smallest[parent], r);
+        pre->skip[parent] = PAR_MAX(pre->skip[parent], pre->skip[i]);
+    }
+    PAR_FREE(parents);
+    PAR_FREE(stack);
+    pre->xforms = PAR_MALLOC(PARFLT, 3 * (maxdepth + 1));
+    pre->spancapacity = 16;
+    pre->spans = PAR_MALLOC(PARINT, pre->spancapacity * 2);
+    return (par_bubbles_preorder_t*) pre;
+}
+
+static void par_bubbles__emit_span(par_bubbles__preorder* pre, PARINT begin,
+    PARINT end)
+{
+    if (pre->nspans > 0 && pre->spans[pre->nspans * 2 - 1] == begin) {
+        pre->spans[pre->nspans * 2 - 1] = end;
+        return;
+    }
+    if (pre->nspans == pre->spancapacity) {
+        pre->spancapacity *= 2;
+        pre->spans = PAR_REALLOC(PARINT, pre->spans, pre->spancapacity * 2);
+    }
+    pre->spans[pre->nspans * 2] = begin;
+    pre->spans[pre->nspans * 2 + 1] = end;
+    pre->nspans++;
+}
+
+void par_bubbles_cull_preorder(par_bubbles_preorder_t* ppre,
+    PARFLT const* aabb, PARFLT minradius)
+{
+    par_bubbles__preorder* pre = (par_bubbles__preorder*) ppre;
+    if (pre->count == 0) {
+        return;
+    }
+    if (pre->culled && pre->viewradius == minradius &&
+        pre->bounded == (aabb != 0) && (!aabb ||
+        (pre->aabb[0] == aabb[0] && pre->aabb[1] == aabb[1] &&
+        pre->aabb[2] == aabb[2] && pre->aabb[3] == aabb[3]))) {
+        return;
+    }
+    pre->culled = true;
+    pre->viewradius = minradius;
+    pre->bounded = aabb != 0;
+    for (int i = 0; aabb && i < 4; i++) {
+        pre->aabb[i] = aabb[i];
+    }
+    pre->nspans = 0;
+
+    // The whole-subtree test is conservative, which keeps the result
+    // identical to cull_local despite differences in rounding.
+    const PARFLT margin = 1.001;
+    PARFLT* xforms = pre->xforms;
+    xforms[0] = xforms[1] = 0;
+    xforms[2] = 1;
+    PARINT i = 0;
+    while (i < pre->count) {
+        PARINT depth = pre->depth[i];
+        PARFLT* xform = xforms + depth * 3;
+        if (depth > 0) {
+            PARFLT const* parent = xform - 3;
+            xform[0] = parent[0] + parent[2] * pre->x[i];
+            xform[1] = parent[1] + parent[2] * pre->y[i];
+            xform[2] = parent[2] * pre->r[i];
+            if (aabb && !par_bubbles_check_aabb(xform, aabb)) {
+                i = pre->skip[i];
+                continue;
+            }
+            if (xform[2] < minradius) {
+                i = pre->skip[i];
+                continue;
+            }
+        }
+        PARFLT extent = xform[2] * margin;
+        bool inside = !aabb || (
+            xform[0] - extent >= aabb[0] && xform[0] + extent <= aabb[2] &&
+            xform[1] - extent >= aabb[1] && xform[1] + extent <= aabb[3]);
+        if (inside && xform[2] * pre->smallest[i] >= minradius * margin) {
+            par_bubbles__emit_span(pre, i, pre->skip[i]);
+            i = pre->skip[i];
+            continue;
+        }
+        par_bubbles__emit_span(pre, i, i + 1);
+        i++;
+    }
+}
+
+void par_bubbles_free_preorder(par_bubbles_preorder_t* ppre)
+{
+    par_bubbles__preorder* pre = (par_bubbles__preorder*) ppre;
+    PAR_FREE(pre->ids);
+    PAR_FREE(pre->spans);
+    PAR_FREE(pre->x);
+    PAR_FREE(pre->y);
+    PAR_FREE(pre->r);
+    PAR_FREE(pre->smallest);
+    PAR_FREE(pre->skip);
+    PAR_FREE(pre->depth);
+    PAR_FREE(pre->xforms);
+    PAR_FREE(pre);
+}
+
 par_bubbles_t* par_bubbles_hpack_local(PARINT* nodes, PARINT nnodes)
 {
     par_bubbles__t* bubbles = PAR_CALLOC(par_bubbles__t, 1);
@@ -1147,20 +1956,154 @@ par_bubbles_t* par_bubbles_hpack_local(PARINT* nodes, PARINT nnodes)
         bubbles->chain = PAR_MALLOC(par_bubbles__node, nnodes);
         bubbles->xyr = PAR_MALLOC(PARFLT, 3 * nnodes);
         par_bubbles__initgraph(bubbles);
-        par_bubbles__t* worker = PAR_CALLOC(par_bubbles__t, 1);
-        worker->radiuses = PAR_MALLOC(PARFLT, bubbles->maxwidth);
-        worker->chain = PAR_MALLOC(par_bubbles__node, bubbles->maxwidth);
-        worker->xyr = PAR_MALLOC(PARFLT, 3 * bubbles->maxwidth);
-        par_bubbles__generate_radii(bubbles, worker, 0);
+        par_bubbles__generate_radii(bubbles);
+        bubbles->weights = PAR_MALLOC(PARFLT, nnodes);
+        for (PARINT i = 0; i < nnodes; i++) {
+            bubbles->weights[i] = bubbles->xyr[i * 3 + 2];
+        }
         bubbles->xyr[0] = 0;
         bubbles->xyr[1] = 0;
         bubbles->xyr[2] = 1;
-        par_bubbles__hpack(bubbles, worker, 0, true);
-        par_bubbles_free_result((par_bubbles_t*) worker);
+        par_bubbles__hpack_all(bubbles, true);
     }
     return (par_bubbles_t*) bubbles;
 }
 
+typedef struct {
+    PARINT node;
+    PARINT depth;
+} par_bubbles__dirty;
+
+static int par_bubbles__cmpdirty(const void* pa, const void* pb)
+{
+    par_bubbles__dirty const* a = (par_bubbles__dirty const*) pa;
+    par_bubbles__dirty const* b = (par_bubbles__dirty const*) pb;
+    if (a->depth != b->depth) {
+        return a->depth < b->depth ? 1 : -1;
+    }
+    return a->node < b->node ? -1 : (a->node > b->node);
+}
+
+void par_bubbles_hpack_local_update(par_bubbles_t* pbubbles, PARINT* nodes,
+    PARINT nnodes, PARINT const* edited, PARINT nedited)
+{
+    par_bubbles__t* bubbles = (par_bubbles__t*) pbubbles;
+    PARINT oldcount = bubbles->count;
+    bubbles->nmoved = 0;
+    if (nnodes <= 0) {
+        bubbles->count = 0;
+        return;
+    }
+
+    // Find the old parent of each edited node before rebuilding the graph.
+    PARINT* oldparents = PAR_MALLOC(PARINT, PAR_MAX(nedited, 1));
+    PARINT* inverse = PAR_MALLOC(PARINT, PAR_MAX(oldcount, 1));
+    for (PARINT parent = 0; parent < oldcount; parent++) {
+        PARINT head = bubbles->graph_heads[parent];
+        PARINT tail = bubbles->graph_tails[parent];
+        for (PARINT cindex = head; cindex != tail; cindex++) {
+            inverse[bubbles->graph_children[cindex]] = parent;
+        }
+    }
+    for (PARINT e = 0; e < nedited; e++) {
+        PARINT node = edited[e];
+        oldparents[e] = node > 0 && node < oldcount ? inverse[node] : -1;
+    }
+    PAR_FREE(inverse);
+
+    bubbles->graph_parents = nodes;
+    bubbles->count = nnodes;
+    if (nnodes > oldcount) {
+        bubbles->xyr = PAR_REALLOC(PARFLT, bubbles->xyr, 3 * nnodes);
+        bubbles->weights = PAR_REALLOC(PARFLT, bubbles->weights, nnodes);
+        for (PARINT i = oldcount; i < nnodes; i++) {
+            bubbles->weights[i] = 1;
+        }
+    }
+    par_bubbles__initgraph(bubbles);
+
+    // Mark the parents of edited nodes and all their ancestors.
+    char* marked = PAR_CALLOC(char, nnodes);
+    par_bubbles__dirty* dirty = PAR_MALLOC(par_bubbles__dirty, nnodes);
+    PARINT ndirty = 0;
+    for (PARINT e = 0; e < nedited * 2; e++) {
+        PARINT node = (e % 2) ? oldparents[e / 2] : edited[e / 2];
+        if (!(e % 2)) {
+            node = node < nnodes ? nodes[node] : -1;
+        }
+        if (node < 0 || node >= nnodes) {
+            continue;
+        }
+        while (!marked[node]) {
+            marked[node] = 1;
+            dirty[ndirty++].node = node;
+            if (node == 0) {
+                break;
+            }
+            node = nodes[node];
+        }
+    }
+    for (PARINT i = 0; i < ndirty; i++) {
+        dirty[i].depth = par_bubbles_get_depth(pbubbles, dirty[i].node);
+    }
+    qsort(dirty, ndirty, sizeof(par_bubbles__dirty), par_bubbles__cmpdirty);
+
+    // Refresh weights from the bottom up, then re-pack each dirty node.
+    PARFLT* weights = bubbles->weights;
+    for (PARINT i = 0; i < ndirty; i++) {
+        PARINT parent = dirty[i].node;
+        PARINT head = bubbles->graph_heads[parent];
+        PARINT tail = bubbles->graph_tails[parent];
+        PARFLT weight = 1;
+        for (PARINT cindex = head; cindex != tail; cindex++) {
+            weight += weights[bubbles->graph_children[cindex]];
+        }
+        weights[parent] = head == tail ? 1 : sqrtf(weight);
+    }
+    bubbles->xyr[0] = 0;
+    bubbles->xyr[1] = 0;
+    bubbles->xyr[2] = 1;
+    par_bubbles__t* worker = par_bubbles__create_worker(bubbles->maxwidth);
+    PARFLT* previous = PAR_MALLOC(PARFLT, 3 * PAR_MAX(bubbles->maxwidth, 1));
+    bubbles->moved = PAR_REALLOC(PARINT, bubbles->moved, nnodes);
+    for (PARINT i = 0; i < ndirty; i++) {
+        PARINT parent = dirty[i].node;
+        PARINT head = bubbles->graph_heads[parent];
+        PARINT tail = bubbles->graph_tails[parent];
+        for (PARINT cindex = head; cindex != tail; cindex++) {
+            PARINT child = bubbles->graph_children[cindex];
+            PARFLT* xyr = bubbles->xyr + child * 3;
+            bool fresh = child >= oldcount;
+            for (int j = 0; j < 3; j++) {
+                previous[(cindex - head) * 3 + j] = fresh ? NAN : xyr[j];
+            }
+            xyr[2] = weights[child];
+        }
+        par_bubbles__hpack(bubbles, worker, parent, true);
+        for (PARINT cindex = head; cindex != tail; cindex++) {
+            PARINT child = bubbles->graph_children[cindex];
+            PARFLT const* xyr = bubbles->xyr + child * 3;
+            PARFLT const* prev = previous + (cindex - head) * 3;
+            if (xyr[0] != prev[0] || xyr[1] != prev[1] || xyr[2] != prev[2]) {
+                bubbles->moved[bubbles->nmoved++] = child;
+            }
+        }
+    }
+    par_bubbles__free_worker(worker);
+    PAR_FREE(previous);
+    PAR_FREE(dirty);
+    PAR_FREE(marked);
+    PAR_FREE(oldparents);
+}
+
+void par_bubbles_get_moved(par_bubbles_t const* pbubbles, PARINT** pmoved,
+    PARINT* nmoved)
+{
+    par_bubbles__t const* bubbles = (par_bubbles__t const*) pbubbles;
+    *pmoved = bubbles->moved;
+    *nmoved = bubbles->nmoved;
+}
+
 static bool par_bubbles__disk_encloses_aabb(PAR_BUBBLES_FLT cx,
     PAR_BUBBLES_FLT cy, PAR_BUBBLES_FLT r, PAR_BUBBLES_FLT const* aabb)
 {
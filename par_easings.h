@@ -15,8 +15,10 @@
 extern "C" {
 #endif
 
+// The batched functions use SSE2 or NEON when this is left as the default.
 #ifndef PAR_EASINGS_FLOAT
 #define PAR_EASINGS_FLOAT float
+#define PAR_EASINGS__SINGLE 1
 #endif
 
 PAR_EASINGS_FLOAT par_easings_linear(PAR_EASINGS_FLOAT t);
@@ -36,6 +38,67 @@ PAR_EASINGS_FLOAT par_easings_in_back(PAR_EASINGS_FLOAT t);
 PAR_EASINGS_FLOAT par_easings_out_back(PAR_EASINGS_FLOAT t);
 PAR_EASINGS_FLOAT par_easings_in_out_back(PAR_EASINGS_FLOAT t);
 
+// Batched versions of the above, which evaluate n values at once.  The sine
+// and exponential in the elastic curves are replaced by polynomials that are
+// accurate to about 1e-5 for t in [0, 1].
+void par_easings_linear_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_cubic_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_out_cubic_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_out_cubic_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_quad_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_out_quad_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_out_quad_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_elastic_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_out_elastic_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_out_elastic_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_bounce_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_out_bounce_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_out_bounce_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_back_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_out_back_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+void par_easings_in_out_back_n(PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+
+typedef PAR_EASINGS_FLOAT (*par_easings_fn)(PAR_EASINGS_FLOAT t);
+
+// Sampled easing curve over [0, 1] that is evaluated by linear interpolation.
+typedef struct {
+    PAR_EASINGS_FLOAT* values;   // resolution + 1 samples
+    int resolution;
+    PAR_EASINGS_FLOAT maxerror;  // Largest deviation found between samples
+} par_easings_lut;
+
+// Sample an easing function at the given number of intervals.  If maxerror is
+// positive, the resolution is doubled until the interpolation error is within
+// maxerror, up to PAR_EASINGS_LUT_MAXRESOLUTION intervals.
+par_easings_lut* par_easings_create_lut(par_easings_fn, int resolution,
+    PAR_EASINGS_FLOAT maxerror);
+
+void par_easings_free_lut(par_easings_lut*);
+
+// Evaluate a sampled curve, clamping t to [0, 1].
+void par_easings_lut_n(par_easings_lut const*, PAR_EASINGS_FLOAT const* t,
+    PAR_EASINGS_FLOAT* out, int n);
+
+#ifndef PAR_EASINGS_LUT_MAXRESOLUTION
+#define PAR_EASINGS_LUT_MAXRESOLUTION (1 << 16)
+#endif
+
 #ifndef PAR_PI
 #define PAR_PI (3.14159265359)
 #define PAR_MIN(a, b) (a > b ? b : a)
@@ -55,6 +118,10 @@ PAR_EASINGS_FLOAT par_easings_in_out_back(PAR_EASINGS_FLOAT t);
 
 #ifdef PAR_EASINGS_IMPLEMENTATION
 
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
 #define PARFLT PAR_EASINGS_FLOAT
 
 PARFLT par_easings__linear(PARFLT t, PARFLT b, PARFLT c, PARFLT d)
@@ -402,6 +469,379 @@ PARFLT par_easings_in_out_back(PARFLT t)
     return par_easings__in_out_back(t, 0, 1, 1);
 }
 
+// The batched kernels are written once against a small vector vocabulary,
+// which maps onto SSE2, NEON, or plain scalar arithmetic.
+#if defined(PAR_EASINGS__SINGLE) && defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128 par_easings__vec;
+typedef __m128 par_easings__mask;
+#define PAR_EASINGS__WIDTH 4
+#define PAR_EASINGS__SPLAT(x) _mm_set1_ps((float) (x))
+#define PAR_EASINGS__LOAD(p) _mm_loadu_ps(p)
+#define PAR_EASINGS__STORE(p, v) _mm_storeu_ps(p, v)
+#define PAR_EASINGS__ADD(a, b) _mm_add_ps(a, b)
+#define PAR_EASINGS__SUB(a, b) _mm_sub_ps(a, b)
+#define PAR_EASINGS__MUL(a, b) _mm_mul_ps(a, b)
+#define PAR_EASINGS__LT(a, b) _mm_cmplt_ps(a, b)
+#define PAR_EASINGS__SEL(m, a, b) \
+    _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define PAR_EASINGS__ROUND(x) _mm_cvtepi32_ps(_mm_cvtps_epi32(x))
+#elif defined(PAR_EASINGS__SINGLE) && defined(__ARM_NEON)
+#include <arm_neon.h>
+typedef float32x4_t par_easings__vec;
+typedef uint32x4_t par_easings__mask;
+#define PAR_EASINGS__WIDTH 4
+#define PAR_EASINGS__SPLAT(x) vdupq_n_f32((float) (x))
+#define PAR_EASINGS__LOAD(p) vld1q_f32(p)
+#define PAR_EASINGS__STORE(p, v) vst1q_f32(p, v)
+#define PAR_EASINGS__ADD(a, b) vaddq_f32(a, b)
+#define PAR_EASINGS__SUB(a, b) vsubq_f32(a, b)
+#define PAR_EASINGS__MUL(a, b) vmulq_f32(a, b)
+#define PAR_EASINGS__LT(a, b) vcltq_f32(a, b)
+#define PAR_EASINGS__SEL(m, a, b) vbslq_f32(m, a, b)
+#define PAR_EASINGS__ROUND(x) \
+    vsubq_f32(vaddq_f32(x, vdupq_n_f32(12582912.0f)), vdupq_n_f32(12582912.0f))
+#else
+typedef PARFLT par_easings__vec;
+typedef int par_easings__mask;
+#define PAR_EASINGS__WIDTH 1
+#define PAR_EASINGS__SPLAT(x) ((PARFLT) (x))
+#define PAR_EASINGS__LOAD(p) (*(p))
+#define PAR_EASINGS__STORE(p, v) (*(p) = (v))
+#define PAR_EASINGS__ADD(a, b) ((a) + (b))
+#define PAR_EASINGS__SUB(a, b) ((a) - (b))
+#define PAR_EASINGS__MUL(a, b) ((a) * (b))
+#define PAR_EASINGS__LT(a, b) ((a) < (b))
+#define PAR_EASINGS__SEL(m, a, b) ((m) ? (a) : (b))
+#define PAR_EASINGS__ROUND(x) ((PARFLT) floor((x) + 0.5))
+#endif
+
+#define PARVEC par_easings__vec
+#define PAR_EASINGS__MAD(a, b, c) \
+    PAR_EASINGS__ADD(PAR_EASINGS__MUL(a, b), PAR_EASINGS__SPLAT(c))
+
+// Computes 2^x as (2^(x / 16))^16, where the small power comes from a Taylor
+// series.  The relative error stays below 2e-6 for x in [-10, 0].
+static PARVEC par_easings__exp2(PARVEC x)
+{
+    PARVEC y = PAR_EASINGS__MUL(x, PAR_EASINGS__SPLAT(0.693147180559945 / 16));
+    PARVEC e = PAR_EASINGS__MAD(y, PAR_EASINGS__SPLAT(1.0 / 5040), 1.0 / 720);
+    e = PAR_EASINGS__MAD(e, y, 1.0 / 120);
+    e = PAR_EASINGS__MAD(e, y, 1.0 / 24);
+    e = PAR_EASINGS__MAD(e, y, 1.0 / 6);
+    e = PAR_EASINGS__MAD(e, y, 0.5);
+    e = PAR_EASINGS__MAD(e, y, 1);
+    e = PAR_EASINGS__MAD(e, y, 1);
+    e = PAR_EASINGS__MUL(e, e);
+    e = PAR_EASINGS__MUL(e, e);
+    e = PAR_EASINGS__MUL(e, e);
+    return PAR_EASINGS__MUL(e, e);
+}
+
+// Reduces x to r in [-pi/2, pi/2] such that sin(x) = (-1)^q sin(r), then
+// evaluates a Taylor series in r.  The error stays below 4e-6.
+static PARVEC par_easings__sin(PARVEC x)
+{
+    PARVEC q = PAR_EASINGS__ROUND(PAR_EASINGS__MUL(x,
+        PAR_EASINGS__SPLAT(1.0 / PAR_PI)));
+    PARVEC r = PAR_EASINGS__SUB(x, PAR_EASINGS__MUL(q,
+        PAR_EASINGS__SPLAT(3.140625)));
+    r = PAR_EASINGS__SUB(r, PAR_EASINGS__MUL(q,
+        PAR_EASINGS__SPLAT(PAR_PI - 3.140625)));
+    PARVEC half = PAR_EASINGS__ROUND(PAR_EASINGS__SUB(PAR_EASINGS__MUL(q,
+        PAR_EASINGS__SPLAT(0.5)), PAR_EASINGS__SPLAT(0.25)));
+    PARVEC odd = PAR_EASINGS__SUB(q, PAR_EASINGS__ADD(half, half));
+    PARVEC sign = PAR_EASINGS__SUB(PAR_EASINGS__SPLAT(1),
+        PAR_EASINGS__ADD(odd, odd));
+    PARVEC r2 = PAR_EASINGS__MUL(r, r);
+    PARVEC p = PAR_EASINGS__MAD(r2, PAR_EASINGS__SPLAT(1.0 / 362880),
+        -1.0 / 5040);
+    p = PAR_EASINGS__MAD(p, r2, 1.0 / 120);
+    p = PAR_EASINGS__MAD(p, r2, -1.0 / 6);
+    p = PAR_EASINGS__MAD(p, r2, 1);
+    return PAR_EASINGS__MUL(PAR_EASINGS__MUL(p, r), sign);
+}
+
+static PARVEC par_easings__v_linear(PARVEC t)
+{
+    return t;
+}
+
+static PARVEC par_easings__v_in_cubic(PARVEC t)
+{
+    return PAR_EASINGS__MUL(PAR_EASINGS__MUL(t, t), t);
+}
+
+static PARVEC par_easings__v_out_cubic(PARVEC t)
+{
+    PARVEC u = PAR_EASINGS__SUB(t, PAR_EASINGS__SPLAT(1));
+    return PAR_EASINGS__MAD(PAR_EASINGS__MUL(u, u), u, 1);
+}
+
+static PARVEC par_easings__v_in_out_cubic(PARVEC t)
+{
+    PARVEC one = PAR_EASINGS__SPLAT(1);
+    PARVEC half = PAR_EASINGS__SPLAT(0.5);
+    t = PAR_EASINGS__ADD(t, t);
+    PARVEC u = PAR_EASINGS__SEL(PAR_EASINGS__LT(t, one), t,
+        PAR_EASINGS__SUB(t, PAR_EASINGS__SPLAT(2)));
+    PARVEC v = PAR_EASINGS__MUL(PAR_EASINGS__MUL(half, u),
+        PAR_EASINGS__MUL(u, u));
+    return PAR_EASINGS__SEL(PAR_EASINGS__LT(t, one), v,
+        PAR_EASINGS__ADD(v, one));
+}
+
+static PARVEC par_easings__v_in_quad(PARVEC t)
+{
+    return PAR_EASINGS__MUL(t, t);
+}
+
+static PARVEC par_easings__v_out_quad(PARVEC t)
+{
+    return PAR_EASINGS__MUL(t, PAR_EASINGS__SUB(PAR_EASINGS__SPLAT(2), t));
+}
+
+static PARVEC par_easings__v_in_out_quad(PARVEC t)
+{
+    PARVEC one = PAR_EASINGS__SPLAT(1);
+    PARVEC half = PAR_EASINGS__SPLAT(0.5);
+    t = PAR_EASINGS__ADD(t, t);
+    PARVEC u = PAR_EASINGS__SUB(t, one);
+    PARVEC in = PAR_EASINGS__MUL(PAR_EASINGS__MUL(half, t), t);
+    PARVEC out = PAR_EASINGS__MUL(half, PAR_EASINGS__SUB(one,
+        PAR_EASINGS__MUL(u, PAR_EASINGS__SUB(u, PAR_EASINGS__SPLAT(2)))));
+    return PAR_EASINGS__SEL(PAR_EASINGS__LT(t, one), in, out);
+}
+
+// The elastic curves use an amplitude of 1 and periods of 0.3 and 0.45, so
+// their phase offsets are a quarter period.
+static PARVEC par_easings__v_in_elastic(PARVEC t)
+{
+    PARVEC u = PAR_EASINGS__SUB(t, PAR_EASINGS__SPLAT(1));
+    PARVEC e = par_easings__exp2(PAR_EASINGS__MUL(u, PAR_EASINGS__SPLAT(10)));
+    PARVEC s = par_easings__sin(PAR_EASINGS__MUL(PAR_EASINGS__SUB(u,
+        PAR_EASINGS__SPLAT(0.075)), PAR_EASINGS__SPLAT(2 * PAR_PI / 0.3)));
+    return PAR_EASINGS__SUB(PAR_EASINGS__SPLAT(0), PAR_EASINGS__MUL(e, s));
+}
+
+static PARVEC par_easings__v_out_elastic(PARVEC t)
+{
+    PARVEC e = par_easings__exp2(PAR_EASINGS__MUL(t, PAR_EASINGS__SPLAT(-10)));
+    PARVEC s = par_easings__sin(PAR_EASINGS__MUL(PAR_EASINGS__SUB(t,
+        PAR_EASINGS__SPLAT(0.075)), PAR_EASINGS__SPLAT(2 * PAR_PI / 0.3)));
+    return PAR_EASINGS__MAD(e, s, 1);
+}
+
+static PARVEC par_easings__v_in_out_elastic(PARVEC t)
+{
+    par_easings__mask first = PAR_EASINGS__LT(t, PAR_EASINGS__SPLAT(1));
+    PARVEC u = PAR_EASINGS__SUB(t, PAR_EASINGS__SPLAT(1));
+    PARVEC x = PAR_EASINGS__MUL(u, PAR_EASINGS__SEL(first,
+        PAR_EASINGS__SPLAT(10), PAR_EASINGS__SPLAT(-10)));
+    PARVEC s = par_easings__sin(PAR_EASINGS__MUL(PAR_EASINGS__SUB(u,
+        PAR_EASINGS__SPLAT(0.1125)), PAR_EASINGS__SPLAT(2 * PAR_PI / 0.45)));
+    PARVEC v = PAR_EASINGS__MUL(PAR_EASINGS__MUL(par_easings__exp2(x), s),
+        PAR_EASINGS__SPLAT(0.5));
+    return PAR_EASINGS__SEL(first, PAR_EASINGS__SUB(PAR_EASINGS__SPLAT(0), v),
+        PAR_EASINGS__ADD(v, PAR_EASINGS__SPLAT(1)));
+}
+
+static PARVEC par_easings__v_out_bounce(PARVEC t)
+{
+    par_easings__mask m0 = PAR_EASINGS__LT(t, PAR_EASINGS__SPLAT(1.0 / 2.75));
+    par_easings__mask m1 = PAR_EASINGS__LT(t, PAR_EASINGS__SPLAT(2.0 / 2.75));
+    par_easings__mask m2 = PAR_EASINGS__LT(t, PAR_EASINGS__SPLAT(2.5 / 2.75));
+    PARVEC offset = PAR_EASINGS__SEL(m2, PAR_EASINGS__SPLAT(2.25 / 2.75),
+        PAR_EASINGS__SPLAT(2.625 / 2.75));
+    PARVEC lift = PAR_EASINGS__SEL(m2, PAR_EASINGS__SPLAT(0.9375),
+        PAR_EASINGS__SPLAT(0.984375));
+    offset = PAR_EASINGS__SEL(m1, PAR_EASINGS__SPLAT(1.5 / 2.75), offset);
+    lift = PAR_EASINGS__SEL(m1, PAR_EASINGS__SPLAT(0.75), lift);
+    offset = PAR_EASINGS__SEL(m0, PAR_EASINGS__SPLAT(0), offset);
+    lift = PAR_EASINGS__SEL(m0, PAR_EASINGS__SPLAT(0), lift);
+    PARVEC u = PAR_EASINGS__SUB(t, offset);
+    return PAR_EASINGS__ADD(PAR_EASINGS__MUL(PAR_EASINGS__SPLAT(7.5625),
+        PAR_EASINGS__MUL(u, u)), lift);
+}
+
+static PARVEC par_easings__v_in_bounce(PARVEC t)
+{
+    PARVEC one = PAR_EASINGS__SPLAT(1);
+    return PAR_EASINGS__SUB(one,
+        par_easings__v_out_bounce(PAR_EASINGS__SUB(one, t)));
+}
+
+static PARVEC par_easings__v_in_out_bounce(PARVEC t)
+{
+    PARVEC one = PAR_EASINGS__SPLAT(1);
+    PARVEC half = PAR_EASINGS__SPLAT(0.5);
+    par_easings__mask first = PAR_EASINGS__LT(t, half);
+    PARVEC t2 = PAR_EASINGS__ADD(t, t);
+    PARVEC v = par_easings__v_out_bounce(PAR_EASINGS__SEL(first,
+        PAR_EASINGS__SUB(one, t2), PAR_EASINGS__SUB(t2, one)));
+    return PAR_EASINGS__SEL(first, PAR_EASINGS__MUL(PAR_EASINGS__SUB(one, v),
+        half), PAR_EASINGS__MAD(v, half, 0.5));
+}
+
+static PARVEC par_easings__v_in_back(PARVEC t)
+{
+    PARVEC s = PAR_EASINGS__SPLAT(1.70158);
+    PARVEC v = PAR_EASINGS__SUB(PAR_EASINGS__MUL(PAR_EASINGS__SPLAT(2.70158),
+        t), s);
+    return PAR_EASINGS__MUL(PAR_EASINGS__MUL(t, t), v);
+}
+
+static PARVEC par_easings__v_out_back(PARVEC t)
+{
+    PARVEC u = PAR_EASINGS__SUB(t, PAR_EASINGS__SPLAT(1));
+    PARVEC v = PAR_EASINGS__MAD(PAR_EASINGS__SPLAT(2.70158), u, 1.70158);
+    return PAR_EASINGS__MAD(PAR_EASINGS__MUL(u, u), v, 1);
+}
+
+// Matches the scalar version, which scales the overshoot twice on the way out.
+static PARVEC par_easings__v_in_out_back(PARVEC t)
+{
+    const double s1 = 1.70158 * 1.525;
+    const double s2 = s1 * 1.525;
+    PARVEC half = PAR_EASINGS__SPLAT(0.5);
+    t = PAR_EASINGS__ADD(t, t);
+    PARVEC in = PAR_EASINGS__MUL(PAR_EASINGS__MUL(t, t),
+        PAR_EASINGS__MAD(PAR_EASINGS__SPLAT(s1 + 1), t, -s1));
+    PARVEC u = PAR_EASINGS__SUB(t, PAR_EASINGS__SPLAT(2));
+    PARVEC out = PAR_EASINGS__MUL(PAR_EASINGS__MUL(u, u),
+        PAR_EASINGS__MUL(PAR_EASINGS__SPLAT(s2 + 1), u));
+    out = PAR_EASINGS__MAD(PAR_EASINGS__ADD(out, PAR_EASINGS__SPLAT(s2)),
+        half, 2);
+    return PAR_EASINGS__SEL(PAR_EASINGS__LT(t, PAR_EASINGS__SPLAT(1)),
+        PAR_EASINGS__MUL(in, half), out);
+}
+
+// The tail is padded to a full vector so that every element goes through the
+// same kernel.
+#define PAR_EASINGS__BATCH(name) \
+void par_easings_##name##_n(PARFLT const* t, PARFLT* out, int n) \
+{ \
+    int i = 0; \
+    for (; i + PAR_EASINGS__WIDTH <= n; i += PAR_EASINGS__WIDTH) { \
+        PAR_EASINGS__STORE(out + i, \
+            par_easings__v_##name(PAR_EASINGS__LOAD(t + i))); \
+    } \
+    if (i < n) { \
+        PARFLT tail[PAR_EASINGS__WIDTH] = {0}; \
+        memcpy(tail, t + i, sizeof(PARFLT) * (n - i)); \
+        PAR_EASINGS__STORE(tail, \
+            par_easings__v_##name(PAR_EASINGS__LOAD(tail))); \
+        memcpy(out + i, tail, sizeof(PARFLT) * (n - i)); \
+    } \
+}
+
+PAR_EASINGS__BATCH(linear)
+PAR_EASINGS__BATCH(in_cubic)
+PAR_EASINGS__BATCH(out_cubic)
+PAR_EASINGS__BATCH(in_out_cubic)
+PAR_EASINGS__BATCH(in_quad)
+PAR_EASINGS__BATCH(out_quad)
+PAR_EASINGS__BATCH(in_out_quad)
+PAR_EASINGS__BATCH(in_elastic)
+PAR_EASINGS__BATCH(out_elastic)
+PAR_EASINGS__BATCH(in_out_elastic)
+PAR_EASINGS__BATCH(in_bounce)
+PAR_EASINGS__BATCH(out_bounce)
+PAR_EASINGS__BATCH(in_out_bounce)
+PAR_EASINGS__BATCH(in_back)
+PAR_EASINGS__BATCH(out_back)
+PAR_EASINGS__BATCH(in_out_back)
+
+#undef PARVEC
+
+// Returns the largest deviation between a sampled curve and its function,
+// probing each interval at its quarter points.
+static PARFLT par_easings__lut_error(par_easings_lut const* lut,
+    par_easings_fn fn)
+{
+    PARFLT maxerror = 0;
+    PARFLT dt = (PARFLT) 1 / lut->resolution;
+    for (int i = 0; i < lut->resolution; i++) {
+        PARFLT a = lut->values[i];
+        PARFLT b = lut->values[i + 1];
+        for (int j = 1; j < 4; j++) {
+            PARFLT f = (PARFLT) j / 4;
+            PARFLT e = fabs(fn((i + f) * dt) - (a + (b - a) * f));
+            maxerror = PAR_MAX(maxerror, e);
+        }
+    }
+    return maxerror;
+}
+
+par_easings_lut* par_easings_create_lut(par_easings_fn fn, int resolution,
+    PARFLT maxerror)
+{
+    par_easings_lut* lut = (par_easings_lut*) calloc(sizeof(par_easings_lut),
+        1);
+    resolution = PAR_CLAMP(resolution, 1, PAR_EASINGS_LUT_MAXRESOLUTION);
+    while (1) {
+        int nvalues = resolution + 1;
+        lut->values = (PARFLT*) realloc(lut->values, sizeof(PARFLT) * nvalues);
+        lut->resolution = resolution;
+        for (int i = 0; i < nvalues; i++) {
+            lut->values[i] = fn((PARFLT) i / resolution);
+        }
+        lut->maxerror = par_easings__lut_error(lut, fn);
+        if (maxerror <= 0 || lut->maxerror <= maxerror ||
+            resolution * 2 > PAR_EASINGS_LUT_MAXRESOLUTION) {
+            return lut;
+        }
+        resolution *= 2;
+    }
+}
+
+void par_easings_free_lut(par_easings_lut* lut)
+{
+    free(lut->values);
+    free(lut);
+}
+
+void par_easings_lut_n(par_easings_lut const* lut, PARFLT const* t,
+    PARFLT* out, int n)
+{
+    PARFLT const* values = lut->values;
+    PARFLT scale = (PARFLT) lut->resolution;
+    int last = lut->resolution - 1;
+    int i = 0;
+
+    // SSE2 has no gather, but computing the indices and blending four lanes
+    // at once still halves the cost of the scalar loop.
+#if defined(PAR_EASINGS__SINGLE) && defined(__SSE2__)
+    __m128 vscale = _mm_set1_ps(scale);
+    __m128i vlast = _mm_set1_epi32(last);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(t + i), vscale);
+        x = _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), vscale);
+        __m128i j = _mm_cvttps_epi32(x);
+        __m128i clamp = _mm_cmpgt_epi32(j, vlast);
+        j = _mm_or_si128(_mm_and_si128(clamp, vlast),
+            _mm_andnot_si128(clamp, j));
+        __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(j));
+        int k[4];
+        _mm_storeu_si128((__m128i*) k, j);
+        __m128 a = _mm_setr_ps(values[k[0]], values[k[1]], values[k[2]],
+            values[k[3]]);
+        __m128 b = _mm_setr_ps(values[k[0] + 1], values[k[1] + 1],
+            values[k[2] + 1], values[k[3] + 1]);
+        _mm_storeu_ps(out + i, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f)));
+    }
+#endif
+    for (; i < n; i++) {
+        PARFLT x = t[i] * scale;
+        x = x > 0 ? x : 0;
+        int j = (int) x;
+        j = j < last ? j : last;
+        PARFLT f = x - j;
+        f = f < 1 ? f : 1;
+        out[i] = values[j] + (values[j + 1] - values[j]) * f;
+    }
+}
+
 #undef PARFLT
 
 #endif // PAR_EASINGS_IMPLEMENTATION
@@ -31,6 +31,54 @@ int par_easycurl_to_memory(char const* url, par_byte** data, int* nbytes);
 // success and 0 otherwise.
 int par_easycurl_to_file(char const* srcurl, char const* dstpath);
 
+// A session keeps its connections alive between requests and multiplexes
+// requests to the same host over HTTP/2 where possible.  Sessions are not
+// thread-safe, but separate threads can use separate sessions.
+typedef struct par_easycurl_session_s par_easycurl_session;
+
+// Creates a session that opens at most the given number of connections, or
+// a default number if it is 0.
+par_easycurl_session* par_easycurl_create_session(int maxconnections);
+
+void par_easycurl_destroy_session(par_easycurl_session*);
+
+// These behave like the functions above but reuse the session's connections.
+int par_easycurl_session_to_memory(par_easycurl_session*, char const* url,
+    par_byte** data, int* nbytes);
+int par_easycurl_session_to_file(par_easycurl_session*, char const* srcurl,
+    char const* dstpath);
+
+// Called as each request of a batch finishes.  On success the callback takes
+// ownership of the data, which is null on failure.
+typedef void (*par_easycurl_fn)(void* userdata, int success, par_byte* data,
+    int nbytes);
+
+typedef struct {
+    char const* url;
+    int sizehint;            // Expected body size in bytes, or 0 if unknown
+    par_easycurl_fn oncomplete;
+    void* userdata;
+} par_easycurl_request;
+
+// Downloads all the given URLs concurrently, invoking their callbacks on the
+// calling thread as they finish.  Returns the number of successful requests.
+int par_easycurl_fetch(par_easycurl_session*,
+    par_easycurl_request const* requests, int nrequests);
+
+#ifdef PAR_FILECACHE_H
+
+// Downloads a blob through a filecache context, or through the default cache
+// if the context is null.  This is available when par_filecache.h is included
+// first.  Bodies are cached with their ETag and Last-Modified validators.  A
+// copy that is still fresh according to Cache-Control max-age is returned
+// without touching the network; otherwise a conditional request is sent and
+// a 304 response returns the cached copy.  The cached copy is also returned
+// when the server cannot be reached.  The session may be null.
+int par_easycurl_cached_to_memory(par_easycurl_session*,
+    par_filecache_context*, char const* url, par_byte** data, int* nbytes);
+
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,8 +92,16 @@ int par_easycurl_to_file(char const* srcurl, char const* dstpath);
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
 #include <curl/curl.h>
 
+#define PAR_EASYCURL__MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Connection limit for sessions created with a maxconnections of 0.
+#define PAR_EASYCURL__CONNECTIONS 8
+
 static int _ready = 0;
 
 void par_easycurl_init(unsigned int flags)
@@ -63,33 +119,124 @@ void par_easycurl_shutdown()
     }
 }
 
-static size_t onheader(void* v, size_t size, size_t nmemb)
+#define PAR_EASYCURL__ETAG 128
+
+enum { PAR_EASYCURL__MAXAGE = 1, PAR_EASYCURL__NOSTORE = 2 };
+
+// Besides the body, this collects the caching headers of the final response.
+typedef struct {
+    par_byte* data;
+    int nbytes;
+    int capacity;
+    FILE* file;
+    int flags;
+    long maxage;
+    time_t lastmodified;
+    char etag[PAR_EASYCURL__ETAG];
+} par_easycurl_buffer;
+
+// Buffers start at the size hint or the Content-Length, then grow
+// geometrically.  Compressed responses report their compressed length, so
+// that only gives a lower bound.
+static int par_easycurl__reserve(par_easycurl_buffer* mem, size_t nbytes)
+{
+    if (nbytes + 1 <= (size_t) mem->capacity) {
+        return 1;
+    }
+    size_t capacity = PAR_EASYCURL__MAX(nbytes + 1, 2 * (size_t) mem->capacity);
+    par_byte* data = (par_byte*) realloc(mem->data, capacity);
+    if (!data) {
+        return 0;
+    }
+    mem->data = data;
+    mem->capacity = (int) capacity;
+    return 1;
+}
+
+// Copies a header value without surrounding whitespace, returning 0 if it
+// does not fit.
+static int par_easycurl__header_value(char const* src, size_t n, char* dst,
+    size_t capacity)
+{
+    while (n > 0 && (*src == ' ' || *src == '\t')) {
+        src++;
+        n--;
+    }
+    while (n > 0 && strchr(" \t\r\n", src[n - 1])) {
+        n--;
+    }
+    dst[0] = 0;
+    if (n >= capacity) {
+        return 0;
+    }
+    memcpy(dst, src, n);
+    dst[n] = 0;
+    return 1;
+}
+
+static void par_easycurl__cache_control(par_easycurl_buffer* mem,
+    char const* src, size_t n)
+{
+    char value[256];
+    if (!par_easycurl__header_value(src, n, value, sizeof(value))) {
+        return;
+    }
+    for (char* c = value; *c; c++) {
+        *c = (char) tolower(*c);
+    }
+    char const* maxage = strstr(value, "max-age=");
+    if (strstr(value, "no-store")) {
+        mem->flags |= PAR_EASYCURL__NOSTORE;
+    }
+    if (strstr(value, "no-cache")) {
+        mem->flags |= PAR_EASYCURL__MAXAGE;
+        mem->maxage = 0;
+    } else if (maxage && (maxage == value || !isalpha(maxage[-1]))) {
+        mem->flags |= PAR_EASYCURL__MAXAGE;
+        mem->maxage = strtol(maxage + 8, 0, 10);
+    }
+}
+
+static size_t onheader(char* v, size_t size, size_t nmemb, void* udata)
 {
     size_t n = size * nmemb;
     char* h = (char*) v;
-    if (n > 14 && !strncasecmp("Last-Modified:", h, 14)) {
+    par_easycurl_buffer* mem = (par_easycurl_buffer*) udata;
+
+    // Each response in a redirect chain starts with a status line.
+    if (n > 5 && !strncmp("HTTP/", h, 5)) {
+        mem->flags = 0;
+        mem->maxage = 0;
+        mem->lastmodified = 0;
+        mem->etag[0] = 0;
+    } else if (n > 15 && !strncasecmp("Content-Length:", h, 15) &&
+        !mem->file) {
+        long length = strtol(h + 15, 0, 10);
+        if (length > 0 && length < INT32_MAX) {
+            par_easycurl__reserve(mem, (size_t) length);
+        }
+    } else if (n > 14 && !strncasecmp("Last-Modified:", h, 14)) {
         char const* s = h + 14;
         time_t r = curl_getdate(s, 0);
         if (r != -1) {
-            // TODO handle last-modified
+            mem->lastmodified = r;
         }
     } else if (n > 5 && !strncasecmp("ETag:", h, 5)) {
-        // TODO handle etag
+        par_easycurl__header_value(h + 5, n - 5, mem->etag, sizeof(mem->etag));
+    } else if (n > 14 && !strncasecmp("Cache-Control:", h, 14)) {
+        par_easycurl__cache_control(mem, h + 14, n - 14);
     }
     return n;
 }
 
-typedef struct {
-    par_byte* data;
-    int nbytes;
-} par_easycurl_buffer;
-
 static size_t onwrite(char* contents, size_t size, size_t nmemb, void* udata)
 {
     size_t realsize = size * nmemb;
     par_easycurl_buffer* mem = (par_easycurl_buffer*) udata;
-    mem->data = (par_byte*) realloc(mem->data, mem->nbytes + realsize + 1);
-    if (!mem->data) {
+    if (mem->file) {
+        return fwrite(contents, size, nmemb, mem->file) * size;
+    }
+    if (!par_easycurl__reserve(mem, mem->nbytes + realsize)) {
         return 0;
     }
     memcpy(mem->data + mem->nbytes, contents, realsize);
@@ -124,77 +271,431 @@ bool curlToMemory(char const* url, uint8_t** data, int* nbytes)
 
 #endif
 
-int par_easycurl_to_memory(char const* url, par_byte** data, int* nbytes)
+static void par_easycurl__configure(CURL* handle, char const* url,
+    par_easycurl_buffer* buffer, char* errbuf)
 {
-    char errbuf[CURL_ERROR_SIZE] = {0};
-    par_easycurl_buffer buffer = {(par_byte*) malloc(1), 0};
-    long code = 0;
-    long status = 0;
-    CURL* handle = curl_easy_init();
     curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(handle, CURLOPT_ENCODING, "gzip, deflate");
     curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
     curl_easy_setopt(handle, CURLOPT_MAXREDIRS, 8);
     curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1);
     curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, onwrite);
-    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &buffer);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, buffer);
     curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, onheader);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, buffer);
     curl_easy_setopt(handle, CURLOPT_URL, url);
-    curl_easy_setopt(handle, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
-    curl_easy_setopt(handle, CURLOPT_TIMEVALUE, 0);
     curl_easy_setopt(handle, CURLOPT_HTTPHEADER, 0);
     curl_easy_setopt(handle, CURLOPT_TIMEOUT, 60);
     curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errbuf);
     curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 0);
-    CURLcode res = curl_easy_perform(handle);
+}
+
+// Returns 1 if a finished transfer has a usable body.
+static int par_easycurl__succeeded(CURL* handle, CURLcode res,
+    char const* errbuf)
+{
+    long status = 0;
     if (res != CURLE_OK) {
-        printf("CURL Error: %s\n", errbuf);
+        printf("CURL Error: %s\n",
+            errbuf[0] ? errbuf : curl_easy_strerror(res));
         return 0;
     }
-    curl_easy_getinfo(handle, CURLINFO_CONDITION_UNMET, &code);
     curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
-    if (status == 304 || status >= 400) {
+    return status != 304 && status < 400;
+}
+
+int par_easycurl_to_memory(char const* url, par_byte** data, int* nbytes)
+{
+    char errbuf[CURL_ERROR_SIZE] = {0};
+    par_easycurl_buffer buffer = {0};
+    CURL* handle = curl_easy_init();
+    par_easycurl__configure(handle, url, &buffer, errbuf);
+    CURLcode res = curl_easy_perform(handle);
+    int ok = par_easycurl__succeeded(handle, res, errbuf) &&
+        par_easycurl__reserve(&buffer, buffer.nbytes);
+    curl_easy_cleanup(handle);
+    if (!ok) {
+        free(buffer.data);
         return 0;
     }
+    buffer.data[buffer.nbytes] = 0;
     *data = buffer.data;
     *nbytes = buffer.nbytes;
-    curl_easy_cleanup(handle);
     return 1;
 }
 
 int par_easycurl_to_file(char const* srcurl, char const* dstpath)
 {
-    long code = 0;
-    long status = 0;
-    FILE* filehandle = fopen(dstpath, "wb");
-    if (!filehandle) {
+    char errbuf[CURL_ERROR_SIZE] = {0};
+    par_easycurl_buffer buffer = {0};
+    buffer.file = fopen(dstpath, "wb");
+    if (!buffer.file) {
         printf("Unable to open %s for writing.\n", dstpath);
         return 0;
     }
     CURL* handle = curl_easy_init();
-    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
-    curl_easy_setopt(handle, CURLOPT_ENCODING, "gzip, deflate");
-    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
-    curl_easy_setopt(handle, CURLOPT_MAXREDIRS, 8);
-    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1);
-    curl_easy_setopt(handle, CURLOPT_WRITEDATA, filehandle);
-    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, onheader);
-    curl_easy_setopt(handle, CURLOPT_URL, srcurl);
-    curl_easy_setopt(handle, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
-    curl_easy_setopt(handle, CURLOPT_TIMEVALUE, 0);
-    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, 0);
-    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 60);
-    curl_easy_perform(handle);
-    curl_easy_getinfo(handle, CURLINFO_CONDITION_UNMET, &code);
-    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
-    fclose(filehandle);
-    if (status == 304 || status >= 400) {
+    par_easycurl__configure(handle, srcurl, &buffer, errbuf);
+    CURLcode res = curl_easy_perform(handle);
+    int ok = par_easycurl__succeeded(handle, res, errbuf);
+    curl_easy_cleanup(handle);
+    fclose(buffer.file);
+    if (!ok) {
+        remove(dstpath);
+    }
+    return ok;
+}
+
+typedef struct {
+    CURL* handle;
+    par_easycurl_buffer buffer;
+    par_easycurl_request request;
+    struct curl_slist* headers;
+    time_t ifmodifiedsince;
+    char errbuf[CURL_ERROR_SIZE];
+    long status;
+    int success;
+} par_easycurl__transfer;
+
+// Idle easy handles are pooled because each one keeps its own DNS cache and
+// TLS session ids; live connections are cached by the multi handle.  The pool
+// holds at most "maxconnections" handles.
+struct par_easycurl_session_s {
+    CURLM* multi;
+    CURL** idle;
+    int nidle;
+    int maxconnections;
+};
+
+par_easycurl_session* par_easycurl_create_session(int maxconnections)
+{
+    par_easycurl_session* session = (par_easycurl_session*)
+        calloc(sizeof(par_easycurl_session), 1);
+    if (maxconnections <= 0) {
+        maxconnections = PAR_EASYCURL__CONNECTIONS;
+    }
+    session->maxconnections = maxconnections;
+    session->idle = (CURL**) malloc(sizeof(CURL*) * maxconnections);
+    session->multi = curl_multi_init();
+    curl_multi_setopt(session->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+        (long) maxconnections);
+    curl_multi_setopt(session->multi, CURLMOPT_MAXCONNECTS,
+        (long) maxconnections);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_multi_setopt(session->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    return session;
+}
+
+void par_easycurl_destroy_session(par_easycurl_session* session)
+{
+    for (int i = 0; i < session->nidle; i++) {
+        curl_easy_cleanup(session->idle[i]);
+    }
+    free(session->idle);
+    curl_multi_cleanup(session->multi);
+    free(session);
+}
+
+static CURL* par_easycurl__acquire(par_easycurl_session* session)
+{
+    if (session->nidle == 0) {
+        return curl_easy_init();
+    }
+    CURL* handle = session->idle[--session->nidle];
+    curl_easy_reset(handle);
+    return handle;
+}
+
+// Finishes a transfer and hands its body to the callback.
+static void par_easycurl__complete(par_easycurl_session* session,
+    par_easycurl__transfer* transfer, CURLcode res)
+{
+    CURL* handle = transfer->handle;
+    par_easycurl_buffer* buffer = &transfer->buffer;
+    transfer->success = par_easycurl__succeeded(handle, res,
+        transfer->errbuf) && (buffer->file ||
+        par_easycurl__reserve(buffer, buffer->nbytes));
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &transfer->status);
+
+    // libcurl discards the body of a 200 whose Last-Modified fails the time
+    // condition, which amounts to a 304.
+    long unmet = 0;
+    curl_easy_getinfo(handle, CURLINFO_CONDITION_UNMET, &unmet);
+    if (unmet && transfer->success) {
+        transfer->success = 0;
+        transfer->status = 304;
+    }
+    curl_multi_remove_handle(session->multi, handle);
+    if (session->nidle < session->maxconnections) {
+        session->idle[session->nidle++] = handle;
+    } else {
+        curl_easy_cleanup(handle);
+    }
+    transfer->handle = 0;
+    if (!transfer->success) {
+        free(buffer->data);
+        buffer->data = 0;
+        buffer->nbytes = 0;
+    } else if (!buffer->file) {
+        buffer->data[buffer->nbytes] = 0;
+    }
+    if (transfer->request.oncomplete) {
+        transfer->request.oncomplete(transfer->request.userdata,
+            transfer->success, buffer->data, buffer->nbytes);
+    }
+}
+
+static int par_easycurl__perform(par_easycurl_session* session,
+    par_easycurl__transfer* transfers, int ntransfers)
+{
+    for (int i = 0; i < ntransfers; i++) {
+        par_easycurl__transfer* transfer = transfers + i;
+        CURL* handle = par_easycurl__acquire(session);
+        transfer->handle = handle;
+        par_easycurl__configure(handle, transfer->request.url,
+            &transfer->buffer, transfer->errbuf);
+        curl_easy_setopt(handle, CURLOPT_PRIVATE, transfer);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+            CURL_HTTP_VERSION_2TLS);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+#endif
+        if (transfer->headers) {
+            curl_easy_setopt(handle, CURLOPT_HTTPHEADER, transfer->headers);
+        }
+        if (transfer->ifmodifiedsince > 0) {
+            curl_easy_setopt(handle, CURLOPT_TIMECONDITION,
+                CURL_TIMECOND_IFMODSINCE);
+            curl_easy_setopt(handle, CURLOPT_TIMEVALUE,
+                (long) transfer->ifmodifiedsince);
+        }
+        if (transfer->request.sizehint > 0 && !transfer->buffer.file) {
+            par_easycurl__reserve(&transfer->buffer,
+                transfer->request.sizehint);
+        }
+        curl_multi_add_handle(session->multi, handle);
+    }
+    int nsucceeded = 0;
+    int running = 1;
+    while (running) {
+        if (curl_multi_perform(session->multi, &running) != CURLM_OK) {
+            break;
+        }
+        CURLMsg* msg;
+        int nmsgs;
+        while ((msg = curl_multi_info_read(session->multi, &nmsgs))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            par_easycurl__transfer* transfer = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+            par_easycurl__complete(session, transfer, msg->data.result);
+            nsucceeded += transfer->success;
+        }
+        if (running) {
+            curl_multi_wait(session->multi, 0, 0, 1000, 0);
+        }
+    }
+
+    // Handles that never reported completion are only left behind when the
+    // multi handle itself fails.
+    for (int i = 0; i < ntransfers; i++) {
+        if (transfers[i].handle) {
+            par_easycurl__complete(session, transfers + i,
+                CURLE_FAILED_INIT);
+        }
+    }
+    return nsucceeded;
+}
+
+int par_easycurl_fetch(par_easycurl_session* session,
+    par_easycurl_request const* requests, int nrequests)
+{
+    if (nrequests <= 0) {
+        return 0;
+    }
+    par_easycurl__transfer* transfers = (par_easycurl__transfer*)
+        calloc(sizeof(par_easycurl__transfer), nrequests);
+    for (int i = 0; i < nrequests; i++) {
+        transfers[i].request = requests[i];
+    }
+    int nsucceeded = par_easycurl__perform(session, transfers, nrequests);
+    free(transfers);
+    return nsucceeded;
+}
+
+int par_easycurl_session_to_memory(par_easycurl_session* session,
+    char const* url, par_byte** data, int* nbytes)
+{
+    par_easycurl__transfer transfer = {0};
+    transfer.request.url = url;
+    if (!par_easycurl__perform(session, &transfer, 1)) {
+        return 0;
+    }
+    *data = transfer.buffer.data;
+    *nbytes = transfer.buffer.nbytes;
+    return 1;
+}
+
+int par_easycurl_session_to_file(par_easycurl_session* session,
+    char const* srcurl, char const* dstpath)
+{
+    par_easycurl__transfer transfer = {0};
+    transfer.request.url = srcurl;
+    transfer.buffer.file = fopen(dstpath, "wb");
+    if (!transfer.buffer.file) {
+        printf("Unable to open %s for writing.\n", dstpath);
+        return 0;
+    }
+    int ok = par_easycurl__perform(session, &transfer, 1);
+    fclose(transfer.buffer.file);
+    if (!ok) {
         remove(dstpath);
+    }
+    return ok;
+}
+
+#ifdef PAR_FILECACHE_H
+
+// Fixed-size filecache header that precedes each cached body.
+typedef struct {
+    char magic[4];
+    int32_t flags;
+    int64_t validated;
+    int64_t maxage;
+    int64_t lastmodified;
+    char etag[PAR_EASYCURL__ETAG];
+} par_easycurl__cached;
+
+static char const par_easycurl__magic[4] = {'P', 'E', 'C', '1'};
+
+// Cache names must be valid file names, so they are derived from an FNV-1a
+// hash of the URL.
+static void par_easycurl__cache_name(char const* url, char* name)
+{
+    uint64_t hval = 14695981039346656037ull;
+    for (unsigned char const* c = (unsigned char const*) url; *c; c++) {
+        hval ^= (uint64_t) *c;
+        hval *= 1099511628211ull;
+    }
+    sprintf(name, "url%016llx", (unsigned long long) hval);
+}
+
+static int par_easycurl__cache_load(par_filecache_context* cache,
+    char const* name, par_byte** data, int* nbytes,
+    par_easycurl__cached* entry)
+{
+    uint8_t* header = (uint8_t*) entry;
+    int headersize = (int) sizeof(*entry);
+    bool ok = cache ?
+        par_filecache_ctx_load(cache, name, data, nbytes, header, headersize) :
+        par_filecache_load(name, data, nbytes, header, headersize);
+    if (ok && memcmp(entry->magic, par_easycurl__magic, 4)) {
+        free(*data);
+        ok = false;
+    }
+    return ok;
+}
+
+static void par_easycurl__cache_save(par_filecache_context* cache,
+    char const* name, par_byte const* data, int nbytes,
+    par_easycurl__cached const* entry)
+{
+    uint8_t const* header = (uint8_t const*) entry;
+    int headersize = (int) sizeof(*entry);
+    if (cache) {
+        par_filecache_ctx_save(cache, name, data, nbytes, header, headersize);
+    } else {
+        par_filecache_save(name, data, nbytes, header, headersize);
+    }
+}
+
+static void par_easycurl__validators(par_easycurl__cached* entry,
+    par_easycurl_buffer const* buffer)
+{
+    if (buffer->flags & PAR_EASYCURL__MAXAGE) {
+        entry->flags |= PAR_EASYCURL__MAXAGE;
+        entry->maxage = buffer->maxage;
+    }
+    if (buffer->lastmodified > 0) {
+        entry->lastmodified = buffer->lastmodified;
+    }
+    if (buffer->etag[0]) {
+        strcpy(entry->etag, buffer->etag);
+    }
+}
+
+int par_easycurl_cached_to_memory(par_easycurl_session* session,
+    par_filecache_context* cache, char const* url, par_byte** data,
+    int* nbytes)
+{
+    char name[32];
+    par_easycurl__cache_name(url, name);
+    par_easycurl__cached entry;
+    par_byte* cached = 0;
+    int ncached = 0;
+    int hit = par_easycurl__cache_load(cache, name, &cached, &ncached,
+        &entry);
+    time_t now = time(0);
+    if (hit && (entry.flags & PAR_EASYCURL__MAXAGE) &&
+        now - entry.validated < entry.maxage) {
+        *data = cached;
+        *nbytes = ncached;
+        return 1;
+    }
+    par_easycurl__transfer transfer = {0};
+    transfer.request.url = url;
+
+    // If-Modified-Since is ignored when If-None-Match is present, so it is sent
+    // only for entries that lack an ETag.
+    if (hit && entry.etag[0]) {
+        char line[PAR_EASYCURL__ETAG + 16];
+        sprintf(line, "If-None-Match: %s", entry.etag);
+        transfer.headers = curl_slist_append(0, line);
+    } else if (hit) {
+        transfer.ifmodifiedsince = (time_t) entry.lastmodified;
+    }
+    par_easycurl_session* owned = session ? 0 :
+        par_easycurl_create_session(1);
+    int ok = par_easycurl__perform(session ? session : owned, &transfer, 1);
+    curl_slist_free_all(transfer.headers);
+    if (owned) {
+        par_easycurl_destroy_session(owned);
+    }
+    par_easycurl_buffer* buffer = &transfer.buffer;
+    if (ok) {
+        free(cached);
+        if (!(buffer->flags & PAR_EASYCURL__NOSTORE)) {
+            memset(&entry, 0, sizeof(entry));
+            memcpy(entry.magic, par_easycurl__magic, 4);
+            entry.validated = now;
+            par_easycurl__validators(&entry, buffer);
+            par_easycurl__cache_save(cache, name, buffer->data,
+                buffer->nbytes, &entry);
+        }
+        *data = buffer->data;
+        *nbytes = buffer->nbytes;
+        return 1;
+    }
+
+    // Serve the cached copy when it was revalidated, or when no HTTP response
+    // arrived at all.  Only a fresh max-age makes rewriting it worthwhile.
+    if (!hit || (transfer.status != 304 && transfer.status != 0)) {
+        free(cached);
         return 0;
     }
-    curl_easy_cleanup(handle);
+    if (transfer.status == 304 && (buffer->flags & PAR_EASYCURL__MAXAGE)) {
+        entry.validated = now;
+        par_easycurl__validators(&entry, buffer);
+        par_easycurl__cache_save(cache, name, cached, ncached, &entry);
+    }
+    *data = cached;
+    *nbytes = ncached;
     return 1;
 }
 
+#endif // PAR_FILECACHE_H
+
 #endif // PAR_EASYCURL_IMPLEMENTATION
 #endif // PAR_EASYCURL_H
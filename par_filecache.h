@@ -7,11 +7,19 @@
 //
 // Each item is divided into a payload (arbitrary size) and an optional header
 // (fixed size). The structure of the payload and header are completely up to
-// you. The list of items is stored in a text file at "{PREFIX}table", which
-// contains a list of names, timestamps, and byte counts.  This table is loaded
-// only once, but is saved every time the client fetches a blob from the cache,
-// so that the most-recently-accessed timestamps are always up to date, even
-// when your application doesn't close gracefully.
+// you. The list of items is stored at "{PREFIX}table", which is a binary
+// journal of names, timestamps, and byte counts.  This table is loaded only
+// once, and a small record is appended every time the client saves or fetches
+// a blob, so that the most-recently-accessed timestamps are always up to date,
+// even when your application doesn't close gracefully.  The journal is
+// compacted when most of its records are stale.
+//
+// Each cache is a context object, so a process can hold several independent
+// caches as long as their prefixes differ.  The functions without a context
+// argument operate on a default context that is created lazily.  When
+// PAR_FILECACHE_THREADS is enabled, contexts may be shared between threads;
+// items are written atomically and evicted files are deleted in the
+// background.
 //
 // The MIT License
 // Copyright (c) 2015 Philip Rideout
@@ -29,6 +37,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Initialize the filecache using the given prefix (usually a folder path with
 // a trailing slash) and the given maximum byte count.  If items already exist
@@ -38,7 +47,8 @@ void par_filecache_init(char const* prefix, int maxsize);
 
 // Save a blob to the cache using the given unique name.  If adding the blob
 // would cause the cache to exceed maxsize, the least-recently-used item is
-// evicted at this time.
+// evicted at this time.  Items are written to a temporary file that is then
+// renamed, so readers never observe a partial item.
 void par_filecache_save(char const* name, uint8_t const* payload,
     int payloadsize, uint8_t const* header, int headersize);
 
@@ -48,15 +58,77 @@ void par_filecache_save(char const* name, uint8_t const* payload,
 bool par_filecache_load(char const* name, uint8_t** payload, int* payloadsize,
     uint8_t* header, int headersize);
 
+// Load a blob into a caller-provided buffer, decompressing straight into it.
+// The payload size is always written if the blob exists, so pass a capacity
+// of zero to query it.  Returns false if the blob is missing, or if it does
+// not fit.
+bool par_filecache_load_into(char const* name, uint8_t* payload, int capacity,
+    int* payloadsize, uint8_t* header, int headersize);
+
+// Borrowed view of a cached blob, which stays valid until it is unmapped.
+typedef struct {
+    uint8_t const* header;
+    uint8_t const* payload;
+    int payloadsize;
+    void* mapping;
+    size_t mapsize;
+    bool owned;
+} par_filecache_view;
+
+// Memory-map a blob without copying it.  The header and an uncompressed
+// payload point into the mapping; a compressed payload is decompressed into
+// memory that is owned by the view.
+bool par_filecache_map(char const* name, par_filecache_view* view,
+    int headersize);
+
+void par_filecache_unmap(par_filecache_view* view);
+
 // Remove all items from the cache.
 void par_filecache_evict_all();
 
+typedef struct par_filecache_context_s par_filecache_context;
+
+// Create an independent cache with its own prefix and maximum byte count,
+// loading any existing table.  The global functions above are equivalent to
+// calling these on a default context.
+par_filecache_context* par_filecache_create_context(char const* prefix,
+    int maxsize);
+
+// Finish pending evictions and free the context.  Items stay on disk.
+void par_filecache_destroy_context(par_filecache_context*);
+
+void par_filecache_ctx_save(par_filecache_context*, char const* name,
+    uint8_t const* payload, int payloadsize, uint8_t const* header,
+    int headersize);
+
+bool par_filecache_ctx_load(par_filecache_context*, char const* name,
+    uint8_t** payload, int* payloadsize, uint8_t* header, int headersize);
+
+bool par_filecache_ctx_load_into(par_filecache_context*, char const* name,
+    uint8_t* payload, int capacity, int* payloadsize, uint8_t* header,
+    int headersize);
+
+bool par_filecache_ctx_map(par_filecache_context*, char const* name,
+    par_filecache_view* view, int headersize);
+
+void par_filecache_ctx_evict_all(par_filecache_context*);
+
+// Block until the background thread has deleted every evicted file and
+// compacted the journal if that was due.
+void par_filecache_ctx_flush(par_filecache_context*);
+
 // Set this to zero if you wish to avoid LZ4 compression.  I recommend using
 // it though, because it's very fast and it's a two-file library.
 #ifndef ENABLE_LZ4
 #define ENABLE_LZ4 0
 #endif
 
+// Set this to 1 to make contexts safe to use from several threads, which uses
+// pthreads.  Evicted files are then deleted on a background thread.
+#ifndef PAR_FILECACHE_THREADS
+#define PAR_FILECACHE_THREADS 0
+#endif
+
 #ifndef PAR_FILECACHE_VERBOSE
 #define PAR_FILECACHE_VERBOSE 0
 #endif
@@ -97,6 +169,7 @@ void par_filecache_evict_all();
 #include <libgen.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -106,6 +179,32 @@ void par_filecache_evict_all();
 #include "lz4.h"
 #endif
 
+// Prefault mappings where possible, since every load reads the whole item.
+#ifdef MAP_POPULATE
+#define PAR_FILECACHE_MAP_FLAGS (MAP_PRIVATE | MAP_POPULATE)
+#else
+#define PAR_FILECACHE_MAP_FLAGS MAP_PRIVATE
+#endif
+
+// Compressed payloads are written as independent LZ4 blocks of this size, so
+// saving only needs a scratch buffer for one block.
+#define PAR_FILECACHE_CHUNK (64 * 1024)
+
+// Each context splits its index into shards with separate locks, selected by
+// the upper bits of the name hash.
+#define PAR_FILECACHE_NSHARDS 8
+
+#if PAR_FILECACHE_THREADS
+#include <pthread.h>
+typedef pthread_mutex_t par_filecache__mutex;
+#define PAR_FILECACHE__LOCK(M) pthread_mutex_lock(&(M))
+#define PAR_FILECACHE__UNLOCK(M) pthread_mutex_unlock(&(M))
+#else
+typedef int par_filecache__mutex;
+#define PAR_FILECACHE__LOCK(M) ((void) (M))
+#define PAR_FILECACHE__UNLOCK(M) ((void) (M))
+#endif
+
 static char * _par_strdup(char const* s)
 {
     if (s) {
@@ -119,41 +218,113 @@ static char * _par_strdup(char const* s)
     return 0;
 }
 
-#define PAR_MAX_ENTRIES 64
-
 typedef struct {
     time_t last_used_timestamp;
     uint64_t hashed_name;
+    uint64_t seq; // Position in the context-wide access order
     char const* name;
     int nbytes;
+    int newer;    // Neighbor toward the most-recently-used end, or -1
+    int older;    // Neighbor toward the least-recently-used end, or -1
 } filecache_entry_t;
 
+// Entries live in a dense array that is indexed by an open-addressed hash of
+// their names and threaded onto an intrusive LRU list.
 typedef struct {
-    filecache_entry_t entries[PAR_MAX_ENTRIES];
+    par_filecache__mutex lock;
+    filecache_entry_t* entries;
     int nentries;
+    int capacity;
+    int* slots;
+    int nslots;
+    int mru;
+    int lru;
     int totalbytes;
-} filecache_table_t;
+} filecache_shard_t;
 
-static void _update_table(char const* item_name, int item_size);
-static void _append_table(char const* item_name, int item_size);
-static void _read_or_create_tablefile();
-static void _save_tablefile();
-static void _evict_lru();
+// The table file is an append-only journal of binary records that gets
+// compacted occasionally.  Locks are always taken in the order shards
+// (ascending), journal, queue, and no thread holds two shard locks unless it
+// holds all of them.
+struct par_filecache_context_s {
+    char fileprefix[PATH_MAX];
+    char tablepath[PATH_MAX];
+    int maxtotalbytes;
+    filecache_shard_t shards[PAR_FILECACHE_NSHARDS];
+    par_filecache__mutex journal_lock;
+    FILE* journal;
+    int nrecords;
+    int nentries;
+    uint64_t seq;
+    int ntempfiles;
+#if PAR_FILECACHE_THREADS
+    pthread_t evictor;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    char** queue;
+    int nqueued;
+    int queuecapacity;
+    bool compact;
+    bool busy;
+    bool quit;
+#endif
+};
+
+enum { FILECACHE_TOUCH = 1, FILECACHE_REMOVE = 2 };
+
+static void _read_or_create_tablefile(par_filecache_context* ctx);
+static void _save_tablefile(par_filecache_context* ctx);
+static void _evict_lru(par_filecache_context* ctx, filecache_shard_t* shard,
+    int index);
 static uint64_t _hash(char const* name);
 
 static char _fileprefix[PATH_MAX] = "./_cache.";
-static char _tablepath[PATH_MAX] = "./_cache.table";
 static int _maxtotalbytes = 1024 * 1024 * 16;
-static filecache_table_t* _table = 0;
+static par_filecache_context* _default = 0;
+static char const _journal_magic[4] = {'P', 'F', 'C', '1'};
+
+#if PAR_FILECACHE_THREADS
+static pthread_mutex_t _default_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static par_filecache__mutex _default_lock = 0;
+#endif
+
+static void par_filecache__release_default()
+{
+    PAR_FILECACHE__LOCK(_default_lock);
+    if (_default) {
+        par_filecache_destroy_context(_default);
+        _default = 0;
+    }
+    PAR_FILECACHE__UNLOCK(_default_lock);
+}
+
+static par_filecache_context* par_filecache__default()
+{
+    static bool registered = false;
+    PAR_FILECACHE__LOCK(_default_lock);
+    if (!_default) {
+        _default = par_filecache_create_context(_fileprefix, _maxtotalbytes);
+        if (!registered) {
+            atexit(par_filecache__release_default);
+            registered = true;
+        }
+    }
+    par_filecache_context* ctx = _default;
+    PAR_FILECACHE__UNLOCK(_default_lock);
+    return ctx;
+}
 
 void par_filecache_init(char const* prefix, int maxsize)
 {
     size_t len = strlen(prefix);
     assert(len + 1 < PATH_MAX && "Cache prefix is too long");
+    par_filecache__release_default();
+    PAR_FILECACHE__LOCK(_default_lock);
     strncpy(_fileprefix, prefix, len + 1);
-    strcpy(_tablepath, _fileprefix);
-    strcat(_tablepath, "table");
     _maxtotalbytes = maxsize;
+    PAR_FILECACHE__UNLOCK(_default_lock);
 }
 
 #if IOS_EXAMPLE
@@ -180,241 +351,993 @@ static bool par_filecache__read(void* dest, int nbytes, FILE* file)
     return consumed == 1;
 }
 
-bool par_filecache_load(char const* name, uint8_t** payload, int* payloadsize,
-    uint8_t* header, int headersize)
+static filecache_shard_t* _shard_of(par_filecache_context* ctx,
+    uint64_t hashed_name)
+{
+    int shard = (int) (hashed_name >> 32) & (PAR_FILECACHE_NSHARDS - 1);
+    return ctx->shards + shard;
+}
+
+static bool par_filecache__qualify(par_filecache_context* ctx,
+    char const* name, char* qualified)
 {
-    char qualified[PATH_MAX];
     size_t len = strlen(name);
     if (len == 0) {
         return false;
     }
-    assert(len + strlen(_fileprefix) < PATH_MAX);
-    strcpy(qualified, _fileprefix);
+    assert(len + strlen(ctx->fileprefix) < PATH_MAX);
+    strcpy(qualified, ctx->fileprefix);
     strcat(qualified, name);
-    if (access(qualified, F_OK) == -1) {
+    return true;
+}
+
+static int _find_entry(filecache_shard_t* shard, uint64_t hashed_name)
+{
+    int mask = shard->nslots - 1;
+    int slot = (int) (hashed_name & mask);
+    while (shard->slots[slot] != -1) {
+        int index = shard->slots[slot];
+        if (shard->entries[index].hashed_name == hashed_name) {
+            return index;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Returns the hash slot that holds the given entry index.
+static int _find_slot(filecache_shard_t* shard, int index)
+{
+    int mask = shard->nslots - 1;
+    int slot = (int) (shard->entries[index].hashed_name & mask);
+    while (shard->slots[slot] != index) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void _insert_slot(filecache_shard_t* shard, int index)
+{
+    int mask = shard->nslots - 1;
+    int slot = (int) (shard->entries[index].hashed_name & mask);
+    while (shard->slots[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    shard->slots[slot] = index;
+}
+
+// Clears a slot using backward-shift deletion, which keeps every probe
+// sequence intact without tombstones.
+static void _remove_slot(filecache_shard_t* shard, int slot)
+{
+    int mask = shard->nslots - 1;
+    int hole = slot;
+    shard->slots[hole] = -1;
+    for (slot = (hole + 1) & mask; shard->slots[slot] != -1;
+        slot = (slot + 1) & mask) {
+        int index = shard->slots[slot];
+        int home = (int) (shard->entries[index].hashed_name & mask);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            shard->slots[hole] = index;
+            shard->slots[slot] = -1;
+            hole = slot;
+        }
+    }
+}
+
+static void _unlink_entry(filecache_shard_t* shard, int index)
+{
+    filecache_entry_t* entry = shard->entries + index;
+    if (entry->newer != -1) {
+        shard->entries[entry->newer].older = entry->older;
+    } else {
+        shard->mru = entry->older;
+    }
+    if (entry->older != -1) {
+        shard->entries[entry->older].newer = entry->newer;
+    } else {
+        shard->lru = entry->newer;
+    }
+}
+
+static void _link_mru(filecache_shard_t* shard, int index)
+{
+    filecache_entry_t* entry = shard->entries + index;
+    entry->newer = -1;
+    entry->older = shard->mru;
+    if (shard->mru != -1) {
+        shard->entries[shard->mru].newer = index;
+    } else {
+        shard->lru = index;
+    }
+    shard->mru = index;
+}
+
+static int _add_entry(filecache_shard_t* shard, char const* name, int nbytes,
+    time_t timestamp)
+{
+    if (shard->nentries == shard->capacity) {
+        shard->capacity = PAR_MAX(64, shard->capacity * 2);
+        shard->entries = PAR_REALLOC(filecache_entry_t, shard->entries,
+            shard->capacity);
+    }
+    if (shard->nentries * 2 >= shard->nslots) {
+        PAR_FREE(shard->slots);
+        shard->nslots = PAR_MAX(128, shard->nslots * 2);
+        shard->slots = PAR_MALLOC(int, shard->nslots);
+        memset(shard->slots, 0xff, sizeof(int) * shard->nslots);
+        for (int i = 0; i < shard->nentries; i++) {
+            _insert_slot(shard, i);
+        }
+    }
+    int index = shard->nentries++;
+    filecache_entry_t* entry = shard->entries + index;
+    entry->last_used_timestamp = timestamp;
+    entry->hashed_name = _hash(name);
+    entry->seq = 0;
+    entry->name = _par_strdup(name);
+    entry->nbytes = nbytes;
+    shard->totalbytes += nbytes;
+    _insert_slot(shard, index);
+    _link_mru(shard, index);
+    return index;
+}
+
+// Removes an entry by moving the last entry into its place.
+static void _remove_entry(filecache_shard_t* shard, int index)
+{
+    filecache_entry_t* entry = shard->entries + index;
+    shard->totalbytes -= entry->nbytes;
+    free((void*) entry->name);
+    _unlink_entry(shard, index);
+    _remove_slot(shard, _find_slot(shard, index));
+    int last = --shard->nentries;
+    if (index == last) {
+        return;
+    }
+    shard->slots[_find_slot(shard, last)] = index;
+    *entry = shard->entries[last];
+    if (entry->newer != -1) {
+        shard->entries[entry->newer].older = index;
+    } else {
+        shard->mru = index;
+    }
+    if (entry->older != -1) {
+        shard->entries[entry->older].newer = index;
+    } else {
+        shard->lru = index;
+    }
+}
+
+static void _clear_shard(filecache_shard_t* shard)
+{
+    for (int i = 0; i < shard->nentries; i++) {
+        free((void*) shard->entries[i].name);
+    }
+    shard->nentries = 0;
+    shard->totalbytes = 0;
+    shard->mru = shard->lru = -1;
+    memset(shard->slots, 0xff, sizeof(int) * shard->nslots);
+}
+
+static void _lock_shards(par_filecache_context* ctx)
+{
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        PAR_FILECACHE__LOCK(ctx->shards[i].lock);
+    }
+}
+
+static void _unlock_shards(par_filecache_context* ctx)
+{
+    for (int i = PAR_FILECACHE_NSHARDS - 1; i >= 0; i--) {
+        PAR_FILECACHE__UNLOCK(ctx->shards[i].lock);
+    }
+}
+
+#if PAR_FILECACHE_THREADS
+
+// Deletes an evicted file unless the item has been saved again since, which
+// is safe because saves rename and index items under the same shard lock.
+static void _delete_evicted(par_filecache_context* ctx, char const* name)
+{
+    char qualified[PATH_MAX];
+    uint64_t hashed_name = _hash(name);
+    filecache_shard_t* shard = _shard_of(ctx, hashed_name);
+    PAR_FILECACHE__LOCK(shard->lock);
+    if (_find_entry(shard, hashed_name) == -1 &&
+        par_filecache__qualify(ctx, name, qualified)) {
+        #if PAR_FILECACHE_VERBOSE
+        printf("Evicting %s\n", qualified);
+        #endif
+        remove(qualified);
+    }
+    PAR_FILECACHE__UNLOCK(shard->lock);
+}
+
+static void* _evictor_thread(void* arg)
+{
+    par_filecache_context* ctx = (par_filecache_context*) arg;
+    pthread_mutex_lock(&ctx->queue_lock);
+    while (1) {
+        if (ctx->compact) {
+            ctx->compact = false;
+            ctx->busy = true;
+            pthread_mutex_unlock(&ctx->queue_lock);
+            _lock_shards(ctx);
+            pthread_mutex_lock(&ctx->journal_lock);
+            _save_tablefile(ctx);
+            pthread_mutex_unlock(&ctx->journal_lock);
+            _unlock_shards(ctx);
+            pthread_mutex_lock(&ctx->queue_lock);
+            ctx->busy = false;
+        } else if (ctx->nqueued > 0) {
+            char* name = ctx->queue[--ctx->nqueued];
+            ctx->busy = true;
+            pthread_mutex_unlock(&ctx->queue_lock);
+            _delete_evicted(ctx, name);
+            free(name);
+            pthread_mutex_lock(&ctx->queue_lock);
+            ctx->busy = false;
+        } else if (ctx->quit) {
+            break;
+        } else {
+            pthread_cond_broadcast(&ctx->idle);
+            pthread_cond_wait(&ctx->wake, &ctx->queue_lock);
+        }
+    }
+    pthread_cond_broadcast(&ctx->idle);
+    pthread_mutex_unlock(&ctx->queue_lock);
+    return 0;
+}
+
+static void _queue_eviction(par_filecache_context* ctx, char const* name)
+{
+    pthread_mutex_lock(&ctx->queue_lock);
+    if (ctx->nqueued == ctx->queuecapacity) {
+        ctx->queuecapacity = PAR_MAX(64, ctx->queuecapacity * 2);
+        ctx->queue = PAR_REALLOC(char*, ctx->queue, ctx->queuecapacity);
+    }
+    ctx->queue[ctx->nqueued++] = _par_strdup(name);
+    pthread_cond_signal(&ctx->wake);
+    pthread_mutex_unlock(&ctx->queue_lock);
+}
+
+#endif
+
+par_filecache_context* par_filecache_create_context(char const* prefix,
+    int maxsize)
+{
+    size_t len = strlen(prefix);
+    assert(len + 5 < PATH_MAX && "Cache prefix is too long");
+    par_filecache_context* ctx = PAR_CALLOC(par_filecache_context, 1);
+    strcpy(ctx->fileprefix, prefix);
+    strcpy(ctx->tablepath, prefix);
+    strcat(ctx->tablepath, "table");
+    ctx->maxtotalbytes = maxsize;
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        filecache_shard_t* shard = ctx->shards + i;
+        shard->nslots = 128;
+        shard->slots = PAR_MALLOC(int, shard->nslots);
+        memset(shard->slots, 0xff, sizeof(int) * shard->nslots);
+        shard->mru = shard->lru = -1;
+#if PAR_FILECACHE_THREADS
+        pthread_mutex_init(&shard->lock, 0);
+#endif
+    }
+#if PAR_FILECACHE_THREADS
+    pthread_mutex_init(&ctx->journal_lock, 0);
+    pthread_mutex_init(&ctx->queue_lock, 0);
+    pthread_cond_init(&ctx->wake, 0);
+    pthread_cond_init(&ctx->idle, 0);
+#endif
+    _read_or_create_tablefile(ctx);
+#if PAR_FILECACHE_THREADS
+    pthread_create(&ctx->evictor, 0, _evictor_thread, ctx);
+#endif
+    return ctx;
+}
+
+void par_filecache_destroy_context(par_filecache_context* ctx)
+{
+#if PAR_FILECACHE_THREADS
+    pthread_mutex_lock(&ctx->queue_lock);
+    ctx->quit = true;
+    pthread_cond_signal(&ctx->wake);
+    pthread_mutex_unlock(&ctx->queue_lock);
+    pthread_join(ctx->evictor, 0);
+    PAR_FREE(ctx->queue);
+    pthread_cond_destroy(&ctx->idle);
+    pthread_cond_destroy(&ctx->wake);
+    pthread_mutex_destroy(&ctx->queue_lock);
+    pthread_mutex_destroy(&ctx->journal_lock);
+#endif
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        filecache_shard_t* shard = ctx->shards + i;
+        _clear_shard(shard);
+        PAR_FREE(shard->entries);
+        PAR_FREE(shard->slots);
+#if PAR_FILECACHE_THREADS
+        pthread_mutex_destroy(&shard->lock);
+#endif
+    }
+    if (ctx->journal) {
+        fclose(ctx->journal);
+    }
+    PAR_FREE(ctx);
+}
+
+void par_filecache_ctx_flush(par_filecache_context* ctx)
+{
+#if PAR_FILECACHE_THREADS
+    pthread_mutex_lock(&ctx->queue_lock);
+    while (ctx->compact || ctx->busy || ctx->nqueued > 0) {
+        pthread_cond_wait(&ctx->idle, &ctx->queue_lock);
+    }
+    pthread_mutex_unlock(&ctx->queue_lock);
+#else
+    (void) ctx;
+#endif
+}
+
+static void _write_record(FILE* fhandle, int op, filecache_entry_t const* entry)
+{
+    uint8_t opcode = (uint8_t) op;
+    int64_t timestamp = (int64_t) entry->last_used_timestamp;
+    int32_t nbytes = entry->nbytes;
+    uint16_t namelen = (uint16_t) strlen(entry->name);
+    fwrite(&opcode, 1, sizeof(opcode), fhandle);
+    fwrite(&timestamp, 1, sizeof(timestamp), fhandle);
+    fwrite(&nbytes, 1, sizeof(nbytes), fhandle);
+    fwrite(&namelen, 1, sizeof(namelen), fhandle);
+    fwrite(entry->name, 1, namelen, fhandle);
+}
+
+// Appends a record to the journal and stamps the entry with the next access
+// sequence number.  The caller holds the entry's shard lock and passes the
+// change in entry count, so that the journal can be compacted when most of
+// its records have been superseded.
+static void _journal_entry(par_filecache_context* ctx, int op,
+    filecache_entry_t* entry, int delta)
+{
+    PAR_FILECACHE__LOCK(ctx->journal_lock);
+    entry->seq = ++ctx->seq;
+    ctx->nentries += delta;
+    if (ctx->nrecords > 2 * ctx->nentries + 256) {
+#if PAR_FILECACHE_THREADS
+        pthread_mutex_lock(&ctx->queue_lock);
+        if (!ctx->compact) {
+            ctx->compact = true;
+            pthread_cond_signal(&ctx->wake);
+        }
+        pthread_mutex_unlock(&ctx->queue_lock);
+#else
+        _save_tablefile(ctx);
+#endif
+    }
+    if (!ctx->journal) {
+        ctx->journal = fopen(ctx->tablepath, "ab");
+        assert(ctx->journal && "Unable to open filecache journal.");
+        if (ftell(ctx->journal) == 0) {
+            fwrite(_journal_magic, 1, sizeof(_journal_magic), ctx->journal);
+        }
+    }
+    _write_record(ctx->journal, op, entry);
+    fflush(ctx->journal);
+    ctx->nrecords++;
+    PAR_FILECACHE__UNLOCK(ctx->journal_lock);
+}
+
+// Returns the least-recently-used entry in a shard that may be evicted.
+static int _oldest_entry(filecache_shard_t* shard)
+{
+    const uint64_t never_evict = _hash("version");
+    int index = shard->lru;
+    while (index != -1 && shard->entries[index].hashed_name == never_evict) {
+        index = shard->entries[index].newer;
+    }
+    return index;
+}
+
+// Evicts the least-recently-used items across all shards until nbytes more
+// would fit.  Only one shard is locked at a time.
+static void _reserve(par_filecache_context* ctx, int nbytes)
+{
+    while (1) {
+        int total = nbytes;
+        filecache_shard_t* victim = 0;
+        uint64_t oldest = UINT64_MAX;
+        for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+            filecache_shard_t* shard = ctx->shards + i;
+            PAR_FILECACHE__LOCK(shard->lock);
+            total += shard->totalbytes;
+            int index = _oldest_entry(shard);
+            if (index != -1 && shard->entries[index].seq < oldest) {
+                oldest = shard->entries[index].seq;
+                victim = shard;
+            }
+            PAR_FILECACHE__UNLOCK(shard->lock);
+        }
+        if (total <= ctx->maxtotalbytes || !victim) {
+            return;
+        }
+        PAR_FILECACHE__LOCK(victim->lock);
+        int index = _oldest_entry(victim);
+        if (index != -1) {
+            _evict_lru(ctx, victim, index);
+        }
+        PAR_FILECACHE__UNLOCK(victim->lock);
+    }
+}
+
+// Moves a freshly written file into place and indexes it, evicting older items
+// first if the cache would exceed its maximum size.
+static void _commit_item(par_filecache_context* ctx, char const* name,
+    char const* temppath, char const* qualified, int item_size)
+{
+    uint64_t hashed_name = _hash(name);
+    filecache_shard_t* shard = _shard_of(ctx, hashed_name);
+    _reserve(ctx, item_size);
+    PAR_FILECACHE__LOCK(shard->lock);
+    rename(temppath, qualified);
+    int delta = 0;
+    int index = _find_entry(shard, hashed_name);
+    if (index == -1) {
+        index = _add_entry(shard, name, item_size, time(0));
+        delta = 1;
+    } else {
+        filecache_entry_t* entry = shard->entries + index;
+        shard->totalbytes += item_size - entry->nbytes;
+        entry->nbytes = item_size;
+        entry->last_used_timestamp = time(0);
+        _unlink_entry(shard, index);
+        _link_mru(shard, index);
+    }
+    _journal_entry(ctx, FILECACHE_TOUCH, shard->entries + index, delta);
+    PAR_FILECACHE__UNLOCK(shard->lock);
+}
+
+// Updates the timestamp of an item that was just read, unless it was evicted
+// in the meantime.
+static void _touch_item(par_filecache_context* ctx, char const* name)
+{
+    uint64_t hashed_name = _hash(name);
+    filecache_shard_t* shard = _shard_of(ctx, hashed_name);
+    PAR_FILECACHE__LOCK(shard->lock);
+    int index = _find_entry(shard, hashed_name);
+    if (index != -1) {
+        filecache_entry_t* entry = shard->entries + index;
+        entry->last_used_timestamp = time(0);
+        _unlink_entry(shard, index);
+        _link_mru(shard, index);
+        _journal_entry(ctx, FILECACHE_TOUCH, entry, 0);
+    }
+    PAR_FILECACHE__UNLOCK(shard->lock);
+}
+
+// Maps the named item read-only.  Returns false if it is not in the index, or
+// if its file is missing or empty, in which case the stale entry is dropped.
+static bool par_filecache__map(par_filecache_context* ctx, char const* name,
+    uint8_t** base, size_t* size)
+{
+    char qualified[PATH_MAX];
+    if (!par_filecache__qualify(ctx, name, qualified)) {
         return false;
     }
-    FILE* cachefile = fopen(qualified, "rb");
-    assert(cachefile && "Unable to open cache file for reading");
-    fseek(cachefile, 0, SEEK_END);
-    long fsize = ftell(cachefile);
-    fseek(cachefile, 0, SEEK_SET);
-    if (headersize > 0 && !par_filecache__read(header, headersize, cachefile)) {
+    uint64_t hashed_name = _hash(name);
+    filecache_shard_t* shard = _shard_of(ctx, hashed_name);
+    PAR_FILECACHE__LOCK(shard->lock);
+    int index = _find_entry(shard, hashed_name);
+    uint64_t seq = index == -1 ? 0 : shard->entries[index].seq;
+    PAR_FILECACHE__UNLOCK(shard->lock);
+    if (index == -1) {
         return false;
     }
+    void* mapping = MAP_FAILED;
+    struct stat st;
+    int fd = open(qualified, O_RDONLY);
+    if (fd != -1) {
+        if (!fstat(fd, &st) && st.st_size > 0) {
+            mapping = mmap(0, st.st_size, PROT_READ, PAR_FILECACHE_MAP_FLAGS,
+                fd, 0);
+        }
+        close(fd);
+    }
+    if (mapping != MAP_FAILED) {
+        *base = (uint8_t*) mapping;
+        *size = st.st_size;
+        return true;
+    }
+
+    // An unchanged sequence number means the item was not saved again since
+    // the lookup, so neither the entry nor the file is current.
+    PAR_FILECACHE__LOCK(shard->lock);
+    index = _find_entry(shard, hashed_name);
+    if (index != -1 && shard->entries[index].seq == seq) {
+        _journal_entry(ctx, FILECACHE_REMOVE, shard->entries + index, -1);
+        _remove_entry(shard, index);
+        remove(qualified);
+    }
+    PAR_FILECACHE__UNLOCK(shard->lock);
+    return false;
+}
+
+// Returns the decompressed payload size of a mapped item, or -1 if the item
+// is too small.  With LZ4, a negative stored size marks a chunked payload.
+static int par_filecache__payload_size(uint8_t const* base, size_t size,
+    int headersize)
+{
+    if (size < (size_t) headersize) {
+        return -1;
+    }
+#if ENABLE_LZ4
     int32_t dnbytes;
+    if (size < headersize + sizeof(dnbytes)) {
+        return -1;
+    }
+    memcpy(&dnbytes, base + headersize, sizeof(dnbytes));
+    return dnbytes < 0 ? -dnbytes : dnbytes;
+#else
+    return (int) (size - headersize);
+#endif
+}
+
+// Decompresses or copies the payload of a mapped item into dst.
+static bool par_filecache__extract(uint8_t const* base, size_t size,
+    int headersize, uint8_t* dst, int dnbytes)
+{
+    char const* src = (char const*) base + headersize;
 #if ENABLE_LZ4
-    long cnbytes = fsize - headersize - sizeof(dnbytes);
-    if (!par_filecache__read(&dnbytes, sizeof(dnbytes), cachefile)) {
-        return false;
+    int32_t stored;
+    memcpy(&stored, src, sizeof(stored));
+    src += sizeof(stored);
+    long remaining = (long) (size - headersize - sizeof(stored));
+    if (stored >= 0) {
+        return LZ4_decompress_safe(src, (char*) dst, (int) remaining,
+            dnbytes) == dnbytes;
+    }
+    for (int offset = 0; offset < dnbytes;) {
+        int32_t csize;
+        if (remaining < (long) sizeof(csize)) {
+            return false;
+        }
+        memcpy(&csize, src, sizeof(csize));
+        src += sizeof(csize);
+        remaining -= sizeof(csize);
+        if (csize < 0 || csize > remaining) {
+            return false;
+        }
+        int n = PAR_MIN(PAR_FILECACHE_CHUNK, dnbytes - offset);
+        if (LZ4_decompress_safe(src, (char*) dst + offset, csize, n) != n) {
+            return false;
+        }
+        src += csize;
+        remaining -= csize;
+        offset += n;
     }
+    return true;
 #else
-    long cnbytes = fsize - headersize;
-    dnbytes = (int32_t) cnbytes;
+    memcpy(dst, src, dnbytes);
+    return true;
 #endif
-    char* cbuff = (char*) malloc(cnbytes);
-    if (!par_filecache__read(cbuff, (int) cnbytes, cachefile)) {
+}
+
+bool par_filecache_ctx_load(par_filecache_context* ctx, char const* name,
+    uint8_t** payload, int* payloadsize, uint8_t* header, int headersize)
+{
+    uint8_t* base;
+    size_t size;
+    if (!par_filecache__map(ctx, name, &base, &size)) {
+        return false;
+    }
+    int dnbytes = par_filecache__payload_size(base, size, headersize);
+    uint8_t* dbuff = 0;
+    bool ok = dnbytes >= 0;
+    if (ok && headersize > 0) {
+        memcpy(header, base, headersize);
+    }
+    if (ok) {
+        dbuff = (uint8_t*) malloc(dnbytes);
+        ok = par_filecache__extract(base, size, headersize, dbuff, dnbytes);
+    }
+    munmap(base, size);
+    if (!ok) {
+        free(dbuff);
+        return false;
+    }
+    *payload = dbuff;
+    *payloadsize = dnbytes;
+    _touch_item(ctx, name);
+    return true;
+}
+
+bool par_filecache_ctx_load_into(par_filecache_context* ctx, char const* name,
+    uint8_t* payload, int capacity, int* payloadsize, uint8_t* header,
+    int headersize)
+{
+    uint8_t* base;
+    size_t size;
+    if (!par_filecache__map(ctx, name, &base, &size)) {
+        return false;
+    }
+    int dnbytes = par_filecache__payload_size(base, size, headersize);
+    bool ok = dnbytes >= 0;
+    if (ok) {
+        *payloadsize = dnbytes;
+        ok = dnbytes <= capacity;
+    }
+    if (ok && headersize > 0) {
+        memcpy(header, base, headersize);
+    }
+    if (ok) {
+        ok = par_filecache__extract(base, size, headersize, payload, dnbytes);
+    }
+    munmap(base, size);
+    if (ok) {
+        _touch_item(ctx, name);
+    }
+    return ok;
+}
+
+bool par_filecache_ctx_map(par_filecache_context* ctx, char const* name,
+    par_filecache_view* view, int headersize)
+{
+    uint8_t* base;
+    size_t size;
+    memset(view, 0, sizeof(*view));
+    if (!par_filecache__map(ctx, name, &base, &size)) {
         return false;
     }
+    int dnbytes = par_filecache__payload_size(base, size, headersize);
+    if (dnbytes < 0) {
+        munmap(base, size);
+        return false;
+    }
+    view->mapping = base;
+    view->mapsize = size;
+    view->header = base;
+    view->payloadsize = dnbytes;
 #if ENABLE_LZ4
-    char* dbuff = (char*) malloc(dnbytes);
-    LZ4_decompress_safe(cbuff, dbuff, (int) cnbytes, dnbytes);
-    free(cbuff);
+    uint8_t* dbuff = (uint8_t*) malloc(dnbytes);
+    view->payload = dbuff;
+    view->owned = true;
+    if (!par_filecache__extract(base, size, headersize, dbuff, dnbytes)) {
+        par_filecache_unmap(view);
+        return false;
+    }
 #else
-    char* dbuff = cbuff;
+    view->payload = base + headersize;
 #endif
-    fclose(cachefile);
-    *payload = (uint8_t*) dbuff;
-    *payloadsize = dnbytes;
-    _update_table(name, (int) cnbytes);
+    _touch_item(ctx, name);
     return true;
 }
 
-void par_filecache_save(char const* name, uint8_t const* payload,
-    int payloadsize, uint8_t const* header, int headersize)
+void par_filecache_unmap(par_filecache_view* view)
+{
+    if (view->mapping) {
+        munmap(view->mapping, view->mapsize);
+    }
+    if (view->owned) {
+        free((void*) view->payload);
+    }
+    memset(view, 0, sizeof(*view));
+}
+
+static bool par_filecache__write(int fd, void const* src, int nbytes)
+{
+    char const* bytes = (char const*) src;
+    while (nbytes > 0) {
+        ssize_t written = write(fd, bytes, nbytes);
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        nbytes -= (int) written;
+    }
+    return true;
+}
+
+// Creates a uniquely named temporary file next to the given item.
+static int par_filecache__create_temp(par_filecache_context* ctx,
+    char const* qualified, char* temppath)
+{
+    assert(strlen(qualified) + 24 < PATH_MAX);
+    PAR_FILECACHE__LOCK(ctx->journal_lock);
+    int serial = ctx->ntempfiles++;
+    PAR_FILECACHE__UNLOCK(ctx->journal_lock);
+    sprintf(temppath, "%s.%d.%d.tmp", qualified, (int) getpid(), serial);
+    return open(temppath, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, 0644);
+}
+
+void par_filecache_ctx_save(par_filecache_context* ctx, char const* name,
+    uint8_t const* payload, int payloadsize, uint8_t const* header,
+    int headersize)
 {
     char qualified[PATH_MAX];
-    size_t len = strlen(name);
-    if (len == 0) {
+    char temppath[PATH_MAX];
+    if (!par_filecache__qualify(ctx, name, qualified)) {
         return;
     }
-    assert(len + strlen(_fileprefix) < PATH_MAX);
-    strcpy(qualified, _fileprefix);
-    strcat(qualified, name);
-    FILE* cachefile = fopen(qualified, "wb");
-    assert(cachefile && "Unable to open cache file for writing");
-    if (headersize > 0) {
-        fwrite(header, 1, headersize, cachefile);
-    }
+    int fd = par_filecache__create_temp(ctx, qualified, temppath);
+    assert(fd != -1 && "Unable to open cache file for writing");
+    bool ok = headersize <= 0 ||
+        par_filecache__write(fd, header, headersize);
     int csize = 0;
-    if (payloadsize > 0) {
+    if (ok && payloadsize > 0) {
 #if ENABLE_LZ4
-        int32_t nbytes = payloadsize;
-        fwrite(&nbytes, 1, sizeof(nbytes), cachefile);
-        int maxsize = LZ4_compressBound(nbytes);
-        char* dst = (char*) malloc(maxsize);
+        int32_t nbytes = -payloadsize;
+        ok = par_filecache__write(fd, &nbytes, sizeof(nbytes));
+        int maxsize = LZ4_COMPRESSBOUND(PAR_FILECACHE_CHUNK);
+        char* dst = (char*) malloc(sizeof(int32_t) + maxsize);
         char const* src = (char const*) payload;
-        assert(nbytes < LZ4_MAX_INPUT_SIZE);
-        csize = LZ4_compress_default(src, dst, nbytes, maxsize);
-        fwrite(dst, 1, csize, cachefile);
+        for (int offset = 0; ok && offset < payloadsize;
+            offset += PAR_FILECACHE_CHUNK) {
+            int n = PAR_MIN(PAR_FILECACHE_CHUNK, payloadsize - offset);
+            int32_t chunksize = LZ4_compress_default(src + offset,
+                dst + sizeof(chunksize), n, maxsize);
+            memcpy(dst, &chunksize, sizeof(chunksize));
+            chunksize += sizeof(chunksize);
+            ok = par_filecache__write(fd, dst, chunksize);
+            csize += chunksize;
+        }
         free(dst);
 #else
         csize = payloadsize;
-        int actual = (int) fwrite(payload, 1, csize, cachefile);
-        if (actual < csize) {
-            fclose(cachefile);
-            remove(qualified);
-            printf("Unable to save %s to cache (%d bytes)\n", name, csize);
-            return;
-        }
+        ok = par_filecache__write(fd, payload, csize);
 #endif
     }
-    fclose(cachefile);
-    _update_table(name, csize + headersize);
+    if (close(fd) || !ok) {
+        remove(temppath);
+        printf("Unable to save %s to cache (%d bytes)\n", name, csize);
+        return;
+    }
+    _commit_item(ctx, name, temppath, qualified, csize + headersize);
 }
 
-void par_filecache_evict_all()
+void par_filecache_ctx_evict_all(par_filecache_context* ctx)
 {
     #if PAR_FILECACHE_VERBOSE
     printf("Evicting all.\n");
     #endif
     char qualified[PATH_MAX];
-    if (!_table) {
-        _read_or_create_tablefile();
+    _lock_shards(ctx);
+    PAR_FILECACHE__LOCK(ctx->journal_lock);
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        filecache_shard_t* shard = ctx->shards + i;
+        filecache_entry_t* entry = shard->entries;
+        for (int j = 0; j < shard->nentries; j++, entry++) {
+            strcpy(qualified, ctx->fileprefix);
+            strcat(qualified, entry->name);
+            #if PAR_FILECACHE_VERBOSE
+            printf("Evicting %s\n", qualified);
+            #endif
+            remove(qualified);
+        }
+        _clear_shard(shard);
     }
-    filecache_entry_t* entry = _table->entries;
-    for (int i = 0; i < _table->nentries; i++, entry++) {
-        strcpy(qualified, _fileprefix);
-        strcat(qualified, entry->name);
-        #if PAR_FILECACHE_VERBOSE
-        printf("Evicting %s\n", qualified);
-        #endif
-        remove(qualified);
+    if (ctx->journal) {
+        fclose(ctx->journal);
+        ctx->journal = 0;
     }
-    _table->nentries = 0;
-    _table->totalbytes = 0;
-    remove(_tablepath);
+    ctx->nrecords = 0;
+    ctx->nentries = 0;
+    remove(ctx->tablepath);
+    PAR_FILECACHE__UNLOCK(ctx->journal_lock);
+    _unlock_shards(ctx);
 }
 
-// Adds the given item to the table and evicts the LRU items if the total cache
-// size exceeds the specified maxsize.
-static void _append_table(char const* item_name, int item_size)
+// Replays records into the index during construction, before any other thread
+// can see the context.
+static void _replay_record(par_filecache_context* ctx, int op,
+    char const* name, int nbytes, time_t timestamp)
 {
-    time_t now = time(0);
-    if (!_table) {
-        _read_or_create_tablefile();
+    filecache_shard_t* shard = _shard_of(ctx, _hash(name));
+    int index = _find_entry(shard, _hash(name));
+    if (index != -1) {
+        _remove_entry(shard, index);
     }
-    uint64_t hashed_name = _hash(item_name);
-    int total = _table->totalbytes + item_size;
-    while (_table->nentries >= PAR_MAX_ENTRIES || total > _maxtotalbytes) {
-        assert(_table->nentries > 0 && "Cache size is too small.");
-        _evict_lru();
-        total = _table->totalbytes + item_size;
+    if (op == FILECACHE_TOUCH) {
+        index = _add_entry(shard, name, nbytes, timestamp);
+        shard->entries[index].seq = ++ctx->seq;
     }
-    _table->totalbytes = total;
-    filecache_entry_t* entry = &_table->entries[_table->nentries++];
-    entry->last_used_timestamp = now;
-    entry->hashed_name = hashed_name;
-    entry->name = _par_strdup(item_name);
-    entry->nbytes = item_size;
-    _save_tablefile();
 }
 
-// Updates the timestamp associated with the given item.
-static void _update_table(char const* item_name, int item_size)
+// Replays the binary journal, returning false if the file has some other
+// format.  A truncated final record (e.g. from a crash) is ignored.
+static bool _replay_journal(par_filecache_context* ctx, FILE* fhandle)
 {
-    time_t now = time(0);
-    if (!_table) {
-        _read_or_create_tablefile();
+    char magic[sizeof(_journal_magic)];
+    if (!par_filecache__read(magic, sizeof(magic), fhandle) ||
+        memcmp(magic, _journal_magic, sizeof(magic))) {
+        return false;
+    }
+    char name[PATH_MAX];
+    uint8_t opcode;
+    int64_t timestamp;
+    int32_t nbytes;
+    uint16_t namelen;
+    while (par_filecache__read(&opcode, sizeof(opcode), fhandle) &&
+        par_filecache__read(&timestamp, sizeof(timestamp), fhandle) &&
+        par_filecache__read(&nbytes, sizeof(nbytes), fhandle) &&
+        par_filecache__read(&namelen, sizeof(namelen), fhandle) &&
+        namelen < PATH_MAX &&
+        (namelen == 0 || par_filecache__read(name, namelen, fhandle))) {
+        name[namelen] = 0;
+        ctx->nrecords++;
+        _replay_record(ctx, opcode, name, nbytes, (time_t) timestamp);
     }
-    uint64_t hashed_name = _hash(item_name);
-    filecache_entry_t* entry = _table->entries;
-    int i;
-    for (i = 0; i < _table->nentries; i++, entry++) {
-        if (entry->hashed_name == hashed_name) {
+    return true;
+}
+
+static int _compare_timestamps(void const* a, void const* b)
+{
+    filecache_entry_t const* ea = (filecache_entry_t const*) a;
+    filecache_entry_t const* eb = (filecache_entry_t const*) b;
+    if (ea->last_used_timestamp < eb->last_used_timestamp) return -1;
+    if (ea->last_used_timestamp > eb->last_used_timestamp) return 1;
+    return 0;
+}
+
+static int _compare_seqs(void const* a, void const* b)
+{
+    filecache_entry_t const* ea = *(filecache_entry_t const* const*) a;
+    filecache_entry_t const* eb = *(filecache_entry_t const* const*) b;
+    if (ea->seq < eb->seq) return -1;
+    if (ea->seq > eb->seq) return 1;
+    return 0;
+}
+
+// Reads the text table written by earlier versions of this library.
+static void _read_legacy_table(par_filecache_context* ctx, FILE* fhandle)
+{
+    filecache_entry_t* legacy = 0;
+    int nlegacy = 0, capacity = 0;
+    filecache_entry_t entry;
+    char name[PATH_MAX];
+    rewind(fhandle);
+    while (1) {
+        long timestamp;
+        int nargs = fscanf(fhandle, "%ld %d %s", &timestamp, &entry.nbytes,
+            name);
+        if (nargs != 3) {
             break;
         }
+        if (nlegacy == capacity) {
+            capacity = PAR_MAX(64, capacity * 2);
+            legacy = PAR_REALLOC(filecache_entry_t, legacy, capacity);
+        }
+        entry.last_used_timestamp = (time_t) timestamp;
+        entry.name = _par_strdup(name);
+        legacy[nlegacy++] = entry;
     }
-    if (i >= _table->nentries) {
-        _append_table(item_name, item_size);
-        return;
+    qsort(legacy, nlegacy, sizeof(filecache_entry_t), _compare_timestamps);
+    for (int i = 0; i < nlegacy; i++) {
+        _replay_record(ctx, FILECACHE_TOUCH, legacy[i].name, legacy[i].nbytes,
+            legacy[i].last_used_timestamp);
+        free((void*) legacy[i].name);
     }
-    entry->last_used_timestamp = now;
-    _save_tablefile();
+    PAR_FREE(legacy);
 }
 
-static void _read_or_create_tablefile()
+static void _read_or_create_tablefile(par_filecache_context* ctx)
 {
-    _table = (filecache_table_t*) calloc(sizeof(filecache_table_t), 1);
-    FILE* fhandle = fopen(_tablepath, "r");
+    FILE* fhandle = fopen(ctx->tablepath, "rb");
     if (!fhandle) {
-        fhandle = fopen(_tablepath, "w");
+        fhandle = fopen(ctx->tablepath, "wb");
         if (!fhandle) {
-            mkdir(dirname(_tablepath), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-            fhandle = fopen(_tablepath, "w");
+            char dir[PATH_MAX];
+            strcpy(dir, ctx->tablepath);
+            mkdir(dirname(dir), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+            fhandle = fopen(ctx->tablepath, "wb");
         }
         assert(fhandle && "Unable to create filecache info file.");
-    } else {
-        filecache_entry_t entry;
-        char name[PATH_MAX];
-        while (1) {
-            int nargs = fscanf(fhandle, "%ld %d %s", &entry.last_used_timestamp,
-                &entry.nbytes, name);
-            if (nargs != 3) {
-                break;
-            }
-            entry.name = _par_strdup(name);
-            entry.hashed_name = _hash(entry.name);
-            _table->entries[_table->nentries++] = entry;
-            _table->totalbytes += entry.nbytes;
-        }
+        fclose(fhandle);
+        return;
+    }
+    bool journaled = _replay_journal(ctx, fhandle);
+    if (!journaled) {
+        _read_legacy_table(ctx, fhandle);
     }
     fclose(fhandle);
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        ctx->nentries += ctx->shards[i].nentries;
+    }
+    if (!journaled) {
+        _save_tablefile(ctx);
+    }
 }
 
-static void _save_tablefile()
+// Compacts the journal by writing one record per entry, from least to most
+// recently used, then atomically replacing the old journal.  The caller holds
+// every lock.
+static void _save_tablefile(par_filecache_context* ctx)
 {
-    FILE* fhandle = fopen(_tablepath, "w");
+    char temppath[PATH_MAX];
+    strcpy(temppath, ctx->tablepath);
+    strcat(temppath, ".tmp");
+    FILE* fhandle = fopen(temppath, "wb");
     assert(fhandle && "Unable to create filecache info file.");
-    filecache_entry_t* entry = _table->entries;
-    for (int i = 0; i < _table->nentries; i++, entry++) {
-        fprintf(fhandle, "%ld %d %s\n", entry->last_used_timestamp,
-            entry->nbytes, entry->name);
+    fwrite(_journal_magic, 1, sizeof(_journal_magic), fhandle);
+
+    // Count the shards directly, since a removal is counted in ctx->nentries
+    // before its entry leaves the index.
+    int nentries = 0;
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        nentries += ctx->shards[i].nentries;
+    }
+    filecache_entry_t const** sorted = PAR_MALLOC(filecache_entry_t const*,
+        nentries);
+    int nsorted = 0;
+    for (int i = 0; i < PAR_FILECACHE_NSHARDS; i++) {
+        filecache_shard_t* shard = ctx->shards + i;
+        for (int j = shard->lru; j != -1; j = shard->entries[j].newer) {
+            sorted[nsorted++] = shard->entries + j;
+        }
     }
+    qsort(sorted, nsorted, sizeof(*sorted), _compare_seqs);
+    for (int i = 0; i < nsorted; i++) {
+        _write_record(fhandle, FILECACHE_TOUCH, sorted[i]);
+    }
+    PAR_FREE(sorted);
     fclose(fhandle);
+    if (ctx->journal) {
+        fclose(ctx->journal);
+        ctx->journal = 0;
+    }
+    rename(temppath, ctx->tablepath);
+    ctx->nrecords = nsorted;
 }
 
-static void _evict_lru()
+// Removes an entry from the index while its shard is locked.  The file itself
+// is deleted by the background thread when there is one.
+static void _evict_lru(par_filecache_context* ctx, filecache_shard_t* shard,
+    int index)
 {
-    const uint64_t never_evict = _hash("version");
-    int oldest_index = -1;
-    time_t oldest_time = LONG_MAX;
-    filecache_entry_t* entry = _table->entries;
-    for (int i = 0; i < _table->nentries; i++, entry++) {
-        if (entry->hashed_name == never_evict) {
-            continue;
-        }
-        if (entry->last_used_timestamp < oldest_time) {
-            oldest_time = entry->last_used_timestamp;
-            oldest_index = i;
-        }
-    }
-    if (oldest_index > -1) {
-        entry = _table->entries + oldest_index;
-        char qualified[PATH_MAX];
-        size_t len = strlen(entry->name);
-        assert(len + strlen(_fileprefix) < PATH_MAX);
-        strcpy(qualified, _fileprefix);
-        strcat(qualified, entry->name);
-        #if PAR_FILECACHE_VERBOSE
-        printf("Evicting %s\n", entry->name);
-        #endif
-        remove(qualified);
-        _table->totalbytes -= entry->nbytes;
-        if (_table->nentries-- > 1) {
-            *entry = _table->entries[_table->nentries];
-        }
-    }
+    filecache_entry_t* entry = shard->entries + index;
+    _journal_entry(ctx, FILECACHE_REMOVE, entry, -1);
+#if PAR_FILECACHE_THREADS
+    _queue_eviction(ctx, entry->name);
+#else
+    char qualified[PATH_MAX];
+    par_filecache__qualify(ctx, entry->name, qualified);
+    #if PAR_FILECACHE_VERBOSE
+    printf("Evicting %s\n", entry->name);
+    #endif
+    remove(qualified);
+#endif
+    _remove_entry(shard, index);
+}
+
+void par_filecache_save(char const* name, uint8_t const* payload,
+    int payloadsize, uint8_t const* header, int headersize)
+{
+    par_filecache_ctx_save(par_filecache__default(), name, payload,
+        payloadsize, header, headersize);
+}
+
+bool par_filecache_load(char const* name, uint8_t** payload, int* payloadsize,
+    uint8_t* header, int headersize)
+{
+    return par_filecache_ctx_load(par_filecache__default(), name, payload,
+        payloadsize, header, headersize);
+}
+
+bool par_filecache_load_into(char const* name, uint8_t* payload, int capacity,
+    int* payloadsize, uint8_t* header, int headersize)
+{
+    return par_filecache_ctx_load_into(par_filecache__default(), name, payload,
+        capacity, payloadsize, header, headersize);
+}
+
+bool par_filecache_map(char const* name, par_filecache_view* view,
+    int headersize)
+{
+    return par_filecache_ctx_map(par_filecache__default(), name, view,
+        headersize);
+}
+
+void par_filecache_evict_all()
+{
+    par_filecache_ctx_evict_all(par_filecache__default());
 }
 
 // https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
@@ -432,6 +1355,5 @@ static uint64_t _hash(char const* name)
     return hval;
 }
 
-#undef PAR_MAX_ENTRIES
 #endif // PAR_FILECACHE_IMPLEMENTATION
 #endif // PAR_FILECACHE_H
@@ -24,18 +24,24 @@ extern "C" {
 // BEGIN PUBLIC API
 // -----------------------------------------------------------------------------
 
+// Index type for triangles.  Define this to uint32_t before including this
+// header to allow meshes with more than 65536 verts.
+#ifndef PAR_MSQUARES_T
+#define PAR_MSQUARES_T uint16_t
+#endif
+
 typedef uint8_t par_byte;
 
 typedef struct par_msquares_meshlist_s par_msquares_meshlist;
 
 // Results of a marching squares operation.  Triangles are counter-clockwise.
 typedef struct {
-    float* points;        // pointer to XY (or XYZ) vertex coordinates
-    int npoints;          // number of vertex coordinates
-    uint16_t* triangles;  // pointer to 3-tuples of vertex indices
-    int ntriangles;       // number of 3-tuples
-    int dim;              // number of floats per point (either 2 or 3)
-    uint32_t color;       // used only with par_msquares_color_multi
+    float* points;              // pointer to XY (or XYZ) vertex coordinates
+    int npoints;                // number of vertex coordinates
+    PAR_MSQUARES_T* triangles;  // pointer to 3-tuples of vertex indices
+    int ntriangles;             // number of 3-tuples
+    int dim;                    // number of floats per point (either 2 or 3)
+    uint32_t color;             // used only with par_msquares_color_multi
 } par_msquares_mesh;
 
 // Polyline boundary extracted from a mesh, composed of one or more chains.
@@ -43,11 +49,11 @@ typedef struct {
 // serializing to SVG, all chains can be aggregated in a single <path>,
 // provided they each terminate with a "Z" and use the default fill rule.
 typedef struct {
-    float* points;        // list of XY vertex coordinates
-    int npoints;          // number of vertex coordinates
-    float** chains;       // list of pointers to the start of each chain
-    uint16_t* lengths;    // list of chain lengths
-    int nchains;          // number of chains
+    float* points;            // list of XY vertex coordinates
+    int npoints;              // number of vertex coordinates
+    float** chains;           // list of pointers to the start of each chain
+    PAR_MSQUARES_T* lengths;  // list of chain lengths
+    int nchains;              // number of chains
 } par_msquares_boundary;
 
 // Reverses the "insideness" test.
@@ -78,6 +84,19 @@ typedef struct {
 // Requires the PAR_MSQUARES_SIMPLIFY flag to be disabled.
 #define PAR_MSQUARES_CLEAN (1 << 7)
 
+// Splits the image into horizontal bands that are marched concurrently, then
+// stitched together.  The result is identical to the serial result.  This has
+// no effect unless the implementation is compiled with PAR_MSQUARES_THREADS.
+// (par_msquares_function and the functions built upon it)
+#define PAR_MSQUARES_PARALLEL (1 << 8)
+
+// Splits meshes that have too many verts for PAR_MSQUARES_T into several
+// consecutive meshes.  Cannot be combined with SNAP, or with CONNECT when
+// producing multiple meshes.  (par_msquares_function and the functions built
+// upon it, and par_msquares_color_multi, which splits every color into bands
+// of rows)
+#define PAR_MSQUARES_SPLIT (1 << 9)
+
 par_msquares_meshlist* par_msquares_grayscale(float const* data, int width,
     int height, int cellsize, float threshold, int flags);
 
@@ -99,6 +118,29 @@ par_msquares_meshlist* par_msquares_function(int width, int height,
     int cellsize, int flags, void* context, par_msquares_inside_fn insidefn,
     par_msquares_height_fn heightfn);
 
+// Fills a row of "width" insideness values, where nonzero means inside.
+typedef void (*par_msquares_row_fn)(int row, par_byte* inside, void* context);
+
+// Variant of par_msquares_function that requests the insideness of a whole row
+// of pixels at a time.  Supports every flag and shares verts across the entire
+// mesh, at the cost of holding a byte per pixel in memory.
+par_msquares_meshlist* par_msquares_function_rows(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_row_fn rowfn,
+    par_msquares_height_fn heightfn);
+
+// Receives the mesh for a range of cell rows.  The mesh is owned by the
+// library and is valid only for the duration of the callback.
+typedef void (*par_msquares_chunk_fn)(par_msquares_mesh const* mesh, int row0,
+    int row1, void* context);
+
+// Streaming variant of par_msquares_function that requests pixel rows on
+// demand, holding only a single row of cells in memory.  Emits a separate mesh
+// for every "chunksize" rows of cells; verts are not shared between chunks.
+// DUAL and SNAP are not supported.
+void par_msquares_stream(int width, int height, int cellsize, int chunksize,
+    int flags, void* context, par_msquares_row_fn rowfn,
+    par_msquares_height_fn heightfn, par_msquares_chunk_fn chunkfn);
+
 par_msquares_meshlist* par_msquares_grayscale_multi(float const* data,
     int width, int height, int cellsize, float const* thresholds,
     int nthresholds, int flags);
@@ -108,6 +150,19 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
 
 par_msquares_boundary* par_msquares_extract_boundary(par_msquares_mesh const* );
 
+// Contour-only variants of par_msquares_function, par_msquares_grayscale, and
+// par_msquares_color.  These link boundary segments into chains while marching
+// and never build triangles, yielding the same polylines as extracting the
+// boundary of the corresponding mesh.  Only INVERT and SWIZZLE are honored.
+par_msquares_boundary* par_msquares_function_boundary(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_inside_fn insidefn);
+
+par_msquares_boundary* par_msquares_grayscale_boundary(float const* data,
+    int width, int height, int cellsize, float threshold, int flags);
+
+par_msquares_boundary* par_msquares_color_boundary(par_byte const* data,
+    int width, int height, int cellsize, uint32_t color, int bpp, int flags);
+
 #ifndef PAR_PI
 #define PAR_PI (3.14159265359)
 #define PAR_MIN(a, b) (a > b ? b : a)
@@ -124,6 +179,16 @@ par_msquares_boundary* par_msquares_extract_boundary(par_msquares_mesh const* );
 #define PAR_FREE(BUF) free(BUF)
 #endif
 
+// Set this to 1 to enable PAR_MSQUARES_PARALLEL, which uses pthreads.
+#ifndef PAR_MSQUARES_THREADS
+#define PAR_MSQUARES_THREADS 0
+#endif
+
+// Number of bands used by PAR_MSQUARES_PARALLEL, or 0 to match the core count.
+#ifndef PAR_MSQUARES_NTHREADS
+#define PAR_MSQUARES_NTHREADS 0
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -136,24 +201,38 @@ par_msquares_boundary* par_msquares_extract_boundary(par_msquares_mesh const* );
 #include <stdlib.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <string.h>
 
+#if PAR_MSQUARES_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 typedef struct {
-    uint16_t* values;
+    PAR_MSQUARES_T* values;
     size_t count;
     size_t capacity;
-} par__uint16list;
+} par__indexlist;
 
 typedef struct {
     float* points;
     int npoints;
-    uint16_t* triangles;
+    PAR_MSQUARES_T* triangles;
     int ntriangles;
     int dim;
     uint32_t color;
     int nconntriangles;
-    uint16_t* conntri;
-    par__uint16list* tjunctions;
+    PAR_MSQUARES_T* conntri;
+    par__indexlist* tjunctions;
 } par_msquares__mesh;
 
 struct par_msquares_meshlist_s {
@@ -163,6 +242,7 @@ struct par_msquares_meshlist_s {
 
 static int** par_msquares_binary_point_table = 0;
 static int** par_msquares_binary_triangle_table = 0;
+static int** par_msquares_binary_segment_table = 0;
 static int* par_msquares_quaternary_triangle_table[64][4];
 static int* par_msquares_quaternary_boundary_table[64][4];
 
@@ -213,6 +293,49 @@ static void par_init_tables()
         }
     }
 
+    // Find the boundary edges of each square, as (from, to, side) tuples where
+    // "side" is the square's side that contains the edge, or -1 if the edge
+    // lies in its interior.  Edges along a side only belong to the boundary
+    // when the side is along the border of the image.
+    par_msquares_binary_segment_table = PAR_CALLOC(int*, 16);
+    for (int i = 0; i < 16; i++) {
+        int const* sqrtris = par_msquares_binary_triangle_table[i];
+        int nedges = sqrtris[0] * 3;
+        int edges[12][2];
+        for (int t = 0; t < sqrtris[0]; t++) {
+            int const* tri = sqrtris + 1 + t * 3;
+            for (int e = 0; e < 3; e++) {
+                edges[t * 3 + e][0] = tri[2 - e];
+                edges[t * 3 + e][1] = tri[(4 - e) % 3];
+            }
+        }
+        int nvalues = 1 + nedges * 3;
+        int* sqrsegs = par_msquares_binary_segment_table[i] =
+            PAR_CALLOC(int, nvalues);
+        for (int e = 0; e < nedges; e++) {
+            int a = edges[e][0], b = edges[e][1];
+            int shared = 0;
+            for (int f = 0; f < nedges; f++) {
+                shared |= edges[f][0] == b && edges[f][1] == a;
+            }
+            if (shared) {
+                continue;
+            }
+            int side = -1;
+            for (int k = 0; k < 4; k++) {
+                int lo = k * 2, hi = (k * 2 + 2) % 8;
+                if ((a == lo || a == lo + 1 || a == hi) &&
+                    (b == lo || b == lo + 1 || b == hi)) {
+                    side = k;
+                }
+            }
+            int* seg = sqrsegs + 1 + sqrsegs[0]++ * 3;
+            seg[0] = a;
+            seg[1] = b;
+            seg[2] = side;
+        }
+    }
+
     char const* QUATERNARY_TABLE =
         "2024046000"
         "3346360301112300"
@@ -380,8 +503,6 @@ static void par_init_tables()
 typedef struct {
     float const* data;
     float threshold;
-    float lower_bound;
-    float upper_bound;
     int width;
     int height;
 } par_gray_context;
@@ -392,15 +513,6 @@ static int gray_inside(int location, void* contextptr)
     return context->data[location] > context->threshold;
 }
 
-static int gray_multi_inside(int location, void* contextptr)
-{
-    par_gray_context* context = (par_gray_context*) contextptr;
-    float val = context->data[location];
-    float upper = context->upper_bound;
-    float lower = context->lower_bound;
-    return val >= lower && val < upper;
-}
-
 static float gray_height(float x, float y, void* contextptr)
 {
     par_gray_context* context = (par_gray_context*) contextptr;
@@ -439,79 +551,6 @@ static float color_height(float x, float y, void* contextptr)
     return context->data[k * 4 + 3] / 255.0;
 }
 
-par_msquares_meshlist* par_msquares_color(par_byte const* data, int width,
-    int height, int cellsize, uint32_t color, int bpp, int flags)
-{
-    par_color_context context;
-    context.bpp = bpp;
-    if (flags & PAR_MSQUARES_SWIZZLE) {
-        context.color[0] = (color >>  0) & 0xff;
-        context.color[1] = (color >>  8) & 0xff;
-        context.color[2] = (color >> 16) & 0xff;
-        context.color[3] = (color >> 24) & 0xff;
-    } else {
-        context.color[0] = (color >> 16) & 0xff;
-        context.color[1] = (color >>  8) & 0xff;
-        context.color[2] = (color >>  0) & 0xff;
-        context.color[3] = (color >> 24) & 0xff;
-    }
-    context.data = data;
-    context.width = width;
-    context.height = height;
-    return par_msquares_function(
-        width, height, cellsize, flags, &context, color_inside, color_height);
-}
-
-par_msquares_meshlist* par_msquares_grayscale(float const* data, int width,
-    int height, int cellsize, float threshold, int flags)
-{
-    par_gray_context context;
-    context.width = width;
-    context.height = height;
-    context.data = data;
-    context.threshold = threshold;
-    return par_msquares_function(
-        width, height, cellsize, flags, &context, gray_inside, gray_height);
-}
-
-par_msquares_meshlist* par_msquares_grayscale_multi(float const* data,
-    int width, int height, int cellsize, float const* thresholds,
-    int nthresholds, int flags)
-{
-    par_msquares_meshlist* mlists[2];
-    mlists[0] = PAR_CALLOC(par_msquares_meshlist, 1);
-    int connect = flags & PAR_MSQUARES_CONNECT;
-    int snap = flags & PAR_MSQUARES_SNAP;
-    int heights = flags & PAR_MSQUARES_HEIGHTS;
-    if (!heights) {
-        snap = connect = 0;
-    }
-    flags &= ~PAR_MSQUARES_INVERT;
-    flags &= ~PAR_MSQUARES_DUAL;
-    flags &= ~PAR_MSQUARES_CONNECT;
-    flags &= ~PAR_MSQUARES_SNAP;
-    par_gray_context context;
-    context.width = width;
-    context.height = height;
-    context.data = data;
-    context.lower_bound = -FLT_MAX;
-    for (int i = 0; i <= nthresholds; i++) {
-        int mergeconf = i > 0 ? connect : 0;
-        if (i == nthresholds) {
-            context.upper_bound = FLT_MAX;
-            mergeconf |= snap;
-        } else {
-            context.upper_bound = thresholds[i];
-        }
-        mlists[1] = par_msquares_function(width, height, cellsize, flags,
-            &context, gray_multi_inside, gray_height);
-        mlists[0] = par_msquares__merge(mlists, 2, mergeconf);
-        context.lower_bound = context.upper_bound;
-        flags |= connect;
-    }
-    return mlists[0];
-}
-
 par_msquares_mesh const* par_msquares_get_mesh(
     par_msquares_meshlist* mlist, int mindex)
 {
@@ -619,7 +658,7 @@ static void par_remove_unreferenced_verts(par_msquares__mesh* mesh)
         return;
     }
     char* markers = PAR_CALLOC(char, mesh->npoints);
-    uint16_t const* ptris = mesh->triangles;
+    PAR_MSQUARES_T const* ptris = mesh->triangles;
     int newnpts = 0;
     for (int i = 0; i < mesh->ntriangles * 3; i++, ptris++) {
         if (!markers[*ptris]) {
@@ -628,7 +667,7 @@ static void par_remove_unreferenced_verts(par_msquares__mesh* mesh)
         }
     }
     float* newpts = PAR_CALLOC(float, newnpts * mesh->dim);
-    uint16_t* mapping = PAR_CALLOC(uint16_t, mesh->npoints);
+    PAR_MSQUARES_T* mapping = PAR_CALLOC(PAR_MSQUARES_T, mesh->npoints);
     float const* ppts = mesh->points;
     float* pnewpts = newpts;
     int j = 0;
@@ -660,541 +699,1876 @@ static void par_remove_unreferenced_verts(par_msquares__mesh* mesh)
     free(mapping);
 }
 
-par_msquares_meshlist* par_msquares_function(int width, int height,
-    int cellsize, int flags, void* context, par_msquares_inside_fn insidefn,
-    par_msquares_height_fn heightfn)
+// The marching engine below produces one mesh per "level", which allows
+// multiple meshes to be extracted in a single sweep over the image.  Each
+// corner of the grid is classified with a level index, or -1 if it does not
+// belong to any level.
+typedef struct par_msquares__march_s par_msquares__march;
+
+typedef int (*par_msquares__classify_fn)(int, par_msquares__march const*);
+typedef void (*par_msquares__corners_fn)(int, int*,
+    par_msquares__march const*);
+typedef int (*par_msquares__level_inside_fn)(int, int,
+    par_msquares__march const*);
+
+struct par_msquares__march_s {
+    int width;
+    int height;
+    int cellsize;
+    int flags;
+    int ncols;
+    int nrows;
+    int dim;
+    float normalization;
+    int nlevels;
+    int firstconnect;  // levels at or above this receive extrusion triangles
+    int firstlevel;    // offset applied to levels when testing insideness
+    int invert;
+    int contour;       // links boundary segments instead of emitting triangles
+    par_msquares__classify_fn classify;
+    par_msquares__corners_fn corners;  // classifies a row of cell corners
+    par_msquares__level_inside_fn inside;
+    void* context;
+    par_msquares_inside_fn insidefn;
+    par_msquares_height_fn heightfn;
+    float const* thresholds;
+    int nthresholds;
+    par_byte* rowcache;  // ring of pixel rows, used only for streaming
+    int nrowcache;
+};
+
+// Fixups are recorded when a band duplicates a vertex that lives in the last
+// row of the band above it.  They are resolved when the bands are stitched.
+typedef struct {
+    int offset;  // index of the duplicate vertex within the band
+    int ref;     // seam slot (col * 3 + i)
+} par_msquares__fixup;
+
+// Information about a non-empty cell, used for simplification.
+typedef struct {
+    int col;
+    int full;
+    int tri;
+    int ntris;
+} par_msquares__cellspan;
+
+// Triangles and welding state for a single level within a band.  Indices are
+// local to the band until it gets stitched; negative indices refer to verts in
+// the band above.
+typedef struct {
+    float* pts;
+    int npts;
+    int maxpts;
+    int* tris;
+    int ntris;
+    int maxtris;
+    int* conntris;
+    int nconntris;
+    int maxconntris;
+    int* edgemap;
+    int* links;  // next vert along the boundary, used only for contours
+    uint8_t* rowmasks;
+    int* rowinds;
+    int* rowstamps;
+    int* seamcopies;
+    int previnds[8];
+    uint8_t prevmask;
+    int prevcol;
+    int* pairtris;
+    int npairtris;
+    int maxpairtris;
+    par_msquares__cellspan* spans[2];
+    int nspans[2];
+    int maxspans[2];
+    par_msquares__fixup* fixups;
+    int nfixups;
+    int maxfixups;
+} par_msquares__level;
+
+// A horizontal range of cell rows that can be marched independently.
+typedef struct {
+    par_msquares__march const* march;
+    int row0;
+    int row1;
+    par_msquares__level* levels;
+    int* north;   // levels of the corners along the top of the current row
+    int* south;   // levels of the corners along the bottom of the current row
+    int southy;   // pixel row that corresponds to "south"
+} par_msquares__band;
+
+#define PAR_MSQUARES__NONE INT_MIN
+
+// The number of verts that can be addressed by PAR_MSQUARES_T.
+#define PAR_MSQUARES__MAXVERTS ((int64_t) (PAR_MSQUARES_T) -1 < INT_MAX ? \
+    (int) (PAR_MSQUARES_T) -1 + 1 : INT_MAX)
+
+#define PAR_MSQUARES__GROW(T, BUF, COUNT, CAP, N) \
+    if ((COUNT) + (N) > (CAP)) { \
+        CAP = PAR_MAX((CAP) * 2, (COUNT) + (N)); \
+        BUF = PAR_REALLOC(T, BUF, CAP); \
+    }
+
+static void par_msquares__add_fixup(par_msquares__level* lvl, int offset,
+    int ref)
 {
-    assert(width > 0 && width % cellsize == 0);
-    assert(height > 0 && height % cellsize == 0);
+    PAR_MSQUARES__GROW(par_msquares__fixup, lvl->fixups, lvl->nfixups,
+        lvl->maxfixups, 1);
+    par_msquares__fixup* fixup = lvl->fixups + lvl->nfixups++;
+    fixup->offset = offset;
+    fixup->ref = ref;
+}
 
-    if (flags & PAR_MSQUARES_DUAL) {
-        int connect = flags & PAR_MSQUARES_CONNECT;
-        int snap = flags & PAR_MSQUARES_SNAP;
-        int heights = flags & PAR_MSQUARES_HEIGHTS;
-        if (!heights) {
-            snap = connect = 0;
+// Ensures that a single cell has enough room for its verts and triangles.
+static void par_msquares__reserve(par_msquares__level* lvl, int dim,
+    int simplify)
+{
+    int maxpts = lvl->maxpts;
+    PAR_MSQUARES__GROW(float, lvl->pts, lvl->npts * dim, lvl->maxpts,
+        10 * dim);
+    if (lvl->edgemap && lvl->maxpts != maxpts) {
+        lvl->edgemap = PAR_REALLOC(int, lvl->edgemap, lvl->maxpts / dim);
+        for (int i = maxpts / dim; i < lvl->maxpts / dim; i++) {
+            lvl->edgemap[i] = -1;
         }
-        flags ^= PAR_MSQUARES_INVERT;
-        flags &= ~PAR_MSQUARES_DUAL;
-        flags &= ~PAR_MSQUARES_CONNECT;
-        par_msquares_meshlist* m[2];
-        m[0] = par_msquares_function(width, height, cellsize, flags,
-            context, insidefn, heightfn);
-        flags ^= PAR_MSQUARES_INVERT;
-        if (connect) {
-            flags |= PAR_MSQUARES_CONNECT;
+    }
+    if (lvl->links) {
+        if (lvl->maxpts != maxpts) {
+            lvl->links = PAR_REALLOC(int, lvl->links, lvl->maxpts / dim);
+            for (int i = maxpts / dim; i < lvl->maxpts / dim; i++) {
+                lvl->links[i] = -1;
+            }
         }
-        m[1] = par_msquares_function(width, height, cellsize, flags,
-            context, insidefn, heightfn);
-        return par_msquares__merge(m, 2, snap | connect);
+        return;
     }
+    if (simplify) {
+        PAR_MSQUARES__GROW(int, lvl->pairtris, lvl->npairtris * 3,
+            lvl->maxpairtris, 12);
+    } else {
+        PAR_MSQUARES__GROW(int, lvl->tris, lvl->ntris * 3, lvl->maxtris, 12);
+    }
+    if (lvl->edgemap) {
+        PAR_MSQUARES__GROW(int, lvl->conntris, lvl->nconntris * 3,
+            lvl->maxconntris, 24);
+    }
+}
 
-    int invert = flags & PAR_MSQUARES_INVERT;
+// Returns the index of the extrusion vertex that duplicates the given vertex,
+// creating it if necessary.
+static int par_msquares__extrude(par_msquares__level* lvl, int index,
+    int dim, float** ppts)
+{
+    if (index >= 0) {
+        if (lvl->edgemap[index] == -1) {
+            for (int d = 0; d < dim; d++) {
+                *(*ppts)++ = lvl->pts[index * dim + d];
+            }
+            lvl->edgemap[index] = lvl->npts++;
+        }
+        return lvl->edgemap[index];
+    }
 
-    // Create the two code tables if we haven't already.  These are tables of
-    // fixed constants, so it's embarassing that we use dynamic memory
-    // allocation for them.  However it's easy and it's one-time-only.
-    if (!par_msquares_binary_point_table) {
-        par_init_tables();
+    // Only the southern midpoint of the row above can be extruded from here.
+    int ref = -1 - index;
+    int col = ref / 3;
+    if (lvl->seamcopies[col] == PAR_MSQUARES__NONE) {
+        par_msquares__add_fixup(lvl, lvl->npts, ref);
+        *ppts += dim;
+        lvl->seamcopies[col] = lvl->npts++;
     }
+    return lvl->seamcopies[col];
+}
 
-    // Allocate the meshlist and the first mesh.
-    par_msquares_meshlist* mlist = PAR_CALLOC(par_msquares_meshlist, 1);
-    mlist->nmeshes = 1;
-    mlist->meshes = PAR_CALLOC(par_msquares__mesh*, 1);
-    mlist->meshes[0] = PAR_CALLOC(par_msquares__mesh, 1);
-    par_msquares__mesh* mesh = mlist->meshes[0];
-    mesh->dim = (flags & PAR_MSQUARES_HEIGHTS) ? 3 : 2;
-    int ncols = width / cellsize;
-    int nrows = height / cellsize;
-
-    // Worst case is four triangles and six verts per cell, so allocate that
-    // much.
-    int maxtris = ncols * nrows * 4;
-    int maxpts = ncols * nrows * 6;
-    int maxedges = ncols * nrows * 2;
-
-    // However, if we include extrusion triangles for boundary edges,
-    // we need space for another 4 triangles and 4 points per cell.
-    uint16_t* conntris = 0;
-    int nconntris = 0;
-    uint16_t* edgemap = 0;
-    if (flags & PAR_MSQUARES_CONNECT) {
-        conntris = PAR_CALLOC(uint16_t, maxedges * 6);
-        maxtris +=  maxedges * 2;
-        maxpts += maxedges * 2;
-        edgemap = PAR_CALLOC(uint16_t, maxpts);
-        for (int i = 0; i < maxpts; i++) {
-            edgemap[i] = 0xffff;
+// Determines if the given cell code duplicates its southern midpoint for the
+// sake of extrusion triangles, mirroring the logic in par_msquares__cell.
+static int par_msquares__extrudes_south(int code)
+{
+    int const* trianglespec = par_msquares_binary_triangle_table[code];
+    int trispeclength = *trianglespec++;
+    while (trispeclength--) {
+        int a = *trianglespec++;
+        int b = *trianglespec++;
+        int c = *trianglespec++;
+        if ((a % 2) && (b % 2)) {
+            if (a == 1 || b == 1) {
+                return 1;
+            }
+        } else if ((a % 2) && (c % 2)) {
+            if (a == 1 || c == 1) {
+                return 1;
+            }
+        } else if ((b % 2) && (c % 2)) {
+            if (b == 1 || c == 1) {
+                return 1;
+            }
         }
     }
-    uint16_t* tris = PAR_CALLOC(uint16_t, maxtris * 3);
-    int ntris = 0;
-    float* pts = PAR_CALLOC(float, maxpts * mesh->dim);
-    int npts = 0;
+    return 0;
+}
 
-    // The "verts" x/y/z arrays are the 4 corners and 4 midpoints around the
-    // square, in counter-clockwise order.  The origin of "triangle space" is at
-    // the lower-left, although we expect the image data to be in raster order
-    // (starts at top-left).
-    float vertsx[8], vertsy[8];
-    float normalization = 1.0f / PAR_MAX(width, height);
-    float normalized_cellsize = cellsize * normalization;
-    int maxrow = (height - 1) * width;
-    uint16_t* ptris = tris;
-    uint16_t* pconntris = conntris;
-    float* ppts = pts;
-    uint8_t* prevrowmasks = PAR_CALLOC(uint8_t, ncols);
-    int* prevrowinds = PAR_CALLOC(int, ncols * 3);
-
-    // If simplification is enabled, we need to track all 'F' cells and their
-    // repsective triangle indices.
-    uint8_t* simplification_codes = 0;
-    uint16_t* simplification_tris = 0;
-    uint8_t* simplification_ntris = 0;
-    if (flags & PAR_MSQUARES_SIMPLIFY) {
-        simplification_codes = PAR_CALLOC(uint8_t, nrows * ncols);
-        simplification_tris = PAR_CALLOC(uint16_t, nrows * ncols);
-        simplification_ntris = PAR_CALLOC(uint8_t, nrows * ncols);
+static void par_msquares__init_level(par_msquares__level* lvl,
+    par_msquares__march const* march, int level)
+{
+    int ncols = march->ncols;
+    lvl->rowmasks = PAR_CALLOC(uint8_t, ncols);
+    lvl->rowinds = PAR_CALLOC(int, ncols * 3);
+    lvl->rowstamps = PAR_MALLOC(int, ncols);
+    lvl->seamcopies = PAR_MALLOC(int, ncols);
+    for (int col = 0; col < ncols; col++) {
+        lvl->rowstamps[col] = -2;
     }
+    if ((march->flags & PAR_MSQUARES_CONNECT) && level >= march->firstconnect) {
+        lvl->edgemap = PAR_MALLOC(int, 1);
+    }
+    if (march->contour) {
+        lvl->links = PAR_MALLOC(int, 1);
+    }
+    lvl->prevcol = -2;
+}
 
-    // Do the march!
-    for (int row = 0; row < nrows; row++) {
-        vertsx[0] = vertsx[6] = vertsx[7] = 0;
-        vertsx[1] = vertsx[5] = 0.5 * normalized_cellsize;
-        vertsx[2] = vertsx[3] = vertsx[4] = normalized_cellsize;
-        vertsy[0] = vertsy[1] = vertsy[2] = normalized_cellsize * (row + 1);
-        vertsy[4] = vertsy[5] = vertsy[6] = normalized_cellsize * row;
-        vertsy[3] = vertsy[7] = normalized_cellsize * (row + 0.5);
-
-        int northi = row * cellsize * width;
-        int southi = PAR_MIN(northi + cellsize * width, maxrow);
-        int northwest = invert ^ insidefn(northi, context);
-        int southwest = invert ^ insidefn(southi, context);
-        int previnds[8] = {0};
-        uint8_t prevmask = 0;
+// Returns the segments of the given square that lie on the boundary, as a
+// bitmask over its segment table.  The "sides" bitmask indicates which sides
+// of the square are along the border of the image.
+static int par_msquares__contour_segments(int code, int sides, int* ptmask)
+{
+    int const* segs = par_msquares_binary_segment_table[code];
+    int nsegs = *segs++;
+    int segmask = 0;
+    *ptmask = 0;
+    for (int i = 0; i < nsegs; i++, segs += 3) {
+        if (segs[2] == -1 || (sides & (1 << segs[2]))) {
+            segmask |= 1 << i;
+            *ptmask |= (1 << segs[0]) | (1 << segs[1]);
+        }
+    }
+    return segmask;
+}
 
-        for (int col = 0; col < ncols; col++) {
-            northi += cellsize;
-            southi += cellsize;
-            if (col == ncols - 1) {
-                northi--;
-                southi--;
-            }
+// Stashes the verts of a cell to allow welding with the cells to its east and
+// south.
+static void par_msquares__end_cell(par_msquares__level* lvl, int row, int col,
+    uint8_t mask, int const* currinds)
+{
+    lvl->rowmasks[col] = mask;
+    lvl->rowstamps[col] = row;
+    lvl->rowinds[col * 3 + 0] = currinds[0];
+    lvl->rowinds[col * 3 + 1] = currinds[1];
+    lvl->rowinds[col * 3 + 2] = currinds[2];
+    lvl->prevmask = mask;
+    lvl->prevcol = col;
+    for (int i = 0; i < 8; i++) {
+        lvl->previnds[i] = currinds[i];
+    }
+}
 
-            int northeast = invert ^ insidefn(northi, context);
-            int southeast = invert ^ insidefn(southi, context);
-            int code = southwest | (southeast << 1) | (northwest << 2) |
-                (northeast << 3);
-
-            int const* pointspec = par_msquares_binary_point_table[code];
-            int ptspeclength = *pointspec++;
-            int currinds[8] = {0};
-            uint8_t mask = 0;
-            uint8_t prevrowmask = prevrowmasks[col];
-            while (ptspeclength--) {
-                int midp = *pointspec++;
-                int bit = 1 << midp;
-                mask |= bit;
+// Marches a single cell for a single level, given the 4-bit code that
+// describes which of its corners belong to the level.
+static void par_msquares__cell(par_msquares__band* band, int level, int code,
+    int row, int col, int northi, int southi, float const* vertsx,
+    float const* vertsy)
+{
+    par_msquares__march const* march = band->march;
+    par_msquares__level* lvl = band->levels + level;
+    int const width = march->width;
+    int const cellsize = march->cellsize;
+    int const dim = march->dim;
+    int const simplify = march->flags & PAR_MSQUARES_SIMPLIFY;
+    float normalization = march->normalization;
+
+    // Contours only need the verts of boundary segments.
+    int segmask = 0;
+    int ptmask = 0xff;
+    if (march->contour) {
+        int sides = (row == march->nrows - 1) |
+            ((col == march->ncols - 1) << 1) | ((row == 0) << 2) |
+            ((col == 0) << 3);
+        segmask = par_msquares__contour_segments(code, sides, &ptmask);
+        if (!segmask) {
+            return;
+        }
+    }
+    if (!lvl->rowmasks) {
+        par_msquares__init_level(lvl, march, level);
+    }
+    par_msquares__reserve(lvl, dim, simplify);
+    float* ppts = lvl->pts + lvl->npts * dim;
+
+    int const* pointspec = par_msquares_binary_point_table[code];
+    int ptspeclength = *pointspec++;
+    int currinds[8] = {0};
+    int const* previnds = lvl->previnds;
+    int const* prevrowinds = lvl->rowinds;
+    uint8_t mask = 0;
+    uint8_t prevmask = lvl->prevcol == col - 1 ? lvl->prevmask : 0;
+    uint8_t prevrowmask = lvl->rowstamps[col] == row - 1 ?
+        lvl->rowmasks[col] : 0;
+    while (ptspeclength--) {
+        int midp = *pointspec++;
+        int bit = 1 << midp;
+        if (!(ptmask & bit)) {
+            continue;
+        }
+        mask |= bit;
+
+        // The following six conditionals perform welding to reduce the
+        // number of vertices.  The first three perform welding with the
+        // cell to the west; the latter three perform welding with the
+        // cell to the north.
+        if (bit == 1 && (prevmask & 4)) {
+            currinds[midp] = previnds[2];
+            continue;
+        }
+        if (bit == 128 && (prevmask & 8)) {
+            currinds[midp] = previnds[3];
+            continue;
+        }
+        if (bit == 64 && (prevmask & 16)) {
+            currinds[midp] = previnds[4];
+            continue;
+        }
+        if (bit == 16 && (prevrowmask & 4)) {
+            currinds[midp] = prevrowinds[col * 3 + 2];
+            continue;
+        }
+        if (bit == 32 && (prevrowmask & 2)) {
+            currinds[midp] = prevrowinds[col * 3 + 1];
+            continue;
+        }
+        if (bit == 64 && (prevrowmask & 1)) {
+            currinds[midp] = prevrowinds[col * 3 + 0];
+            continue;
+        }
 
-                // The following six conditionals perform welding to reduce the
-                // number of vertices.  The first three perform welding with the
-                // cell to the west; the latter three perform welding with the
-                // cell to the north.
-                if (bit == 1 && (prevmask & 4)) {
-                    currinds[midp] = previnds[2];
-                    continue;
-                }
-                if (bit == 128 && (prevmask & 8)) {
-                    currinds[midp] = previnds[3];
-                    continue;
-                }
-                if (bit == 64 && (prevmask & 16)) {
-                    currinds[midp] = previnds[4];
-                    continue;
-                }
-                if (bit == 16 && (prevrowmask & 4)) {
-                    currinds[midp] = prevrowinds[col * 3 + 2];
-                    continue;
-                }
-                if (bit == 32 && (prevrowmask & 2)) {
-                    currinds[midp] = prevrowinds[col * 3 + 1];
-                    continue;
+        ppts[0] = vertsx[midp];
+        ppts[1] = vertsy[midp];
+
+        // Adjust the midpoints to a more exact crossing point.
+        if (midp == 1) {
+            int begin = southi - cellsize / 2;
+            int previous = 0;
+            for (int i = 0; i < cellsize; i++) {
+                int offset = begin + i / 2 * ((i % 2) ? -1 : 1);
+                int inside = march->inside(offset, level, march);
+                if (i > 0 && inside != previous) {
+                    ppts[0] = normalization *
+                        (col * cellsize + offset - southi + cellsize);
+                    break;
                 }
-                if (bit == 64 && (prevrowmask & 1)) {
-                    currinds[midp] = prevrowinds[col * 3 + 0];
-                    continue;
+                previous = inside;
+            }
+        } else if (midp == 5) {
+            int begin = northi - cellsize / 2;
+            int previous = 0;
+            for (int i = 0; i < cellsize; i++) {
+                int offset = begin + i / 2 * ((i % 2) ? -1 : 1);
+                int inside = march->inside(offset, level, march);
+                if (i > 0 && inside != previous) {
+                    ppts[0] = normalization *
+                        (col * cellsize + offset - northi + cellsize);
+                    break;
                 }
-
-                ppts[0] = vertsx[midp];
-                ppts[1] = vertsy[midp];
-
-                // Adjust the midpoints to a more exact crossing point.
-                if (midp == 1) {
-                    int begin = southi - cellsize / 2;
-                    int previous = 0;
-                    for (int i = 0; i < cellsize; i++) {
-                        int offset = begin + i / 2 * ((i % 2) ? -1 : 1);
-                        int inside = insidefn(offset, context);
-                        if (i > 0 && inside != previous) {
-                            ppts[0] = normalization *
-                                (col * cellsize + offset - southi + cellsize);
-                            break;
-                        }
-                        previous = inside;
-                    }
-                } else if (midp == 5) {
-                    int begin = northi - cellsize / 2;
-                    int previous = 0;
-                    for (int i = 0; i < cellsize; i++) {
-                        int offset = begin + i / 2 * ((i % 2) ? -1 : 1);
-                        int inside = insidefn(offset, context);
-                        if (i > 0 && inside != previous) {
-                            ppts[0] = normalization *
-                                (col * cellsize + offset - northi + cellsize);
-                            break;
-                        }
-                        previous = inside;
-                    }
-                } else if (midp == 3) {
-                    int begin = northi + width * cellsize / 2;
-                    int previous = 0;
-                    for (int i = 0; i < cellsize; i++) {
-                        int offset = begin +
-                            width * (i / 2 * ((i % 2) ? -1 : 1));
-                        int inside = insidefn(offset, context);
-                        if (i > 0 && inside != previous) {
-                            ppts[1] = normalization *
-                                (row * cellsize +
-                                (offset - northi) / (float) width);
-                            break;
-                        }
-                        previous = inside;
-                    }
-                } else if (midp == 7) {
-                    int begin = northi + width * cellsize / 2 - cellsize;
-                    int previous = 0;
-                    for (int i = 0; i < cellsize; i++) {
-                        int offset = begin +
-                            width * (i / 2 * ((i % 2) ? -1 : 1));
-                        int inside = insidefn(offset, context);
-                        if (i > 0 && inside != previous) {
-                            ppts[1] = normalization *
-                                (row * cellsize +
-                                (offset - northi - cellsize) / (float) width);
-                            break;
-                        }
-                        previous = inside;
-                    }
+                previous = inside;
+            }
+        } else if (midp == 3) {
+            int begin = northi + width * cellsize / 2;
+            int previous = 0;
+            for (int i = 0; i < cellsize; i++) {
+                int offset = begin +
+                    width * (i / 2 * ((i % 2) ? -1 : 1));
+                int inside = march->inside(offset, level, march);
+                if (i > 0 && inside != previous) {
+                    ppts[1] = normalization *
+                        (row * cellsize +
+                        (offset - northi) / (float) width);
+                    break;
                 }
-
-                if (mesh->dim == 3) {
-                    ppts[2] = heightfn(ppts[0], ppts[1], context);
+                previous = inside;
+            }
+        } else if (midp == 7) {
+            int begin = northi + width * cellsize / 2 - cellsize;
+            int previous = 0;
+            for (int i = 0; i < cellsize; i++) {
+                int offset = begin +
+                    width * (i / 2 * ((i % 2) ? -1 : 1));
+                int inside = march->inside(offset, level, march);
+                if (i > 0 && inside != previous) {
+                    ppts[1] = normalization *
+                        (row * cellsize +
+                        (offset - northi - cellsize) / (float) width);
+                    break;
                 }
-
-                ppts += mesh->dim;
-                currinds[midp] = npts++;
+                previous = inside;
             }
+        }
 
-            int const* trianglespec = par_msquares_binary_triangle_table[code];
-            int trispeclength = *trianglespec++;
+        if (dim == 3) {
+            ppts[2] = march->heightfn(ppts[0], ppts[1], march->context);
+        }
 
-            if (flags & PAR_MSQUARES_SIMPLIFY) {
-                simplification_codes[ncols * row + col] = code;
-                simplification_tris[ncols * row + col] = ntris;
-                simplification_ntris[ncols * row + col] = trispeclength;
-            }
+        ppts += dim;
+        currinds[midp] = lvl->npts++;
+    }
 
-            // Add triangles.
-            while (trispeclength--) {
-                int a = *trianglespec++;
-                int b = *trianglespec++;
-                int c = *trianglespec++;
-                *ptris++ = currinds[c];
-                *ptris++ = currinds[b];
-                *ptris++ = currinds[a];
-                ntris++;
+    // Link the boundary segments rather than adding triangles.
+    if (lvl->links) {
+        int const* segs = par_msquares_binary_segment_table[code] + 1;
+        for (; segmask; segmask >>= 1, segs += 3) {
+            if (segmask & 1) {
+                lvl->links[currinds[segs[0]]] = currinds[segs[1]];
             }
+        }
+        par_msquares__end_cell(lvl, row, col, mask, currinds);
+        return;
+    }
 
-            // Create two extrusion triangles for each boundary edge.
-            if (flags & PAR_MSQUARES_CONNECT) {
-                trianglespec = par_msquares_binary_triangle_table[code];
-                trispeclength = *trianglespec++;
-                while (trispeclength--) {
-                    int a = *trianglespec++;
-                    int b = *trianglespec++;
-                    int c = *trianglespec++;
-                    int i = currinds[a];
-                    int j = currinds[b];
-                    int k = currinds[c];
-                    int u = 0, v = 0, w = 0;
-                    if ((a % 2) && (b % 2)) {
-                        u = v = 1;
-                    } else if ((a % 2) && (c % 2)) {
-                        u = w = 1;
-                    } else if ((b % 2) && (c % 2)) {
-                        v = w = 1;
-                    } else {
-                        continue;
-                    }
-                    if (u && edgemap[i] == 0xffff) {
-                        for (int d = 0; d < mesh->dim; d++) {
-                            *ppts++ = pts[i * mesh->dim + d];
-                        }
-                        edgemap[i] = npts++;
-                    }
-                    if (v && edgemap[j] == 0xffff) {
-                        for (int d = 0; d < mesh->dim; d++) {
-                            *ppts++ = pts[j * mesh->dim + d];
-                        }
-                        edgemap[j] = npts++;
-                    }
-                    if (w && edgemap[k] == 0xffff) {
-                        for (int d = 0; d < mesh->dim; d++) {
-                            *ppts++ = pts[k * mesh->dim + d];
-                        }
-                        edgemap[k] = npts++;
-                    }
-                    if ((a % 2) && (b % 2)) {
-                        *pconntris++ = i;
-                        *pconntris++ = j;
-                        *pconntris++ = edgemap[j];
-                        *pconntris++ = edgemap[j];
-                        *pconntris++ = edgemap[i];
-                        *pconntris++ = i;
-                    } else if ((a % 2) && (c % 2)) {
-                        *pconntris++ = edgemap[k];
-                        *pconntris++ = k;
-                        *pconntris++ = i;
-                        *pconntris++ = edgemap[i];
-                        *pconntris++ = edgemap[k];
-                        *pconntris++ = i;
-                    } else if ((b % 2) && (c % 2)) {
-                        *pconntris++ = j;
-                        *pconntris++ = k;
-                        *pconntris++ = edgemap[k];
-                        *pconntris++ = edgemap[k];
-                        *pconntris++ = edgemap[j];
-                        *pconntris++ = j;
-                    }
-                    nconntris += 2;
-                }
-            }
+    int const* trianglespec = par_msquares_binary_triangle_table[code];
+    int trispeclength = *trianglespec++;
+
+    // Add triangles, deferring them to the row-pair buffer if simplification
+    // is enabled.
+    int* ptris = lvl->tris + lvl->ntris * 3;
+    if (simplify) {
+        int parity = row & 1;
+        PAR_MSQUARES__GROW(par_msquares__cellspan, lvl->spans[parity],
+            lvl->nspans[parity], lvl->maxspans[parity], 1);
+        par_msquares__cellspan* span =
+            lvl->spans[parity] + lvl->nspans[parity]++;
+        span->col = col;
+        span->full = code == 0xf;
+        span->tri = lvl->npairtris;
+        span->ntris = trispeclength;
+        ptris = lvl->pairtris + lvl->npairtris * 3;
+        lvl->npairtris += trispeclength;
+    } else {
+        lvl->ntris += trispeclength;
+    }
+    while (trispeclength--) {
+        int a = *trianglespec++;
+        int b = *trianglespec++;
+        int c = *trianglespec++;
+        *ptris++ = currinds[c];
+        *ptris++ = currinds[b];
+        *ptris++ = currinds[a];
+    }
 
-            // Prepare for the next cell.
-            prevrowmasks[col] = mask;
-            prevrowinds[col * 3 + 0] = currinds[0];
-            prevrowinds[col * 3 + 1] = currinds[1];
-            prevrowinds[col * 3 + 2] = currinds[2];
-            prevmask = mask;
-            northwest = northeast;
-            southwest = southeast;
-            for (int i = 0; i < 8; i++) {
-                previnds[i] = currinds[i];
-                vertsx[i] += normalized_cellsize;
+    // Create two extrusion triangles for each boundary edge.
+    if (lvl->edgemap) {
+        int* pconntris = lvl->conntris + lvl->nconntris * 3;
+        trianglespec = par_msquares_binary_triangle_table[code];
+        trispeclength = *trianglespec++;
+        while (trispeclength--) {
+            int a = *trianglespec++;
+            int b = *trianglespec++;
+            int c = *trianglespec++;
+            int i = currinds[a];
+            int j = currinds[b];
+            int k = currinds[c];
+            if ((a % 2) && (b % 2)) {
+                int ei = par_msquares__extrude(lvl, i, dim, &ppts);
+                int ej = par_msquares__extrude(lvl, j, dim, &ppts);
+                *pconntris++ = i;
+                *pconntris++ = j;
+                *pconntris++ = ej;
+                *pconntris++ = ej;
+                *pconntris++ = ei;
+                *pconntris++ = i;
+            } else if ((a % 2) && (c % 2)) {
+                int ei = par_msquares__extrude(lvl, i, dim, &ppts);
+                int ek = par_msquares__extrude(lvl, k, dim, &ppts);
+                *pconntris++ = ek;
+                *pconntris++ = k;
+                *pconntris++ = i;
+                *pconntris++ = ei;
+                *pconntris++ = ek;
+                *pconntris++ = i;
+            } else if ((b % 2) && (c % 2)) {
+                int ej = par_msquares__extrude(lvl, j, dim, &ppts);
+                int ek = par_msquares__extrude(lvl, k, dim, &ppts);
+                *pconntris++ = j;
+                *pconntris++ = k;
+                *pconntris++ = ek;
+                *pconntris++ = ek;
+                *pconntris++ = ej;
+                *pconntris++ = j;
+            } else {
+                continue;
             }
+            lvl->nconntris += 2;
         }
     }
-    free(edgemap);
-    free(prevrowmasks);
-    free(prevrowinds);
 
-    // Perform quick-n-dirty simplification by iterating two rows at a time.
-    // In no way does this create the simplest possible mesh, but at least it's
-    // fast and easy.
-    if (flags & PAR_MSQUARES_SIMPLIFY) {
-        int in_run = 0, start_run;
+    par_msquares__end_cell(lvl, row, col, mask, currinds);
+}
 
-        // First figure out how many triangles we can eliminate.
-        int neliminated_triangles = 0;
-        for (int row = 0; row < nrows - 1; row += 2) {
-            for (int col = 0; col < ncols; col++) {
-                int a = simplification_codes[ncols * row + col] == 0xf;
-                int b = simplification_codes[ncols * row + col + ncols] == 0xf;
-                if (a && b) {
-                    if (!in_run) {
-                        in_run = 1;
-                        start_run = col;
-                    }
+// Emits a pair of triangles that replaces a run of 'F' cells spanning two
+// rows.
+static int* par_msquares__emit_run(int* dst, int const* tris,
+    par_msquares__cellspan const* nw, par_msquares__cellspan const* sw,
+    par_msquares__cellspan const* ne, par_msquares__cellspan const* se)
+{
+    int nw_corner = tris[nw->tri * 3 + 4];
+    int ne_corner = tris[ne->tri * 3 + 0];
+    int sw_corner = tris[sw->tri * 3 + 2];
+    int se_corner = tris[se->tri * 3 + 1];
+    *dst++ = se_corner;
+    *dst++ = sw_corner;
+    *dst++ = nw_corner;
+    *dst++ = nw_corner;
+    *dst++ = ne_corner;
+    *dst++ = se_corner;
+    return dst;
+}
+
+// Performs quick-n-dirty simplification on a pair of rows.  In no way does
+// this create the simplest possible mesh, but at least it's fast and easy.
+// If any given cell is 'F' and its neighbor to the south is also 'F', then
+// it's part of a run.
+static void par_msquares__simplify_pair(par_msquares__level* lvl)
+{
+    int const* tris = lvl->pairtris;
+    PAR_MSQUARES__GROW(int, lvl->tris, lvl->ntris * 3, lvl->maxtris,
+        lvl->npairtris * 3);
+    int* dst = lvl->tris + lvl->ntris * 3;
+    par_msquares__cellspan const* north = lvl->spans[0];
+    par_msquares__cellspan const* south = lvl->spans[1];
+    par_msquares__cellspan const* nend = north + lvl->nspans[0];
+    par_msquares__cellspan const* send = south + lvl->nspans[1];
+    par_msquares__cellspan const* runstart[2] = {0, 0};
+    par_msquares__cellspan const* runend[2] = {0, 0};
+    while (north != nend || south != send) {
+        int ncol = north != nend ? north->col : INT_MAX;
+        int scol = south != send ? south->col : INT_MAX;
+        int col = PAR_MIN(ncol, scol);
+        par_msquares__cellspan const* n = ncol == col ? north++ : 0;
+        par_msquares__cellspan const* s = scol == col ? south++ : 0;
+
+        // Empty cells between occupied columns terminate any run.
+        if (runstart[0] && runend[0]->col != col - 1) {
+            dst = par_msquares__emit_run(dst, tris, runstart[0], runstart[1],
+                runend[0], runend[1]);
+            runstart[0] = 0;
+        }
+        if (n && s && n->full && s->full) {
+            if (!runstart[0]) {
+                runstart[0] = n;
+                runstart[1] = s;
+            }
+            runend[0] = n;
+            runend[1] = s;
+            continue;
+        }
+        if (runstart[0]) {
+            dst = par_msquares__emit_run(dst, tris, runstart[0], runstart[1],
+                runend[0], runend[1]);
+            runstart[0] = 0;
+        }
+        if (n) {
+            memcpy(dst, tris + n->tri * 3, sizeof(int) * n->ntris * 3);
+            dst += n->ntris * 3;
+        }
+        if (s) {
+            memcpy(dst, tris + s->tri * 3, sizeof(int) * s->ntris * 3);
+            dst += s->ntris * 3;
+        }
+    }
+    if (runstart[0]) {
+        dst = par_msquares__emit_run(dst, tris, runstart[0], runstart[1],
+            runend[0], runend[1]);
+    }
+    lvl->ntris = (dst - lvl->tris) / 3;
+    lvl->npairtris = 0;
+    lvl->nspans[0] = lvl->nspans[1] = 0;
+}
+
+// Moves the triangles of an unpaired trailing row into the final list.
+static void par_msquares__flush_row(par_msquares__level* lvl)
+{
+    PAR_MSQUARES__GROW(int, lvl->tris, lvl->ntris * 3, lvl->maxtris,
+        lvl->npairtris * 3);
+    memcpy(lvl->tris + lvl->ntris * 3, lvl->pairtris,
+        sizeof(int) * lvl->npairtris * 3);
+    lvl->ntris += lvl->npairtris;
+    lvl->npairtris = 0;
+    lvl->nspans[0] = 0;
+}
+
+// Passes each level that touches the given corners to par_msquares__cell.
+static void par_msquares__cells(par_msquares__band* band, int row, int col,
+    int northi, int southi, float const* vertsx, float const* vertsy,
+    int sw, int se, int nw, int ne)
+{
+    int corners[4] = {sw, se, nw, ne};
+    for (int c = 0; c < 4; c++) {
+        int level = corners[c];
+        if (level < 0 || (c > 0 && level == corners[0]) ||
+            (c > 1 && level == corners[1]) ||
+            (c > 2 && level == corners[2])) {
+            continue;
+        }
+        int code = (sw == level) | ((se == level) << 1) |
+            ((nw == level) << 2) | ((ne == level) << 3);
+        par_msquares__cell(band, level, code, row, col, northi, southi,
+            vertsx, vertsy);
+    }
+}
+
+// Computes the 4-bit codes of "n" consecutive single-level cells, whose
+// corners are 0 when inside and -1 otherwise.
+static void par_msquares__codes(int const* north, int const* south,
+    int* codes, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i b0 = _mm256_set1_epi32(1), b1 = _mm256_set1_epi32(2);
+    __m256i b2 = _mm256_set1_epi32(4), b3 = _mm256_set1_epi32(8);
+    for (; i + 8 <= n; i += 8) {
+        __m256i sw = _mm256_loadu_si256((__m256i const*) (south + i));
+        __m256i se = _mm256_loadu_si256((__m256i const*) (south + i + 1));
+        __m256i nw = _mm256_loadu_si256((__m256i const*) (north + i));
+        __m256i ne = _mm256_loadu_si256((__m256i const*) (north + i + 1));
+        __m256i code = _mm256_or_si256(
+            _mm256_or_si256(_mm256_andnot_si256(sw, b0),
+            _mm256_andnot_si256(se, b1)),
+            _mm256_or_si256(_mm256_andnot_si256(nw, b2),
+            _mm256_andnot_si256(ne, b3)));
+        _mm256_storeu_si256((__m256i*) (codes + i), code);
+    }
+#elif defined(__SSE2__)
+    __m128i b0 = _mm_set1_epi32(1), b1 = _mm_set1_epi32(2);
+    __m128i b2 = _mm_set1_epi32(4), b3 = _mm_set1_epi32(8);
+    for (; i + 4 <= n; i += 4) {
+        __m128i sw = _mm_loadu_si128((__m128i const*) (south + i));
+        __m128i se = _mm_loadu_si128((__m128i const*) (south + i + 1));
+        __m128i nw = _mm_loadu_si128((__m128i const*) (north + i));
+        __m128i ne = _mm_loadu_si128((__m128i const*) (north + i + 1));
+        __m128i code = _mm_or_si128(
+            _mm_or_si128(_mm_andnot_si128(sw, b0), _mm_andnot_si128(se, b1)),
+            _mm_or_si128(_mm_andnot_si128(nw, b2), _mm_andnot_si128(ne, b3)));
+        _mm_storeu_si128((__m128i*) (codes + i), code);
+    }
+#elif defined(__ARM_NEON)
+    int32x4_t b0 = vdupq_n_s32(1), b1 = vdupq_n_s32(2);
+    int32x4_t b2 = vdupq_n_s32(4), b3 = vdupq_n_s32(8);
+    for (; i + 4 <= n; i += 4) {
+        int32x4_t code = vorrq_s32(
+            vorrq_s32(vbicq_s32(b0, vld1q_s32(south + i)),
+            vbicq_s32(b1, vld1q_s32(south + i + 1))),
+            vorrq_s32(vbicq_s32(b2, vld1q_s32(north + i)),
+            vbicq_s32(b3, vld1q_s32(north + i + 1))));
+        vst1q_s32(codes + i, code);
+    }
+#endif
+    for (; i < n; i++) {
+        codes[i] = (~south[i] & 1) | (~south[i + 1] & 2) |
+            (~north[i] & 4) | (~north[i + 1] & 8);
+    }
+}
+
+// Classifies the corners along the top and bottom of the given row of cells,
+// reusing the bottom of the previous row when possible.
+static void par_msquares__classify_rows(par_msquares__band* band, int row)
+{
+    par_msquares__march const* march = band->march;
+    int northy = row * march->cellsize;
+    int southy = PAR_MIN(northy + march->cellsize, march->height - 1);
+    if (!band->north) {
+        int ncorners = march->ncols + 1;
+        band->north = PAR_MALLOC(int, ncorners);
+        band->south = PAR_MALLOC(int, ncorners);
+        band->southy = -1;
+    }
+    if (band->southy == northy) {
+        PAR_SWAP(int*, band->north, band->south);
+    } else {
+        march->corners(northy, band->north, march);
+    }
+    march->corners(southy, band->south, march);
+    band->southy = southy;
+}
+
+// Marches a single row of cells, simplifying each pair of rows as soon as it
+// is complete.
+static void par_msquares__march_row(par_msquares__band* band, int row)
+{
+    par_msquares__march const* march = band->march;
+    int const width = march->width;
+    int const height = march->height;
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    int const nlevels = march->nlevels;
+
+    // The "verts" x/y/z arrays are the 4 corners and 4 midpoints around the
+    // square, in counter-clockwise order.  The origin of "triangle space" is at
+    // the lower-left, although we expect the image data to be in raster order
+    // (starts at top-left).
+    float vertsx[8], vertsy[8];
+    float normalization = 1.0f / PAR_MAX(width, height);
+    float normalized_cellsize = cellsize * normalization;
+    int maxrow = (height - 1) * width;
+    vertsx[0] = vertsx[6] = vertsx[7] = 0;
+    vertsx[1] = vertsx[5] = 0.5 * normalized_cellsize;
+    vertsx[2] = vertsx[3] = vertsx[4] = normalized_cellsize;
+    vertsy[0] = vertsy[1] = vertsy[2] = normalized_cellsize * (row + 1);
+    vertsy[4] = vertsy[5] = vertsy[6] = normalized_cellsize * row;
+    vertsy[3] = vertsy[7] = normalized_cellsize * (row + 0.5);
+
+    int northi = row * cellsize * width;
+    int southi = PAR_MIN(northi + cellsize * width, maxrow);
+    par_msquares__classify_rows(band, row);
+    int const* north = band->north;
+    int const* south = band->south;
+    for (int level = 0; level < nlevels; level++) {
+        band->levels[level].prevcol = -2;
+    }
+    int codes[16];
+    for (int col = 0; col < ncols; col++) {
+        northi += cellsize;
+        southi += cellsize;
+        if (col == ncols - 1) {
+            northi--;
+            southi--;
+        }
+
+        // Skip cells whose corners are all -1, which is the common case.  With
+        // a single level, the cell codes are computed 16 at a time.
+        if (nlevels == 1) {
+            if (col % 16 == 0) {
+                par_msquares__codes(north + col, south + col, codes,
+                    PAR_MIN(16, ncols - col));
+            }
+            if (codes[col % 16]) {
+                par_msquares__cell(band, 0, codes[col % 16], row, col, northi,
+                    southi, vertsx, vertsy);
+            }
+        } else if ((north[col] & north[col + 1] & south[col] &
+            south[col + 1]) != -1) {
+            par_msquares__cells(band, row, col, northi, southi, vertsx,
+                vertsy, south[col], south[col + 1], north[col],
+                north[col + 1]);
+        }
+        for (int i = 0; i < 8; i++) {
+            vertsx[i] += normalized_cellsize;
+        }
+    }
+    if ((march->flags & PAR_MSQUARES_SIMPLIFY) && (row & 1)) {
+        for (int level = 0; level < nlevels; level++) {
+            if (band->levels[level].rowmasks) {
+                par_msquares__simplify_pair(band->levels + level);
+            }
+        }
+    }
+}
+
+// Flushes any row that is still waiting to be paired up for simplification.
+static void par_msquares__finish_band(par_msquares__band* band)
+{
+    par_msquares__march const* march = band->march;
+    if (!(march->flags & PAR_MSQUARES_SIMPLIFY) || !(band->row1 & 1)) {
+        return;
+    }
+    for (int level = 0; level < march->nlevels; level++) {
+        if (band->levels[level].rowmasks) {
+            par_msquares__flush_row(band->levels + level);
+        }
+    }
+}
+
+static void* par_msquares__march_band(void* arg)
+{
+    par_msquares__band* band = (par_msquares__band*) arg;
+    par_msquares__march const* march = band->march;
+    int const ncols = march->ncols;
+
+    // If this band is not at the top of the image, classify the last row of
+    // the band above to allow welding across the seam.  The indices of the
+    // welded verts are not yet known, so they are marked with negative values.
+    if (band->row0 > 0) {
+        int row = band->row0 - 1;
+        par_msquares__classify_rows(band, row);
+        for (int col = 0; col < ncols; col++) {
+            int northwest = band->north[col];
+            int northeast = band->north[col + 1];
+            int southwest = band->south[col];
+            int southeast = band->south[col + 1];
+            int corners[4] = {southwest, southeast, northwest, northeast};
+            for (int c = 0; c < 4; c++) {
+                int level = corners[c];
+                if (level < 0) {
                     continue;
                 }
-                if (in_run) {
-                    in_run = 0;
-                    int run_width = col - start_run;
-                    neliminated_triangles += run_width * 4 - 2;
+                par_msquares__level* lvl = band->levels + level;
+                if (!lvl->rowmasks) {
+                    par_msquares__init_level(lvl, march, level);
+                }
+                if (lvl->rowstamps[col] == row) {
+                    continue;
+                }
+                int code = (southwest == level) | ((southeast == level) << 1) |
+                    ((northwest == level) << 2) | ((northeast == level) << 3);
+                int const* pointspec = par_msquares_binary_point_table[code];
+                int ptspeclength = *pointspec++;
+                uint8_t mask = 0;
+                while (ptspeclength--) {
+                    mask |= 1 << *pointspec++;
+                }
+                lvl->rowmasks[col] = mask;
+                lvl->rowstamps[col] = row;
+                for (int i = 0; i < 3; i++) {
+                    lvl->rowinds[col * 3 + i] = -1 - (col * 3 + i);
+                }
+                lvl->seamcopies[col] = PAR_MSQUARES__NONE;
+                if (lvl->edgemap && par_msquares__extrudes_south(code)) {
+                    lvl->seamcopies[col] = -1 - (ncols * 3 + col);
                 }
             }
-            if (in_run) {
-                in_run = 0;
-                int run_width = ncols - start_run;
-                neliminated_triangles += run_width * 4 - 2;
+        }
+    }
+
+    // Do the march!
+    for (int row = band->row0; row < band->row1; row++) {
+        par_msquares__march_row(band, row);
+    }
+    par_msquares__finish_band(band);
+    return 0;
+}
+
+// Determines how many bands to march concurrently.  Bands always contain an
+// even number of rows, which allows simplification to ignore the seams.
+static int par_msquares__nbands(int flags, int nrows)
+{
+#if PAR_MSQUARES_THREADS
+    if (!(flags & PAR_MSQUARES_PARALLEL)) {
+        return 1;
+    }
+    int nthreads = PAR_MSQUARES_NTHREADS;
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return PAR_CLAMP(nthreads, 1, nrows / 2);
+#else
+    return 1;
+#endif
+}
+
+// Appends a mesh made from the given verts and triangles to the meshlist.  If
+// no ordering is given, the mesh takes ownership of the verts.
+static void par_msquares__add_mesh(par_msquares_meshlist* mlist,
+    float* pts, int const* order, int npts, int const* tris,
+    int const* mapping, int ntris, int nconntris, int dim)
+{
+    par_msquares__mesh* mesh = PAR_CALLOC(par_msquares__mesh, 1);
+    mesh->dim = dim;
+    mesh->npoints = npts;
+    if (order) {
+        mesh->points = PAR_MALLOC(float, npts * dim);
+        for (int i = 0; i < npts; i++) {
+            memcpy(mesh->points + i * dim, pts + order[i] * dim,
+                sizeof(float) * dim);
+        }
+    } else {
+        mesh->points = PAR_REALLOC(float, pts, PAR_MAX(npts * dim, 1));
+    }
+    mesh->ntriangles = ntris;
+    mesh->nconntriangles = nconntris;
+    mesh->triangles = PAR_MALLOC(PAR_MSQUARES_T, ntris * 3);
+    for (int i = 0; i < ntris * 3; i++) {
+        mesh->triangles[i] = mapping ? mapping[tris[i]] : tris[i];
+    }
+    mlist->meshes = PAR_REALLOC(par_msquares__mesh*, mlist->meshes,
+        mlist->nmeshes + 1);
+    mlist->meshes[mlist->nmeshes++] = mesh;
+}
+
+// Removes unreferenced verts, preserving the order of the remaining verts, and
+// returns the new number of verts.
+static int par_msquares__compact(float* pts, int npts, int* tris,
+    int nindices, int dim)
+{
+    int* mapping = PAR_MALLOC(int, npts);
+    for (int i = 0; i < npts; i++) {
+        mapping[i] = -1;
+    }
+    for (int i = 0; i < nindices; i++) {
+        mapping[tris[i]] = 0;
+    }
+    int newnpts = 0;
+    for (int i = 0; i < npts; i++) {
+        if (mapping[i] == 0) {
+            memmove(pts + newnpts * dim, pts + i * dim, sizeof(float) * dim);
+            mapping[i] = newnpts++;
+        }
+    }
+    for (int i = 0; i < nindices; i++) {
+        tris[i] = mapping[tris[i]];
+    }
+    free(mapping);
+    return newnpts;
+}
+
+// Divides a mesh with too many verts for PAR_MSQUARES_T into several meshes,
+// each of which has its own copy of the verts that it references.  Extrusion
+// triangles come in pairs and are kept together, at the end of each mesh.
+static void par_msquares__split(par_msquares_meshlist* mlist, float* pts,
+    int npts, int const* tris, int ntris, int nconntris, int dim)
+{
+    int const maxverts = PAR_MSQUARES__MAXVERTS;
+    int* mapping = PAR_MALLOC(int, npts);
+    int* stamps = PAR_MALLOC(int, npts);
+    int* order = PAR_MALLOC(int, maxverts);
+    for (int i = 0; i < npts; i++) {
+        stamps[i] = -1;
+    }
+    int ntotal = ntris + nconntris;
+    int tri = 0;
+    while (tri < ntotal) {
+        int first = tri;
+        int nverts = 0;
+        while (tri < ntotal) {
+            int end = (tri + (tri >= ntris ? 2 : 1)) * 3;
+            int needed = 0;
+            for (int i = tri * 3; i < end; i++) {
+                needed += stamps[tris[i]] != first;
             }
+            if (nverts + needed > maxverts) {
+                break;
+            }
+            for (int i = tri * 3; i < end; i++) {
+                int vert = tris[i];
+                if (stamps[vert] != first) {
+                    stamps[vert] = first;
+                    mapping[vert] = nverts;
+                    order[nverts++] = vert;
+                }
+            }
+            tri = end / 3;
         }
+        int nconn = PAR_MAX(0, tri - PAR_MAX(first, ntris));
+        par_msquares__add_mesh(mlist, pts, order, nverts, tris + first * 3,
+            mapping, tri - first, nconn, dim);
+    }
+    free(mapping);
+    free(stamps);
+    free(order);
+}
 
-        // Build a new index array cell-by-cell.  If any given cell is 'F' and
-        // its neighbor to the south is also 'F', then it's part of a run.
-        int nnewtris = ntris + nconntris - neliminated_triangles;
-        uint16_t* newtris = PAR_CALLOC(uint16_t, nnewtris * 3);
-        uint16_t* pnewtris = newtris;
-        in_run = 0;
-        for (int row = 0; row < nrows - 1; row += 2) {
-            for (int col = 0; col < ncols; col++) {
-                int cell = ncols * row + col;
-                int south = cell + ncols;
-                int a = simplification_codes[cell] == 0xf;
-                int b = simplification_codes[south] == 0xf;
-                if (a && b) {
-                    if (!in_run) {
-                        in_run = 1;
-                        start_run = col;
+// Stitches the bands of a single level into a mesh by concatenating their
+// points and triangles, offsetting their indices, and resolving references to
+// the verts along each seam.  Extrusion triangles are placed at the end.  The
+// result is appended to the given meshlist, possibly as several meshes.
+static void par_msquares__stitch(par_msquares__band* bands, int nbands,
+    int level, par_msquares_meshlist* mlist)
+{
+    par_msquares__march const* march = bands->march;
+    int const dim = march->dim;
+    int const ncols = march->ncols;
+    int npts = 0, ntris = 0, nconntris = 0;
+    for (int b = 0; b < nbands; b++) {
+        npts += bands[b].levels[level].npts;
+        ntris += bands[b].levels[level].ntris;
+        nconntris += bands[b].levels[level].nconntris;
+    }
+    float* pts;
+    int* tris;
+
+    // A single band has no seams, so its buffers can be used as they are.
+    if (nbands == 1) {
+        par_msquares__level* lvl = bands->levels + level;
+        if (nconntris) {
+            PAR_MSQUARES__GROW(int, lvl->tris, ntris * 3, lvl->maxtris,
+                nconntris * 3);
+            memcpy(lvl->tris + ntris * 3, lvl->conntris,
+                sizeof(int) * nconntris * 3);
+        }
+        pts = lvl->pts;
+        tris = lvl->tris;
+        lvl->pts = 0;
+        lvl->tris = 0;
+        lvl->maxpts = lvl->maxtris = 0;
+    } else {
+        pts = PAR_MALLOC(float, npts * dim);
+        tris = PAR_MALLOC(int, (ntris + nconntris) * 3);
+        float* ppts = pts;
+        int* ptris = tris;
+        int* pconntris = tris + ntris * 3;
+        int* offsets = PAR_CALLOC(int, nbands);
+        for (int b = 0; b < nbands; b++) {
+            par_msquares__level const* lvl = bands[b].levels + level;
+            par_msquares__level const* above = b > 0 ?
+                bands[b - 1].levels + level : 0;
+            offsets[b] = (ppts - pts) / dim;
+            memcpy(ppts, lvl->pts, sizeof(float) * lvl->npts * dim);
+            ppts += lvl->npts * dim;
+            for (int pass = 0; pass < 2; pass++) {
+                int const* src = pass ? lvl->conntris : lvl->tris;
+                int n = (pass ? lvl->nconntris : lvl->ntris) * 3;
+                int* dst = pass ? pconntris : ptris;
+                for (int i = 0; i < n; i++) {
+                    int index = src[i];
+                    if (index >= 0) {
+                        dst[i] = index + offsets[b];
+                        continue;
                     }
-                    continue;
-                }
-                if (in_run) {
-                    in_run = 0;
-                    int nw_cell = ncols * row + start_run;
-                    int ne_cell = ncols * row + col - 1;
-                    int sw_cell = nw_cell + ncols;
-                    int se_cell = ne_cell + ncols;
-                    int nw_tri = simplification_tris[nw_cell];
-                    int ne_tri = simplification_tris[ne_cell];
-                    int sw_tri = simplification_tris[sw_cell];
-                    int se_tri = simplification_tris[se_cell];
-                    int nw_corner = nw_tri * 3 + 4;
-                    int ne_corner = ne_tri * 3 + 0;
-                    int sw_corner = sw_tri * 3 + 2;
-                    int se_corner = se_tri * 3 + 1;
-                    *pnewtris++ = tris[se_corner];
-                    *pnewtris++ = tris[sw_corner];
-                    *pnewtris++ = tris[nw_corner];
-                    *pnewtris++ = tris[nw_corner];
-                    *pnewtris++ = tris[ne_corner];
-                    *pnewtris++ = tris[se_corner];
+                    int ref = -1 - index;
+                    if (ref < ncols * 3) {
+                        index = above->rowinds[ref];
+                    } else {
+                        index = above->edgemap[above->rowinds[
+                            (ref - ncols * 3) * 3 + 1]];
+                    }
+                    dst[i] = index + offsets[b - 1];
                 }
-                int ncelltris = simplification_ntris[cell];
-                int celltri = simplification_tris[cell];
-                for (int t = 0; t < ncelltris; t++, celltri++) {
-                    *pnewtris++ = tris[celltri * 3];
-                    *pnewtris++ = tris[celltri * 3 + 1];
-                    *pnewtris++ = tris[celltri * 3 + 2];
+                if (pass) {
+                    pconntris += n;
+                } else {
+                    ptris += n;
                 }
-                ncelltris = simplification_ntris[south];
-                celltri = simplification_tris[south];
-                for (int t = 0; t < ncelltris; t++, celltri++) {
-                    *pnewtris++ = tris[celltri * 3];
-                    *pnewtris++ = tris[celltri * 3 + 1];
-                    *pnewtris++ = tris[celltri * 3 + 2];
+            }
+            for (int f = 0; f < lvl->nfixups; f++) {
+                par_msquares__fixup const* fixup = lvl->fixups + f;
+                int index = above->rowinds[fixup->ref] + offsets[b - 1];
+                float* dst = pts + (offsets[b] + fixup->offset) * dim;
+                for (int d = 0; d < dim; d++) {
+                    dst[d] = pts[index * dim + d];
                 }
             }
-            if (in_run) {
-                in_run = 0;
-                int nw_cell = ncols * row + start_run;
-                int ne_cell = ncols * row + ncols - 1;
-                int sw_cell = nw_cell + ncols;
-                int se_cell = ne_cell + ncols;
-                int nw_tri = simplification_tris[nw_cell];
-                int ne_tri = simplification_tris[ne_cell];
-                int sw_tri = simplification_tris[sw_cell];
-                int se_tri = simplification_tris[se_cell];
-                int nw_corner = nw_tri * 3 + 4;
-                int ne_corner = ne_tri * 3 + 0;
-                int sw_corner = sw_tri * 3 + 2;
-                int se_corner = se_tri * 3 + 1;
-                *pnewtris++ = tris[se_corner];
-                *pnewtris++ = tris[sw_corner];
-                *pnewtris++ = tris[nw_corner];
-                *pnewtris++ = tris[nw_corner];
-                *pnewtris++ = tris[ne_corner];
-                *pnewtris++ = tris[se_corner];
+        }
+        free(offsets);
+    }
+    if (march->flags & PAR_MSQUARES_SIMPLIFY) {
+        npts = par_msquares__compact(pts, npts, tris, (ntris + nconntris) * 3,
+            dim);
+    }
+    if (npts <= PAR_MSQUARES__MAXVERTS) {
+        par_msquares__add_mesh(mlist, pts, 0, npts, tris, 0,
+            ntris + nconntris, nconntris, dim);
+    } else {
+        assert((march->flags & PAR_MSQUARES_SPLIT) &&
+            "Too many verts for PAR_MSQUARES_T");
+        par_msquares__split(mlist, pts, npts, tris, ntris, nconntris, dim);
+        free(pts);
+    }
+    free(tris);
+}
+
+static void par_msquares__free_level(par_msquares__level* lvl)
+{
+    free(lvl->pts);
+    free(lvl->tris);
+    free(lvl->conntris);
+    free(lvl->edgemap);
+    free(lvl->links);
+    free(lvl->rowmasks);
+    free(lvl->rowinds);
+    free(lvl->rowstamps);
+    free(lvl->seamcopies);
+    free(lvl->pairtris);
+    free(lvl->spans[0]);
+    free(lvl->spans[1]);
+    free(lvl->fixups);
+}
+
+// Marches all levels in a single sweep and returns a meshlist with one mesh
+// per level.
+static par_msquares_meshlist* par_msquares__march_levels(
+    par_msquares__march* march)
+{
+    assert(march->width > 0 && march->width % march->cellsize == 0);
+    assert(march->height > 0 && march->height % march->cellsize == 0);
+
+    // Create the two code tables if we haven't already.  These are tables of
+    // fixed constants, so it's embarassing that we use dynamic memory
+    // allocation for them.  However it's easy and it's one-time-only.
+    if (!par_msquares_binary_point_table) {
+        par_init_tables();
+    }
+    march->ncols = march->width / march->cellsize;
+    march->nrows = march->height / march->cellsize;
+    march->dim = (march->flags & PAR_MSQUARES_HEIGHTS) ? 3 : 2;
+    march->normalization = 1.0f / PAR_MAX(march->width, march->height);
+    int nrows = march->nrows;
+    int nlevels = march->nlevels;
+    int nbands = par_msquares__nbands(march->flags, nrows);
+    par_msquares__band* bands = PAR_CALLOC(par_msquares__band, nbands);
+    for (int b = 0; b < nbands; b++) {
+        par_msquares__band* band = bands + b;
+        band->march = march;
+        band->row0 = 2 * (nrows / 2 * b / nbands);
+        band->row1 = nrows;
+        band->levels = PAR_CALLOC(par_msquares__level, nlevels);
+        if (b > 0) {
+            bands[b - 1].row1 = band->row0;
+        }
+    }
+#if PAR_MSQUARES_THREADS
+    pthread_t* threads = PAR_MALLOC(pthread_t, nbands);
+    for (int b = 1; b < nbands; b++) {
+        pthread_create(threads + b, 0, par_msquares__march_band, bands + b);
+    }
+    par_msquares__march_band(bands);
+    for (int b = 1; b < nbands; b++) {
+        pthread_join(threads[b], 0);
+    }
+    free(threads);
+#else
+    par_msquares__march_band(bands);
+#endif
+    par_msquares_meshlist* mlist = PAR_CALLOC(par_msquares_meshlist, 1);
+    for (int level = 0; level < nlevels; level++) {
+        par_msquares__stitch(bands, nbands, level, mlist);
+    }
+    for (int b = 0; b < nbands; b++) {
+        for (int level = 0; level < nlevels; level++) {
+            par_msquares__free_level(bands[b].levels + level);
+        }
+        free(bands[b].levels);
+        free(bands[b].north);
+        free(bands[b].south);
+    }
+    free(bands);
+    return mlist;
+}
+
+// Classifies a row of corners with the classify callback.  The kernels below
+// do the same for the built-in insideness tests, without any indirect calls.
+static void par_msquares__corners_generic(int y, int* corners,
+    par_msquares__march const* march)
+{
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    int location = y * march->width;
+    for (int col = 0; col < ncols; col++) {
+        corners[col] = march->classify(location + col * cellsize, march);
+    }
+    corners[ncols] = march->classify(location + march->width - 1, march);
+}
+
+// Calls the user's insideness test directly rather than through classify.
+static void par_msquares__corners_function(int y, int* corners,
+    par_msquares__march const* march)
+{
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    int location = y * march->width;
+    int flip = march->invert ? -1 : 0;
+    for (int col = 0; col < ncols; col++) {
+        int inside = march->insidefn(location + col * cellsize, march->context);
+        corners[col] = (inside ? 0 : -1) ^ flip;
+    }
+    int inside = march->insidefn(location + march->width - 1, march->context);
+    corners[ncols] = (inside ? 0 : -1) ^ flip;
+}
+
+// The SIMD kernels compare 8 (AVX2) or 4 (SSE2, NEON) corners at a time and
+// store the comparison masks, flipped unless inverted, as corner levels.  When
+// the cells are larger than a pixel, the corners are gathered with a stride.
+static void par_msquares__corners_gray(int y, int* corners,
+    par_msquares__march const* march)
+{
+    par_gray_context const* context = (par_gray_context const*) march->context;
+    float const* data = context->data + y * march->width;
+    float threshold = context->threshold;
+    int flip = march->invert ? -1 : 0;
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    int col = 0;
+#if defined(__AVX2__)
+    __m256 t = _mm256_set1_ps(threshold);
+    __m256i f = _mm256_set1_epi32(~flip);
+    __m256i stride = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5,
+        6, 7), _mm256_set1_epi32(cellsize));
+    for (; col + 8 <= ncols; col += 8) {
+        float const* src = data + col * cellsize;
+        __m256 v = cellsize == 1 ? _mm256_loadu_ps(src) :
+            _mm256_i32gather_ps(src, stride, 4);
+        __m256i m = _mm256_castps_si256(_mm256_cmp_ps(v, t, _CMP_GT_OQ));
+        _mm256_storeu_si256((__m256i*) (corners + col), _mm256_xor_si256(m, f));
+    }
+#elif defined(__SSE2__)
+    __m128 t = _mm_set1_ps(threshold);
+    __m128i f = _mm_set1_epi32(~flip);
+    for (; col + 4 <= ncols; col += 4) {
+        float const* src = data + col * cellsize;
+        __m128 v = cellsize == 1 ? _mm_loadu_ps(src) : _mm_setr_ps(src[0],
+            src[cellsize], src[cellsize * 2], src[cellsize * 3]);
+        __m128i m = _mm_castps_si128(_mm_cmpgt_ps(v, t));
+        _mm_storeu_si128((__m128i*) (corners + col), _mm_xor_si128(m, f));
+    }
+#elif defined(__ARM_NEON)
+    float32x4_t t = vdupq_n_f32(threshold);
+    uint32x4_t f = vdupq_n_u32((uint32_t) ~flip);
+    for (; col + 4 <= ncols; col += 4) {
+        float const* src = data + col * cellsize;
+        float32x4_t v;
+        if (cellsize == 1) {
+            v = vld1q_f32(src);
+        } else {
+            float lanes[4] = {src[0], src[cellsize], src[cellsize * 2],
+                src[cellsize * 3]};
+            v = vld1q_f32(lanes);
+        }
+        uint32x4_t m = vcgtq_f32(v, t);
+        vst1q_s32(corners + col, vreinterpretq_s32_u32(veorq_u32(m, f)));
+    }
+#endif
+    for (; col < ncols; col++) {
+        corners[col] = (data[col * cellsize] > threshold ? 0 : -1) ^ flip;
+    }
+    corners[ncols] = (data[march->width - 1] > threshold ? 0 : -1) ^ flip;
+}
+
+static void par_msquares__corners_color(int y, int* corners,
+    par_msquares__march const* march)
+{
+    par_color_context const* context =
+        (par_color_context const*) march->context;
+    int const bpp = context->bpp;
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    par_byte const* data = context->data + y * march->width * bpp;
+    int flip = march->invert ? -1 : 0;
+    int col = 0;
+    if (bpp == 4) {
+        uint32_t key, pixel;
+        memcpy(&key, context->color, 4);
+#if defined(__AVX2__)
+        __m256i k = _mm256_set1_epi32((int) key);
+        __m256i f = _mm256_set1_epi32(~flip);
+        __m256i stride = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4,
+            5, 6, 7), _mm256_set1_epi32(cellsize));
+        for (; col + 8 <= ncols; col += 8) {
+            int const* src = (int const*) (data + col * cellsize * 4);
+            __m256i v = cellsize == 1 ?
+                _mm256_loadu_si256((__m256i const*) src) :
+                _mm256_i32gather_epi32(src, stride, 4);
+            __m256i m = _mm256_cmpeq_epi32(v, k);
+            _mm256_storeu_si256((__m256i*) (corners + col),
+                _mm256_xor_si256(m, f));
+        }
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+        uint32_t lanes[4];
+#if defined(__SSE2__)
+        __m128i k = _mm_set1_epi32((int) key);
+        __m128i f = _mm_set1_epi32(~flip);
+#else
+        uint32x4_t k = vdupq_n_u32(key);
+        uint32x4_t f = vdupq_n_u32((uint32_t) ~flip);
+#endif
+        for (; col + 4 <= ncols; col += 4) {
+            par_byte const* src = data + col * cellsize * 4;
+            if (cellsize > 1) {
+                for (int i = 0; i < 4; i++) {
+                    memcpy(lanes + i, src + i * cellsize * 4, 4);
+                }
+                src = (par_byte const*) lanes;
             }
+#if defined(__SSE2__)
+            __m128i v = _mm_loadu_si128((__m128i const*) src);
+            __m128i m = _mm_cmpeq_epi32(v, k);
+            _mm_storeu_si128((__m128i*) (corners + col), _mm_xor_si128(m, f));
+#else
+            uint32x4_t m = vceqq_u32(vld1q_u32((uint32_t const*) src), k);
+            vst1q_s32(corners + col, vreinterpretq_s32_u32(veorq_u32(m, f)));
+#endif
+        }
+#endif
+        for (; col < ncols; col++) {
+            memcpy(&pixel, data + col * cellsize * 4, 4);
+            corners[col] = (pixel == key ? 0 : -1) ^ flip;
+        }
+        memcpy(&pixel, data + (march->width - 1) * 4, 4);
+        corners[ncols] = (pixel == key ? 0 : -1) ^ flip;
+        return;
+    }
+    for (; col <= ncols; col++) {
+        int x = col < ncols ? col * cellsize : march->width - 1;
+        par_byte const* pixel = data + x * bpp;
+        int inside = 1;
+        for (int i = 0; i < bpp; i++) {
+            inside = inside && pixel[i] == context->color[i];
+        }
+        corners[col] = (inside ? 0 : -1) ^ flip;
+    }
+}
+
+static int par_msquares__classify_function(int location,
+    par_msquares__march const* march)
+{
+    return (march->invert ^ march->insidefn(location, march->context)) ?
+        0 : -1;
+}
+
+static int par_msquares__inside_function(int location, int level,
+    par_msquares__march const* march)
+{
+    return march->insidefn(location, march->context);
+}
+
+static int par_msquares__inside_stream(int location, int level,
+    par_msquares__march const* march);
+static int par_msquares__classify_stream(int location,
+    par_msquares__march const* march);
+static void par_msquares__corners_stream(int y, int* corners,
+    par_msquares__march const* march);
+
+// If "rowcache" is non-null, it holds the insideness of every pixel and
+// supersedes insidefn.
+static par_msquares_meshlist* par_msquares__function(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_inside_fn insidefn,
+    par_msquares_height_fn heightfn, par_msquares__corners_fn corners,
+    par_byte* rowcache)
+{
+    assert(width > 0 && width % cellsize == 0);
+    assert(height > 0 && height % cellsize == 0);
+
+    if (flags & PAR_MSQUARES_DUAL) {
+        int connect = flags & PAR_MSQUARES_CONNECT;
+        int snap = flags & PAR_MSQUARES_SNAP;
+        int heights = flags & PAR_MSQUARES_HEIGHTS;
+        if (!heights) {
+            snap = connect = 0;
+        }
+        assert(!(flags & PAR_MSQUARES_SPLIT) || !(snap | connect));
+        flags ^= PAR_MSQUARES_INVERT;
+        flags &= ~PAR_MSQUARES_DUAL;
+        flags &= ~PAR_MSQUARES_CONNECT;
+        par_msquares_meshlist* m[2];
+        m[0] = par_msquares__function(width, height, cellsize, flags,
+            context, insidefn, heightfn, corners, rowcache);
+        flags ^= PAR_MSQUARES_INVERT;
+        if (connect) {
+            flags |= PAR_MSQUARES_CONNECT;
+        }
+        m[1] = par_msquares__function(width, height, cellsize, flags,
+            context, insidefn, heightfn, corners, rowcache);
+        return par_msquares__merge(m, 2, snap | connect);
+    }
+
+    par_msquares__march march = {0};
+    march.width = width;
+    march.height = height;
+    march.cellsize = cellsize;
+    march.flags = flags;
+    march.nlevels = 1;
+    march.invert = (flags & PAR_MSQUARES_INVERT) ? 1 : 0;
+    march.classify = par_msquares__classify_function;
+    march.corners = corners;
+    march.inside = par_msquares__inside_function;
+    march.context = context;
+    march.insidefn = insidefn;
+    march.heightfn = heightfn;
+    if (rowcache) {
+        march.classify = par_msquares__classify_stream;
+        march.corners = par_msquares__corners_stream;
+        march.inside = par_msquares__inside_stream;
+        march.rowcache = rowcache;
+        march.nrowcache = height;
+    }
+    return par_msquares__march_levels(&march);
+}
+
+par_msquares_meshlist* par_msquares_function(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_inside_fn insidefn,
+    par_msquares_height_fn heightfn)
+{
+    return par_msquares__function(width, height, cellsize, flags, context,
+        insidefn, heightfn, par_msquares__corners_function, 0);
+}
+
+par_msquares_meshlist* par_msquares_function_rows(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_row_fn rowfn,
+    par_msquares_height_fn heightfn)
+{
+    assert(width > 0 && height > 0);
+    par_byte* inside = PAR_MALLOC(par_byte, width * height);
+    for (int row = 0; row < height; row++) {
+        rowfn(row, inside + row * width, context);
+    }
+    par_msquares_meshlist* mlist = par_msquares__function(width, height,
+        cellsize, flags, context, 0, heightfn, 0, inside);
+    free(inside);
+    return mlist;
+}
+
+static void par_msquares__color_context(par_color_context* context,
+    par_byte const* data, int width, int height, uint32_t color, int bpp,
+    int flags)
+{
+    context->bpp = bpp;
+    if (flags & PAR_MSQUARES_SWIZZLE) {
+        context->color[0] = (color >>  0) & 0xff;
+        context->color[1] = (color >>  8) & 0xff;
+        context->color[2] = (color >> 16) & 0xff;
+        context->color[3] = (color >> 24) & 0xff;
+    } else {
+        context->color[0] = (color >> 16) & 0xff;
+        context->color[1] = (color >>  8) & 0xff;
+        context->color[2] = (color >>  0) & 0xff;
+        context->color[3] = (color >> 24) & 0xff;
+    }
+    context->data = data;
+    context->width = width;
+    context->height = height;
+}
+
+par_msquares_meshlist* par_msquares_color(par_byte const* data, int width,
+    int height, int cellsize, uint32_t color, int bpp, int flags)
+{
+    par_color_context context;
+    par_msquares__color_context(&context, data, width, height, color, bpp,
+        flags);
+    return par_msquares__function(width, height, cellsize, flags, &context,
+        color_inside, color_height, par_msquares__corners_color, 0);
+}
+
+par_msquares_meshlist* par_msquares_grayscale(float const* data, int width,
+    int height, int cellsize, float threshold, int flags)
+{
+    par_gray_context context;
+    context.width = width;
+    context.height = height;
+    context.data = data;
+    context.threshold = threshold;
+    return par_msquares__function(width, height, cellsize, flags, &context,
+        gray_inside, gray_height, par_msquares__corners_gray, 0);
+}
+
+// Gathers the chains of a contour by following the links between its verts.
+// As with par_msquares_extract_boundary, each closed chain repeats its first
+// point at the end.
+static par_msquares_boundary* par_msquares__link_chains(
+    par_msquares__level const* lvl)
+{
+    par_msquares_boundary* result = PAR_CALLOC(par_msquares_boundary, 1);
+    int const npts = lvl->npts;
+    int const* links = lvl->links;
+    uint8_t* visited = PAR_CALLOC(uint8_t, PAR_MAX(npts, 1));
+    int nchains = 0;
+    for (int i = 0; i < npts; i++) {
+        if (visited[i] || links[i] == -1) {
+            continue;
+        }
+        for (int j = i; j > -1 && !visited[j]; j = links[j]) {
+            visited[j] = 1;
+        }
+        nchains++;
+    }
+    result->nchains = nchains;
+    result->points = PAR_MALLOC(float, 2 * (npts + nchains));
+    result->chains = PAR_MALLOC(float*, nchains);
+    result->lengths = PAR_MALLOC(PAR_MSQUARES_T, nchains);
+    memset(visited, 0, npts);
+    float* dst = result->points;
+    nchains = 0;
+    for (int i = 0; i < npts; i++) {
+        if (visited[i] || links[i] == -1) {
+            continue;
+        }
+        float* chain = dst;
+        int j = i;
+        for (; j > -1 && !visited[j]; j = links[j]) {
+            visited[j] = 1;
+            *dst++ = lvl->pts[j * 2];
+            *dst++ = lvl->pts[j * 2 + 1];
+        }
+        if (j == i) {
+            *dst++ = chain[0];
+            *dst++ = chain[1];
+        }
+        int length = (dst - chain) / 2;
+        assert(length <= PAR_MSQUARES__MAXVERTS - 1 &&
+            "Too many chain verts for PAR_MSQUARES_T");
+        result->chains[nchains] = chain;
+        result->lengths[nchains++] = length;
+    }
+    result->npoints = (dst - result->points) / 2;
+    free(visited);
+    return result;
+}
+
+static par_msquares_boundary* par_msquares__boundary(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_inside_fn insidefn,
+    par_msquares__corners_fn corners)
+{
+    assert(width > 0 && width % cellsize == 0);
+    assert(height > 0 && height % cellsize == 0);
+    if (!par_msquares_binary_point_table) {
+        par_init_tables();
+    }
+    par_msquares__march march = {0};
+    march.width = width;
+    march.height = height;
+    march.cellsize = cellsize;
+    march.flags = flags & PAR_MSQUARES_INVERT;
+    march.ncols = width / cellsize;
+    march.nrows = height / cellsize;
+    march.dim = 2;
+    march.normalization = 1.0f / PAR_MAX(width, height);
+    march.nlevels = 1;
+    march.invert = (flags & PAR_MSQUARES_INVERT) ? 1 : 0;
+    march.contour = 1;
+    march.classify = par_msquares__classify_function;
+    march.corners = corners;
+    march.inside = par_msquares__inside_function;
+    march.context = context;
+    march.insidefn = insidefn;
+
+    // Links only refer to verts within the band, so contours use one band.
+    par_msquares__level lvl = {0};
+    par_msquares__band band = {0};
+    band.march = &march;
+    band.row1 = march.nrows;
+    band.levels = &lvl;
+    par_msquares__march_band(&band);
+    par_msquares_boundary* result;
+    if (lvl.links) {
+        result = par_msquares__link_chains(&lvl);
+    } else {
+        result = PAR_CALLOC(par_msquares_boundary, 1);
+    }
+    par_msquares__free_level(&lvl);
+    free(band.north);
+    free(band.south);
+    return result;
+}
+
+par_msquares_boundary* par_msquares_function_boundary(int width, int height,
+    int cellsize, int flags, void* context, par_msquares_inside_fn insidefn)
+{
+    return par_msquares__boundary(width, height, cellsize, flags, context,
+        insidefn, par_msquares__corners_function);
+}
+
+par_msquares_boundary* par_msquares_grayscale_boundary(float const* data,
+    int width, int height, int cellsize, float threshold, int flags)
+{
+    par_gray_context context;
+    context.width = width;
+    context.height = height;
+    context.data = data;
+    context.threshold = threshold;
+    return par_msquares__boundary(width, height, cellsize, flags, &context,
+        gray_inside, par_msquares__corners_gray);
+}
+
+par_msquares_boundary* par_msquares_color_boundary(par_byte const* data,
+    int width, int height, int cellsize, uint32_t color, int bpp, int flags)
+{
+    par_color_context context;
+    par_msquares__color_context(&context, data, width, height, color, bpp,
+        flags);
+    return par_msquares__boundary(width, height, cellsize, flags, &context,
+        color_inside, par_msquares__corners_color);
+}
+
+// Clears the output and welding state of a level without freeing its buffers,
+// allowing them to be reused for the next chunk.
+static void par_msquares__reset_level(par_msquares__level* lvl, int ncols)
+{
+    if (!lvl->rowmasks) {
+        return;
+    }
+    if (lvl->edgemap) {
+        for (int i = 0; i < lvl->npts; i++) {
+            lvl->edgemap[i] = -1;
         }
-        ptris = pnewtris;
-        ntris -= neliminated_triangles;
-        free(tris);
-        tris = newtris;
-        free(simplification_codes);
-        free(simplification_tris);
-        free(simplification_ntris);
-
-        // Remove unreferenced points.
-        char* markers = PAR_CALLOC(char, npts);
-        ptris = tris;
-        int newnpts = 0;
-        for (int i = 0; i < ntris * 3; i++, ptris++) {
-            if (!markers[*ptris]) {
-                newnpts++;
-                markers[*ptris] = 1;
+    }
+    for (int col = 0; col < ncols; col++) {
+        lvl->rowstamps[col] = -2;
+    }
+    lvl->npts = lvl->ntris = lvl->nconntris = lvl->nfixups = 0;
+    lvl->prevcol = -2;
+}
+
+static int par_msquares__inside_stream(int location, int level,
+    par_msquares__march const* march)
+{
+    int y = location / march->width;
+    int x = location - y * march->width;
+    return march->rowcache[(y % march->nrowcache) * march->width + x] != 0;
+}
+
+static int par_msquares__classify_stream(int location,
+    par_msquares__march const* march)
+{
+    int inside = par_msquares__inside_stream(location, 0, march);
+    return (march->invert ^ inside) ? 0 : -1;
+}
+
+static void par_msquares__corners_stream(int y, int* corners,
+    par_msquares__march const* march)
+{
+    par_byte const* row = march->rowcache +
+        (y % march->nrowcache) * march->width;
+    int flip = march->invert ? -1 : 0;
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    for (int col = 0; col < ncols; col++) {
+        corners[col] = (row[col * cellsize] ? 0 : -1) ^ flip;
+    }
+    corners[ncols] = (row[march->width - 1] ? 0 : -1) ^ flip;
+}
+
+void par_msquares_stream(int width, int height, int cellsize, int chunksize,
+    int flags, void* context, par_msquares_row_fn rowfn,
+    par_msquares_height_fn heightfn, par_msquares_chunk_fn chunkfn)
+{
+    assert(width > 0 && width % cellsize == 0);
+    assert(height > 0 && height % cellsize == 0);
+    assert(chunksize > 0);
+    assert(!(flags & (PAR_MSQUARES_DUAL | PAR_MSQUARES_SNAP)));
+    if (!par_msquares_binary_point_table) {
+        par_init_tables();
+    }
+
+    // Cells only look at the rows along their own edges, so it suffices to
+    // cache the pixel rows spanned by a single row of cells.
+    par_msquares__march march = {0};
+    march.width = width;
+    march.height = height;
+    march.cellsize = cellsize;
+    march.flags = flags;
+    march.ncols = width / cellsize;
+    march.nrows = height / cellsize;
+    march.dim = (flags & PAR_MSQUARES_HEIGHTS) ? 3 : 2;
+    march.normalization = 1.0f / PAR_MAX(width, height);
+    march.nlevels = 1;
+    march.invert = (flags & PAR_MSQUARES_INVERT) ? 1 : 0;
+    march.classify = par_msquares__classify_stream;
+    march.corners = par_msquares__corners_stream;
+    march.inside = par_msquares__inside_stream;
+    march.context = context;
+    march.heightfn = heightfn;
+    march.nrowcache = cellsize + 1;
+    march.rowcache = PAR_MALLOC(par_byte, march.nrowcache * width);
+    par_msquares__level level = {0};
+    par_msquares__band band = {0};
+    band.march = &march;
+    band.levels = &level;
+    int nloaded = 0;
+    for (band.row0 = 0; band.row0 < march.nrows; band.row0 = band.row1) {
+        band.row1 = PAR_MIN(band.row0 + chunksize, march.nrows);
+        for (int row = band.row0; row < band.row1; row++) {
+            int lastpixel = PAR_MIN((row + 1) * cellsize, height - 1);
+            for (; nloaded <= lastpixel; nloaded++) {
+                int slot = nloaded % march.nrowcache;
+                rowfn(nloaded, march.rowcache + slot * width, context);
             }
+            par_msquares__march_row(&band, row);
         }
-        for (int i = 0; i < nconntris * 3; i++) {
-            if (!markers[conntris[i]]) {
-                newnpts++;
-                markers[conntris[i]] = 1;
-            }
+        par_msquares__finish_band(&band);
+        par_msquares_meshlist* mlist = PAR_CALLOC(par_msquares_meshlist, 1);
+        par_msquares__stitch(&band, 1, 0, mlist);
+        for (int m = 0; m < mlist->nmeshes; m++) {
+            chunkfn(par_msquares_get_mesh(mlist, m), band.row0, band.row1,
+                context);
         }
-        float* newpts = PAR_CALLOC(float, newnpts * mesh->dim);
-        uint16_t* mapping = PAR_CALLOC(uint16_t, npts);
-        ppts = pts;
-        float* pnewpts = newpts;
-        int j = 0;
-        if (mesh->dim == 3) {
-            for (int i = 0; i < npts; i++, ppts += 3) {
-                if (markers[i]) {
-                    *pnewpts++ = ppts[0];
-                    *pnewpts++ = ppts[1];
-                    *pnewpts++ = ppts[2];
-                    mapping[i] = j++;
-                }
-            }
+        par_msquares_free(mlist);
+        par_msquares__reset_level(&level, march.ncols);
+    }
+    par_msquares__free_level(&level);
+    free(band.north);
+    free(band.south);
+    free(march.rowcache);
+}
+
+static int par_msquares__inside_multi(int location, int level,
+    par_msquares__march const* march)
+{
+    par_gray_context const* context = (par_gray_context const*) march->context;
+    float val = context->data[location];
+    level += march->firstlevel;
+    float lower = level > 0 ? march->thresholds[level - 1] : -FLT_MAX;
+    float upper = level < march->nthresholds ? march->thresholds[level] :
+        FLT_MAX;
+    return val >= lower && val < upper;
+}
+
+// Finds the level of the given pixel with a binary search, which requires the
+// thresholds to be sorted.
+static int par_msquares__classify_multi(int location,
+    par_msquares__march const* march)
+{
+    par_gray_context const* context = (par_gray_context const*) march->context;
+    float val = context->data[location];
+    int lo = 0, hi = march->nthresholds;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (march->thresholds[mid] <= val) {
+            lo = mid + 1;
         } else {
-            for (int i = 0; i < npts; i++, ppts += 2) {
-                if (markers[i]) {
-                    *pnewpts++ = ppts[0];
-                    *pnewpts++ = ppts[1];
-                    mapping[i] = j++;
-                }
+            hi = mid;
+        }
+    }
+    return par_msquares__inside_multi(location, lo, march) ? lo : -1;
+}
+
+static void par_msquares__corners_multi(int y, int* corners,
+    par_msquares__march const* march)
+{
+    int const cellsize = march->cellsize;
+    int const ncols = march->ncols;
+    int location = y * march->width;
+    for (int col = 0; col < ncols; col++) {
+        corners[col] = par_msquares__classify_multi(location + col * cellsize,
+            march);
+    }
+    corners[ncols] = par_msquares__classify_multi(location + march->width - 1,
+        march);
+}
+
+static int par_msquares__classify_level(int location,
+    par_msquares__march const* march)
+{
+    return par_msquares__inside_multi(location, 0, march) ? 0 : -1;
+}
+
+// Assigns Z values to the given meshes such that the result is identical to
+// merging them one at a time with par_msquares__merge, where each merge after
+// the first performs a "connect" and the final merge performs a "snap".  Since
+// each of these merges flattens every mesh, only the range of Z values in each
+// mesh needs to be tracked along the way.
+static void par_msquares__snap_levels(par_msquares_meshlist* mlist, int snap,
+    int connect)
+{
+    if (!snap && !connect) {
+        return;
+    }
+    int nmeshes = mlist->nmeshes;
+    float* lo = PAR_MALLOC(float, nmeshes);
+    float* hi = PAR_MALLOC(float, nmeshes);
+    float* zeds = PAR_MALLOC(float, nmeshes);
+    float* markerzeds = PAR_MALLOC(float, nmeshes);
+    for (int i = 0; i < nmeshes; i++) {
+        par_msquares__mesh const* mesh = mlist->meshes[i];
+        float const* pzed = mesh->points + 2;
+        lo[i] = FLT_MAX;
+        hi[i] = -FLT_MAX;
+        for (int j = 0; j < mesh->npoints; j++, pzed += 3) {
+            lo[i] = PAR_MIN(*pzed, lo[i]);
+            hi[i] = PAR_MAX(*pzed, hi[i]);
+        }
+    }
+    int mergeconf = 0;
+    for (int k = 0; k < nmeshes; k++) {
+        mergeconf = k > 0 ? connect : 0;
+        if (k == nmeshes - 1) {
+            mergeconf |= snap;
+        }
+        if (!mergeconf) {
+            continue;
+        }
+        float zmin = FLT_MAX;
+        float zmax = -zmin;
+        for (int i = 0; i <= k; i++) {
+            zmin = PAR_MIN(lo[i], zmin);
+            zmax = PAR_MAX(hi[i], zmax);
+        }
+        float zextent = zmax - zmin;
+        for (int i = 0; i <= k; i++) {
+            zeds[i] = zmin + zextent * i / k;
+            markerzeds[i] = zeds[i];
+            if (i > 0 && (mergeconf & PAR_MSQUARES_CONNECT) &&
+                mlist->meshes[i]->nconntriangles) {
+                markerzeds[i] = zmin + zextent * (i - 1) / k;
+            }
+            if (mlist->meshes[i]->npoints) {
+                lo[i] = PAR_MIN(markerzeds[i], zeds[i]);
+                hi[i] = PAR_MAX(markerzeds[i], zeds[i]);
             }
         }
-        free(pts);
-        free(markers);
-        pts = newpts;
-        npts = newnpts;
-        for (int i = 0; i < ntris * 3; i++) {
-            tris[i] = mapping[tris[i]];
+    }
+    for (int i = 0; mergeconf && i < nmeshes; i++) {
+        par_msquares__mesh* mesh = mlist->meshes[i];
+        char* markers = PAR_CALLOC(char, mesh->npoints);
+        int tri = mesh->ntriangles - mesh->nconntriangles;
+        while (tri < mesh->ntriangles) {
+            markers[mesh->triangles[tri * 3 + 3]] = 1;
+            markers[mesh->triangles[tri * 3 + 4]] = 1;
+            tri += 2;
         }
-        for (int i = 0; i < nconntris * 3; i++) {
-            conntris[i] = mapping[conntris[i]];
+        float* pzed = mesh->points + 2;
+        for (int j = 0; j < mesh->npoints; j++, pzed += 3) {
+            *pzed = markers[j] ? markerzeds[i] : zeds[i];
         }
-        free(mapping);
+        free(markers);
     }
+    free(lo);
+    free(hi);
+    free(zeds);
+    free(markerzeds);
+}
 
-    // Append all extrusion triangles to the main triangle array.
-    // We need them to be last so that they form a contiguous sequence.
-    pconntris = conntris;
-    for (int i = 0; i < nconntris; i++) {
-        *ptris++ = *pconntris++;
-        *ptris++ = *pconntris++;
-        *ptris++ = *pconntris++;
-        ntris++;
+par_msquares_meshlist* par_msquares_grayscale_multi(float const* data,
+    int width, int height, int cellsize, float const* thresholds,
+    int nthresholds, int flags)
+{
+    int connect = flags & PAR_MSQUARES_CONNECT;
+    int snap = flags & PAR_MSQUARES_SNAP;
+    int heights = flags & PAR_MSQUARES_HEIGHTS;
+    if (!heights) {
+        snap = connect = 0;
+    }
+    assert(!(flags & PAR_MSQUARES_SPLIT) || !(snap | connect));
+    flags &= ~PAR_MSQUARES_INVERT;
+    flags &= ~PAR_MSQUARES_DUAL;
+    flags &= ~PAR_MSQUARES_CONNECT;
+    flags &= ~PAR_MSQUARES_SNAP;
+    par_gray_context context;
+    context.width = width;
+    context.height = height;
+    context.data = data;
+    par_msquares__march march = {0};
+    march.width = width;
+    march.height = height;
+    march.cellsize = cellsize;
+    march.flags = flags | connect;
+    march.firstconnect = 1;
+    march.context = &context;
+    march.heightfn = gray_height;
+    march.thresholds = thresholds;
+    march.nthresholds = nthresholds;
+    march.inside = par_msquares__inside_multi;
+    int sorted = 1;
+    for (int i = 1; i < nthresholds; i++) {
+        sorted = sorted && thresholds[i - 1] <= thresholds[i];
     }
-    free(conntris);
 
-    // Final cleanup and return.
-    assert(npts <= maxpts);
-    assert(ntris <= maxtris);
-    mesh->npoints = npts;
-    mesh->points = pts;
-    mesh->ntriangles = ntris;
-    mesh->triangles = tris;
-    mesh->nconntriangles = nconntris;
+    // If the thresholds are sorted, every pixel belongs to at most one level,
+    // so all levels can be extracted in a single sweep.  Otherwise the levels
+    // might overlap, so fall back to one sweep per level.
+    par_msquares_meshlist* mlist;
+    if (sorted) {
+        march.nlevels = nthresholds + 1;
+        march.classify = par_msquares__classify_multi;
+        march.corners = par_msquares__corners_multi;
+        mlist = par_msquares__march_levels(&march);
+    } else {
+        mlist = PAR_CALLOC(par_msquares_meshlist, 1);
+        march.nlevels = 1;
+        march.classify = par_msquares__classify_level;
+        march.corners = par_msquares__corners_generic;
+        for (int i = 0; i <= nthresholds; i++) {
+            march.firstlevel = i;
+            march.firstconnect = i > 0 ? 0 : 1;
+            par_msquares_meshlist* single = par_msquares__march_levels(&march);
+            int nmeshes = mlist->nmeshes + single->nmeshes;
+            mlist->meshes = PAR_REALLOC(par_msquares__mesh*, mlist->meshes,
+                nmeshes);
+            memcpy(mlist->meshes + mlist->nmeshes, single->meshes,
+                sizeof(par_msquares__mesh*) * single->nmeshes);
+            mlist->nmeshes = nmeshes;
+            free(single->meshes);
+            free(single);
+        }
+    }
+    par_msquares__snap_levels(mlist, snap, connect);
     return mlist;
 }
 
 typedef struct {
-    uint16_t outera;
-    uint16_t outerb;
-    uint16_t innera;
-    uint16_t innerb;
+    PAR_MSQUARES_T outera;
+    PAR_MSQUARES_T outerb;
+    PAR_MSQUARES_T innera;
+    PAR_MSQUARES_T innerb;
     char i;
     char j;
     par_msquares__mesh* mesh;
@@ -1212,15 +2586,6 @@ static par_connector* par_conn_find(par_connector* conns, int nconns,
     return 0;
 }
 
-static int par_msquares_cmp(const void *a, const void *b)
-{
-    uint32_t arg1 = *((uint32_t const*) a);
-    uint32_t arg2 = *((uint32_t const*) b);
-    if (arg1 < arg2) return -1;
-    if (arg1 > arg2) return 1;
-    return 0;
-}
-
 typedef int (*par_msquares_code_fn)(int, int, int, int, void*);
 
 static int par_msquares_multi_code(int sw, int se, int ne, int nw)
@@ -1259,7 +2624,7 @@ static uint32_t par_msquares_argb(par_byte const* pdata, int bpp)
         color |= pdata[2];
         color |= pdata[1] << 8;
         color |= pdata[0] << 16;
-        color |= pdata[3] << 24;
+        color |= (uint32_t) pdata[3] << 24;
         return color;
     }
     for (int j = 0; j < bpp; j++) {
@@ -1278,9 +2643,9 @@ static void par_msquares__finalize(par_msquares_meshlist* mlist)
     for (int m = 1; m < mlist->nmeshes; m++) {
         par_msquares__mesh* mesh = mlist->meshes[m];
         int ntris = mesh->ntriangles + mesh->nconntriangles;
-        uint16_t* triangles = PAR_CALLOC(uint16_t, ntris * 3);
-        uint16_t* dst = triangles;
-        uint16_t const* src = mesh->triangles;
+        PAR_MSQUARES_T* triangles = PAR_CALLOC(PAR_MSQUARES_T, ntris * 3);
+        PAR_MSQUARES_T* dst = triangles;
+        PAR_MSQUARES_T const* src = mesh->triangles;
         for (int t = 0; t < mesh->ntriangles; t++) {
             *dst++ = *src++;
             *dst++ = *src++;
@@ -1301,28 +2666,29 @@ static void par_msquares__finalize(par_msquares_meshlist* mlist)
     }
 }
 
-static par__uint16list* par__uint16list_create()
+static par__indexlist* par__indexlist_create()
 {
-    par__uint16list* list = PAR_CALLOC(par__uint16list, 1);
+    par__indexlist* list = PAR_CALLOC(par__indexlist, 1);
     list->count = 0;
     list->capacity = 32;
-    list->values = PAR_CALLOC(uint16_t, list->capacity);
+    list->values = PAR_CALLOC(PAR_MSQUARES_T, list->capacity);
     return list;
 }
 
-static void par__uint16list_add3(par__uint16list* list,
-    uint16_t a, uint16_t b, uint16_t c)
+static void par__indexlist_add3(par__indexlist* list,
+    PAR_MSQUARES_T a, PAR_MSQUARES_T b, PAR_MSQUARES_T c)
 {
     if (list->count + 3 > list->capacity) {
         list->capacity *= 2;
-        list->values = PAR_REALLOC(uint16_t, list->values, list->capacity);
+        list->values = PAR_REALLOC(PAR_MSQUARES_T, list->values,
+            list->capacity);
     }
     list->values[list->count++] = a;
     list->values[list->count++] = b;
     list->values[list->count++] = c;
 }
 
-static void par__uint16list_free(par__uint16list* list)
+static void par__indexlist_free(par__indexlist* list)
 {
     if (list) {
         PAR_FREE(list->values);
@@ -1330,57 +2696,226 @@ static void par__uint16list_free(par__uint16list* list)
     }
 }
 
+// Open-addressing table that maps directed edges to the triangle corner where
+// they begin.  An edge that has been split maps to its split vertex instead,
+// encoded as a negative value.
+typedef struct {
+    uint64_t* keys;
+    int* values;
+    uint32_t mask;
+} par_msquares__edgetable;
+
+static int* par_msquares__edge_find(par_msquares__edgetable* table, int a,
+    int b)
+{
+    uint64_t key = ((uint64_t) a << 32) | (uint32_t) b;
+    uint32_t h = (uint32_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & table->mask;
+    while (table->values[h] != -1 && table->keys[h] != key) {
+        h = (h + 1) & table->mask;
+    }
+    table->keys[h] = key;
+    return table->values + h;
+}
+
 static void par_msquares__repair_tjunctions(par_msquares_meshlist* mlist)
 {
     for (int m = 0; m < mlist->nmeshes; m++) {
         par_msquares__mesh* mesh = mlist->meshes[m];
-        par__uint16list* tjunctions = mesh->tjunctions;
+        par__indexlist* tjunctions = mesh->tjunctions;
         int njunctions = (int) tjunctions->count / 3;
         if (njunctions == 0) {
             continue;
         }
         int ntriangles = mesh->ntriangles + njunctions;
-        mesh->triangles = PAR_REALLOC(uint16_t, mesh->triangles,
+        mesh->triangles = PAR_REALLOC(PAR_MSQUARES_T, mesh->triangles,
             ntriangles * 3);
-        uint16_t const* jun = tjunctions->values;
-        uint16_t* new_triangles = mesh->triangles + mesh->ntriangles * 3;
+
+        // Index every directed edge by the triangle corner that starts it.
+        uint32_t capacity = 1;
+        while (capacity < (uint32_t) (ntriangles * 3 + njunctions) * 2) {
+            capacity *= 2;
+        }
+        par_msquares__edgetable table;
+        table.keys = PAR_MALLOC(uint64_t, capacity);
+        table.values = PAR_MALLOC(int, capacity);
+        table.mask = capacity - 1;
+        for (uint32_t i = 0; i < capacity; i++) {
+            table.values[i] = -1;
+        }
+        PAR_MSQUARES_T* tris = mesh->triangles;
+        for (int c = 0; c < mesh->ntriangles * 3; c++) {
+            int next = c - c % 3 + (c + 1) % 3;
+            *par_msquares__edge_find(&table, tris[c], tris[next]) = c;
+        }
+
+        // Split the triangle that owns each junction's edge.  If the edge was
+        // already split by another junction, descend into the half that
+        // contains the new vert.
+        PAR_MSQUARES_T const* jun = tjunctions->values;
+        float const* pts = mesh->points;
+        int dim = mesh->dim;
         int ncreated = 0;
         for (int j = 0; j < njunctions; j++, jun += 3) {
-            uint16_t* tri = mesh->triangles;
-            int t;
-            for (t = 0; t < mesh->ntriangles; t++, tri += 3) {
-                int i = -1;
-                if (tri[0] == jun[0] && tri[1] == jun[1]) {
-                    i = 0;
-                } else if (tri[1] == jun[0] && tri[2] == jun[1]) {
-                    i = 1;
-                } else if (tri[2] == jun[0] && tri[0] == jun[1]) {
-                    i = 2;
+            int a = jun[0], b = jun[1], v = jun[2];
+            float dx = pts[b * dim] - pts[a * dim];
+            float dy = pts[b * dim + 1] - pts[a * dim + 1];
+            float vt = dx * (pts[v * dim] - pts[a * dim]) +
+                dy * (pts[v * dim + 1] - pts[a * dim + 1]);
+            int* value = par_msquares__edge_find(&table, a, b);
+            while (*value < -1) {
+                int split = -2 - *value;
+                float st = dx * (pts[split * dim] - pts[jun[0] * dim]) +
+                    dy * (pts[split * dim + 1] - pts[jun[0] * dim + 1]);
+                if (vt < st) {
+                    b = split;
                 } else {
-                    continue;
+                    a = split;
                 }
-                new_triangles[0] = tri[(i + 0) % 3];
-                new_triangles[1] = jun[2];
-                new_triangles[2] = tri[(i + 2) % 3];
-                tri[(i + 0) % 3] = jun[2];
-                new_triangles += 3;
-                ncreated++;
-                break;
+                value = par_msquares__edge_find(&table, a, b);
             }
-            // TODO: Need to investigate the "msquares_multi_diagram.obj" test.
-            assert(t != mesh->ntriangles &&
-                "Error with T-Junction repair; please disable the CLEAN flag.");
+
+            // Every junction lies on an edge of its own mesh.
+            assert(*value != -1 && "Unmatched T-junction");
+            if (*value == -1) {
+                continue;
+            }
+            int corner = *value;
+            int t = corner / 3;
+            int i = corner % 3;
+            PAR_MSQUARES_T* tri = tris + t * 3;
+            int n = mesh->ntriangles + ncreated++;
+            PAR_MSQUARES_T* new_triangle = tris + n * 3;
+            int opposite = tri[(i + 2) % 3];
+            new_triangle[0] = a;
+            new_triangle[1] = v;
+            new_triangle[2] = opposite;
+            tri[i] = v;
+            *value = -2 - v;
+            *par_msquares__edge_find(&table, a, v) = n * 3;
+            *par_msquares__edge_find(&table, v, opposite) = n * 3 + 1;
+            *par_msquares__edge_find(&table, opposite, a) = n * 3 + 2;
+            *par_msquares__edge_find(&table, v, b) = corner;
+            *par_msquares__edge_find(&table, opposite, v) = t * 3 + (i + 2) % 3;
         }
         mesh->ntriangles += ncreated;
+        free(table.keys);
+        free(table.values);
     }
 }
 
-par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
-    int height, int cellsize, int bpp, int flags)
+static int par_msquares__cmp64(const void *a, const void *b)
 {
-    if (!par_msquares_binary_point_table) {
-        par_init_tables();
+    uint64_t arg1 = *((uint64_t const*) a);
+    uint64_t arg2 = *((uint64_t const*) b);
+    if (arg1 < arg2) return -1;
+    if (arg1 > arg2) return 1;
+    return 0;
+}
+
+// Builds a sorted palette and an image of palette indices in a single pass,
+// using an open-addressing hash table with a fast path for runs of identical
+// pixels.  Returns the number of colors.
+static int par_msquares__palette(par_byte const* data, int npixels, int bpp,
+    int* indices, uint32_t** palette)
+{
+    int capacity = 64;
+    int ncolors = 0;
+    uint32_t* keys = PAR_MALLOC(uint32_t, capacity);
+    int* slots = PAR_MALLOC(int, capacity);
+    uint32_t* colors = PAR_MALLOC(uint32_t, capacity / 2);
+    for (int i = 0; i < capacity; i++) {
+        slots[i] = -1;
+    }
+    uint32_t prevcolor = 0;
+    int previndex = -1;
+    for (int i = 0; i < npixels; i++, data += bpp) {
+        uint32_t color = par_msquares_argb(data, bpp);
+        if (color == prevcolor && previndex > -1) {
+            indices[i] = previndex;
+            continue;
+        }
+        uint32_t mask = capacity - 1;
+        uint32_t h = (color * 2654435761u) & mask;
+        while (slots[h] > -1 && keys[h] != color) {
+            h = (h + 1) & mask;
+        }
+        if (slots[h] == -1) {
+            slots[h] = ncolors;
+            keys[h] = color;
+            colors[ncolors++] = color;
+        }
+        indices[i] = previndex = slots[h];
+        prevcolor = color;
+        if (ncolors < capacity / 2) {
+            continue;
+        }
+
+        // Double the table to keep the load factor at or below one half.
+        int newcapacity = capacity * 2;
+        uint32_t* newkeys = PAR_MALLOC(uint32_t, newcapacity);
+        int* newslots = PAR_MALLOC(int, newcapacity);
+        for (int j = 0; j < newcapacity; j++) {
+            newslots[j] = -1;
+        }
+        mask = newcapacity - 1;
+        for (int j = 0; j < capacity; j++) {
+            if (slots[j] == -1) {
+                continue;
+            }
+            h = (keys[j] * 2654435761u) & mask;
+            while (newslots[h] > -1) {
+                h = (h + 1) & mask;
+            }
+            newslots[h] = slots[j];
+            newkeys[h] = keys[j];
+        }
+        free(keys);
+        free(slots);
+        keys = newkeys;
+        slots = newslots;
+        capacity = newcapacity;
+        colors = PAR_REALLOC(uint32_t, colors, capacity / 2);
+    }
+    free(keys);
+    free(slots);
+
+    // Sort the palette and remap the index image accordingly.
+    uint64_t* sorted = PAR_MALLOC(uint64_t, ncolors);
+    for (int i = 0; i < ncolors; i++) {
+        sorted[i] = ((uint64_t) colors[i] << 32) | (uint32_t) i;
+    }
+    qsort(sorted, ncolors, sizeof(uint64_t), par_msquares__cmp64);
+    int* remap = PAR_MALLOC(int, ncolors);
+    for (int i = 0; i < ncolors; i++) {
+        colors[i] = sorted[i] >> 32;
+        remap[(uint32_t) sorted[i]] = i;
+    }
+    for (int i = 0; i < npixels; i++) {
+        indices[i] = remap[indices[i]];
+    }
+    free(remap);
+    free(sorted);
+    *palette = colors;
+    return ncolors;
+}
+
+static int par_msquares__find_slot(int const* colors, int color)
+{
+    for (int c = 0; c < 4; c++) {
+        if (colors[c] == color) {
+            return c;
+        }
     }
+    return -1;
+}
+
+// Marches the cell rows in [rowbegin, rowend) of a palettized image into one
+// mesh per color.  Returns null if a mesh would have too many verts for
+// PAR_MSQUARES_T.
+static par_msquares_meshlist* par_msquares__color_rows(int const* pixels,
+    uint32_t const* colors, int ncolors, int width, int height, int cellsize,
+    int flags, int rowbegin, int rowend)
+{
     const int ncols = width / cellsize;
     const int nrows = height / cellsize;
     const int maxrow = (height - 1) * width;
@@ -1388,37 +2923,6 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
     const int dim = (flags & PAR_MSQUARES_HEIGHTS) ? 3 : 2;
     const int west_to_east[9] =   {  2, -1, -1, -1, -1, -1,  4,  3, -1 };
     const int north_to_south[9] = { -1, -1, -1, -1,  2,  1,  0, -1, -1 };
-    assert(!(flags & PAR_MSQUARES_HEIGHTS) || bpp == 4);
-    assert(bpp > 0 && bpp <= 4 && "Bytes per pixel must be 1, 2, 3, or 4.");
-    assert(!(flags & PAR_MSQUARES_CLEAN) || !(flags & PAR_MSQUARES_SIMPLIFY));
-    assert(!(flags & PAR_MSQUARES_SNAP) &&
-        "SNAP is not supported with color_multi");
-    assert(!(flags & PAR_MSQUARES_INVERT) &&
-        "INVERT is not supported with color_multi");
-    assert(!(flags & PAR_MSQUARES_DUAL) &&
-        "DUAL is not supported with color_multi");
-
-    // Find all unique colors and ensure there are no more than 256 colors.
-    uint32_t colors[256];
-    int ncolors = 0;
-    par_byte const* pdata = data;
-    for (int i = 0; i < width * height; i++, pdata += bpp) {
-        uint32_t color = par_msquares_argb(pdata, bpp);
-        if (0 == bsearch(&color, colors, ncolors, 4, par_msquares_cmp)) {
-            assert(ncolors < 256);
-            colors[ncolors++] = color;
-            qsort(colors, ncolors, sizeof(uint32_t), par_msquares_cmp);
-        }
-    }
-
-    // Convert the color image to grayscale using the mapping table.
-    par_byte* pixels = PAR_CALLOC(par_byte, width * height);
-    pdata = data;
-    for (int i = 0; i < width * height; i++, pdata += bpp) {
-        uint32_t color = par_msquares_argb(pdata, bpp);
-        void* result = bsearch(&color, colors, ncolors, 4, par_msquares_cmp);
-        pixels[i] = (uint32_t*) result - &colors[0];
-    }
 
     // Allocate 1 mesh for each color.
     par_msquares_meshlist* mlist = PAR_CALLOC(par_msquares_meshlist, 1);
@@ -1433,45 +2937,61 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
     for (int i = 0; i < ncolors; i++) {
         mesh = mlist->meshes[i] = PAR_CALLOC(par_msquares__mesh, 1);
         mesh->color = colors[i];
-        mesh->points = PAR_CALLOC(float, ncells * maxpts_per_cell * dim);
-        mesh->triangles = PAR_CALLOC(uint16_t, ncells * maxtris_per_cell * 3);
         mesh->dim = dim;
-        mesh->tjunctions = par__uint16list_create();
-        if (flags & PAR_MSQUARES_CONNECT) {
-            mesh->conntri = PAR_CALLOC(uint16_t, ncells * 8 * 3);
-        }
+        mesh->tjunctions = par__indexlist_create();
     }
 
+    // Mesh buffers grow on demand since most colors cover a small area.
+    int* capacities = PAR_CALLOC(int, ncolors * 3);
+
     // The "verts" x/y/z arrays are the 4 corners and 4 midpoints around the
     // square, in counter-clockwise order, starting at the lower-left.  The
     // ninth vert is the center point.
 
+    // Per-color state is kept in four slots per cell, one for each corner,
+    // since a cell touches at most four colors.  A color's slot is the first
+    // corner that has that color.
+
     float vertsx[9], vertsy[9];
     float normalization = 1.0f / PAR_MAX(width, height);
     float normalized_cellsize = cellsize * normalization;
-    uint8_t cella[256];
-    uint8_t cellb[256];
+    int cellcolorsa[4] = { -1, -1, -1, -1 };
+    int cellcolorsb[4] = { -1, -1, -1, -1 };
+    int* currcolors = cellcolorsa;
+    int* prevcolors = cellcolorsb;
+    uint8_t cella[4];
+    uint8_t cellb[4];
     uint8_t* currcell = cella;
     uint8_t* prevcell = cellb;
-    uint16_t inds0[256 * 9];
-    uint16_t inds1[256 * 9];
-    uint16_t* currinds = inds0;
-    uint16_t* previnds = inds1;
-    uint16_t* rowindsa = PAR_CALLOC(uint16_t, ncols * 3 * 256);
-    uint8_t* rowcellsa = PAR_CALLOC(uint8_t, ncols * 256);
-    uint16_t* rowindsb = PAR_CALLOC(uint16_t, ncols * 3 * 256);
-    uint8_t* rowcellsb = PAR_CALLOC(uint8_t, ncols * 256);
-    uint16_t* prevrowinds = rowindsa;
-    uint16_t* currrowinds = rowindsb;
+    PAR_MSQUARES_T inds0[4 * 9];
+    PAR_MSQUARES_T inds1[4 * 9];
+    PAR_MSQUARES_T* currinds = inds0;
+    PAR_MSQUARES_T* previnds = inds1;
+    PAR_MSQUARES_T* rowindsa = PAR_CALLOC(PAR_MSQUARES_T, ncols * 3 * 4);
+    uint8_t* rowcellsa = PAR_CALLOC(uint8_t, ncols * 4);
+    int* rowcolorsa = PAR_MALLOC(int, ncols * 4);
+    PAR_MSQUARES_T* rowindsb = PAR_CALLOC(PAR_MSQUARES_T, ncols * 3 * 4);
+    uint8_t* rowcellsb = PAR_CALLOC(uint8_t, ncols * 4);
+    int* rowcolorsb = PAR_MALLOC(int, ncols * 4);
+    for (int i = 0; i < ncols * 4; i++) {
+        rowcolorsa[i] = rowcolorsb[i] = -1;
+    }
+    PAR_MSQUARES_T* prevrowinds = rowindsa;
+    PAR_MSQUARES_T* currrowinds = rowindsb;
     uint8_t* prevrowcells = rowcellsa;
     uint8_t* currrowcells = rowcellsb;
-    uint32_t* simplification_words = 0;
+    int* prevrowcolors = rowcolorsa;
+    int* currrowcolors = rowcolorsb;
+    int* simplification_colors = 0;
+    uint32_t* simplification_counts = 0;
     if (flags & PAR_MSQUARES_SIMPLIFY) {
-        simplification_words = PAR_CALLOC(uint32_t, 2 * nrows * ncols);
+        simplification_colors = PAR_MALLOC(int, 4 * ncells);
+        simplification_counts = PAR_MALLOC(uint32_t, ncells);
     }
 
     // Do the march!
-    for (int row = 0; row < nrows; row++) {
+    int overflow = 0;
+    for (int row = rowbegin; row < rowend && !overflow; row++) {
         vertsx[0] = vertsx[6] = vertsx[7] = 0;
         vertsx[1] = vertsx[5] = vertsx[8] = 0.5 * normalized_cellsize;
         vertsx[2] = vertsx[3] = vertsx[4] = normalized_cellsize;
@@ -1482,7 +3002,6 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
         int southi = PAR_MIN(northi + cellsize * width, maxrow);
         int nwval = pixels[northi];
         int swval = pixels[southi];
-        memset(currrowcells, 0, ncols * 256);
 
         for (int col = 0; col < ncols; col++) {
             northi += cellsize;
@@ -1541,42 +3060,67 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
             }
             assert(ncedges < 16);
 
-            // Push triangles and points into the four affected meshes.
-            for (int m = 0; m < ncolors; m++) {
-                currcell[m] = 0;
+            // Make room in the four affected meshes.
+            for (int c = 0; c < 4; c++) {
+                int color = vals[c];
+                par_msquares__mesh* mesh = mlist->meshes[color];
+                if (mesh->npoints + maxpts_per_cell > PAR_MSQUARES__MAXVERTS) {
+                    overflow = 1;
+                }
+                int* caps = capacities + color * 3;
+                PAR_MSQUARES__GROW(float, mesh->points, mesh->npoints * dim,
+                    caps[0], maxpts_per_cell * dim);
+                PAR_MSQUARES__GROW(PAR_MSQUARES_T, mesh->triangles,
+                    mesh->ntriangles * 3, caps[1], maxtris_per_cell * 3);
+                if (flags & PAR_MSQUARES_CONNECT) {
+                    PAR_MSQUARES__GROW(PAR_MSQUARES_T, mesh->conntri,
+                        mesh->nconntriangles * 3, caps[2], 8 * 3);
+                }
+                currcolors[c] = color;
+                currcell[c] = 0;
+            }
+            if (overflow) {
+                break;
             }
-            uint32_t colors = 0;
+
+            // Push triangles and points into the four affected meshes.
             uint32_t counts = 0;
-            uint16_t* conntris_start[4];
+            PAR_MSQUARES_T* conntris_start[4];
             for (int c = 0; c < 4; c++) {
                 int color = vals[c];
-                colors |= color << (8 * c);
                 counts |= ntris[c] << (8 * c);
                 par_msquares__mesh* mesh = mlist->meshes[color];
                 float height = (mesh->color >> 24) / 255.0;
                 conntris_start[c] = mesh->conntri + mesh->nconntriangles * 3;
                 int usedpts[9] = {0};
-                uint16_t* pcurrinds = currinds + 9 * color;
-                uint16_t const* pprevinds = previnds + 9 * color;
-                uint16_t const* pprevrowinds =
-                    prevrowinds + ncols * 3 * color + col * 3;
-                uint8_t prevrowcell = prevrowcells[color * ncols + col];
+                int slot = par_msquares__find_slot(currcolors, color);
+                int prevslot = par_msquares__find_slot(prevcolors, color);
+                int rowslot = par_msquares__find_slot(
+                    prevrowcolors + col * 4, color);
+                PAR_MSQUARES_T* pcurrinds = currinds + 9 * slot;
+                PAR_MSQUARES_T const* pprevinds =
+                    previnds + 9 * PAR_MAX(prevslot, 0);
+                PAR_MSQUARES_T const* pprevrowinds =
+                    prevrowinds + (col * 4 + PAR_MAX(rowslot, 0)) * 3;
+                uint8_t prevrowcell = rowslot > -1 ?
+                    prevrowcells[col * 4 + rowslot] : 0;
+                uint8_t prevcellmask = prevslot > -1 ? prevcell[prevslot] : 0;
                 float* pdst = mesh->points + mesh->npoints * mesh->dim;
                 int previndex, prevflag;
                 for (int t = 0; t < ntris[c] * 3; t++) {
-                    uint16_t index = trispecs[c][t];
+                    PAR_MSQUARES_T index = trispecs[c][t];
                     if (usedpts[index]) {
                         continue;
                     }
                     usedpts[index] = 1;
                     if (index < 8) {
-                        currcell[color] |= 1 << index;
+                        currcell[slot] |= 1 << index;
                     }
 
                     // Vertical welding.
                     previndex = north_to_south[index];
                     prevflag = (previndex > -1) ? (1 << previndex) : 0;
-                    if (row > 0 && (prevrowcell & prevflag)) {
+                    if (row > rowbegin && (prevrowcell & prevflag)) {
                         pcurrinds[index] = pprevrowinds[previndex];
                         continue;
                     }
@@ -1584,7 +3128,7 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
                     // Horizontal welding.
                     previndex = west_to_east[index];
                     prevflag = (previndex > -1) ? (1 << previndex) : 0;
-                    if (col > 0 && (prevcell[color] & prevflag)) {
+                    if (col > 0 && (prevcellmask & prevflag)) {
                         pcurrinds[index] = pprevinds[previndex];
                         continue;
                     }
@@ -1611,7 +3155,8 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
                         }
                     } else if (index == 3) {
                         int begin = northi;
-                        for (int i = 1; i < cellsize + 1; i++) {
+                        int n = PAR_MIN(cellsize, (southi - northi) / width);
+                        for (int i = 1; i < n + 1; i++) {
                             int val = pixels[begin + i * width];
                             if (val != pixels[begin]) {
                                 vertex[1] = (1 - vertsy[4]) -
@@ -1626,30 +3171,30 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
                 uint8_t prc = prevrowcell;
                 if (usedpts[4] && !usedpts[5] && usedpts[6] && (prc & 2)) {
                     // Above cell had a middle vert, current cell straddles it.
-                    par__uint16list_add3(mesh->tjunctions,
+                    par__indexlist_add3(mesh->tjunctions,
                         pcurrinds[4], pcurrinds[6], pprevrowinds[1]);
                 } else if ((prc & 1) && !(prc & 2) && (prc & 4) && usedpts[5]) {
                     // Current cell has a middle vert, above cell straddles it.
-                    par__uint16list_add3(mesh->tjunctions,
+                    par__indexlist_add3(mesh->tjunctions,
                         pprevrowinds[0], pprevrowinds[2], pcurrinds[5]);
                 }
-                uint8_t pcc = col > 0 ? prevcell[color] : 0;
+                uint8_t pcc = col > 0 ? prevcellmask : 0;
                 if (usedpts[0] && !usedpts[7] && usedpts[6] && (pcc & 8)) {
                     // Left cell had a middle vert, current cell straddles it.
-                    par__uint16list_add3(mesh->tjunctions,
+                    par__indexlist_add3(mesh->tjunctions,
                         pcurrinds[6], pcurrinds[0], pprevinds[3]);
                 }
                 if ((pcc & 4) && !(pcc & 8) && (pcc & 16) && usedpts[7]) {
                     // Current cell has a middle vert, left cell straddles it.
-                    par__uint16list_add3(mesh->tjunctions,
+                    par__indexlist_add3(mesh->tjunctions,
                         pprevinds[2], pprevinds[4], pcurrinds[7]);
                 }
 
                 // Stamp out the cell's triangle indices for this color.
-                uint16_t* tdst = mesh->triangles + mesh->ntriangles * 3;
+                PAR_MSQUARES_T* tdst = mesh->triangles + mesh->ntriangles * 3;
                 mesh->ntriangles += ntris[c];
                 for (int t = 0; t < ntris[c] * 3; t++) {
-                    uint16_t index = trispecs[c][t];
+                    PAR_MSQUARES_T index = trispecs[c][t];
                     *tdst++ = pcurrinds[index];
                 }
 
@@ -1681,11 +3226,11 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
                         *pdst++ = height;
                     }
                     mesh->npoints++;
-                    uint16_t i0 = mesh->npoints - 1;
-                    uint16_t i1 = mesh->npoints - 2;
-                    uint16_t i2 = pcurrinds[previndex];
-                    uint16_t i3 = pcurrinds[currindex];
-                    uint16_t* ptr = mesh->conntri +
+                    PAR_MSQUARES_T i0 = mesh->npoints - 1;
+                    PAR_MSQUARES_T i1 = mesh->npoints - 2;
+                    PAR_MSQUARES_T i2 = pcurrinds[previndex];
+                    PAR_MSQUARES_T i3 = pcurrinds[currindex];
+                    PAR_MSQUARES_T* ptr = mesh->conntri +
                         mesh->nconntriangles * 3;
                     *ptr++ = i2; *ptr++ = i1; *ptr++ = i0;
                     *ptr++ = i0; *ptr++ = i3; *ptr++ = i2;
@@ -1697,13 +3242,13 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
             if (flags & PAR_MSQUARES_CONNECT) {
                 for (int c = 0; c < 4; c++) {
                     int color = vals[c];
-                    uint16_t* pconninds = conntris_start[c];
+                    PAR_MSQUARES_T* pconninds = conntris_start[c];
                     par_msquares__mesh* mesh = mlist->meshes[color];
                     for (int e = 0; e < nedges[c]; e++) {
                         int previndex = edgespecs[c][e * 2];
                         int currindex = edgespecs[c][e * 2 + 1];
-                        uint16_t i1 = pconninds[1];
-                        uint16_t i0 = pconninds[2];
+                        PAR_MSQUARES_T i1 = pconninds[1];
+                        PAR_MSQUARES_T i0 = pconninds[2];
                         par_connector const* oppedge = par_conn_find(edges,
                             ncedges, currindex, previndex);
                         if (oppedge->mesh_index > color) continue;
@@ -1725,24 +3270,23 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
 
             // Stash the bottom indices for each mesh in this cell to enable
             // vertical as-you-go welding.
-            uint8_t* pcurrrowcells = currrowcells;
-            uint16_t* pcurrrowinds = currrowinds;
-            uint16_t const* pcurrinds = currinds;
-            for (int color = 0; color < ncolors; color++) {
-                pcurrrowcells[col] = currcell[color];
-                pcurrrowcells += ncols;
-                pcurrrowinds[col * 3 + 0] = pcurrinds[0];
-                pcurrrowinds[col * 3 + 1] = pcurrinds[1];
-                pcurrrowinds[col * 3 + 2] = pcurrinds[2];
-                pcurrrowinds += ncols * 3;
+            PAR_MSQUARES_T* pcurrrowinds = currrowinds + col * 4 * 3;
+            PAR_MSQUARES_T const* pcurrinds = currinds;
+            for (int c = 0; c < 4; c++) {
+                currrowcolors[col * 4 + c] = currcolors[c];
+                currrowcells[col * 4 + c] = currcell[c];
+                pcurrrowinds[0] = pcurrinds[0];
+                pcurrrowinds[1] = pcurrinds[1];
+                pcurrrowinds[2] = pcurrinds[2];
+                pcurrrowinds += 3;
                 pcurrinds += 9;
             }
 
             // Stash some information later used by simplification.
             if (flags & PAR_MSQUARES_SIMPLIFY) {
                 int cell = col + row * ncols;
-                simplification_words[cell * 2] = colors;
-                simplification_words[cell * 2 + 1] = counts;
+                memcpy(simplification_colors + cell * 4, vals, sizeof(vals));
+                simplification_counts[cell] = counts;
             }
 
             // Advance the cursor.
@@ -1751,22 +3295,38 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
             for (int i = 0; i < 9; i++) {
                 vertsx[i] += normalized_cellsize;
             }
+            PAR_SWAP(int*, prevcolors, currcolors);
             PAR_SWAP(uint8_t*, prevcell, currcell);
-            PAR_SWAP(uint16_t*, previnds, currinds);
+            PAR_SWAP(PAR_MSQUARES_T*, previnds, currinds);
         }
+        PAR_SWAP(int*, prevrowcolors, currrowcolors);
         PAR_SWAP(uint8_t*, prevrowcells, currrowcells);
-        PAR_SWAP(uint16_t*, prevrowinds, currrowinds);
+        PAR_SWAP(PAR_MSQUARES_T*, prevrowinds, currrowinds);
+    }
+    free(rowindsa);
+    free(rowcellsa);
+    free(rowcolorsa);
+    free(rowindsb);
+    free(rowcellsb);
+    free(rowcolorsb);
+    free(capacities);
+    if (overflow) {
+        for (int m = 0; m < mlist->nmeshes; m++) {
+            par__indexlist_free(mlist->meshes[m]->tjunctions);
+            free(mlist->meshes[m]->conntri);
+        }
+        par_msquares_free(mlist);
+        free(simplification_colors);
+        free(simplification_counts);
+        return 0;
     }
-    free(prevrowinds);
-    free(prevrowcells);
-    free(pixels);
 
     if (flags & PAR_MSQUARES_CLEAN) {
         par_msquares__repair_tjunctions(mlist);
     }
     for (int m = 0; m < mlist->nmeshes; m++) {
         par_msquares__mesh* mesh = mlist->meshes[m];
-        par__uint16list_free(mesh->tjunctions);
+        par__indexlist_free(mesh->tjunctions);
     }
     if (!(flags & PAR_MSQUARES_SIMPLIFY)) {
         par_msquares__finalize(mlist);
@@ -1780,33 +3340,23 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
     // Perform quick-n-dirty simplification by iterating two rows at a time.
     // In no way does this create the simplest possible mesh, but at least it's
     // fast and easy.
-    for (uint32_t color = 0; color < (uint32_t) ncolors; color++) {
+    for (int color = 0; color < ncolors; color++) {
         par_msquares__mesh* mesh = mlist->meshes[color];
 
         // Populate the per-mesh info grids.
         int ntris = 0;
-        for (int row = 0; row < nrows; row++) {
+        for (int row = rowbegin; row < rowend; row++) {
             for (int col = 0; col < ncols; col++) {
                 int cell = ncols * row + col;
-                uint32_t colors = simplification_words[cell * 2];
-                uint32_t counts = simplification_words[cell * 2 + 1];
+                int const* colors = simplification_colors + cell * 4;
+                uint32_t counts = simplification_counts[cell];
                 int ncelltris = 0;
                 int ncorners = 0;
-                if ((colors & 0xff) == color) {
-                    ncelltris = counts & 0xff;
-                    ncorners++;
-                }
-                if (((colors >> 8) & 0xff) == color) {
-                    ncelltris += (counts >> 8) & 0xff;
-                    ncorners++;
-                }
-                if (((colors >> 16) & 0xff) == color) {
-                    ncelltris += (counts >> 16) & 0xff;
-                    ncorners++;
-                }
-                if (((colors >> 24) & 0xff) == color) {
-                    ncelltris += (counts >> 24) & 0xff;
-                    ncorners++;
+                for (int c = 0; c < 4; c++) {
+                    if (colors[c] == color) {
+                        ncelltris += (counts >> (8 * c)) & 0xff;
+                        ncorners++;
+                    }
                 }
                 simplification_ntris[cell] = ncelltris;
                 simplification_tris[cell] = ntris;
@@ -1818,7 +3368,7 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
         // First figure out how many triangles we can eliminate.
         int in_run = 0, start_run;
         int neliminated_triangles = 0;
-        for (int row = 0; row < nrows - 1; row += 2) {
+        for (int row = rowbegin; row < rowend - 1; row += 2) {
             for (int col = 0; col < ncols; col++) {
                 int cell = ncols * row + col;
                 int a = simplification_blocks[cell];
@@ -1849,11 +3399,11 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
         // Build a new index array cell-by-cell.  If any given cell is 'F' and
         // its neighbor to the south is also 'F', then it's part of a run.
         int nnewtris = mesh->ntriangles - neliminated_triangles;
-        uint16_t* newtris = PAR_CALLOC(uint16_t, nnewtris * 3);
-        uint16_t* pnewtris = newtris;
+        PAR_MSQUARES_T* newtris = PAR_CALLOC(PAR_MSQUARES_T, nnewtris * 3);
+        PAR_MSQUARES_T* pnewtris = newtris;
         in_run = 0;
-        uint16_t* tris = mesh->triangles;
-        for (int row = 0; row < nrows - 1; row += 2) {
+        PAR_MSQUARES_T* tris = mesh->triangles;
+        for (int row = rowbegin; row < rowend - 1; row += 2) {
             for (int col = 0; col < ncols; col++) {
                 int cell = ncols * row + col;
                 int south = cell + ncols;
@@ -1932,7 +3482,8 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
     free(simplification_blocks);
     free(simplification_ntris);
     free(simplification_tris);
-    free(simplification_words);
+    free(simplification_colors);
+    free(simplification_counts);
 
     par_msquares__finalize(mlist);
     for (int i = 0; i < mlist->nmeshes; i++) {
@@ -1941,6 +3492,101 @@ par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
     return mlist;
 }
 
+// Marches a range of cell rows, splitting it into bands of an even number of
+// rows while the verts of any color do not fit in PAR_MSQUARES_T.  Each color
+// gets one mesh per band in which it appears.
+static par_msquares_meshlist* par_msquares__color_bands(int const* pixels,
+    uint32_t const* colors, int ncolors, int width, int height, int cellsize,
+    int flags, int rowbegin, int rowend)
+{
+    par_msquares_meshlist* mlist = par_msquares__color_rows(pixels, colors,
+        ncolors, width, height, cellsize, flags, rowbegin, rowend);
+    if (mlist) {
+        return mlist;
+    }
+    assert((flags & PAR_MSQUARES_SPLIT) && "Too many verts for PAR_MSQUARES_T");
+    int mid = rowbegin + ((rowend - rowbegin) / 2 + 1) / 2 * 2;
+    assert(mid < rowend && "Too many verts for PAR_MSQUARES_T in a row");
+    par_msquares_meshlist* bands[2] = {
+        par_msquares__color_bands(pixels, colors, ncolors, width, height,
+            cellsize, flags, rowbegin, mid),
+        par_msquares__color_bands(pixels, colors, ncolors, width, height,
+            cellsize, flags, mid, rowend)
+    };
+
+    // Keep the meshes of each color consecutive, dropping the empty meshes of
+    // colors that are absent from a band.
+    mlist = PAR_CALLOC(par_msquares_meshlist, 1);
+    int nmeshes = bands[0]->nmeshes + bands[1]->nmeshes;
+    mlist->meshes = PAR_MALLOC(par_msquares__mesh*, nmeshes);
+    int cursors[2] = {0, 0};
+    for (int c = 0; c < ncolors; c++) {
+        int first = mlist->nmeshes;
+        par_msquares__mesh* empty = 0;
+        for (int b = 0; b < 2; b++) {
+            par_msquares_meshlist const* band = bands[b];
+            for (; cursors[b] < band->nmeshes; cursors[b]++) {
+                par_msquares__mesh* mesh = band->meshes[cursors[b]];
+                if (mesh->color != colors[c]) {
+                    break;
+                }
+                if (mesh->ntriangles > 0) {
+                    mlist->meshes[mlist->nmeshes++] = mesh;
+                    continue;
+                }
+                if (empty) {
+                    free(mesh->points);
+                    free(mesh->triangles);
+                    free(mesh);
+                } else {
+                    empty = mesh;
+                }
+            }
+        }
+        if (empty && mlist->nmeshes == first) {
+            mlist->meshes[mlist->nmeshes++] = empty;
+        } else if (empty) {
+            free(empty->points);
+            free(empty->triangles);
+            free(empty);
+        }
+    }
+    for (int b = 0; b < 2; b++) {
+        free(bands[b]->meshes);
+        free(bands[b]);
+    }
+    return mlist;
+}
+
+par_msquares_meshlist* par_msquares_color_multi(par_byte const* data, int width,
+    int height, int cellsize, int bpp, int flags)
+{
+    if (!par_msquares_binary_point_table) {
+        par_init_tables();
+    }
+    assert(!(flags & PAR_MSQUARES_HEIGHTS) || bpp == 4);
+    assert(bpp > 0 && bpp <= 4 && "Bytes per pixel must be 1, 2, 3, or 4.");
+    assert(!(flags & PAR_MSQUARES_CLEAN) || !(flags & PAR_MSQUARES_SIMPLIFY));
+    assert(!(flags & PAR_MSQUARES_SNAP) &&
+        "SNAP is not supported with color_multi");
+    assert(!(flags & PAR_MSQUARES_INVERT) &&
+        "INVERT is not supported with color_multi");
+    assert(!(flags & PAR_MSQUARES_DUAL) &&
+        "DUAL is not supported with color_multi");
+    assert(!(flags & PAR_MSQUARES_SPLIT) || !(flags & PAR_MSQUARES_CONNECT));
+
+    // Find all unique colors and convert the image to palette indices.
+    const int npixels = width * height;
+    int* pixels = PAR_MALLOC(int, npixels);
+    uint32_t* colors;
+    int ncolors = par_msquares__palette(data, npixels, bpp, pixels, &colors);
+    par_msquares_meshlist* mlist = par_msquares__color_bands(pixels, colors,
+        ncolors, width, height, cellsize, flags, 0, height / cellsize);
+    free(colors);
+    free(pixels);
+    return mlist;
+}
+
 void par_msquares_free_boundary(par_msquares_boundary* polygon)
 {
     free(polygon->points);
@@ -2007,7 +3653,7 @@ par_msquares_boundary* par_msquares_extract_boundary(
     hemesh.edges = PAR_CALLOC(par__hedge, nedges);
     par__hvert* hverts = hemesh.verts = PAR_CALLOC(par__hvert, mesh->npoints);
     par__hedge* edge = hemesh.edges;
-    uint16_t const* tri = mesh->triangles;
+    PAR_MSQUARES_T const* tri = mesh->triangles;
     for (int n = 0; n < mesh->ntriangles; n++, edge += 3, tri += 3) {
         edge[0].endvert = hverts + tri[1];
         edge[1].endvert = hverts + tri[2];
@@ -2059,7 +3705,7 @@ par_msquares_boundary* par_msquares_extract_boundary(
     result->npoints = nborders + result->nchains;
     result->points = PAR_CALLOC(float, 2 * result->npoints);
     result->chains = PAR_CALLOC(float*, result->nchains);
-    result->lengths = PAR_CALLOC(uint16_t, result->nchains);
+    result->lengths = PAR_CALLOC(PAR_MSQUARES_T, result->nchains);
 
     // Iterate over each polyline.
     edge = hemesh.sorted_edges[0];
@@ -2069,7 +3715,7 @@ par_msquares_boundary* par_msquares_extract_boundary(
     while (1) {
         float* points = result->points;
         par__hedge* orig = edge;
-        uint16_t index = edge->prev->endvert - hverts;
+        PAR_MSQUARES_T index = edge->prev->endvert - hverts;
         result->chains[nchains] = points + pt;
         result->lengths[nchains]++;
         points[pt++] = mesh->points[index * mesh->dim];
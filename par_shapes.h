@@ -92,6 +92,67 @@ typedef void (*par_shapes_fn)(float const*, float*, void*);
 par_shapes_mesh* par_shapes_create_parametric(par_shapes_fn, int slices,
     int stacks, void* userdata);
 
+// Batched flavor of par_shapes_fn, which consumes "count" 2D points and
+// produces "count" 3D points.  When PAR_SHAPES_THREADS is enabled, it can be
+// called concurrently on disjoint ranges, so it must be re-entrant.
+typedef void (*par_shapes_batch_fn)(float const* uvs, float* xyzs, int count,
+    void* userdata);
+par_shapes_mesh* par_shapes_create_parametric_batch(par_shapes_batch_fn,
+    int slices, int stacks, void* userdata);
+
+// Caller-owned destination for par_shapes_generate_parametric and
+// par_shapes_write_mesh.  Any attribute pointer can be null to skip it.
+// Strides are in bytes (zero means tightly packed), which allows writing
+// straight into an interleaved or persistently mapped vertex buffer.  The
+// index size is either 2 or 4 and does not depend on PAR_SHAPES_T.
+typedef struct par_shapes_buffers_s {
+    float* points;
+    int points_stride;
+    float* normals;
+    int normals_stride;
+    float* tcoords;
+    int tcoords_stride;
+    void* triangles;
+    int index_size;
+} par_shapes_buffers;
+
+// Obtain the number of points and triangles that par_shapes_generate_parametric
+// writes for the given tessellation levels, so that buffers can be sized.
+void par_shapes_query_parametric(int slices, int stacks, int* npoints,
+    int* ntriangles);
+
+// Evaluate a parametric surface directly into caller-owned buffers without
+// building a mesh.  Smooth normals are merged across seams and poles where the
+// surface meets itself.  Normals require points.  Returns false if the index
+// size cannot address every point.  When PAR_SHAPES_THREADS is enabled, the
+// normals are summed on several threads, with the same results as one thread.
+bool par_shapes_generate_parametric(par_shapes_fn, int slices, int stacks,
+    void* userdata, par_shapes_buffers const* dst);
+
+// Batched flavor of par_shapes_generate_parametric, which also evaluates the
+// surface on several threads when PAR_SHAPES_THREADS is enabled.
+bool par_shapes_generate_parametric_batch(par_shapes_batch_fn, int slices,
+    int stacks, void* userdata, par_shapes_buffers const* dst);
+
+// The surfaces behind the built-in generators, for use with
+// par_shapes_generate_parametric.  The torus and the trefoil knot expect a
+// pointer to their float radius as userdata.
+typedef enum {
+    PAR_SHAPES_CYLINDER,
+    PAR_SHAPES_SPHERE,
+    PAR_SHAPES_HEMISPHERE,
+    PAR_SHAPES_PLANE,
+    PAR_SHAPES_TORUS,
+    PAR_SHAPES_TREFOIL
+} par_shapes_surface;
+
+par_shapes_fn par_shapes_surface_fn(par_shapes_surface);
+
+// Copy an existing mesh into caller-owned buffers, converting the index size
+// and interleaving as requested.  Attributes that the mesh lacks are left
+// untouched.  Returns false if the index size cannot address every point.
+bool par_shapes_write_mesh(par_shapes_mesh const*, par_shapes_buffers const*);
+
 // Generate points for a 20-sided polyhedron that fits in the unit sphere.
 // Texture coordinates and normals are not generated.
 par_shapes_mesh* par_shapes_create_icosahedron();
@@ -124,6 +185,23 @@ par_shapes_mesh* par_shapes_create_rock(int seed, int nsubdivisions);
 par_shapes_mesh* par_shapes_create_lsystem(char const* program, int slices,
     int maxdepth);
 
+// Instanced output from an L-system program.  The prototype is the tube with
+// normals and texture coordinates, and each instance is a column-major 4x4
+// transform that places it.
+typedef struct par_shapes_instances_s {
+    par_shapes_mesh* prototype;
+    float* transforms;       // Flat list of 16-tuples, one per instance
+    int ninstances;
+} par_shapes_instances;
+
+// Execute an L-system program without merging any geometry, which takes time
+// linear in the number of instances.  Since instances are rigid, "connect"
+// shapes become ordinary tubes.
+par_shapes_instances* par_shapes_create_lsystem_instances(char const* program,
+    int slices, int maxdepth);
+
+void par_shapes_free_instances(par_shapes_instances*);
+
 // Queries ---------------------------------------------------------------------
 
 // Dump out a text file conforming to the venerable OBJ format.
@@ -132,6 +210,10 @@ void par_shapes_export(par_shapes_mesh const*, char const* objfile);
 // Take a pointer to 6 floats and set them to min xyz, max xyz.
 void par_shapes_compute_aabb(par_shapes_mesh const* mesh, float* aabb);
 
+// Compute the average cache miss ratio, or the number of vertex transforms
+// per triangle, for a FIFO vertex cache of the given size.
+float par_shapes_compute_acmr(par_shapes_mesh const*, int cachesize);
+
 // Make a deep copy of a mesh.  To make a brand new copy, pass null to "target".
 // To avoid memory churn, pass an existing mesh to "target".
 par_shapes_mesh* par_shapes_clone(par_shapes_mesh const* mesh,
@@ -161,13 +243,33 @@ void par_shapes_unweld(par_shapes_mesh* mesh, bool create_indices);
 // optimized mesh.  Epsilon is the maximum distance to consider when
 // welding vertices. The mapping argument can be null, or a pointer to
 // npoints integers, which gets filled with the mapping from old vertex
-// indices to new indices.
+// indices to new indices.  Surviving verts keep their relative order, along
+// with their normals and texture coordinates.  This is safe to call from
+// several threads at once.
 par_shapes_mesh* par_shapes_weld(par_shapes_mesh const*, float epsilon,
     PAR_SHAPES_T* mapping);
 
 // Compute smooth normals by averaging adjacent facet normals.
 void par_shapes_compute_normals(par_shapes_mesh* m);
 
+// Reorder triangles for the post-transform vertex cache, then reorder the
+// verts by first use for fetch locality.  The original triangle order is kept
+// if reordering would not lower the ACMR, which is typical for grid-like
+// meshes and caches smaller than their fans.  Returns the resulting ACMR.
+float par_shapes_optimize(par_shapes_mesh*, int cachesize);
+
+// Set this to 1 to compute normals and evaluate batched parametric surfaces on
+// several threads, which uses pthreads.
+#ifndef PAR_SHAPES_THREADS
+#define PAR_SHAPES_THREADS 0
+#endif
+
+// Number of threads used when PAR_SHAPES_THREADS is enabled, or 0 to match
+// the core count.
+#ifndef PAR_SHAPES_NTHREADS
+#define PAR_SHAPES_NTHREADS 0
+#endif
+
 #ifndef PAR_PI
 #define PAR_PI (3.14159265359)
 #define PAR_MIN(a, b) (a > b ? b : a)
@@ -201,6 +303,15 @@ void par_shapes_compute_normals(par_shapes_mesh* m);
 #include <math.h>
 #include <errno.h>
 
+#if PAR_SHAPES_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static void par_shapes__sphere(float const* uv, float* xyz, void*);
 static void par_shapes__hemisphere(float const* uv, float* xyz, void*);
 static void par_shapes__plane(float const* uv, float* xyz, void*);
@@ -279,6 +390,53 @@ static void par_shapes__subtract3(float* result, float const* a)
     result[2] -= a[2];
 }
 
+typedef void* (*par_shapes__job_fn)(void*);
+
+// Picks the number of jobs for splitting "nitems" across threads, such that
+// each job has at least "grain" items.
+static int par_shapes__njobs(int nitems, int grain)
+{
+#if PAR_SHAPES_THREADS
+    int nthreads = PAR_SHAPES_NTHREADS;
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return PAR_MAX(1, PAR_MIN(nthreads, nitems / grain));
+#else
+    return 1;
+#endif
+}
+
+// Runs an array of jobs, each on its own thread when threads are enabled.
+// Jobs that fail to obtain a thread run on the calling thread instead.
+static void par_shapes__run_jobs(par_shapes__job_fn fn, void* jobs, int njobs,
+    size_t jobsize)
+{
+    char* job = (char*) jobs;
+#if PAR_SHAPES_THREADS
+    pthread_t* threads = PAR_MALLOC(pthread_t, njobs);
+    int nlaunched = 1;
+    for (; nlaunched < njobs; nlaunched++) {
+        if (pthread_create(threads + nlaunched, 0, fn,
+            job + nlaunched * jobsize)) {
+            break;
+        }
+    }
+    for (int i = nlaunched; i < njobs; i++) {
+        fn(job + i * jobsize);
+    }
+    fn(job);
+    for (int i = 1; i < nlaunched; i++) {
+        pthread_join(threads[i], 0);
+    }
+    PAR_FREE(threads);
+#else
+    for (int i = 0; i < njobs; i++) {
+        fn(job + i * jobsize);
+    }
+#endif
+}
+
 static void par_shapes__add3(float* result, float const* a)
 {
     result[0] += a[0];
@@ -396,37 +554,23 @@ par_shapes_mesh* par_shapes_create_plane(int slices, int stacks)
         stacks, 0);
 }
 
-par_shapes_mesh* par_shapes_create_parametric(par_shapes_fn fn,
-    int slices, int stacks, void* userdata)
+// Allocates a parametric grid with its texture coordinates and faces, but
+// leaves the points to the caller.  The texture coordinates double as the
+// domain points that are passed to the surface function.
+static par_shapes_mesh* par_shapes__create_grid(int slices, int stacks)
 {
     par_shapes_mesh* mesh = PAR_CALLOC(par_shapes_mesh, 1);
-
-    // Generate verts.
     mesh->npoints = (slices + 1) * (stacks + 1);
     mesh->points = PAR_CALLOC(float, 3 * mesh->npoints);
-    float uv[2];
-    float xyz[3];
-    float* points = mesh->points;
-    for (int stack = 0; stack < stacks + 1; stack++) {
-        uv[0] = (float) stack / stacks;
-        for (int slice = 0; slice < slices + 1; slice++) {
-            uv[1] = (float) slice / slices;
-            fn(uv, xyz, userdata);
-            *points++ = xyz[0];
-            *points++ = xyz[1];
-            *points++ = xyz[2];
-        }
-    }
 
     // Generate texture coordinates.
     mesh->tcoords = PAR_CALLOC(float, 2 * mesh->npoints);
     float* uvs = mesh->tcoords;
     for (int stack = 0; stack < stacks + 1; stack++) {
-        uv[0] = (float) stack / stacks;
+        float u = (float) stack / stacks;
         for (int slice = 0; slice < slices + 1; slice++) {
-            uv[1] = (float) slice / slices;
-            *uvs++ = uv[0];
-            *uvs++ = uv[1];
+            *uvs++ = u;
+            *uvs++ = (float) slice / slices;
         }
     }
 
@@ -447,11 +591,393 @@ par_shapes_mesh* par_shapes_create_parametric(par_shapes_fn fn,
         }
         v += slices + 1;
     }
+    return mesh;
+}
+
+par_shapes_mesh* par_shapes_create_parametric(par_shapes_fn fn,
+    int slices, int stacks, void* userdata)
+{
+    par_shapes_mesh* mesh = par_shapes__create_grid(slices, stacks);
+    float const* uv = mesh->tcoords;
+    float* points = mesh->points;
+    for (int i = 0; i < mesh->npoints; i++, uv += 2, points += 3) {
+        fn(uv, points, userdata);
+    }
+    par_shapes__compute_welded_normals(mesh);
+    return mesh;
+}
+
+typedef struct {
+    par_shapes_batch_fn fn;
+    void* userdata;
+    float const* uvs;
+    float* points;
+    int count;
+} par_shapes__batch_job;
+
+static void* par_shapes__batch(void* arg)
+{
+    par_shapes__batch_job* job = (par_shapes__batch_job*) arg;
+    if (job->count > 0) {
+        job->fn(job->uvs, job->points, job->count, job->userdata);
+    }
+    return 0;
+}
 
+par_shapes_mesh* par_shapes_create_parametric_batch(par_shapes_batch_fn fn,
+    int slices, int stacks, void* userdata)
+{
+    par_shapes_mesh* mesh = par_shapes__create_grid(slices, stacks);
+    int njobs = par_shapes__njobs(mesh->npoints, 4096);
+    par_shapes__batch_job* jobs = PAR_MALLOC(par_shapes__batch_job, njobs);
+    for (int i = 0; i < njobs; i++) {
+        int begin = (int) ((int64_t) mesh->npoints * i / njobs);
+        int end = (int) ((int64_t) mesh->npoints * (i + 1) / njobs);
+        jobs[i].fn = fn;
+        jobs[i].userdata = userdata;
+        jobs[i].uvs = mesh->tcoords + begin * 2;
+        jobs[i].points = mesh->points + begin * 3;
+        jobs[i].count = end - begin;
+    }
+    par_shapes__run_jobs(par_shapes__batch, jobs, njobs,
+        sizeof(par_shapes__batch_job));
+    PAR_FREE(jobs);
     par_shapes__compute_welded_normals(mesh);
     return mesh;
 }
 
+void par_shapes_query_parametric(int slices, int stacks, int* npoints,
+    int* ntriangles)
+{
+    *npoints = (slices + 1) * (stacks + 1);
+    *ntriangles = 2 * slices * stacks;
+}
+
+par_shapes_fn par_shapes_surface_fn(par_shapes_surface surface)
+{
+    switch (surface) {
+    case PAR_SHAPES_CYLINDER: return par_shapes__cylinder;
+    case PAR_SHAPES_SPHERE: return par_shapes__sphere;
+    case PAR_SHAPES_HEMISPHERE: return par_shapes__hemisphere;
+    case PAR_SHAPES_PLANE: return par_shapes__plane;
+    case PAR_SHAPES_TORUS: return par_shapes__torus;
+    case PAR_SHAPES_TREFOIL: return par_shapes__trefoil;
+    }
+    return 0;
+}
+
+// Copies the buffer descriptor, replacing zero strides with packed strides.
+static bool par_shapes__resolve_buffers(par_shapes_buffers* buf,
+    par_shapes_buffers const* dst, int npoints)
+{
+    *buf = *dst;
+    if (!buf->points_stride) {
+        buf->points_stride = 3 * sizeof(float);
+    }
+    if (!buf->normals_stride) {
+        buf->normals_stride = 3 * sizeof(float);
+    }
+    if (!buf->tcoords_stride) {
+        buf->tcoords_stride = 2 * sizeof(float);
+    }
+    if (!buf->triangles) {
+        return true;
+    }
+    return buf->index_size == 4 || (buf->index_size == 2 && npoints <= 65536);
+}
+
+static float* par_shapes__attrib(float* base, int stride, int index)
+{
+    return (float*) ((char*) base + (size_t) stride * index);
+}
+
+static void par_shapes__write_index(par_shapes_buffers const* buf, int i,
+    int value)
+{
+    if (buf->index_size == 2) {
+        ((uint16_t*) buf->triangles)[i] = (uint16_t) value;
+    } else {
+        ((uint32_t*) buf->triangles)[i] = (uint32_t) value;
+    }
+}
+
+#define PAR_SHAPES__POINT(buf, i) \
+    par_shapes__attrib(buf->points, buf->points_stride, i)
+#define PAR_SHAPES__NORMAL(buf, i) \
+    par_shapes__attrib(buf->normals, buf->normals_stride, i)
+
+// Computes the facet normal of the given triangle in the grid, in the same way
+// as par_shapes_compute_normals.  Each quad holds two triangles.
+static void par_shapes__grid_facet(par_shapes_buffers const* buf, int slices,
+    int stack, int slice, int upper, float* facet)
+{
+    int const row = slices + 1;
+    int v = stack * row + slice;
+    int ia = v + row;
+    int ib = upper ? v + 1 + row : v + 1;
+    int ic = upper ? v + 1 : v;
+    float const* pa = PAR_SHAPES__POINT(buf, ia);
+    float next[3], prev[3];
+    par_shapes__copy3(next, PAR_SHAPES__POINT(buf, ib));
+    par_shapes__subtract3(next, pa);
+    par_shapes__copy3(prev, PAR_SHAPES__POINT(buf, ic));
+    par_shapes__subtract3(prev, pa);
+    par_shapes__cross3(facet, next, prev);
+}
+
+static bool par_shapes__colocated(par_shapes_buffers const* buf, int a, int b)
+{
+    float const* pa = PAR_SHAPES__POINT(buf, a);
+    float const* pb = PAR_SHAPES__POINT(buf, b);
+    return par_shapes__sqrdist3(pa, pb) < 1e-8f;
+}
+
+// If an entire edge of the grid has collapsed to a single point (e.g. the pole
+// of a sphere), give every vertex along it the sum of their normals.
+static void par_shapes__merge_pole(par_shapes_buffers const* buf, int first,
+    int step, int count)
+{
+    float sum[3] = {0, 0, 0};
+    for (int i = 0; i < count; i++) {
+        if (!par_shapes__colocated(buf, first, first + i * step)) {
+            return;
+        }
+        par_shapes__add3(sum, PAR_SHAPES__NORMAL(buf, first + i * step));
+    }
+    for (int i = 0; i < count; i++) {
+        par_shapes__copy3(PAR_SHAPES__NORMAL(buf, first + i * step), sum);
+    }
+}
+
+// Sum the normals of colocated vertex pairs on opposite edges of the grid.
+static void par_shapes__merge_seam(par_shapes_buffers const* buf, int a,
+    int b, int step, int count)
+{
+    float sum[3];
+    for (int i = 0; i < count; i++, a += step, b += step) {
+        if (par_shapes__colocated(buf, a, b)) {
+            par_shapes__copy3(sum, PAR_SHAPES__NORMAL(buf, a));
+            par_shapes__add3(sum, PAR_SHAPES__NORMAL(buf, b));
+            par_shapes__copy3(PAR_SHAPES__NORMAL(buf, a), sum);
+            par_shapes__copy3(PAR_SHAPES__NORMAL(buf, b), sum);
+        }
+    }
+}
+
+// Each job evaluates a range of grid rows, then sums the facet normals around
+// each of their verts.  The facets are visited in ascending order, so the sums
+// do not depend on the number of jobs.
+typedef struct {
+    par_shapes_fn fn;
+    par_shapes_batch_fn batchfn;
+    void* userdata;
+    par_shapes_buffers const* buf;
+    int slices;
+    int stacks;
+    int begin;
+    int end;
+} par_shapes__grid_job;
+
+#define PAR_SHAPES__BLOCK 256
+
+static void* par_shapes__evaluate_grid(void* arg)
+{
+    par_shapes__grid_job* job = (par_shapes__grid_job*) arg;
+    par_shapes_buffers const* buf = job->buf;
+    int const row = job->slices + 1;
+    int const end = job->end * row;
+    float uv[PAR_SHAPES__BLOCK * 2], xyz[PAR_SHAPES__BLOCK * 3];
+    bool packed = buf->points_stride == 3 * sizeof(float);
+    for (int v = job->begin * row; v < end; v += PAR_SHAPES__BLOCK) {
+        int count = PAR_MIN(PAR_SHAPES__BLOCK, end - v);
+        for (int i = 0; i < count; i++) {
+            uv[i * 2] = (float) ((v + i) / row) / job->stacks;
+            uv[i * 2 + 1] = (float) ((v + i) % row) / job->slices;
+            if (buf->tcoords) {
+                float* tc = par_shapes__attrib(buf->tcoords,
+                    buf->tcoords_stride, v + i);
+                tc[0] = uv[i * 2];
+                tc[1] = uv[i * 2 + 1];
+            }
+        }
+        if (!buf->points) {
+            continue;
+        }
+        if (job->fn) {
+            for (int i = 0; i < count; i++) {
+                job->fn(uv + i * 2, PAR_SHAPES__POINT(buf, v + i),
+                    job->userdata);
+            }
+            continue;
+        }
+        if (packed) {
+            job->batchfn(uv, PAR_SHAPES__POINT(buf, v), count, job->userdata);
+            continue;
+        }
+        job->batchfn(uv, xyz, count, job->userdata);
+        for (int i = 0; i < count; i++) {
+            par_shapes__copy3(PAR_SHAPES__POINT(buf, v + i), xyz + i * 3);
+        }
+    }
+    return 0;
+}
+
+static void par_shapes__add_facet(par_shapes__grid_job const* job, int stack,
+    int slice, int upper, float* normal)
+{
+    float facet[3];
+    par_shapes__grid_facet(job->buf, job->slices, stack, slice, upper, facet);
+    par_shapes__add3(normal, facet);
+}
+
+static void* par_shapes__grid_normals(void* arg)
+{
+    par_shapes__grid_job* job = (par_shapes__grid_job*) arg;
+    int const slices = job->slices, stacks = job->stacks;
+    for (int stack = job->begin; stack < job->end; stack++) {
+        for (int slice = 0; slice <= slices; slice++) {
+            float* normal = PAR_SHAPES__NORMAL(job->buf,
+                stack * (slices + 1) + slice);
+            normal[0] = normal[1] = normal[2] = 0;
+            if (stack > 0 && slice > 0) {
+                par_shapes__add_facet(job, stack - 1, slice - 1, 1, normal);
+            }
+            if (stack > 0 && slice < slices) {
+                par_shapes__add_facet(job, stack - 1, slice, 0, normal);
+                par_shapes__add_facet(job, stack - 1, slice, 1, normal);
+            }
+            if (stack < stacks && slice > 0) {
+                par_shapes__add_facet(job, stack, slice - 1, 0, normal);
+                par_shapes__add_facet(job, stack, slice - 1, 1, normal);
+            }
+            if (stack < stacks && slice < slices) {
+                par_shapes__add_facet(job, stack, slice, 0, normal);
+            }
+        }
+    }
+    return 0;
+}
+
+static bool par_shapes__generate_grid(par_shapes__grid_job job,
+    par_shapes_buffers const* dst, int njobs)
+{
+    int const slices = job.slices, stacks = job.stacks;
+    int npoints, ntriangles;
+    par_shapes_query_parametric(slices, stacks, &npoints, &ntriangles);
+    par_shapes_buffers resolved;
+    par_shapes_buffers const* buf = &resolved;
+    if (slices < 1 || stacks < 1 || (dst->normals && !dst->points) ||
+        !par_shapes__resolve_buffers(&resolved, dst, npoints)) {
+        return false;
+    }
+
+    // Generate verts and texture coordinates.  Only batched surfaces are
+    // required to be re-entrant.
+    njobs = PAR_MIN(njobs, stacks + 1);
+    par_shapes__grid_job* jobs = PAR_MALLOC(par_shapes__grid_job, njobs);
+    job.buf = buf;
+    for (int i = 0; i < njobs; i++) {
+        jobs[i] = job;
+        jobs[i].begin = (stacks + 1) * i / njobs;
+        jobs[i].end = (stacks + 1) * (i + 1) / njobs;
+    }
+    if (job.fn) {
+        job.begin = 0;
+        job.end = stacks + 1;
+        par_shapes__evaluate_grid(&job);
+    } else {
+        par_shapes__run_jobs(par_shapes__evaluate_grid, jobs, njobs,
+            sizeof(par_shapes__grid_job));
+    }
+
+    // Generate faces, using the same winding as par_shapes_create_parametric.
+    int const row = slices + 1;
+    if (buf->triangles) {
+        int i = 0, v = 0;
+        for (int stack = 0; stack < stacks; stack++, v += row) {
+            for (int slice = 0; slice < slices; slice++) {
+                int next = slice + 1;
+                par_shapes__write_index(buf, i++, v + slice + row);
+                par_shapes__write_index(buf, i++, v + next);
+                par_shapes__write_index(buf, i++, v + slice);
+                par_shapes__write_index(buf, i++, v + slice + row);
+                par_shapes__write_index(buf, i++, v + next + row);
+                par_shapes__write_index(buf, i++, v + next);
+            }
+        }
+    }
+
+    // Sum facet normals in place, then merge them across the poles and seams
+    // rather than welding a temporary copy of the mesh.
+    if (buf->normals) {
+        par_shapes__run_jobs(par_shapes__grid_normals, jobs, njobs,
+            sizeof(par_shapes__grid_job));
+        par_shapes__merge_pole(buf, 0, 1, row);
+        par_shapes__merge_pole(buf, stacks * row, 1, row);
+        par_shapes__merge_pole(buf, 0, row, stacks + 1);
+        par_shapes__merge_pole(buf, slices, row, stacks + 1);
+        par_shapes__merge_seam(buf, 0, slices, row, stacks + 1);
+        par_shapes__merge_seam(buf, 0, stacks * row, 1, row);
+        for (int v = 0; v < npoints; v++) {
+            par_shapes__normalize3(PAR_SHAPES__NORMAL(buf, v));
+        }
+    }
+    PAR_FREE(jobs);
+    return true;
+}
+
+bool par_shapes_generate_parametric(par_shapes_fn fn, int slices, int stacks,
+    void* userdata, par_shapes_buffers const* dst)
+{
+    par_shapes__grid_job job = {fn, 0, userdata, 0, slices, stacks};
+    int npoints = (slices + 1) * (stacks + 1);
+    return par_shapes__generate_grid(job, dst, par_shapes__njobs(npoints,
+        4096));
+}
+
+bool par_shapes_generate_parametric_batch(par_shapes_batch_fn fn, int slices,
+    int stacks, void* userdata, par_shapes_buffers const* dst)
+{
+    par_shapes__grid_job job = {0, fn, userdata, 0, slices, stacks};
+    int npoints = (slices + 1) * (stacks + 1);
+    return par_shapes__generate_grid(job, dst, par_shapes__njobs(npoints,
+        4096));
+}
+
+bool par_shapes_write_mesh(par_shapes_mesh const* mesh,
+    par_shapes_buffers const* dst)
+{
+    par_shapes_buffers resolved;
+    par_shapes_buffers const* buf = &resolved;
+    if (!par_shapes__resolve_buffers(&resolved, dst, mesh->npoints)) {
+        return false;
+    }
+    for (int i = 0; i < mesh->npoints; i++) {
+        if (buf->points) {
+            par_shapes__copy3(PAR_SHAPES__POINT(buf, i), mesh->points + i * 3);
+        }
+        if (buf->normals && mesh->normals) {
+            par_shapes__copy3(PAR_SHAPES__NORMAL(buf, i),
+                mesh->normals + i * 3);
+        }
+        if (buf->tcoords && mesh->tcoords) {
+            float* tc = par_shapes__attrib(buf->tcoords, buf->tcoords_stride,
+                i);
+            tc[0] = mesh->tcoords[i * 2];
+            tc[1] = mesh->tcoords[i * 2 + 1];
+        }
+    }
+    if (buf->triangles) {
+        for (int i = 0; i < mesh->ntriangles * 3; i++) {
+            par_shapes__write_index(buf, i, mesh->triangles[i]);
+        }
+    }
+    return true;
+}
+
+#undef PAR_SHAPES__POINT
+#undef PAR_SHAPES__NORMAL
+
 void par_shapes_free_mesh(par_shapes_mesh* mesh)
 {
     PAR_FREE(mesh->points);
@@ -1136,8 +1662,32 @@ static void par_shapes__connect(par_shapes_mesh* scene,
     scene->ntriangles = ntriangles;
 }
 
-par_shapes_mesh* par_shapes_create_lsystem(char const* text, int slices,
-    int maxdepth)
+// Appends the transform that par_shapes__apply_turtle would apply.
+static void par_shapes__add_instance(par_shapes_instances* instances,
+    int* capacity, par_shapes_mesh const* turtle, float const* pos,
+    float const* scale)
+{
+    if (instances->ninstances == *capacity) {
+        *capacity = PAR_MAX(16, *capacity * 2);
+        instances->transforms = PAR_REALLOC(float, instances->transforms,
+            *capacity * 16);
+    }
+    float* m = instances->transforms + instances->ninstances++ * 16;
+    for (int c = 0; c < 3; c++) {
+        for (int r = 0; r < 3; r++) {
+            m[c * 4 + r] = turtle->points[r * 3 + c] * scale[c];
+        }
+        m[c * 4 + 3] = 0;
+        m[12 + c] = pos[c];
+    }
+    m[15] = 1;
+}
+
+// Executes an L-system program, either merging tubes into the scene or, if
+// instances is non-null, recording their transforms.
+static void par_shapes__run_lsystem(char const* text, int slices,
+    int maxdepth, par_shapes_mesh* tube, par_shapes_mesh* scene,
+    par_shapes_instances* instances)
 {
     char* program;
     program = PAR_MALLOC(char, strlen(text) + 1);
@@ -1214,18 +1764,8 @@ par_shapes_mesh* par_shapes_create_lsystem(char const* text, int slices,
     }
     #endif
 
-    // Instantiate the aggregated shape and the template shapes.
-    par_shapes_mesh* scene = PAR_CALLOC(par_shapes_mesh, 1);
-    par_shapes_mesh* tube = par_shapes_create_cylinder(slices, 1);
     par_shapes_mesh* turtle = par_shapes__create_turtle();
-
-    // We're not attempting to support texture coordinates and normals
-    // with L-systems, so remove them from the template shape.
-    PAR_FREE(tube->normals);
-    PAR_FREE(tube->tcoords);
-    tube->normals = 0;
-    tube->tcoords = 0;
-
+    int capacity = 0;
     const float xaxis[] = {1, 0, 0};
     const float yaxis[] = {0, 1, 0};
     const float zaxis[] = {0, 0, 1};
@@ -1257,7 +1797,10 @@ par_shapes_mesh* par_shapes_create_lsystem(char const* text, int slices,
         #endif
 
         float value;
-        if (!strcmp(cmd->cmd, "shape")) {
+        if (!strcmp(cmd->cmd, "shape") && instances) {
+            par_shapes__add_instance(instances, &capacity, turtle, position,
+                scale);
+        } else if (!strcmp(cmd->cmd, "shape")) {
             par_shapes_mesh* m = par_shapes__apply_turtle(tube, turtle,
                 position, scale);
             if (!strcmp(cmd->arg, "connect")) {
@@ -1324,9 +1867,43 @@ par_shapes_mesh* par_shapes_create_lsystem(char const* text, int slices,
     PAR_FREE(program);
     PAR_FREE(rules);
     PAR_FREE(commands);
+}
+
+par_shapes_mesh* par_shapes_create_lsystem(char const* text, int slices,
+    int maxdepth)
+{
+    par_shapes_mesh* scene = PAR_CALLOC(par_shapes_mesh, 1);
+    par_shapes_mesh* tube = par_shapes_create_cylinder(slices, 1);
+
+    // We're not attempting to support texture coordinates and normals
+    // with L-systems, so remove them from the template shape.
+    PAR_FREE(tube->normals);
+    PAR_FREE(tube->tcoords);
+    tube->normals = 0;
+    tube->tcoords = 0;
+
+    par_shapes__run_lsystem(text, slices, maxdepth, tube, scene, 0);
+    par_shapes_free_mesh(tube);
     return scene;
 }
 
+par_shapes_instances* par_shapes_create_lsystem_instances(char const* text,
+    int slices, int maxdepth)
+{
+    par_shapes_instances* instances = PAR_CALLOC(par_shapes_instances, 1);
+    instances->prototype = par_shapes_create_cylinder(slices, 1);
+    par_shapes__run_lsystem(text, slices, maxdepth, instances->prototype, 0,
+        instances);
+    return instances;
+}
+
+void par_shapes_free_instances(par_shapes_instances* instances)
+{
+    par_shapes_free_mesh(instances->prototype);
+    PAR_FREE(instances->transforms);
+    PAR_FREE(instances);
+}
+
 void par_shapes_unweld(par_shapes_mesh* mesh, bool create_indices)
 {
     int npoints = mesh->ntriangles * 3;
@@ -1353,39 +1930,162 @@ void par_shapes_unweld(par_shapes_mesh* mesh, bool create_indices)
     }
 }
 
-void par_shapes_compute_normals(par_shapes_mesh* m)
+// A single job scatters each facet normal into the normals of its corners.
+// Several jobs instead store the facet normals, then gather them for a range
+// of points in order of ascending triangle, which yields the same sums as
+// scattering regardless of the number of jobs.
+typedef struct {
+    par_shapes_mesh* mesh;
+    int begin;
+    int end;
+    float* facets;
+    int const* offsets;
+    int const* adjacency;
+} par_shapes__normals_job;
+
+static void par_shapes__emit_facet(par_shapes__normals_job const* job, int f,
+    PAR_SHAPES_T const* triangle, float x, float y, float z)
+{
+    if (job->facets) {
+        float* facet = job->facets + 3 * f;
+        facet[0] = x;
+        facet[1] = y;
+        facet[2] = z;
+        return;
+    }
+    for (int c = 0; c < 3; c++) {
+        float* sum = job->mesh->normals + 3 * triangle[c];
+        sum[0] += x;
+        sum[1] += y;
+        sum[2] += z;
+    }
+}
+
+#if defined(__SSE2__)
+static __m128 par_shapes__gather(float const* const* p, int corner, int c)
 {
-    PAR_FREE(m->normals);
-    m->normals = PAR_CALLOC(float, m->npoints * 3);
-    PAR_SHAPES_T const* triangle = m->triangles;
+    return _mm_setr_ps(p[corner][c], p[corner + 3][c], p[corner + 6][c],
+        p[corner + 9][c]);
+}
+#endif
+
+static void* par_shapes__accumulate_facets(void* arg)
+{
+    par_shapes__normals_job* job = (par_shapes__normals_job*) arg;
+    par_shapes_mesh const* m = job->mesh;
+    PAR_SHAPES_T const* triangle = m->triangles + job->begin * 3;
+    int f = job->begin;
+#if defined(__SSE2__)
+
+    // Compute the cross products for four triangles at a time.
+    float const* p[12];
+    float x[4], y[4], z[4];
+    for (; f + 4 <= job->end; f += 4, triangle += 12) {
+        for (int i = 0; i < 12; i++) {
+            p[i] = m->points + 3 * triangle[i];
+        }
+        __m128 ax = par_shapes__gather(p, 0, 0);
+        __m128 ay = par_shapes__gather(p, 0, 1);
+        __m128 az = par_shapes__gather(p, 0, 2);
+        __m128 ux = _mm_sub_ps(par_shapes__gather(p, 1, 0), ax);
+        __m128 uy = _mm_sub_ps(par_shapes__gather(p, 1, 1), ay);
+        __m128 uz = _mm_sub_ps(par_shapes__gather(p, 1, 2), az);
+        __m128 vx = _mm_sub_ps(par_shapes__gather(p, 2, 0), ax);
+        __m128 vy = _mm_sub_ps(par_shapes__gather(p, 2, 1), ay);
+        __m128 vz = _mm_sub_ps(par_shapes__gather(p, 2, 2), az);
+        _mm_storeu_ps(x, _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(uz, vy)));
+        _mm_storeu_ps(y, _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(ux, vz)));
+        _mm_storeu_ps(z, _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(uy, vx)));
+        for (int t = 0; t < 4; t++) {
+            par_shapes__emit_facet(job, f + t, triangle + t * 3, x[t], y[t],
+                z[t]);
+        }
+    }
+#endif
     float next[3], prev[3], cp[3];
-    for (int f = 0; f < m->ntriangles; f++, triangle += 3) {
+    for (; f < job->end; f++, triangle += 3) {
         float const* pa = m->points + 3 * triangle[0];
-        float const* pb = m->points + 3 * triangle[1];
-        float const* pc = m->points + 3 * triangle[2];
-        par_shapes__copy3(next, pb);
+        par_shapes__copy3(next, m->points + 3 * triangle[1]);
         par_shapes__subtract3(next, pa);
-        par_shapes__copy3(prev, pc);
+        par_shapes__copy3(prev, m->points + 3 * triangle[2]);
         par_shapes__subtract3(prev, pa);
         par_shapes__cross3(cp, next, prev);
-        par_shapes__add3(m->normals + 3 * triangle[0], cp);
-        par_shapes__copy3(next, pc);
-        par_shapes__subtract3(next, pb);
-        par_shapes__copy3(prev, pa);
-        par_shapes__subtract3(prev, pb);
-        par_shapes__cross3(cp, next, prev);
-        par_shapes__add3(m->normals + 3 * triangle[1], cp);
-        par_shapes__copy3(next, pa);
-        par_shapes__subtract3(next, pc);
-        par_shapes__copy3(prev, pb);
-        par_shapes__subtract3(prev, pc);
-        par_shapes__cross3(cp, next, prev);
-        par_shapes__add3(m->normals + 3 * triangle[2], cp);
+        par_shapes__emit_facet(job, f, triangle, cp[0], cp[1], cp[2]);
     }
-    float* normal = m->normals;
-    for (int p = 0; p < m->npoints; p++, normal += 3) {
+    return 0;
+}
+
+static void* par_shapes__gather_normals(void* arg)
+{
+    par_shapes__normals_job* job = (par_shapes__normals_job*) arg;
+    float* normal = job->mesh->normals + job->begin * 3;
+    for (int p = job->begin; p < job->end; p++, normal += 3) {
+        for (int a = job->offsets[p]; a < job->offsets[p + 1]; a++) {
+            par_shapes__add3(normal, job->facets + 3 * job->adjacency[a]);
+        }
         par_shapes__normalize3(normal);
     }
+    return 0;
+}
+
+static void par_shapes__compute_normals(par_shapes_mesh* m, int njobs)
+{
+    PAR_FREE(m->normals);
+    m->normals = PAR_CALLOC(float, m->npoints * 3);
+    par_shapes__normals_job job = {m, 0, m->ntriangles, 0, 0, 0};
+    if (njobs == 1) {
+        par_shapes__accumulate_facets(&job);
+        for (int p = 0; p < m->npoints; p++) {
+            par_shapes__normalize3(m->normals + p * 3);
+        }
+        return;
+    }
+
+    // Build the point-to-triangle adjacency in compressed form, with the
+    // triangles of each point in ascending order.
+    int nindices = m->ntriangles * 3;
+    int noffsets = m->npoints + 1;
+    int* offsets = PAR_CALLOC(int, noffsets);
+    int* adjacency = PAR_MALLOC(int, nindices);
+    for (int i = 0; i < nindices; i++) {
+        offsets[m->triangles[i] + 1]++;
+    }
+    for (int p = 0; p < m->npoints; p++) {
+        offsets[p + 1] += offsets[p];
+    }
+    int* fill = PAR_MALLOC(int, m->npoints);
+    memcpy(fill, offsets, sizeof(int) * m->npoints);
+    for (int i = 0; i < nindices; i++) {
+        adjacency[fill[m->triangles[i]]++] = i / 3;
+    }
+    PAR_FREE(fill);
+    par_shapes__normals_job* jobs = PAR_MALLOC(par_shapes__normals_job,
+        njobs);
+    job.facets = PAR_MALLOC(float, nindices);
+    job.offsets = offsets;
+    job.adjacency = adjacency;
+    for (int i = 0; i < njobs; i++) {
+        jobs[i] = job;
+        jobs[i].begin = (int) ((int64_t) m->ntriangles * i / njobs);
+        jobs[i].end = (int) ((int64_t) m->ntriangles * (i + 1) / njobs);
+    }
+    par_shapes__run_jobs(par_shapes__accumulate_facets, jobs, njobs,
+        sizeof(par_shapes__normals_job));
+    for (int i = 0; i < njobs; i++) {
+        jobs[i].begin = (int) ((int64_t) m->npoints * i / njobs);
+        jobs[i].end = (int) ((int64_t) m->npoints * (i + 1) / njobs);
+    }
+    par_shapes__run_jobs(par_shapes__gather_normals, jobs, njobs,
+        sizeof(par_shapes__normals_job));
+    PAR_FREE(jobs);
+    PAR_FREE(job.facets);
+    PAR_FREE(adjacency);
+    PAR_FREE(offsets);
+}
+
+void par_shapes_compute_normals(par_shapes_mesh* m)
+{
+    par_shapes__compute_normals(m, par_shapes__njobs(m->ntriangles, 16384));
 }
 
 static void par_shapes__subdivide(par_shapes_mesh* mesh)
@@ -1495,200 +2195,176 @@ par_shapes_mesh* par_shapes_clone(par_shapes_mesh const* mesh,
     return clone;
 }
 
-static struct {
+// Welding distances are measured in a normalized space where the bounding box
+// spans this many units along each axis.
+#define PAR_SHAPES__WELD_EXTENT 19.0f
+
+// Sparse spatial hash for welding.  Cells are at least twice as wide as the
+// welding distance, so only the 8 cells nearest to a point need probing.  Each
+// occupied slot holds the head of a linked list of representative points.
+typedef struct {
     float const* points;
-    int gridsize;
-} par_shapes__sort_context;
-
-static int par_shapes__cmp1(const void *arg0, const void *arg1)
-{
-    const int g = par_shapes__sort_context.gridsize;
-
-    // Convert arg0 into a flattened grid index.
-    PAR_SHAPES_T d0 = *(const PAR_SHAPES_T*) arg0;
-    float const* p0 = par_shapes__sort_context.points + d0 * 3;
-    int i0 = (int) p0[0];
-    int j0 = (int) p0[1];
-    int k0 = (int) p0[2];
-    int index0 = i0 + g * j0 + g * g * k0;
-
-    // Convert arg1 into a flattened grid index.
-    PAR_SHAPES_T d1 = *(const PAR_SHAPES_T*) arg1;
-    float const* p1 = par_shapes__sort_context.points + d1 * 3;
-    int i1 = (int) p1[0];
-    int j1 = (int) p1[1];
-    int k1 = (int) p1[2];
-    int index1 = i1 + g * j1 + g * g * k1;
-
-    // Return the ordering.
-    if (index0 < index1) return -1;
-    if (index0 > index1) return 1;
-    return 0;
-}
+    float offset[3];
+    float scale[3];
+    float cellsize;
+    uint64_t* keys;
+    int* heads;
+    int* next;
+    int mask;
+} par_shapes__welder;
 
-static void par_shapes__sort_points(par_shapes_mesh* mesh, int gridsize,
-    PAR_SHAPES_T* sortmap)
+static void par_shapes__weld_coord(par_shapes__welder const* w, int p,
+    float* q)
 {
-    // Run qsort over a list of consecutive integers that get deferenced
-    // within the comparator function; this creates a reorder mapping.
-    for (int i = 0; i < mesh->npoints; i++) {
-        sortmap[i] = i;
-    }
-    par_shapes__sort_context.gridsize = gridsize;
-    par_shapes__sort_context.points = mesh->points;
-    qsort(sortmap, mesh->npoints, sizeof(PAR_SHAPES_T), par_shapes__cmp1);
+    float const* pt = w->points + p * 3;
+    q[0] = (pt[0] - w->offset[0]) * w->scale[0];
+    q[1] = (pt[1] - w->offset[1]) * w->scale[1];
+    q[2] = (pt[2] - w->offset[2]) * w->scale[2];
+}
 
-    // Apply the reorder mapping to the XYZ coordinate data.
-    float* newpts = PAR_MALLOC(float, mesh->npoints * 3);
-    PAR_SHAPES_T* invmap = PAR_MALLOC(PAR_SHAPES_T, mesh->npoints);
-    float* dstpt = newpts;
-    for (int i = 0; i < mesh->npoints; i++) {
-        invmap[sortmap[i]] = i;
-        float const* srcpt = mesh->points + 3 * sortmap[i];
-        *dstpt++ = *srcpt++;
-        *dstpt++ = *srcpt++;
-        *dstpt++ = *srcpt++;
-    }
-    PAR_FREE(mesh->points);
-    mesh->points = newpts;
+static uint64_t par_shapes__weld_key(int i, int j, int k)
+{
+    return ((uint64_t) (i & 0x1fffff) << 42) |
+        ((uint64_t) (j & 0x1fffff) << 21) | (uint64_t) (k & 0x1fffff);
+}
 
-    // Apply the inverse reorder mapping to the triangle indices.
-    PAR_SHAPES_T* newinds = PAR_MALLOC(PAR_SHAPES_T, mesh->ntriangles * 3);
-    PAR_SHAPES_T* dstind = newinds;
-    PAR_SHAPES_T const* srcind = mesh->triangles;
-    for (int i = 0; i < mesh->ntriangles * 3; i++) {
-        *dstind++ = invmap[*srcind++];
+static int par_shapes__weld_slot(par_shapes__welder const* w, uint64_t key)
+{
+    int slot = (int) ((key * 0x9e3779b97f4a7c15ull) >> 32) & w->mask;
+    while (w->heads[slot] != -1 && w->keys[slot] != key) {
+        slot = (slot + 1) & w->mask;
     }
-    PAR_FREE(mesh->triangles);
-    mesh->triangles = newinds;
-
-    // Cleanup.
-    memcpy(sortmap, invmap, sizeof(PAR_SHAPES_T) * mesh->npoints);
-    PAR_FREE(invmap);
+    return slot;
 }
 
-static void par_shapes__weld_points(par_shapes_mesh* mesh, int gridsize,
-    float epsilon, PAR_SHAPES_T* weldmap)
+// Doubles the number of slots, which keeps the table sized by the number of
+// occupied cells rather than the number of input points.
+static void par_shapes__weld_grow(par_shapes__welder* w)
 {
-    // Each bin contains a "pointer" (really an index) to its first point.
-    // We add 1 because 0 is reserved to mean that the bin is empty.
-    // Since the points are spatially sorted, there's no need to store
-    // a point count in each bin.
-    PAR_SHAPES_T* bins = PAR_CALLOC(PAR_SHAPES_T,
-        gridsize * gridsize * gridsize);
-    int prev_binindex = -1;
-    for (int p = 0; p < mesh->npoints; p++) {
-        float const* pt = mesh->points + p * 3;
-        int i = (int) pt[0];
-        int j = (int) pt[1];
-        int k = (int) pt[2];
-        int this_binindex = i + gridsize * j + gridsize * gridsize * k;
-        if (this_binindex != prev_binindex) {
-            bins[this_binindex] = 1 + p;
+    uint64_t* keys = w->keys;
+    int* heads = w->heads;
+    int nslots = w->mask + 1;
+    int newslots = nslots * 2;
+    w->mask = newslots - 1;
+    w->keys = PAR_MALLOC(uint64_t, newslots);
+    w->heads = PAR_MALLOC(int, newslots);
+    memset(w->heads, 0xff, sizeof(int) * newslots);
+    for (int i = 0; i < nslots; i++) {
+        if (heads[i] != -1) {
+            int slot = par_shapes__weld_slot(w, keys[i]);
+            w->keys[slot] = keys[i];
+            w->heads[slot] = heads[i];
         }
-        prev_binindex = this_binindex;
     }
+    PAR_FREE(keys);
+    PAR_FREE(heads);
+}
 
-    // Examine all bins that intersect the epsilon-sized cube centered at each
-    // point, and check for colocated points within those bins.
-    float const* pt = mesh->points;
-    int nremoved = 0;
-    for (int p = 0; p < mesh->npoints; p++, pt += 3) {
-
-        // Skip if this point has already been welded.
-        if (weldmap[p] != p) {
-            continue;
-        }
-
-        // Build a list of bins that intersect the epsilon-sized cube.
-        int nearby[8];
-        int nbins = 0;
-        int minp[3], maxp[3];
+par_shapes_mesh* par_shapes_weld(par_shapes_mesh const* mesh, float epsilon,
+    PAR_SHAPES_T* mapping)
+{
+    int npoints = mesh->npoints;
+    float aabb[6];
+    par_shapes_compute_aabb(mesh, aabb);
+    par_shapes__welder w;
+    w.points = mesh->points;
+    for (int c = 0; c < 3; c++) {
+        float extent = aabb[c + 3] - aabb[c];
+        w.offset[c] = aabb[c];
+        w.scale[c] = extent == 0 ? 1.0f : PAR_SHAPES__WELD_EXTENT / extent;
+    }
+
+    // Keep cell coordinates within the 21 bits that each axis gets in a key.
+    w.cellsize = PAR_MAX(2 * sqrtf(epsilon), 1e-5f);
+    int nslots = 64;
+    w.mask = nslots - 1;
+    w.keys = PAR_MALLOC(uint64_t, nslots);
+    w.heads = PAR_MALLOC(int, nslots);
+    w.next = PAR_MALLOC(int, npoints);
+    memset(w.heads, 0xff, sizeof(int) * nslots);
+    int ncells = 0;
+
+    // Visit points in their original order.  Each point is welded to the
+    // nearest representative within epsilon, or becomes a representative.
+    int* weldmap = PAR_MALLOC(int, npoints);
+    int nkept = 0;
+    for (int p = 0; p < npoints; p++) {
+        float q[3], r[3];
+        par_shapes__weld_coord(&w, p, q);
+        int cell[3], lo[3];
         for (int c = 0; c < 3; c++) {
-            minp[c] = (int) (pt[c] - epsilon);
-            maxp[c] = (int) (pt[c] + epsilon);
-        }
-        for (int i = minp[0]; i <= maxp[0]; i++) {
-            for (int j = minp[1]; j <= maxp[1]; j++) {
-                for (int k = minp[2]; k <= maxp[2]; k++) {
-                    int binindex = i + gridsize * j + gridsize * gridsize * k;
-                    PAR_SHAPES_T binvalue = *(bins + binindex);
-                    if (binvalue > 0) {
-                        if (nbins == 8) {
-                            printf("Epsilon value is too large.\n");
-                            break;
+            float x = q[c] / w.cellsize;
+            cell[c] = (int) x;
+            lo[c] = x - cell[c] < 0.5f ? cell[c] - 1 : cell[c];
+        }
+        int nearest = -1;
+        float mindist2 = epsilon;
+        for (int i = lo[0]; i <= lo[0] + 1; i++) {
+            for (int j = lo[1]; j <= lo[1] + 1; j++) {
+                for (int k = lo[2]; k <= lo[2] + 1; k++) {
+                    uint64_t key = par_shapes__weld_key(i, j, k);
+                    int slot = par_shapes__weld_slot(&w, key);
+                    for (int n = w.heads[slot]; n != -1; n = w.next[n]) {
+                        par_shapes__weld_coord(&w, n, r);
+                        float dist2 = par_shapes__sqrdist3(q, r);
+                        if (dist2 < mindist2) {
+                            mindist2 = dist2;
+                            nearest = n;
                         }
-                        nearby[nbins++] = binindex;
                     }
                 }
             }
         }
-
-        // Check for colocated points in each nearby bin.
-        for (int b = 0; b < nbins; b++) {
-            int binindex = nearby[b];
-            PAR_SHAPES_T binvalue = *(bins + binindex);
-            PAR_SHAPES_T nindex = binvalue - 1;
-            while (true) {
-
-                // If this isn't "self" and it's colocated, then weld it!
-                if (nindex != p && weldmap[nindex] == nindex) {
-                    float const* thatpt = mesh->points + nindex * 3;
-                    float dist2 = par_shapes__sqrdist3(thatpt, pt);
-                    if (dist2 < epsilon) {
-                        weldmap[nindex] = p;
-                        nremoved++;
-                    }
-                }
-
-                // Advance to the next point if possible.
-                if (++nindex >= mesh->npoints) {
-                    break;
-                }
-
-                // If the next point is outside the bin, then we're done.
-                float const* nextpt = mesh->points + nindex * 3;
-                int i = (int) nextpt[0];
-                int j = (int) nextpt[1];
-                int k = (int) nextpt[2];
-                int nextbinindex = i + gridsize * j + gridsize * gridsize * k;
-                if (nextbinindex != binindex) {
-                    break;
-                }
-            }
+        if (nearest != -1) {
+            weldmap[p] = weldmap[nearest];
+            continue;
         }
+        uint64_t key = par_shapes__weld_key(cell[0], cell[1], cell[2]);
+        int slot = par_shapes__weld_slot(&w, key);
+        if (w.heads[slot] == -1 && ++ncells * 4 > w.mask) {
+            par_shapes__weld_grow(&w);
+            slot = par_shapes__weld_slot(&w, key);
+        }
+        w.keys[slot] = key;
+        w.next[p] = w.heads[slot];
+        w.heads[slot] = p;
+        weldmap[p] = nkept++;
+    }
+    PAR_FREE(w.keys);
+    PAR_FREE(w.heads);
+    PAR_FREE(w.next);
+
+    // Gather the representatives along with their attributes.  Since they
+    // were numbered in order, a point is a representative if and only if it
+    // maps to the number of representatives seen so far.
+    par_shapes_mesh* welded = PAR_CALLOC(par_shapes_mesh, 1);
+    welded->npoints = nkept;
+    welded->points = PAR_MALLOC(float, nkept * 3);
+    if (mesh->normals) {
+        welded->normals = PAR_MALLOC(float, nkept * 3);
     }
-    PAR_FREE(bins);
-
-    // Apply the weldmap to the vertices.
-    int npoints = mesh->npoints - nremoved;
-    float* newpts = PAR_MALLOC(float, 3 * npoints);
-    float* dst = newpts;
-    PAR_SHAPES_T* condensed_map = PAR_MALLOC(PAR_SHAPES_T, mesh->npoints);
-    PAR_SHAPES_T* cmap = condensed_map;
-    float const* src = mesh->points;
-    int ci = 0;
-    for (int p = 0; p < mesh->npoints; p++, src += 3) {
-        if (weldmap[p] == p) {
-            *dst++ = src[0];
-            *dst++ = src[1];
-            *dst++ = src[2];
-            *cmap++ = ci++;
-        } else {
-            *cmap++ = condensed_map[weldmap[p]];
+    if (mesh->tcoords) {
+        welded->tcoords = PAR_MALLOC(float, nkept * 2);
+    }
+    for (int p = 0, d = 0; p < npoints; p++) {
+        if (weldmap[p] != d) {
+            continue;
+        }
+        par_shapes__copy3(welded->points + d * 3, mesh->points + p * 3);
+        if (mesh->normals) {
+            par_shapes__copy3(welded->normals + d * 3, mesh->normals + p * 3);
         }
+        if (mesh->tcoords) {
+            welded->tcoords[d * 2] = mesh->tcoords[p * 2];
+            welded->tcoords[d * 2 + 1] = mesh->tcoords[p * 2 + 1];
+        }
+        d++;
     }
-    assert(ci == npoints);
-    PAR_FREE(mesh->points);
-    memcpy(weldmap, condensed_map, mesh->npoints * sizeof(PAR_SHAPES_T));
-    PAR_FREE(condensed_map);
-    mesh->points = newpts;
-    mesh->npoints = npoints;
 
     // Apply the weldmap to the triangle indices and skip the degenerates.
+    welded->triangles = PAR_MALLOC(PAR_SHAPES_T, mesh->ntriangles * 3);
     PAR_SHAPES_T const* tsrc = mesh->triangles;
-    PAR_SHAPES_T* tdst = mesh->triangles;
-    int ntriangles = 0;
+    PAR_SHAPES_T* tdst = welded->triangles;
     for (int i = 0; i < mesh->ntriangles; i++, tsrc += 3) {
         PAR_SHAPES_T a = weldmap[tsrc[0]];
         PAR_SHAPES_T b = weldmap[tsrc[1]];
@@ -1697,52 +2373,219 @@ static void par_shapes__weld_points(par_shapes_mesh* mesh, int gridsize,
             *tdst++ = a;
             *tdst++ = b;
             *tdst++ = c;
-            ntriangles++;
+            welded->ntriangles++;
         }
     }
-    mesh->ntriangles = ntriangles;
+    if (mapping) {
+        for (int p = 0; p < npoints; p++) {
+            mapping[p] = weldmap[p];
+        }
+    }
+    PAR_FREE(weldmap);
+    return welded;
 }
 
-par_shapes_mesh* par_shapes_weld(par_shapes_mesh const* mesh, float epsilon,
-    PAR_SHAPES_T* weldmap)
+// Vertex cache optimization uses Tipsify, from "Fast Triangle Reordering for
+// Vertex Locality and Reduced Overdraw" by Sander, Nehab and Barczak.  The
+// cache is modeled as a FIFO in which a vertex stays resident until
+// "cachesize" more vertices have been transformed after it.
+
+float par_shapes_compute_acmr(par_shapes_mesh const* mesh, int cachesize)
 {
-    par_shapes_mesh* clone = par_shapes_clone(mesh, 0);
-    float aabb[6];
-    int gridsize = 20;
-    float maxcell = gridsize - 1;
-    par_shapes_compute_aabb(clone, aabb);
-    float scale[3] = {
-        aabb[3] == aabb[0] ? 1.0f : maxcell / (aabb[3] - aabb[0]),
-        aabb[4] == aabb[1] ? 1.0f : maxcell / (aabb[4] - aabb[1]),
-        aabb[5] == aabb[2] ? 1.0f : maxcell / (aabb[5] - aabb[2]),
-    };
-    par_shapes_translate(clone, -aabb[0], -aabb[1], -aabb[2]);
-    par_shapes_scale(clone, scale[0], scale[1], scale[2]);
-    PAR_SHAPES_T* sortmap = PAR_MALLOC(PAR_SHAPES_T, mesh->npoints);
-    par_shapes__sort_points(clone, gridsize, sortmap);
-    bool owner = false;
-    if (!weldmap) {
-        owner = true;
-        weldmap = PAR_MALLOC(PAR_SHAPES_T, mesh->npoints);
+    if (mesh->ntriangles == 0) {
+        return 0;
     }
-    for (int i = 0; i < mesh->npoints; i++) {
-        weldmap[i] = i;
+    int* stamps = PAR_MALLOC(int, mesh->npoints);
+    memset(stamps, 0xff, sizeof(int) * mesh->npoints);
+    int nmisses = 0;
+    for (int i = 0; i < mesh->ntriangles * 3; i++) {
+        int v = mesh->triangles[i];
+        if (stamps[v] < 0 || nmisses - stamps[v] > cachesize) {
+            stamps[v] = nmisses++;
+        }
+    }
+    PAR_FREE(stamps);
+    return (float) nmisses / mesh->ntriangles;
+}
+
+typedef struct {
+    PAR_SHAPES_T const* triangles;
+    int* offsets;        // Start of each vertex's triangle list
+    int* adjacency;      // Triangles that reference each vertex
+    int* live;           // Number of unemitted triangles for each vertex
+    int* stamps;         // Time at which each vertex entered the cache
+    int* deadends;       // Stack of recently emitted vertices
+    int ndeadends;
+    int* candidates;     // Vertices of the triangles emitted from the fan
+    int ncandidates;
+    int cursor;          // Next vertex to consider when all else fails
+    int npoints;
+} par_shapes__tipsify;
+
+// Picks the next fanning vertex among candidates that will still be in the
+// cache after their remaining triangles are emitted, favoring the oldest.
+// Otherwise falls back to the most recently emitted vertex that is still live.
+static int par_shapes__next_fan(par_shapes__tipsify* ts, int time,
+    int cachesize)
+{
+    int best = -1, bestpriority = 0;
+    for (int i = 0; i < ts->ncandidates; i++) {
+        int v = ts->candidates[i];
+        if (ts->live[v] == 0) {
+            continue;
+        }
+        int priority = 0;
+        if (time - ts->stamps[v] + 2 * ts->live[v] <= cachesize) {
+            priority = time - ts->stamps[v];
+        }
+        if (priority > bestpriority) {
+            bestpriority = priority;
+            best = v;
+        }
+    }
+    if (best != -1) {
+        return best;
+    }
+    while (ts->ndeadends > 0) {
+        int v = ts->deadends[--ts->ndeadends];
+        if (ts->live[v] > 0) {
+            return v;
+        }
+    }
+    for (; ts->cursor < ts->npoints; ts->cursor++) {
+        if (ts->live[ts->cursor] > 0) {
+            return ts->cursor;
+        }
+    }
+    return -1;
+}
+
+float par_shapes_optimize(par_shapes_mesh* mesh, int cachesize)
+{
+    int npoints = mesh->npoints;
+    int nindices = mesh->ntriangles * 3;
+    par_shapes__tipsify ts = {0};
+    ts.triangles = mesh->triangles;
+    ts.npoints = npoints;
+
+    // Build the vertex-to-triangle adjacency in compressed form.
+    int noffsets = npoints + 1;
+    ts.offsets = PAR_CALLOC(int, noffsets);
+    ts.live = PAR_CALLOC(int, npoints);
+    ts.adjacency = PAR_MALLOC(int, nindices);
+    for (int i = 0; i < nindices; i++) {
+        ts.live[mesh->triangles[i]]++;
+    }
+    int maxvalence = 0;
+    for (int v = 0; v < npoints; v++) {
+        ts.offsets[v + 1] = ts.offsets[v] + ts.live[v];
+        maxvalence = PAR_MAX(maxvalence, ts.live[v]);
     }
-    par_shapes__weld_points(clone, gridsize, epsilon, weldmap);
-    if (owner) {
-        PAR_FREE(weldmap);
+    int* fill = PAR_MALLOC(int, npoints);
+    memcpy(fill, ts.offsets, sizeof(int) * npoints);
+    for (int i = 0; i < nindices; i++) {
+        ts.adjacency[fill[mesh->triangles[i]]++] = i / 3;
+    }
+    PAR_FREE(fill);
+
+    // Fan out from one vertex at a time, emitting its remaining triangles.
+    ts.stamps = PAR_CALLOC(int, npoints);
+    ts.deadends = PAR_MALLOC(int, nindices);
+    ts.candidates = PAR_MALLOC(int, maxvalence * 3);
+    bool* emitted = PAR_CALLOC(bool, mesh->ntriangles);
+    PAR_SHAPES_T* triangles = PAR_MALLOC(PAR_SHAPES_T, nindices);
+    PAR_SHAPES_T* dst = triangles;
+    int time = cachesize + 1;
+    int fan = npoints > 0 && nindices > 0 ? 0 : -1;
+    if (fan == 0 && ts.live[0] == 0) {
+        fan = par_shapes__next_fan(&ts, time, cachesize);
+    }
+    while (fan >= 0) {
+        ts.ncandidates = 0;
+        for (int a = ts.offsets[fan]; a < ts.offsets[fan + 1]; a++) {
+            int t = ts.adjacency[a];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = true;
+            for (int c = 0; c < 3; c++) {
+                int v = mesh->triangles[t * 3 + c];
+                *dst++ = v;
+                ts.deadends[ts.ndeadends++] = v;
+                ts.candidates[ts.ncandidates++] = v;
+                ts.live[v]--;
+                if (time - ts.stamps[v] > cachesize) {
+                    ts.stamps[v] = time++;
+                }
+            }
+        }
+        fan = par_shapes__next_fan(&ts, time, cachesize);
+    }
+    PAR_FREE(emitted);
+    PAR_FREE(ts.candidates);
+    PAR_FREE(ts.deadends);
+    PAR_FREE(ts.stamps);
+    PAR_FREE(ts.adjacency);
+    PAR_FREE(ts.live);
+    PAR_FREE(ts.offsets);
+
+    // Tipsify is a heuristic and can lose to the original order, for example
+    // when the cache cannot hold a whole fan but can hold a strip.
+    float before = par_shapes_compute_acmr(mesh, cachesize);
+    par_shapes_mesh reordered = *mesh;
+    reordered.triangles = triangles;
+    float after = par_shapes_compute_acmr(&reordered, cachesize);
+    if (after >= before) {
+        PAR_FREE(triangles);
+        triangles = mesh->triangles;
+        after = before;
     } else {
-        PAR_SHAPES_T* newmap = PAR_MALLOC(PAR_SHAPES_T, mesh->npoints);
-        for (int i = 0; i < mesh->npoints; i++) {
-            newmap[i] = weldmap[sortmap[i]];
+        PAR_FREE(mesh->triangles);
+        mesh->triangles = triangles;
+    }
+
+    // Renumber the vertices in order of first use, keeping any unreferenced
+    // vertices at the end.
+    int* remap = PAR_MALLOC(int, npoints);
+    memset(remap, 0xff, sizeof(int) * npoints);
+    int nused = 0;
+    for (int i = 0; i < nindices; i++) {
+        int v = triangles[i];
+        if (remap[v] < 0) {
+            remap[v] = nused++;
         }
-        memcpy(weldmap, newmap, sizeof(PAR_SHAPES_T) * mesh->npoints);
-        PAR_FREE(newmap);
+        triangles[i] = remap[v];
     }
-    PAR_FREE(sortmap);
-    par_shapes_scale(clone, 1.0 / scale[0], 1.0 / scale[1], 1.0 / scale[2]);
-    par_shapes_translate(clone, aabb[0], aabb[1], aabb[2]);
-    return clone;
+    for (int v = 0; v < npoints; v++) {
+        if (remap[v] < 0) {
+            remap[v] = nused++;
+        }
+    }
+    float* points = PAR_MALLOC(float, npoints * 3);
+    for (int v = 0; v < npoints; v++) {
+        par_shapes__copy3(points + remap[v] * 3, mesh->points + v * 3);
+    }
+    PAR_FREE(mesh->points);
+    mesh->points = points;
+    if (mesh->normals) {
+        float* normals = PAR_MALLOC(float, npoints * 3);
+        for (int v = 0; v < npoints; v++) {
+            par_shapes__copy3(normals + remap[v] * 3, mesh->normals + v * 3);
+        }
+        PAR_FREE(mesh->normals);
+        mesh->normals = normals;
+    }
+    if (mesh->tcoords) {
+        float* tcoords = PAR_MALLOC(float, npoints * 2);
+        for (int v = 0; v < npoints; v++) {
+            tcoords[remap[v] * 2] = mesh->tcoords[v * 2];
+            tcoords[remap[v] * 2 + 1] = mesh->tcoords[v * 2 + 1];
+        }
+        PAR_FREE(mesh->tcoords);
+        mesh->tcoords = tcoords;
+    }
+    PAR_FREE(remap);
+    return after;
 }
 
 // -----------------------------------------------------------------------------
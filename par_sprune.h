@@ -43,6 +43,11 @@ extern "C" {
 #define PAR_SPRUNE_FLT float
 #endif
 
+// Set this to 1 to sort the two axes concurrently, which uses pthreads.
+#ifndef PAR_SPRUNE_THREADS
+#define PAR_SPRUNE_THREADS 0
+#endif
+
 // -----------------------------------------------------------------------------
 // BEGIN PUBLIC API
 // -----------------------------------------------------------------------------
@@ -52,6 +57,10 @@ typedef struct {
     PAR_SPRUNE_INT const ncollision_pairs;       // number of two-tuples
     PAR_SPRUNE_INT const* const culled;          // filled by par_sprune_cull
     PAR_SPRUNE_INT const nculled;                // set by par_sprune_cull
+    PAR_SPRUNE_INT const* const added_pairs;     // filled by par_sprune_update
+    PAR_SPRUNE_INT const nadded_pairs;           // set by par_sprune_update
+    PAR_SPRUNE_INT const* const removed_pairs;   // filled by par_sprune_update
+    PAR_SPRUNE_INT const nremoved_pairs;         // set by par_sprune_update
 } par_sprune_context;
 
 void par_sprune_free_context(par_sprune_context* context);
@@ -62,12 +71,33 @@ void par_sprune_free_context(par_sprune_context* context);
 par_sprune_context* par_sprune_overlap(PAR_SPRUNE_FLT const* aabbs,
     PAR_SPRUNE_INT naabbs, par_sprune_context* previous);
 
+// Produces the same context as par_sprune_overlap, but sweeps only one axis
+// and tests the other inline, so memory is proportional to the number of
+// collisions rather than the number of overlaps along an axis.
+par_sprune_context* par_sprune_overlap_lowmem(PAR_SPRUNE_FLT const* aabbs,
+    PAR_SPRUNE_INT naabbs, par_sprune_context* previous);
+
 // Reads new aabb data from the same pointer that was passed to the overlap
 // function and refreshes the two relevant fields.  This function should
-// only be used when the number of aabbs remains constant. If this returns
-// false, no changes to the collision set were detected.
+// only be used when the number of aabbs remains constant, unless boxes are
+// edited with the functions below. If this returns false, no changes to the
+// collision set were detected.  The sorted endpoints are kept between calls
+// and repaired with insertion sort, so this is fast when boxes move only
+// slightly.  Pairs that entered or left the collision set are listed in
+// "added_pairs" and "removed_pairs", sorted like the main list.
 bool par_sprune_update(par_sprune_context* ctx);
 
+// Edits individual boxes in an existing context and returns the ID of new
+// boxes.  IDs of existing boxes never change, but the IDs of removed boxes are
+// recycled.  The first edit copies the aabb data into the context, which stops
+// reading from the client pointer.  Edits take effect at the next call to
+// par_sprune_update, so they can be batched.
+PAR_SPRUNE_INT par_sprune_add(par_sprune_context* ctx,
+    PAR_SPRUNE_FLT const* aabb);
+void par_sprune_remove(par_sprune_context* ctx, PAR_SPRUNE_INT box);
+void par_sprune_move(par_sprune_context* ctx, PAR_SPRUNE_INT box,
+    PAR_SPRUNE_FLT const* aabb);
+
 // Examines all collision groups and creates a culling set such that no boxes
 // would overlap if the culled boxes are removed.  When two boxes collide, the
 // box that occurs earlier in the list is more likely to be culled. Populates
@@ -75,6 +105,18 @@ bool par_sprune_update(par_sprune_context* ctx);
 // hiding labels in GIS applications.
 void par_sprune_cull(par_sprune_context* context);
 
+#define PAR_SPRUNE_CULL_GREEDY 0
+#define PAR_SPRUNE_CULL_MAXIMAL 1
+
+// Similar to par_sprune_cull, but takes an optional array with one priority
+// per box, where boxes with lower priority are more likely to be culled.  The
+// greedy strategy culls one box from every colliding pair.  The maximal
+// strategy visits boxes from highest to lowest priority and keeps every box
+// that doesn't collide with a box that was already kept, which usually culls
+// fewer boxes.
+void par_sprune_cull_priority(par_sprune_context* context,
+    PAR_SPRUNE_FLT const* priorities, int strategy);
+
 // -----------------------------------------------------------------------------
 // END PUBLIC API
 // -----------------------------------------------------------------------------
@@ -88,8 +130,17 @@ void par_sprune_cull(par_sprune_context* context);
 #define PARFLT PAR_SPRUNE_FLT
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
+#if PAR_SPRUNE_THREADS
+#include <pthread.h>
+#endif
+
+#define PAR_SPRUNE__TEST(BITS, I) ((BITS)[(I) >> 5] & (1u << ((I) & 31)))
+#define PAR_SPRUNE__SET(BITS, I) ((BITS)[(I) >> 5] |= (1u << ((I) & 31)))
+#define PAR_SPRUNE__CLEAR(BITS, I) ((BITS)[(I) >> 5] &= ~(1u << ((I) & 31)))
+
 #ifndef PAR_PI
 #define PAR_PI (3.14159265359)
 #define PAR_MIN(a, b) (a > b ? b : a)
@@ -148,12 +199,30 @@ typedef struct {
     PARINT ncollision_pairs;
     PARINT* culled;
     PARINT nculled;
+    PARINT* added_pairs;
+    PARINT nadded_pairs;
+    PARINT* removed_pairs;
+    PARINT nremoved_pairs;
 
     // Private:
     PARFLT const* aabbs;
     PARINT naabbs;
     PARINT* sorted_indices[2];
     PARINT* pairs[2];
+    PARINT* events;
+    PARINT* merged;
+    PARINT* adjacency;
+    PARINT* ranked;
+    uint32_t* cullbits;
+    uint32_t* keepbits;
+    uint64_t* sortkeys[2];
+    uint64_t* sortscratch[2];
+    PARFLT* boxes;
+    PARINT* freelist;
+    PARINT* pending_adds;
+    PARINT* pending_removes;
+    uint32_t* deadbits;
+    uint32_t* newbits;
 
 } par_sprune__context;
 
@@ -242,6 +311,25 @@ void par_sprune_free_context(par_sprune_context* context)
     pa_free(ctx->pairs[0]);
     pa_free(ctx->pairs[1]);
     pa_free(ctx->collision_pairs);
+    pa_free(ctx->culled);
+    pa_free(ctx->added_pairs);
+    pa_free(ctx->removed_pairs);
+    pa_free(ctx->events);
+    pa_free(ctx->merged);
+    pa_free(ctx->adjacency);
+    pa_free(ctx->ranked);
+    pa_free(ctx->cullbits);
+    pa_free(ctx->keepbits);
+    for (int i = 0; i < 2; i++) {
+        pa_free(ctx->sortkeys[i]);
+        pa_free(ctx->sortscratch[i]);
+    }
+    pa_free(ctx->boxes);
+    pa_free(ctx->freelist);
+    pa_free(ctx->pending_adds);
+    pa_free(ctx->pending_removes);
+    pa_free(ctx->deadbits);
+    pa_free(ctx->newbits);
     PAR_FREE(ctx);
 }
 
@@ -279,7 +367,7 @@ static int par__cmpinds(const void* pa, const void* pb, void* psorter)
     return 0;
 }
 
-static int par__cmppairs(const void* pa, const void* pb, void* unused)
+static int par__cmpfind(const void* pa, const void* pb)
 {
     PARINT a = *((const PARINT*) pa);
     PARINT b = *((const PARINT*) pb);
@@ -292,21 +380,142 @@ static int par__cmppairs(const void* pa, const void* pb, void* unused)
     return 0;
 }
 
-static int par__cmpfind(const void* pa, const void* pb)
+// Maps a float to an unsigned integer with the same ordering.
+static uint32_t par_sprune__key(PARFLT value)
 {
-    PARINT a = *((const PARINT*) pa);
-    PARINT b = *((const PARINT*) pb);
-    if (a > b) return 1;
-    if (a < b) return -1;
-    a = *(1 + (const PARINT*) pa);
-    b = *(1 + (const PARINT*) pb);
-    if (a > b) return 1;
-    if (a < b) return -1;
+    float f = value == 0 ? 0.0f : (float) value;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// Stable LSD radix sort that considers only the bytes at or above "firstbyte".
+// Passes where every key has the same digit are skipped.  Returns either keys
+// or scratch, depending on which one holds the result.
+static uint64_t* par_sprune__radix(uint64_t* keys, uint64_t* scratch,
+    PARINT n, int firstbyte)
+{
+    PARINT counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (PARINT i = 0; i < n; i++) {
+        for (int b = firstbyte; b < 8; b++) {
+            counts[b][(keys[i] >> (b * 8)) & 0xff]++;
+        }
+    }
+    for (int b = firstbyte; b < 8 && n > 0; b++) {
+        PARINT* count = counts[b];
+        if (count[(keys[0] >> (b * 8)) & 0xff] == n) {
+            continue;
+        }
+        PARINT offset = 0;
+        for (int d = 0; d < 256; d++) {
+            PARINT c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+        for (PARINT i = 0; i < n; i++) {
+            uint64_t key = keys[i];
+            scratch[count[(key >> (b * 8)) & 0xff]++] = key;
+        }
+        PAR_SWAP(uint64_t*, keys, scratch);
+    }
+    return keys;
+}
+
+// Sorts either a list of endpoints (when aabbs is non-null) or a list of
+// pairs.  Endpoints must be given in increasing order of their float index,
+// since ties are resolved by the stability of the sort.
+typedef struct {
+    PARINT* items;
+    PARINT count;
+    PARFLT const* aabbs;
+    uint64_t* keys;
+    uint64_t* scratch;
+} par_sprune__sortjob;
+
+static void* par_sprune__sort(void* arg)
+{
+    par_sprune__sortjob* job = (par_sprune__sortjob*) arg;
+    PARINT* items = job->items;
+    PARINT n = job->count;
+    if (job->aabbs && sizeof(PARFLT) != sizeof(float)) {
+        par__sprune_sorter sorter;
+        sorter.aabbs = job->aabbs;
+        par_qsort(items, n, sizeof(PARINT), par__cmpinds, &sorter);
+        return 0;
+    }
+    pa_clear(job->keys);
+    pa_clear(job->scratch);
+    pa_add(job->keys, n);
+    pa_add(job->scratch, n);
+    uint64_t* keys = job->keys;
+    if (job->aabbs) {
+        for (PARINT i = 0; i < n; i++) {
+            uint64_t key = par_sprune__key(job->aabbs[items[i]]);
+            keys[i] = (key << 32) | (uint32_t) items[i];
+        }
+        keys = par_sprune__radix(keys, job->scratch, n, 4);
+        for (PARINT i = 0; i < n; i++) {
+            items[i] = (PARINT) (keys[i] & 0xffffffffu);
+        }
+        return 0;
+    }
+    for (PARINT i = 0; i < n; i++) {
+        uint64_t key = (uint32_t) items[i * 2];
+        keys[i] = (key << 32) | (uint32_t) items[i * 2 + 1];
+    }
+    keys = par_sprune__radix(keys, job->scratch, n, 0);
+    for (PARINT i = 0; i < n; i++) {
+        items[i * 2] = (PARINT) (keys[i] >> 32);
+        items[i * 2 + 1] = (PARINT) (keys[i] & 0xffffffffu);
+    }
     return 0;
 }
 
-par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
-    par_sprune_context* previous)
+// Executes up to two sort jobs, using a second thread if it's worthwhile.
+static void par_sprune__sort_jobs(par_sprune__context* ctx,
+    par_sprune__sortjob* jobs, int njobs)
+{
+    int first = 0;
+    for (int i = 0; i < njobs; i++) {
+        jobs[i].keys = ctx->sortkeys[i];
+        jobs[i].scratch = ctx->sortscratch[i];
+    }
+#if PAR_SPRUNE_THREADS
+    pthread_t thread;
+    if (njobs == 2 && jobs[0].count + jobs[1].count >= 4096 &&
+        pthread_create(&thread, 0, par_sprune__sort, jobs + 1) == 0) {
+        par_sprune__sort(jobs);
+        pthread_join(thread, 0);
+        first = njobs;
+    }
+#endif
+    for (int i = first; i < njobs; i++) {
+        par_sprune__sort(jobs + i);
+    }
+    for (int i = 0; i < njobs; i++) {
+        ctx->sortkeys[i] = jobs[i].keys;
+        ctx->sortscratch[i] = jobs[i].scratch;
+    }
+}
+
+// Compares two endpoints with the same ordering used by par__cmpinds.
+static bool par_sprune__less(PARFLT const* aabbs, PARINT a, PARINT b)
+{
+    return aabbs[a] < aabbs[b] || (aabbs[a] == aabbs[b] && a < b);
+}
+
+static bool par_sprune__overlaps(PARFLT const* aabbs, PARINT a, PARINT b,
+    int axis)
+{
+    return par_sprune__less(aabbs, a * 4 + axis, b * 4 + axis + 2) &&
+        par_sprune__less(aabbs, b * 4 + axis, a * 4 + axis + 2);
+}
+
+// Sorts the endpoints along both axes, which is required for subsequent calls
+// to par_sprune_update.
+static par_sprune__context* par_sprune__begin(PARFLT const* aabbs,
+    PARINT naabbs, par_sprune_context* previous)
 {
     par_sprune__context* ctx = (par_sprune__context*) previous;
     if (!ctx) {
@@ -325,8 +534,37 @@ par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
         ctx->sorted_indices[0][i * 2 + 1] = i * 4 + 2;
         ctx->sorted_indices[1][i * 2 + 1] = i * 4 + 3;
     }
-    par__sprune_sorter sorter;
-    sorter.aabbs = ctx->aabbs;
+    par_sprune__sortjob jobs[2];
+    for (int axis = 0; axis < 2; axis++) {
+        jobs[axis].items = ctx->sorted_indices[axis];
+        jobs[axis].count = naabbs * 2;
+        jobs[axis].aabbs = aabbs;
+    }
+    par_sprune__sort_jobs(ctx, jobs, 2);
+    pa_clear(ctx->collision_pairs);
+    pa_clear(ctx->freelist);
+    pa_clear(ctx->pending_adds);
+    pa_clear(ctx->pending_removes);
+    pa_clear(ctx->deadbits);
+    pa_add(ctx->deadbits, (naabbs + 31) / 32);
+    for (PARINT i = 0; i < pa_count(ctx->deadbits); i++) {
+        ctx->deadbits[i] = 0;
+    }
+    return ctx;
+}
+
+static void par_sprune__end(par_sprune__context* ctx)
+{
+    ctx->ncollision_pairs = pa_count(ctx->collision_pairs) / 2;
+    pa_clear(ctx->added_pairs);
+    pa_clear(ctx->removed_pairs);
+    ctx->nadded_pairs = ctx->nremoved_pairs = 0;
+}
+
+par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
+    par_sprune_context* previous)
+{
+    par_sprune__context* ctx = par_sprune__begin(aabbs, naabbs, previous);
     PARINT* active = 0;
 
     // Sweep a plane first across the X-axis, then down through the Y-axis.
@@ -334,7 +572,6 @@ par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
     for (int axis = 0; axis < 2; axis++) {
         PARINT** pairs = &ctx->pairs[axis];
         PARINT* indices = ctx->sorted_indices[axis];
-        par_qsort(indices, naabbs * 2, sizeof(PARINT), par__cmpinds, &sorter);
         pa_clear(active);
         for (PARINT i = 0; i < naabbs * 2; i++) {
             PARINT fltindex = indices[i];
@@ -355,8 +592,7 @@ par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
     }
 
     // Sort the Y-axis collision pairs to make it easier to intersect it
-    // with the set of X-axis collision pairs.  We also sort the X-axis
-    // pairs because it's required for subsequent calls to par_sprune_update.
+    // with the set of X-axis collision pairs.
 
     PARINT* xpairs = ctx->pairs[0];
     PARINT* ypairs = ctx->pairs[1];
@@ -364,9 +600,13 @@ par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
     int nypairs = pa_count(ypairs) / 2;
     int pairsize = 2 * sizeof(PARINT);
     pa_free(active);
-    par_qsort(xpairs, nxpairs, pairsize, par__cmppairs, 0);
-    par_qsort(ypairs, nypairs, pairsize, par__cmppairs, 0);
-    pa_clear(ctx->collision_pairs);
+    par_sprune__sortjob jobs[2];
+    jobs[0].items = xpairs;
+    jobs[0].count = nxpairs;
+    jobs[1].items = ypairs;
+    jobs[1].count = nypairs;
+    jobs[0].aabbs = jobs[1].aabbs = 0;
+    par_sprune__sort_jobs(ctx, jobs, 2);
 
     // Find the intersection of X-axis overlaps and Y-axis overlaps.
 
@@ -381,73 +621,507 @@ par_sprune_context* par_sprune_overlap(PARFLT const* aabbs, PARINT naabbs,
             pa_push(ctx->collision_pairs, key[1]);
         }
     }
-    ctx->ncollision_pairs = pa_count(ctx->collision_pairs) / 2;
+    par_sprune__end(ctx);
     return (par_sprune_context*) ctx;
 }
 
+par_sprune_context* par_sprune_overlap_lowmem(PARFLT const* aabbs,
+    PARINT naabbs, par_sprune_context* previous)
+{
+    par_sprune__context* ctx = par_sprune__begin(aabbs, naabbs, previous);
+    for (int axis = 0; axis < 2; axis++) {
+        pa_free(ctx->pairs[axis]);
+        ctx->pairs[axis] = 0;
+    }
+
+    // Choose the axis with the fewest expected overlaps, which is the one
+    // where boxes are small relative to the spread of their centers.
+
+    double density[2];
+    for (int axis = 0; axis < 2; axis++) {
+        double extent = 0, sum = 0, sqrsum = 0;
+        for (PARINT i = 0; i < naabbs; i++) {
+            double lo = aabbs[i * 4 + axis], hi = aabbs[i * 4 + axis + 2];
+            double center = 0.5 * (lo + hi);
+            extent += hi - lo;
+            sum += center;
+            sqrsum += center * center;
+        }
+        double n = PAR_MAX(naabbs, 1);
+        double variance = sqrsum / n - PAR_SQR(sum / n);
+        density[axis] = PAR_SQR(extent / n) / PAR_MAX(variance, 1e-30);
+    }
+    int axis = density[1] < density[0] ? 1 : 0;
+
+    // Sweep along the chosen axis and test the other axis inline, such that
+    // only true collisions are emitted.
+
+    PARINT* indices = ctx->sorted_indices[axis];
+    PARINT* active = 0;
+    for (PARINT i = 0; i < naabbs * 2; i++) {
+        PARINT fltindex = indices[i];
+        PARINT boxindex = fltindex / 4;
+        bool ismin = ((fltindex - axis) % 4) == 0;
+        if (!ismin) {
+            par_sprune__remove(active, boxindex);
+            continue;
+        }
+        for (int j = 0; j < pa_count(active); j++) {
+            if (par_sprune__overlaps(aabbs, active[j], boxindex, 1 - axis)) {
+                pa_push(ctx->collision_pairs, PAR_MIN(active[j], boxindex));
+                pa_push(ctx->collision_pairs, PAR_MAX(active[j], boxindex));
+            }
+        }
+        pa_push(active, boxindex);
+    }
+    pa_free(active);
+    par_sprune__sortjob job;
+    job.items = ctx->collision_pairs;
+    job.count = pa_count(ctx->collision_pairs) / 2;
+    job.aabbs = 0;
+    par_sprune__sort_jobs(ctx, &job, 1);
+    par_sprune__end(ctx);
+    return (par_sprune_context*) ctx;
+}
+
+// Events are (mina, maxb, sequence, added) tuples.
+static void par_sprune__push_event(par_sprune__context* ctx, PARINT a,
+    PARINT b, PARINT added)
+{
+    PARINT sequence = pa_count(ctx->events) / 4;
+    pa_push(ctx->events, PAR_MIN(a, b));
+    pa_push(ctx->events, PAR_MAX(a, b));
+    pa_push(ctx->events, sequence);
+    pa_push(ctx->events, added);
+}
+
+static int par__cmpevents(const void* pa, const void* pb, void* unused)
+{
+    PARINT const* a = (const PARINT*) pa;
+    PARINT const* b = (const PARINT*) pb;
+    for (int i = 0; i < 3; i++) {
+        if (a[i] > b[i]) return 1;
+        if (a[i] < b[i]) return -1;
+    }
+    return 0;
+}
+
+// Drops the endpoints of removed boxes and lists their pairs as removed.
+static void par_sprune__apply_removes(par_sprune__context* ctx)
+{
+    if (pa_count(ctx->pending_removes) == 0) {
+        return;
+    }
+    uint32_t const* dead = ctx->deadbits;
+    for (int axis = 0; axis < 2; axis++) {
+        PARINT* indices = ctx->sorted_indices[axis];
+        PARINT n = 0;
+        for (PARINT i = 0; i < pa_count(indices); i++) {
+            if (!PAR_SPRUNE__TEST(dead, indices[i] / 4)) {
+                indices[n++] = indices[i];
+            }
+        }
+        if (indices) {
+            pa___n(indices) = n;
+        }
+    }
+    PARINT const* pairs = ctx->collision_pairs;
+    for (PARINT i = 0; i < ctx->ncollision_pairs * 2; i += 2) {
+        if (PAR_SPRUNE__TEST(dead, pairs[i]) ||
+            PAR_SPRUNE__TEST(dead, pairs[i + 1])) {
+            pa_push(ctx->removed_pairs, pairs[i]);
+            pa_push(ctx->removed_pairs, pairs[i + 1]);
+        }
+    }
+}
+
+// Merges the endpoints of new boxes into the sorted lists, then finds the
+// pairs that involve at least one new box.
+static void par_sprune__apply_adds(par_sprune__context* ctx)
+{
+    PARINT* adds = ctx->pending_adds;
+    PARINT nadds = 0;
+    for (PARINT i = 0; i < pa_count(adds); i++) {
+        if (!PAR_SPRUNE__TEST(ctx->deadbits, adds[i])) {
+            adds[nadds++] = adds[i];
+        }
+    }
+    if (nadds == 0) {
+        return;
+    }
+    pa_clear(ctx->newbits);
+    pa_add(ctx->newbits, pa_count(ctx->deadbits));
+    uint32_t* isnew = ctx->newbits;
+    for (PARINT i = 0; i < pa_count(isnew); i++) {
+        isnew[i] = 0;
+    }
+    for (PARINT i = 0; i < nadds; i++) {
+        PAR_SPRUNE__SET(isnew, adds[i]);
+    }
+    PARFLT const* aabbs = ctx->aabbs;
+    par__sprune_sorter sorter;
+    sorter.aabbs = aabbs;
+    for (int axis = 0; axis < 2; axis++) {
+        pa_clear(ctx->events);
+        pa_add(ctx->events, nadds * 2);
+        PARINT* incoming = ctx->events;
+        for (PARINT i = 0; i < nadds; i++) {
+            incoming[i * 2 + 0] = adds[i] * 4 + axis;
+            incoming[i * 2 + 1] = adds[i] * 4 + axis + 2;
+        }
+        par_qsort(incoming, nadds * 2, sizeof(PARINT), par__cmpinds, &sorter);
+        PARINT i = pa_count(ctx->sorted_indices[axis]) - 1;
+        PARINT j = nadds * 2 - 1;
+        pa_add(ctx->sorted_indices[axis], nadds * 2);
+        PARINT* indices = ctx->sorted_indices[axis];
+        PARINT k = pa_count(indices) - 1;
+        while (j >= 0) {
+            if (i >= 0 && par_sprune__less(aabbs, incoming[j], indices[i])) {
+                indices[k--] = indices[i--];
+            } else {
+                indices[k--] = incoming[j--];
+            }
+        }
+    }
+
+    // Boxes that overlap a new box along X have a min endpoint between its
+    // own min endpoint and max endpoint, or slightly before it.  The widest
+    // box determines how far to look back.
+
+    PARINT* indices = ctx->sorted_indices[0];
+    PARINT nendpoints = pa_count(indices);
+    double maxwidth = 0;
+    for (PARINT i = 0; i < nendpoints; i++) {
+        if (indices[i] % 4 == 0) {
+            double lo = aabbs[indices[i]], hi = aabbs[indices[i] + 2];
+            maxwidth = PAR_MAX(maxwidth, hi - lo);
+        }
+    }
+    for (PARINT i = 0; i < nadds; i++) {
+        PARINT box = adds[i];
+        PARINT lo = 0, hi = nendpoints - 1;
+        while (lo < hi) {
+            PARINT mid = (lo + hi) / 2;
+            if (par_sprune__less(aabbs, indices[mid], box * 4)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        double limit = (double) aabbs[box * 4] - maxwidth;
+        for (PARINT j = lo - 1; j >= 0 && aabbs[indices[j]] >= limit; j--) {
+            PARINT other = indices[j] / 4;
+            if (indices[j] % 4 || PAR_SPRUNE__TEST(isnew, other)) {
+                continue;
+            }
+            if (par_sprune__overlaps(aabbs, other, box, 0) &&
+                par_sprune__overlaps(aabbs, other, box, 1)) {
+                pa_push(ctx->added_pairs, PAR_MIN(other, box));
+                pa_push(ctx->added_pairs, PAR_MAX(other, box));
+            }
+        }
+        for (PARINT j = lo + 1; indices[j] != box * 4 + 2; j++) {
+            PARINT other = indices[j] / 4;
+            if (indices[j] % 4 == 0 &&
+                par_sprune__overlaps(aabbs, other, box, 1)) {
+                pa_push(ctx->added_pairs, PAR_MIN(other, box));
+                pa_push(ctx->added_pairs, PAR_MAX(other, box));
+            }
+        }
+    }
+}
+
 bool par_sprune_update(par_sprune_context* context)
 {
     par_sprune__context* ctx = (par_sprune__context*) context;
-    PARINT* collision_pairs = ctx->collision_pairs;
-    PARINT ncollision_pairs = ctx->ncollision_pairs;
-    ctx->collision_pairs = 0;
-    par_sprune_overlap(ctx->aabbs, ctx->naabbs, context);
-    bool dirty = ncollision_pairs != ctx->ncollision_pairs;
-    if (!dirty) {
-        int pairsize = 2 * sizeof(PARINT);
-        for (int i = 0; i < ctx->ncollision_pairs; i += 2) {
-            PARINT* key = ctx->collision_pairs + i;
-            if (!bsearch(key, collision_pairs, ncollision_pairs,
-                pairsize, par__cmpfind)) {
-                dirty = true;
-                break;
+    pa_clear(ctx->events);
+    pa_clear(ctx->added_pairs);
+    pa_clear(ctx->removed_pairs);
+    par_sprune__apply_removes(ctx);
+    PARFLT const* aabbs = ctx->aabbs;
+
+    // Restore the order of each axis with insertion sort.  Whenever a min
+    // endpoint passes a max endpoint, two boxes either start or stop
+    // overlapping along that axis.
+
+    for (int axis = 0; axis < 2; axis++) {
+        PARINT* indices = ctx->sorted_indices[axis];
+        PARINT nendpoints = pa_count(indices);
+        for (PARINT i = 1; i < nendpoints; i++) {
+            PARINT moving = indices[i];
+            PARINT movingbox = moving / 4;
+            bool movingmin = ((moving - axis) % 4) == 0;
+            PARINT j = i - 1;
+            for (; j >= 0 && par_sprune__less(aabbs, moving, indices[j]); j--) {
+                PARINT passed = indices[j];
+                PARINT passedbox = passed / 4;
+                bool passedmin = ((passed - axis) % 4) == 0;
+                indices[j + 1] = passed;
+                if (movingbox == passedbox || movingmin == passedmin) {
+                    continue;
+                }
+
+                // Pairs that are apart along Y can skip the removal event
+                // during the X sweep, since the Y sweep will remove them.
+                if ((!movingmin && axis == 1) || par_sprune__overlaps(aabbs,
+                    movingbox, passedbox, 1 - axis)) {
+                    par_sprune__push_event(ctx, movingbox, passedbox,
+                        movingmin);
+                }
             }
+            indices[j + 1] = moving;
+        }
+    }
+
+    // The last event for each pair determines its new state, which is
+    // compared against its old state to produce the deltas.
+
+    PARINT* events = ctx->events;
+    int nevents = pa_count(events) / 4;
+    int pairsize = 2 * sizeof(PARINT);
+    par_qsort(events, nevents, 4 * sizeof(PARINT), par__cmpevents, 0);
+    for (int i = 0; i < nevents; i++) {
+        PARINT const* event = events + i * 4;
+        PARINT const* next = event + 4;
+        if (i + 1 < nevents && next[0] == event[0] && next[1] == event[1]) {
+            continue;
+        }
+        bool before = bsearch(event, ctx->collision_pairs,
+            ctx->ncollision_pairs, pairsize, par__cmpfind) != 0;
+        bool after = event[3] != 0;
+        if (before != after) {
+            PARINT** deltas = after ? &ctx->added_pairs : &ctx->removed_pairs;
+            pa_push(*deltas, event[0]);
+            pa_push(*deltas, event[1]);
+        }
+    }
+    par_sprune__apply_adds(ctx);
+    for (PARINT i = 0; i < pa_count(ctx->pending_removes); i++) {
+        pa_push(ctx->freelist, ctx->pending_removes[i]);
+    }
+    pa_clear(ctx->pending_adds);
+    pa_clear(ctx->pending_removes);
+
+    // Edits produce deltas out of order, so sort them before merging.
+
+    par_sprune__sortjob jobs[2];
+    jobs[0].items = ctx->added_pairs;
+    jobs[0].count = pa_count(ctx->added_pairs) / 2;
+    jobs[1].items = ctx->removed_pairs;
+    jobs[1].count = pa_count(ctx->removed_pairs) / 2;
+    jobs[0].aabbs = jobs[1].aabbs = 0;
+    par_sprune__sort_jobs(ctx, jobs, 2);
+    ctx->nadded_pairs = jobs[0].count;
+    ctx->nremoved_pairs = jobs[1].count;
+    if (ctx->nadded_pairs == 0 && ctx->nremoved_pairs == 0) {
+        return false;
+    }
+
+    // Merge the deltas into the sorted list of collision pairs.
+
+    PARINT const* oldpairs = ctx->collision_pairs;
+    PARINT const* added = ctx->added_pairs;
+    PARINT const* removed = ctx->removed_pairs;
+    PARINT const* oldend = oldpairs + ctx->ncollision_pairs * 2;
+    PARINT const* addedend = added + ctx->nadded_pairs * 2;
+    PARINT const* removedend = removed + ctx->nremoved_pairs * 2;
+    pa_clear(ctx->merged);
+    while (oldpairs < oldend || added < addedend) {
+        PARINT const** src = &added;
+        if (added == addedend || (oldpairs < oldend &&
+            par__cmpfind(oldpairs, added) < 0)) {
+            src = &oldpairs;
         }
+        if (src == &oldpairs && removed < removedend &&
+            par__cmpfind(oldpairs, removed) == 0) {
+            oldpairs += 2;
+            removed += 2;
+            continue;
+        }
+        pa_push(ctx->merged, (*src)[0]);
+        pa_push(ctx->merged, (*src)[1]);
+        *src += 2;
+    }
+    PAR_SWAP(PARINT*, ctx->collision_pairs, ctx->merged);
+    ctx->ncollision_pairs = pa_count(ctx->collision_pairs) / 2;
+    return true;
+}
+
+// Copies the client's aabb data into the context so that boxes can be edited.
+static void par_sprune__own(par_sprune__context* ctx)
+{
+    if (ctx->boxes && ctx->aabbs == ctx->boxes) {
+        return;
     }
-    pa_free(collision_pairs);
-    return dirty;
+    pa_clear(ctx->boxes);
+    pa_add(ctx->boxes, ctx->naabbs * 4);
+    if (ctx->naabbs > 0) {
+        memcpy(ctx->boxes, ctx->aabbs, sizeof(PARFLT) * 4 * ctx->naabbs);
+    }
+    ctx->aabbs = ctx->boxes;
 }
 
-bool par_sprune__is_culled(par_sprune__context* ctx, PARINT key)
+PARINT par_sprune_add(par_sprune_context* context, PARFLT const* aabb)
 {
-    for (int i = 0; i < pa_count(ctx->culled); i++) {
-        if (key == ctx->culled[i]) {
-            return true;
+    par_sprune__context* ctx = (par_sprune__context*) context;
+    par_sprune__own(ctx);
+    PARINT box;
+    if (pa_count(ctx->freelist) > 0) {
+        box = pa_last(ctx->freelist);
+        pa___n(ctx->freelist)--;
+    } else {
+        box = ctx->naabbs++;
+        pa_add(ctx->boxes, 4);
+        ctx->aabbs = ctx->boxes;
+        if (pa_count(ctx->deadbits) * 32 < ctx->naabbs) {
+            pa_push(ctx->deadbits, 0);
         }
     }
-    return false;
+    PAR_SPRUNE__CLEAR(ctx->deadbits, box);
+    memcpy(ctx->boxes + box * 4, aabb, sizeof(PARFLT) * 4);
+    pa_push(ctx->pending_adds, box);
+    return box;
+}
+
+void par_sprune_remove(par_sprune_context* context, PARINT box)
+{
+    par_sprune__context* ctx = (par_sprune__context*) context;
+    par_sprune__own(ctx);
+    if (!PAR_SPRUNE__TEST(ctx->deadbits, box)) {
+        PAR_SPRUNE__SET(ctx->deadbits, box);
+        pa_push(ctx->pending_removes, box);
+    }
+}
+
+void par_sprune_move(par_sprune_context* context, PARINT box,
+    PARFLT const* aabb)
+{
+    par_sprune__context* ctx = (par_sprune__context*) context;
+    par_sprune__own(ctx);
+    memcpy(ctx->boxes + box * 4, aabb, sizeof(PARFLT) * 4);
 }
 
-static int par__cmpfindsingle(const void* pa, const void* pb)
+typedef struct {
+    PARFLT const* priorities;
+} par__sprune_ranker;
+
+// Orders boxes from most important to least important.  Boxes that occur
+// earlier in the list are less important when priorities are equal.
+static int par__cmpranks(const void* pa, const void* pb, void* pranker)
 {
     PARINT a = *((const PARINT*) pa);
     PARINT b = *((const PARINT*) pb);
-    if (a > b) return 1;
-    if (a < b) return -1;
+    PARFLT const* priorities = ((par__sprune_ranker*) pranker)->priorities;
+    if (priorities && priorities[a] != priorities[b]) {
+        return priorities[a] < priorities[b] ? 1 : -1;
+    }
+    if (a < b) return 1;
+    if (a > b) return -1;
     return 0;
 }
 
-void par_sprune_cull(par_sprune_context* context)
+void par_sprune_cull_priority(par_sprune_context* context,
+    PARFLT const* priorities, int strategy)
 {
     par_sprune__context* ctx = (par_sprune__context*) context;
+    PARINT const* pairs = ctx->collision_pairs;
+    PARINT npairs = ctx->ncollision_pairs;
+    PARINT naabbs = ctx->naabbs;
+    PARINT nwords = (naabbs + 31) / 32;
     pa_clear(ctx->culled);
-    PARINT* collision_pairs = ctx->collision_pairs;
-    PARINT ncollision_pairs = ctx->ncollision_pairs;
-    int pairsize = 2 * sizeof(PARINT);
-    for (int i = 0; i < ctx->naabbs; i++) {
-        PARINT* found = (PARINT*) bsearch(&i, collision_pairs, ncollision_pairs,
-            pairsize, par__cmpfindsingle);
-        if (!found) {
-            continue;
+    pa_clear(ctx->cullbits);
+    pa_add(ctx->cullbits, nwords);
+    uint32_t* culled = ctx->cullbits;
+    for (PARINT i = 0; i < nwords; i++) {
+        culled[i] = 0;
+    }
+
+    // The greedy strategy visits each pair once and culls the less important
+    // box unless one of them is already gone.
+
+    if (strategy == PAR_SPRUNE_CULL_GREEDY) {
+        for (PARINT i = 0; i < npairs * 2; i += 2) {
+            PARINT a = pairs[i], b = pairs[i + 1];
+            if (PAR_SPRUNE__TEST(culled, a) || PAR_SPRUNE__TEST(culled, b)) {
+                continue;
+            }
+            bool alower = priorities ? priorities[a] <= priorities[b] : true;
+            PAR_SPRUNE__SET(culled, alower ? a : b);
+        }
+    }
+
+    // The maximal strategy builds an adjacency list from the collision pairs,
+    // then visits boxes in order of importance, keeping each box that does
+    // not collide with a box that was already kept.
+
+    if (strategy == PAR_SPRUNE_CULL_MAXIMAL) {
+        pa_clear(ctx->adjacency);
+        pa_add(ctx->adjacency, naabbs + 1 + npairs * 2);
+        PARINT* offsets = ctx->adjacency;
+        PARINT* neighbors = offsets + naabbs + 1;
+        for (PARINT i = 0; i <= naabbs; i++) {
+            offsets[i] = 0;
+        }
+        for (PARINT i = 0; i < npairs * 2; i++) {
+            offsets[pairs[i] + 1]++;
+        }
+        pa_clear(ctx->ranked);
+        for (PARINT i = 0; i < naabbs; i++) {
+            if (offsets[i + 1] > 0) {
+                pa_push(ctx->ranked, i);
+            }
+            offsets[i + 1] += offsets[i];
+        }
+        for (PARINT i = 0; i < npairs * 2; i += 2) {
+            PARINT a = pairs[i], b = pairs[i + 1];
+            neighbors[offsets[a]++] = b;
+            neighbors[offsets[b]++] = a;
         }
-        if (!par_sprune__is_culled(ctx, found[0]) &&
-            !par_sprune__is_culled(ctx, found[1])) {
-            pa_push(ctx->culled, found[0]);
+        for (PARINT i = naabbs; i > 0; i--) {
+            offsets[i] = offsets[i - 1];
+        }
+        offsets[0] = 0;
+        par__sprune_ranker ranker;
+        ranker.priorities = priorities;
+        PARINT nranked = pa_count(ctx->ranked);
+        par_qsort(ctx->ranked, nranked, sizeof(PARINT), par__cmpranks,
+            &ranker);
+        pa_clear(ctx->keepbits);
+        pa_add(ctx->keepbits, nwords);
+        uint32_t* kept = ctx->keepbits;
+        for (PARINT i = 0; i < nwords; i++) {
+            kept[i] = 0;
+        }
+        for (PARINT i = 0; i < nranked; i++) {
+            PARINT box = ctx->ranked[i];
+            bool keep = true;
+            for (PARINT j = offsets[box]; j < offsets[box + 1] && keep; j++) {
+                keep = !PAR_SPRUNE__TEST(kept, neighbors[j]);
+            }
+            if (keep) {
+                PAR_SPRUNE__SET(kept, box);
+            } else {
+                PAR_SPRUNE__SET(culled, box);
+            }
+        }
+    }
+
+    for (PARINT i = 0; i < naabbs; i++) {
+        if (PAR_SPRUNE__TEST(culled, i)) {
+            pa_push(ctx->culled, i);
         }
     }
     ctx->nculled = pa_count(ctx->culled);
 }
 
+void par_sprune_cull(par_sprune_context* context)
+{
+    par_sprune_cull_priority(context, 0, PAR_SPRUNE_CULL_GREEDY);
+}
+
+#undef PAR_SPRUNE__TEST
+#undef PAR_SPRUNE__SET
+#undef PAR_SPRUNE__CLEAR
 #undef PARINT
 #undef PARFLT
 #endif // PAR_SPRUNE_IMPLEMENTATION
@@ -0,0 +1,480 @@
+// Reproducible workloads for the par libraries.  Every input is synthesized
+// from a fixed seed, so runs on different machines measure identical work.
+//
+//     par_bench [maxlevel] [tileset]
+//
+// Each workload is repeated at levels 0 through maxlevel (default 2), where
+// every level multiplies the problem size.  The bluenoise workload runs only
+// when the path to a tileset (e.g. bluenoise.trimmed.bin) is provided.  The
+// JSON report goes to stdout; phases are in milliseconds.  Every workload runs
+// in a child process, so each peak_rss_kb is the high-water mark of that
+// workload alone, and the final one is the largest of them.
+
+#define _POSIX_C_SOURCE 200809L
+
+#define PAR_MSQUARES_T uint32_t
+#define PAR_MSQUARES_THREADS 1
+#define PAR_MSQUARES_IMPLEMENTATION
+#include "par_msquares.h"
+
+#define PAR_SPRUNE_THREADS 1
+#define PAR_SPRUNE_IMPLEMENTATION
+#include "par_sprune.h"
+
+#define PAR_BUBBLES_THREADS 1
+#define PAR_BUBBLES_IMPLEMENTATION
+#include "par_bubbles.h"
+
+#define PAR_BLUENOISE_THREADS 1
+#define PAR_BLUENOISE_IMPLEMENTATION
+#include "par_bluenoise.h"
+
+#define PAR_SHAPES_T uint32_t
+#define PAR_SHAPES_THREADS 1
+#define PAR_SHAPES_IMPLEMENTATION
+#include "par_shapes.h"
+
+#define PAR_FILECACHE_THREADS 1
+#define PAR_FILECACHE_IMPLEMENTATION
+#include "par_filecache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define SEED 0x2545f491u
+#define MAXPHASES 8
+#define PREFIX "par_bench."
+
+typedef struct {
+    char const* name;
+    double ms;
+} phase_t;
+
+static phase_t _phases[MAXPHASES];
+static int _nphases;
+static int _nreports;
+static int _reportfd = -1;
+static char const* _tileset;
+static uint32_t _rng;
+static struct timespec _tick;
+
+static void bench_seed()
+{
+    _rng = SEED;
+}
+
+static uint32_t bench_next()
+{
+    _rng = _rng * 1664525u + 1013904223u;
+    return _rng;
+}
+
+static float bench_rand()
+{
+    return (bench_next() >> 8) * (1.0f / (1 << 24));
+}
+
+static double bench_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - _tick.tv_sec) * 1e3 + (t.tv_nsec - _tick.tv_nsec) * 1e-6;
+}
+
+static void bench_begin()
+{
+    _nphases = 0;
+    clock_gettime(CLOCK_MONOTONIC, &_tick);
+}
+
+// Records the time elapsed since the previous phase ended.
+static void bench_phase(char const* name)
+{
+    double ms = bench_now();
+    for (int i = 0; i < _nphases; i++) {
+        ms -= _phases[i].ms;
+    }
+    _phases[_nphases].name = name;
+    _phases[_nphases++].ms = ms;
+}
+
+static long bench_peak_rss(int who)
+{
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_maxrss;
+}
+
+// Prints one JSON record.  Throughput is the item count divided by the total
+// of all phases that were passed in "timed", a comma-separated list.
+static void bench_report(char const* name, char const* variant, long size,
+    char const* unit, double items, char const* timed, long result)
+{
+    double ms = 0;
+    for (int i = 0; i < _nphases; i++) {
+        if (strstr(timed, _phases[i].name)) {
+            ms += _phases[i].ms;
+        }
+    }
+    printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"size\": %ld, ",
+        _nreports++ ? "," : "", name, variant, size);
+    printf("\"result\": %ld,\n     \"phases\": {", result);
+    for (int i = 0; i < _nphases; i++) {
+        printf("%s\"%s\": %.3f", i ? ", " : "", _phases[i].name,
+            _phases[i].ms);
+    }
+    printf("},\n     \"throughput\": %.1f, \"unit\": \"%s\", ",
+        ms > 0 ? items * 1e3 / ms : 0, unit);
+    printf("\"peak_rss_kb\": %ld}", bench_peak_rss(RUSAGE_SELF));
+    fflush(stdout);
+    if (_reportfd != -1 &&
+        write(_reportfd, &_nreports, sizeof(_nreports)) == -1) {
+        _reportfd = -1;
+    }
+}
+
+// Rolling terrain: a few sine octaves plus randomly placed bumps.
+static void bench_msquares(int level)
+{
+    int width = 1024 << level;
+    int cellsize = 8;
+    bench_seed();
+    bench_begin();
+    float* heights = malloc(sizeof(float) * width * width);
+    float* waves = malloc(sizeof(float) * width * 4);
+    for (int i = 0; i < width; i++) {
+        float t = (float) i / width;
+        waves[i * 4 + 0] = sinf(t * 13.0f);
+        waves[i * 4 + 1] = cosf(t * 11.0f);
+        waves[i * 4 + 2] = sinf(t * 37.0f);
+        waves[i * 4 + 3] = cosf(t * 37.0f);
+    }
+    float* dst = heights;
+    for (int row = 0; row < width; row++) {
+        float const* y = waves + row * 4;
+        for (int col = 0; col < width; col++) {
+            float const* x = waves + col * 4;
+            *dst++ = 0.5f + 0.25f * x[0] * y[1] +
+                0.125f * (x[2] * y[3] + x[3] * y[2]);
+        }
+    }
+    free(waves);
+    for (int i = 0; i < 64; i++) {
+        int cx = bench_next() % width, cy = bench_next() % width;
+        int r = width / 64;
+        for (int row = cy - r > 0 ? cy - r : 0; row < cy + r && row < width;
+            row++) {
+            for (int col = cx - r > 0 ? cx - r : 0;
+                col < cx + r && col < width; col++) {
+                heights[row * width + col] += 0.1f;
+            }
+        }
+    }
+    bench_phase("generate");
+    par_msquares_meshlist* mlist = par_msquares_grayscale(heights, width,
+        width, cellsize, 0.5f, PAR_MSQUARES_HEIGHTS);
+    bench_phase("march");
+    long ntriangles = 0;
+    for (int i = 0; i < par_msquares_get_count(mlist); i++) {
+        ntriangles += par_msquares_get_mesh(mlist, i)->ntriangles;
+    }
+    par_msquares_free(mlist);
+    free(heights);
+    bench_phase("free");
+    bench_report("msquares", "grayscale", width, "pixels/s",
+        (double) width * width, "march", ntriangles);
+}
+
+// Uniformly scattered boxes whose size shrinks with the count, so every box
+// overlaps a handful of neighbors at all scales.
+static float* bench_sprune_boxes(int nboxes, float extent)
+{
+    float* aabbs = malloc(sizeof(float) * 4 * nboxes);
+    for (int i = 0; i < nboxes; i++) {
+        float* box = aabbs + i * 4;
+        box[0] = bench_rand();
+        box[1] = bench_rand();
+        box[2] = box[0] + extent * bench_rand();
+        box[3] = box[1] + extent * bench_rand();
+    }
+    return aabbs;
+}
+
+// The two-axis sweep keeps every per-axis overlap, which grows faster than
+// the collision count, so it only runs on the smaller sets.
+static void bench_sprune_sweep(int level)
+{
+    int nboxes = 1000 << (2 * level);
+    if (nboxes > 16000) {
+        return;
+    }
+    bench_seed();
+    bench_begin();
+    float* aabbs = bench_sprune_boxes(nboxes, 2.0f / sqrtf(nboxes));
+    bench_phase("generate");
+    par_sprune_context* ctx = par_sprune_overlap(aabbs, nboxes, 0);
+    bench_phase("sweep");
+    long npairs = ctx->ncollision_pairs;
+    par_sprune_free_context(ctx);
+    free(aabbs);
+    bench_report("sprune", "sweep", nboxes, "boxes/s", nboxes, "sweep",
+        npairs);
+}
+
+static void bench_sprune_lowmem(int level)
+{
+    int nboxes = 1000 << (2 * level);
+    bench_seed();
+    bench_begin();
+    float* aabbs = bench_sprune_boxes(nboxes, 2.0f / sqrtf(nboxes));
+    bench_phase("generate");
+    par_sprune_context* ctx = par_sprune_overlap_lowmem(aabbs, nboxes, 0);
+    bench_phase("sweep");
+    long npairs = ctx->ncollision_pairs;
+    par_sprune_free_context(ctx);
+    free(aabbs);
+    bench_report("sprune", "lowmem", nboxes, "boxes/s", nboxes, "sweep",
+        npairs);
+}
+
+// Every frame nudges all boxes by a small fraction of their extent.
+static void bench_sprune_incremental(int level)
+{
+    int nboxes = 1000 << (2 * level);
+    int nframes = 8;
+    float extent = 2.0f / sqrtf(nboxes);
+    bench_seed();
+    float* aabbs = bench_sprune_boxes(nboxes, extent);
+    bench_seed();
+    bench_begin();
+    par_sprune_context* ctx = par_sprune_overlap_lowmem(aabbs, nboxes, 0);
+    bench_phase("sweep");
+    double jitter = 0;
+    long nchanges = 0;
+    for (int frame = 0; frame < nframes; frame++) {
+        double start = bench_now();
+        for (int i = 0; i < nboxes; i++) {
+            float* box = aabbs + i * 4;
+            float dx = extent * 0.05f * (bench_rand() - 0.5f);
+            float dy = extent * 0.05f * (bench_rand() - 0.5f);
+            box[0] += dx, box[2] += dx;
+            box[1] += dy, box[3] += dy;
+        }
+        jitter += bench_now() - start;
+        par_sprune_update(ctx);
+        nchanges += ctx->nadded_pairs + ctx->nremoved_pairs;
+    }
+    bench_phase("frames");
+    _phases[_nphases - 1].ms -= jitter;
+    _phases[_nphases].name = "jitter";
+    _phases[_nphases++].ms = jitter;
+    par_sprune_free_context(ctx);
+    free(aabbs);
+    bench_report("sprune", "incremental", nboxes, "boxes/s",
+        (double) nboxes * nframes, "frames", nchanges);
+}
+
+// The deep tree attaches every node to one of the eight most recent nodes;
+// the flat tree has 64 children under the root and everything else one
+// level below.
+static void bench_bubbles(int level, int deep)
+{
+    int nnodes = 1000 << (2 * level);
+    bench_seed();
+    bench_begin();
+    PAR_BUBBLES_INT* tree = malloc(sizeof(PAR_BUBBLES_INT) * nnodes);
+    tree[0] = 0;
+    for (int i = 1; i < nnodes; i++) {
+        if (deep) {
+            int window = i < 8 ? i : 8;
+            tree[i] = i - 1 - bench_next() % window;
+        } else {
+            tree[i] = i < 65 ? 0 : 1 + bench_next() % 64;
+        }
+    }
+    bench_phase("generate");
+    par_bubbles_t* bubbles = par_bubbles_hpack_circle(tree, nnodes, 1.0);
+    bench_phase("hpack");
+    PAR_BUBBLES_INT maxdepth, leaf;
+    par_bubbles_get_maxdepth(bubbles, &maxdepth, &leaf);
+    par_bubbles_free_result(bubbles);
+    free(tree);
+    bench_report("bubbles", deep ? "deep" : "flat", nnodes, "nodes/s", nnodes,
+        "hpack", maxdepth);
+}
+
+static void bench_bubbles_deep(int level)
+{
+    bench_bubbles(level, 1);
+}
+
+static void bench_bubbles_flat(int level)
+{
+    bench_bubbles(level, 0);
+}
+
+// Zooms into the domain center; each level halves the viewport and
+// quadruples the density so the point count stays roughly constant.  The
+// tileset is loaded here so that it only counts towards this workload's RSS.
+static void bench_bluenoise(int level)
+{
+    par_bluenoise_context* ctx = par_bluenoise_from_file(_tileset, 1000000);
+    if (!ctx) {
+        fprintf(stderr, "Unable to load %s\n", _tileset);
+        return;
+    }
+    float zoom = 1 << level;
+    float extent = 0.5f / zoom;
+    bench_begin();
+    par_bluenoise_set_viewport(ctx, -extent, -extent, extent, extent);
+    int npts;
+    par_bluenoise_generate(ctx, 10000 * zoom * zoom, &npts);
+    bench_phase("generate");
+    bench_report("bluenoise", "zoom", (long) zoom, "points/s", npts,
+        "generate", npts);
+    par_bluenoise_free(ctx);
+}
+
+// Welds an unwelded torus back together, then computes smooth normals.
+static void bench_shapes(int level)
+{
+    int slices = 64 << level;
+    bench_begin();
+    par_shapes_mesh* mesh = par_shapes_create_torus(slices, slices, 0.5f);
+    PAR_FREE(mesh->normals);
+    PAR_FREE(mesh->tcoords);
+    mesh->normals = mesh->tcoords = 0;
+    par_shapes_unweld(mesh, true);
+    bench_phase("generate");
+    par_shapes_mesh* welded = par_shapes_weld(mesh, 0.0001f, 0);
+    bench_phase("weld");
+    par_shapes_compute_normals(welded);
+    bench_phase("normals");
+    long npoints = welded->npoints;
+    long ninput = mesh->npoints;
+    par_shapes_free_mesh(welded);
+    par_shapes_free_mesh(mesh);
+    bench_report("shapes", "weld", slices, "verts/s", ninput, "weld,normals",
+        npoints);
+}
+
+// Looks up names that are absent, saves them, then loads them back.
+static void bench_filecache(int level)
+{
+    int nitems = 256 << level;
+    int itemsize = 4096;
+    char name[32];
+    bench_seed();
+    bench_begin();
+    uint8_t* payload = malloc(itemsize);
+    uint8_t* loaded = malloc(itemsize);
+    for (int i = 0; i < itemsize; i++) {
+        payload[i] = bench_next() % 16;
+    }
+    par_filecache_context* ctx = par_filecache_create_context(PREFIX,
+        nitems * itemsize * 2);
+    par_filecache_ctx_evict_all(ctx);
+    bench_phase("setup");
+    long nmissed = 0;
+    for (int i = 0; i < nitems; i++) {
+        snprintf(name, sizeof(name), "item%d", i);
+        int nbytes;
+        nmissed += par_filecache_ctx_load_into(ctx, name, loaded, itemsize,
+            &nbytes, 0, 0);
+    }
+    bench_phase("miss");
+    for (int i = 0; i < nitems; i++) {
+        snprintf(name, sizeof(name), "item%d", i);
+        payload[0] = i;
+        par_filecache_ctx_save(ctx, name, payload, itemsize, 0, 0);
+    }
+    bench_phase("save");
+    long nhit = 0;
+    for (int i = 0; i < nitems; i++) {
+        snprintf(name, sizeof(name), "item%d", i);
+        int nbytes;
+        nhit += par_filecache_ctx_load_into(ctx, name, loaded, itemsize,
+            &nbytes, 0, 0);
+    }
+    bench_phase("hit");
+    par_filecache_ctx_evict_all(ctx);
+    par_filecache_destroy_context(ctx);
+    free(payload);
+    free(loaded);
+    bench_phase("teardown");
+    bench_report("filecache", "miss", nitems, "loads/s", nitems, "miss",
+        nmissed);
+    bench_report("filecache", "hit", nitems, "loads/s", nitems, "hit",
+        nhit);
+}
+
+// Runs a workload in a child process and returns once its records are
+// printed.  The child sends its record count down a pipe after each record,
+// so the count survives a crash; the parent then stands in a failure record.
+static void bench_run(char const* name, void (*workload)(int level),
+    int level)
+{
+    int fds[2];
+    fflush(stdout);
+    if (pipe(fds) == -1) {
+        workload(level);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        _reportfd = fds[1];
+        workload(level);
+        fflush(stdout);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        close(fds[0]);
+        workload(level);
+        return;
+    }
+    int count;
+    while (read(fds[0], &count, sizeof(count)) == sizeof(count)) {
+        _nreports = count;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("%s\n    {\"name\": \"%s\", \"level\": %d, \"status\": %d}",
+            _nreports++ ? "," : "", name, level, WIFSIGNALED(status) ?
+            -WTERMSIG(status) : WEXITSTATUS(status));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int maxlevel = argc > 1 ? atoi(argv[1]) : 2;
+    _tileset = argc > 2 ? argv[2] : 0;
+    printf("{\"seed\": %u, \"maxlevel\": %d, \"benchmarks\": [", SEED,
+        maxlevel);
+    for (int level = 0; level <= maxlevel; level++) {
+        if (level <= 4) {
+            bench_run("msquares", bench_msquares, level);
+        }
+        if (level <= 5) {
+            bench_run("sprune_sweep", bench_sprune_sweep, level);
+            bench_run("sprune_lowmem", bench_sprune_lowmem, level);
+            bench_run("sprune_incremental", bench_sprune_incremental, level);
+        }
+        bench_run("bubbles_deep", bench_bubbles_deep, level);
+        bench_run("bubbles_flat", bench_bubbles_flat, level);
+        if (_tileset) {
+            bench_run("bluenoise", bench_bluenoise, level);
+        }
+        bench_run("shapes", bench_shapes, level);
+        bench_run("filecache", bench_filecache, level);
+    }
+    printf("\n], \"peak_rss_kb\": %ld}\n", bench_peak_rss(RUSAGE_CHILDREN));
+    return 0;
+}
@@ -2,7 +2,10 @@
 #include "lodepng.h"
 
 #define PAR_BLUENOISE_IMPLEMENTATION
+#define PAR_BLUENOISE_THREADS 1
+#define PAR_BLUENOISE_NTHREADS 4
 #include "par_bluenoise.h"
+#include "describe.h"
 
 const int MAXPTS = 100000;
 const int DENSITY = 200000;
@@ -10,6 +13,246 @@ const int RESOLUTION = 384;
 
 #define CLAMP(x, min, max) ((x < min) ? min : ((x > max) ? max : x))
 
+// Synthetic tilesets are random rather than blue, but they exercise the same
+// traversal as real tilesets and need no download.
+#define SYNTH_NTILES 3
+#define SYNTH_NSUBTILES 3
+
+static uint32_t synth_rng;
+
+static float synth_rand()
+{
+    synth_rng = synth_rng * 1664525u + 1013904223u;
+    return (synth_rng >> 8) * (1.0f / (1 << 24));
+}
+
+static void synth_write(par_byte** ptr, int32_t i)
+{
+    memcpy(*ptr, &i, 4);
+    *ptr += 4;
+}
+
+static void synth_writef(par_byte** ptr, float f)
+{
+    memcpy(*ptr, &f, 4);
+    *ptr += 4;
+}
+
+static par_bluenoise_context* synthetic_context(int maxpts)
+{
+    int nsubtiles = SYNTH_NSUBTILES * SYNTH_NSUBTILES;
+    int nwords = 3 + SYNTH_NTILES * (6 + nsubtiles + 2 * 9 * 10);
+    par_byte* buffer = malloc(nwords * 4);
+    par_byte* ptr = buffer;
+    synth_rng = 1;
+    synth_write(&ptr, SYNTH_NTILES);
+    synth_write(&ptr, SYNTH_NSUBTILES);
+    synth_write(&ptr, 1);
+    for (int t = 0; t < SYNTH_NTILES; t++) {
+        for (int edge = 0; edge < 4; edge++) {
+            synth_write(&ptr, 0);
+        }
+        for (int i = 0; i < nsubtiles; i++) {
+            synth_write(&ptr, (t + i) % SYNTH_NTILES);
+        }
+        int npoints = 8 + t;
+        synth_write(&ptr, npoints);
+        for (int i = 0; i < npoints * 2; i++) {
+            synth_writef(&ptr, synth_rand());
+        }
+        synth_write(&ptr, npoints * (nsubtiles - 1));
+        for (int i = 0; i < npoints * (nsubtiles - 1) * 2; i++) {
+            synth_writef(&ptr, synth_rand());
+        }
+    }
+    par_bluenoise_context* ctx = par_bluenoise_from_buffer(buffer,
+        ptr - buffer, maxpts);
+    free(buffer);
+    return ctx;
+}
+
+static int cmp_xy(const void* a, const void* b)
+{
+    float const* p = (float const*) a;
+    float const* q = (float const*) b;
+    if (p[0] != q[0]) {
+        return p[0] < q[0] ? -1 : 1;
+    }
+    return p[1] < q[1] ? -1 : p[1] > q[1];
+}
+
+// Counts the points in "pts" that are absent from "sorted", which must be in
+// xy order.
+static int count_missing(float const* pts, int npts, float const* sorted,
+    int nsorted)
+{
+    int missing = 0;
+    for (int i = 0; i < npts; i++) {
+        missing += !bsearch(pts + i * 3, sorted, nsorted, sizeof(float) * 3,
+            cmp_xy);
+    }
+    return missing;
+}
+
+// Returns the number of points that disagree with generate.  Several points
+// can appear at the same density, so the result of generate_exact must
+// contain everything that generate produces just below the smallest density
+// that yields npts points, and nothing beyond what it produces at that
+// density.
+static int exact_mismatches(par_bluenoise_context* ctx, int npts)
+{
+    float* pts = par_bluenoise_generate_exact(ctx, npts, 3);
+    if (!pts) {
+        return npts;
+    }
+    float* exact = malloc(sizeof(float) * 3 * npts);
+    memcpy(exact, pts, sizeof(float) * 3 * npts);
+    qsort(exact, npts, sizeof(float) * 3, cmp_xy);
+    int count;
+    double lo = 0, hi = 1;
+    while (par_bluenoise_generate(ctx, hi, &count), count < npts) {
+        lo = hi;
+        hi *= 2;
+    }
+    for (int i = 0; i < 64 && (float) lo != (float) hi; i++) {
+        double mid = (float) (0.5 * (lo + hi));
+        par_bluenoise_generate(ctx, mid, &count);
+        if (count < npts) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    pts = par_bluenoise_generate(ctx, lo, &count);
+    int mismatches = count_missing(pts, count, exact, npts);
+    pts = par_bluenoise_generate(ctx, hi, &count);
+    qsort(pts, count, sizeof(float) * 3, cmp_xy);
+    mismatches += count_missing(exact, npts, pts, count);
+    free(exact);
+    return mismatches;
+}
+
+static bool near(float a, float b)
+{
+    return fabsf(a - b) < 1e-6f;
+}
+
+// Mirrors generate with the pyramid skip removed, for comparison.
+static void reference_recurse(par_bluenoise_context* ctx, par_tile* tile,
+    float x, float y, int level, par_vec3* dst, int* npts)
+{
+    float tileSize = 1.f / powf(ctx->nsubtiles, level);
+    if (x + tileSize < ctx->left || x > ctx->right ||
+        y + tileSize < ctx->bottom || y > ctx->top) {
+        return;
+    }
+    float depth = powf(ctx->nsubtiles, 2 * level);
+    float threshold = ctx->mag / depth * ctx->global_density - tile->npoints;
+    int ntests = threshold < tile->nsubpts ? threshold : tile->nsubpts;
+    float factor = 1.f / ctx->mag * depth / ctx->global_density;
+    for (int i = 0; i < ntests; i++) {
+        float px = x + tile->subpts[i].x * tileSize;
+        float py = y + tile->subpts[i].y * tileSize;
+        if (px < ctx->left || px > ctx->right || py < ctx->bottom ||
+            py > ctx->top) {
+            continue;
+        }
+        if (sample_density(ctx, px, py) < (i + tile->npoints) * factor) {
+            continue;
+        }
+        dst[*npts].x = px - 0.5;
+        dst[*npts].y = py - 0.5;
+        dst[(*npts)++].rank = (level + 1) + i * factor;
+    }
+    if (threshold <= tile->nsubpts) {
+        return;
+    }
+    float scale = tileSize / ctx->nsubtiles;
+    for (int ty = 0; ty < ctx->nsubtiles; ty++) {
+        for (int tx = 0; tx < ctx->nsubtiles; tx++) {
+            int index = tile->subdivs[0][ty * ctx->nsubtiles + tx];
+            reference_recurse(ctx, ctx->tiles + index, x + tx * scale,
+                y + ty * scale, level + 1, dst, npts);
+        }
+    }
+}
+
+// Emits the points of the root tile the same way generate does.
+static int root_points(par_bluenoise_context* ctx, float density,
+    par_vec3* expected)
+{
+    int nexpected = 0;
+    par_tile* root = ctx->tiles;
+    float factor = 1.f / ctx->mag / density;
+    float limit = ctx->mag * density;
+    int ntests = limit < root->npoints ? limit : root->npoints;
+    for (int i = 0; i < ntests; i++) {
+        float px = root->points[i].x, py = root->points[i].y;
+        if (px < ctx->left || px > ctx->right || py < ctx->bottom ||
+            py > ctx->top) {
+            continue;
+        }
+        if (sample_density(ctx, px, py) >= (i + 1) * factor) {
+            expected[nexpected].x = px - 0.5;
+            expected[nexpected].y = py - 0.5;
+            expected[nexpected++].rank = i * factor;
+        }
+    }
+    return nexpected;
+}
+
+// Returns the number of points that differ from the reference, or -1 if
+// the counts differ.
+static int skip_mismatches(par_bluenoise_context* ctx, float density)
+{
+    int npts;
+    float* pts = par_bluenoise_generate(ctx, density, &npts);
+    par_vec3* expected = malloc(sizeof(par_vec3) * MAXPTS);
+    int nexpected = root_points(ctx, density, expected);
+    reference_recurse(ctx, ctx->tiles, 0, 0, 0, expected, &nexpected);
+    int mismatches = -1;
+    if (nexpected == npts) {
+        mismatches = 0;
+        for (int i = 0; i < npts * 3; i++) {
+            mismatches += pts[i] != (&expected->x)[i];
+        }
+    }
+    free(expected);
+    return mismatches;
+}
+
+// Generates the same points serially and with generate_parallel, which runs
+// even on one core since NTHREADS is fixed.  Returns the number of points
+// that differ from generate, or -1 if the counts differ or no threads ran.
+static int parallel_mismatches(par_bluenoise_context* ctx, float density)
+{
+    int npts;
+    float* pts = par_bluenoise_generate(ctx, density, &npts);
+    par_sink sinks[2];
+    for (int i = 0; i < 2; i++) {
+        sinks[i].points = malloc(sizeof(par_vec3) * ctx->maxpoints);
+        sinks[i].npoints = root_points(ctx, density, sinks[i].points);
+        sinks[i].maxpoints = sinks[i].capacity = ctx->maxpoints;
+        sinks[i].maxlevel = INT_MAX;
+    }
+    recurse_tile(ctx, sinks, ctx->tiles, 0, 0, 0);
+    int mismatches = -1;
+    if (generate_parallel(ctx, sinks + 1) && sinks[0].npoints == npts &&
+        sinks[1].npoints == npts) {
+        mismatches = 0;
+        for (int i = 0; i < npts; i++) {
+            float const* a = &sinks[0].points[i].x;
+            float const* b = &sinks[1].points[i].x;
+            for (int c = 0; c < 3; c++) {
+                mismatches += a[c] != b[c] || a[c] != pts[i * 3 + c];
+            }
+        }
+    }
+    free(sinks[0].points);
+    free(sinks[1].points);
+    return mismatches;
+}
+
 static void test_bluenoise()
 {
     int nbytes;
@@ -64,7 +307,100 @@ static void test_bluenoise()
 
 int main(int argc, char* argv[])
 {
+    describe("par_bluenoise_generate_exact") {
+
+        it("should match generate at the smallest sufficient density") {
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            assert_equal(exact_mismatches(ctx, 20), 0);
+            assert_equal(exact_mismatches(ctx, 500), 0);
+            par_bluenoise_free(ctx);
+        }
+
+        it("should match generate on a striped density map") {
+            unsigned char pixels[64 * 64];
+            for (int i = 0; i < 64 * 64; i++) {
+                pixels[i] = (i % 64) / 8 % 2 ? 0 : 200;
+            }
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            par_bluenoise_density_from_gray(ctx, pixels, 64, 64, 1);
+            assert_equal(exact_mismatches(ctx, 20), 0);
+            assert_equal(exact_mismatches(ctx, 2000), 0);
+            assert_equal(exact_mismatches(ctx, 20000), 0);
+            par_bluenoise_free(ctx);
+        }
+
+        it("should not give up on a thin viewport") {
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            par_bluenoise_set_viewport(ctx, 0.1, -0.1, 0.1 + 1e-5, 0.1);
+            assert_equal(exact_mismatches(ctx, 1), 0);
+            assert_equal(exact_mismatches(ctx, 50), 0);
+            par_bluenoise_free(ctx);
+        }
+
+        it("should fail only when the density is too sparse") {
+            unsigned char pixels[16 * 16];
+            memset(pixels, 255, sizeof(pixels));
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            par_bluenoise_density_from_gray(ctx, pixels, 16, 16, 1);
+            assert_null(par_bluenoise_generate_exact(ctx, 1, 3));
+            par_bluenoise_free(ctx);
+        }
+    }
+
+    describe("density") {
+
+        it("should skip only tiles that contribute no points") {
+            unsigned char pixels[64 * 64];
+            for (int j = 0; j < 64; j++) {
+                for (int i = 0; i < 64; i++) {
+                    pixels[j * 64 + i] = j < 32 ? 255 : i * 4;
+                }
+            }
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            par_bluenoise_density_from_gray(ctx, pixels, 64, 64, 1);
+            assert_equal(skip_mismatches(ctx, 2000), 0);
+            assert_equal(skip_mismatches(ctx, 6000), 0);
+            assert_equal(skip_mismatches(ctx, 30000), 0);
+            par_bluenoise_set_viewport(ctx, -0.3, 0.0, -0.1, 0.2);
+            assert_equal(skip_mismatches(ctx, 300), 0);
+            assert_equal(skip_mismatches(ctx, 1000), 0);
+            par_bluenoise_free(ctx);
+        }
+
+        it("should generate the same points with threads") {
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            assert_equal(parallel_mismatches(ctx, 2000), 0);
+            assert_equal(parallel_mismatches(ctx, 30000), 0);
+            par_bluenoise_free(ctx);
+            ctx = synthetic_context(500);
+            assert_equal(parallel_mismatches(ctx, 30000), 0);
+            assert_equal(ctx->npoints, 500);
+            par_bluenoise_free(ctx);
+        }
+        it("should interpolate bilinearly between texels") {
+            unsigned char pixels[4 * 4];
+            for (int i = 0; i < 16; i++) {
+                pixels[i] = 255 - (i % 4) * 85;
+            }
+            par_bluenoise_context* ctx = synthetic_context(MAXPTS);
+            par_bluenoise_density_from_gray(ctx, pixels, 4, 4, 1);
+            assert_ok(near(sample_density(ctx, 0.125, 0.5), 0.0f));
+            assert_ok(near(sample_density(ctx, 0.25, 0.5), 1.0f / 6.0f));
+            assert_ok(near(sample_density(ctx, 0.5, 0.3), 0.5f));
+            assert_ok(near(sample_density(ctx, 0.75, 0.9), 5.0f / 6.0f));
+            assert_ok(near(sample_density(ctx, 1.0, 0.1), 1.0f));
+            for (int i = 0; i < 16; i++) {
+                pixels[i] = 255 - (i / 4) * 85;
+            }
+            par_bluenoise_density_from_gray(ctx, pixels, 4, 4, 1);
+            assert_ok(near(sample_density(ctx, 0.3, 0.875), 0.0f));
+            assert_ok(near(sample_density(ctx, 0.3, 0.75), 1.0f / 6.0f));
+            assert_ok(near(sample_density(ctx, 0.3, 0.5), 0.5f));
+            par_bluenoise_free(ctx);
+        }
+    }
+
     asset_init();
     test_bluenoise();
-    return 0;
+    return assert_failures();
 }
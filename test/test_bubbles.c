@@ -1,6 +1,8 @@
 #include "describe.h"
 
 #define PAR_BUBBLES_IMPLEMENTATION
+#define PAR_BUBBLES_THREADS 1
+#define PAR_BUBBLES_NTHREADS 4
 #include "par_bubbles.h"
 
 #define PAR_SHAPES_T uint32_t
@@ -143,6 +145,124 @@ int main()
             free(tree);
         }
 
+        it("should pack many circles without overlap") {
+            const int n = 5000;
+            double* radii = malloc(sizeof(double) * n);
+            for (int i = 0; i < n; i++) {
+                radii[i] = 1 + rand() % 10;
+            }
+            bubbles = par_bubbles_pack(radii, n);
+            par_bubbles_t* small = par_bubbles_pack(radii, 60);
+            int mismatches = 0;
+            for (int i = 0; i < small->count * 3; i++) {
+                mismatches += small->xyr[i] != bubbles->xyr[i];
+            }
+            assert_equal(mismatches, 0);
+            int overlaps = 0;
+            for (int i = 0; i < n; i++) {
+                double const* a = bubbles->xyr + i * 3;
+                for (int j = i + 1; j < n; j++) {
+                    double const* b = bubbles->xyr + j * 3;
+                    double dx = a[0] - b[0], dy = a[1] - b[1];
+                    double dr = 0.99 * (a[2] + b[2]);
+                    overlaps += dx * dx + dy * dy < dr * dr;
+                }
+            }
+            assert_equal(overlaps, 0);
+            par_bubbles_free_result(small);
+            par_bubbles_free_result(bubbles);
+            free(radii);
+        }
+
+        it("should pack mixed radii without overlap") {
+            const int n = 5000;
+            double* radii = malloc(sizeof(double) * n);
+            srand(2);
+            for (int i = 0; i < n; i++) {
+                radii[i] = 1 + rand() % 10;
+            }
+            for (int i = 0; i < 20; i++) {
+                radii[100 + i * 211] = 300;
+            }
+            radii[4000] = 3000;
+            bubbles = par_bubbles_pack(radii, n);
+            int overlaps = 0;
+            for (int i = 0; i < n; i++) {
+                double const* a = bubbles->xyr + i * 3;
+                for (int j = i + 1; j < n; j++) {
+                    double const* b = bubbles->xyr + j * 3;
+                    double dx = a[0] - b[0], dy = a[1] - b[1];
+                    double dr = 0.99 * (a[2] + b[2]);
+                    overlaps += dx * dx + dy * dy < dr * dr;
+                }
+            }
+            assert_equal(overlaps, 0);
+            par_bubbles_free_result(bubbles);
+            free(radii);
+        }
+
+    }
+
+    describe("par_bubbles_hpack_local") {
+
+        it("should be deterministic when packing subtrees in parallel") {
+            const int nnodes = 50000;
+            int* tree = malloc(sizeof(int) * nnodes);
+            tree[0] = 0;
+            for (int i = 1; i < nnodes; i++) {
+                float a = (float) rand() / RAND_MAX;
+                float b = (float) rand() / RAND_MAX;
+                tree[i] = i * a * b;
+            }
+            par_bubbles_t* first = par_bubbles_hpack_local(tree, nnodes);
+            par_bubbles_t* second = par_bubbles_hpack_local(tree, nnodes);
+            int mismatches = 0;
+            for (int i = 0; i < nnodes * 3; i++) {
+                mismatches += first->xyr[i] != second->xyr[i];
+            }
+            assert_equal(mismatches, 0);
+            par_bubbles_free_result(first);
+            par_bubbles_free_result(second);
+            free(tree);
+        }
+
+        it("should match a full re-pack after an incremental update") {
+            const int nnodes = 20000, nadded = 100;
+            int* tree = malloc(sizeof(int) * (nnodes + nadded));
+            int edited[nadded + 10];
+            tree[0] = 0;
+            for (int i = 1; i < nnodes + nadded; i++) {
+                float a = (float) rand() / RAND_MAX;
+                float b = (float) rand() / RAND_MAX;
+                tree[i] = i * a * b;
+            }
+            par_bubbles_t* bubbles = par_bubbles_hpack_local(tree, nnodes);
+            int nedited = 0;
+            for (int i = 0; i < nadded; i++) {
+                edited[nedited++] = nnodes + i;
+            }
+            for (int i = 0; i < 10; i++) {
+                int node = 1 + rand() % (nnodes - 1);
+                tree[node] = rand() % node;
+                edited[nedited++] = node;
+            }
+            par_bubbles_hpack_local_update(bubbles, tree, nnodes + nadded,
+                edited, nedited);
+            int* moved;
+            int nmoved;
+            par_bubbles_get_moved(bubbles, &moved, &nmoved);
+            assert_ok(nmoved >= nadded);
+            par_bubbles_t* full = par_bubbles_hpack_local(tree,
+                nnodes + nadded);
+            int mismatches = 0;
+            for (int i = 0; i < (nnodes + nadded) * 3; i++) {
+                mismatches += bubbles->xyr[i] != full->xyr[i];
+            }
+            assert_equal(mismatches, 0);
+            par_bubbles_free_result(bubbles);
+            par_bubbles_free_result(full);
+            free(tree);
+        }
     }
 
     describe("precision") {
@@ -230,5 +350,72 @@ int main()
         }
     }
 
+    describe("par_bubbles_cull_preorder") {
+
+        it("should produce the same disks as cull_local") {
+            bubbles = par_bubbles_hpack_local(hierarchy, NNODES);
+            par_bubbles_preorder_t* preorder =
+                par_bubbles_preorder_local(bubbles, 139);
+            par_bubbles_t* culled = 0;
+            int mismatches = 0;
+            for (int frame = 0; frame < 20; frame++) {
+                double r = pow(0.8, frame);
+                double aabb[4] = { -0.5 - r, -r, -0.5 + r, r };
+                double minradius = r * 0.05;
+                culled = par_bubbles_cull_local(bubbles, aabb, minradius, 139,
+                    culled);
+                par_bubbles_cull_preorder(preorder, aabb, minradius);
+                int count = 0;
+                for (int s = 0; s < preorder->nspans; s++) {
+                    int begin = preorder->spans[s * 2];
+                    int end = preorder->spans[s * 2 + 1];
+                    for (int i = begin; i < end; i++, count++) {
+                        mismatches += count >= culled->count ||
+                            culled->ids[count] != preorder->ids[i];
+                    }
+                }
+                mismatches += count != culled->count;
+            }
+            assert_equal(mismatches, 0);
+            par_bubbles_free_preorder(preorder);
+            par_bubbles_free_result(culled);
+            par_bubbles_free_result(bubbles);
+        }
+    }
+
+    describe("par_bubbles_load") {
+
+        it("should map a saved hierarchy without re-packing") {
+            bubbles = par_bubbles_hpack_local(hierarchy, NNODES);
+            assert_ok(par_bubbles_save(bubbles, "build/test_bubbles.bin"));
+            par_bubbles_t* loaded = par_bubbles_load("build/test_bubbles.bin");
+            assert_ok(loaded);
+            assert_equal(loaded->count, NNODES);
+            int mismatches = 0;
+            for (int i = 0; i < NNODES * 3; i++) {
+                mismatches += loaded->xyr[i] != bubbles->xyr[i];
+            }
+            assert_equal(mismatches, 0);
+            double aabb[4] = { -0.6, -0.1, -0.4, 0.1 };
+            par_bubbles_t* a = par_bubbles_cull_local(bubbles, aabb, 0, 139, 0);
+            par_bubbles_t* b = par_bubbles_cull_local(loaded, aabb, 0, 139, 0);
+            assert_equal(a->count, b->count);
+            assert_equal(par_bubbles_pick_local(loaded, -0.654258, 0.065455,
+                139, 0), 162);
+            par_bubbles_free_result(a);
+            par_bubbles_free_result(b);
+            par_bubbles_free_result(loaded);
+            par_bubbles_free_result(bubbles);
+        }
+
+        it("should reject files that were not created by save") {
+            FILE* file = fopen("build/test_bubbles.svg.bin", "wb");
+            fputs("not a bubble diagram", file);
+            fclose(file);
+            assert_null(par_bubbles_load("build/test_bubbles.svg.bin"));
+            assert_null(par_bubbles_load("build/nonexistent.bin"));
+        }
+    }
+
     return assert_failures();
 }
@@ -0,0 +1,137 @@
+#include "describe.h"
+
+#define PAR_EASINGS_IMPLEMENTATION
+#include "par_easings.h"
+
+#include <math.h>
+
+#define NVALUES 1001
+
+typedef void (*batched_fn)(float const*, float*, int);
+
+static struct {
+    par_easings_fn scalar;
+    batched_fn batched;
+} _easings[] = {
+    {par_easings_linear, par_easings_linear_n},
+    {par_easings_in_cubic, par_easings_in_cubic_n},
+    {par_easings_out_cubic, par_easings_out_cubic_n},
+    {par_easings_in_out_cubic, par_easings_in_out_cubic_n},
+    {par_easings_in_quad, par_easings_in_quad_n},
+    {par_easings_out_quad, par_easings_out_quad_n},
+    {par_easings_in_out_quad, par_easings_in_out_quad_n},
+    {par_easings_in_elastic, par_easings_in_elastic_n},
+    {par_easings_out_elastic, par_easings_out_elastic_n},
+    {par_easings_in_out_elastic, par_easings_in_out_elastic_n},
+    {par_easings_in_bounce, par_easings_in_bounce_n},
+    {par_easings_out_bounce, par_easings_out_bounce_n},
+    {par_easings_in_out_bounce, par_easings_in_out_bounce_n},
+    {par_easings_in_back, par_easings_in_back_n},
+    {par_easings_out_back, par_easings_out_back_n},
+    {par_easings_in_out_back, par_easings_in_out_back_n},
+};
+
+#define NEASINGS ((int) (sizeof(_easings) / sizeof(_easings[0])))
+
+// Fills t with random values in [0, 1], with both endpoints at the front.
+static void random_times(float* t, int n)
+{
+    for (int i = 0; i < n; i++) {
+        t[i] = (float) rand() / RAND_MAX;
+    }
+    t[0] = 0;
+    t[1] = 1;
+}
+
+// Returns the largest difference between a batched function and its scalar
+// counterpart over the first n values of t.
+static float batched_error(int which, float const* t, int n)
+{
+    float out[NVALUES];
+    _easings[which].batched(t, out, n);
+    float maxerror = 0;
+    for (int i = 0; i < n; i++) {
+        float e = fabsf(out[i] - _easings[which].scalar(t[i]));
+        maxerror = e > maxerror ? e : maxerror;
+    }
+    return maxerror;
+}
+
+int main()
+{
+    float t[NVALUES];
+    srand(1);
+    random_times(t, NVALUES);
+
+    describe("batched easings") {
+        it("should match the scalar functions") {
+            int nmismatches = 0;
+            for (int i = 0; i < NEASINGS; i++) {
+                nmismatches += batched_error(i, t, NVALUES) > 1e-5f;
+            }
+            assert_equal(nmismatches, 0);
+        }
+        it("should handle lengths that are not a multiple of the width") {
+            int nmismatches = 0, noverruns = 0;
+            float out[16];
+            for (int i = 0; i < NEASINGS; i++) {
+                for (int n = 0; n < 10; n++) {
+                    nmismatches += batched_error(i, t, n) > 1e-5f;
+                    out[n] = -99;
+                    _easings[i].batched(t, out, n);
+                    noverruns += out[n] != -99;
+                }
+            }
+            assert_equal(nmismatches, 0);
+            assert_equal(noverruns, 0);
+        }
+        it("should match the scalar functions at the endpoints") {
+            int nmismatches = 0;
+            float ends[2] = {0, 1};
+            for (int i = 0; i < NEASINGS; i++) {
+                nmismatches += batched_error(i, ends, 2) > 1e-5f;
+            }
+            assert_equal(nmismatches, 0);
+        }
+    }
+
+    describe("par_easings_lut") {
+        it("should stay within its stated error") {
+            int nmismatches = 0;
+            float out[NVALUES];
+            for (int i = 0; i < NEASINGS; i++) {
+                par_easings_lut* lut = par_easings_create_lut(
+                    _easings[i].scalar, 16, 1e-3f);
+
+                // Only a discontinuity can exhaust the resolution.
+                if (lut->resolution < PAR_EASINGS_LUT_MAXRESOLUTION) {
+                    nmismatches += lut->maxerror > 1e-3f;
+                }
+                par_easings_lut_n(lut, t, out, NVALUES);
+                for (int j = 0; j < NVALUES; j++) {
+                    float e = fabsf(out[j] - _easings[i].scalar(t[j]));
+                    nmismatches += e > lut->maxerror + 1e-6f;
+                }
+                par_easings_free_lut(lut);
+            }
+            assert_equal(nmismatches, 0);
+        }
+        it("should clamp and handle odd lengths") {
+            par_easings_lut* lut = par_easings_create_lut(
+                par_easings_out_bounce, 64, 0);
+            assert_equal(lut->resolution, 64);
+            float clamped[7] = {-1, 0, 0.5f, 1, 2, 1, 0}, out[8];
+            out[7] = -99;
+            par_easings_lut_n(lut, clamped, out, 7);
+            float first = lut->values[0], last = lut->values[64];
+            assert_ok(out[0] == first && out[1] == first && out[6] == first);
+            assert_ok(out[3] == last && out[4] == last && out[5] == last);
+            assert_ok(fabsf(out[2] - par_easings_out_bounce(0.5f)) <=
+                lut->maxerror);
+            assert_ok(out[7] == -99);
+            par_easings_free_lut(lut);
+        }
+    }
+
+    return assert_failures();
+}
@@ -1,17 +1,61 @@
 #include "describe.h"
 
+#ifndef PAR_FILECACHE_THREADS
+#define PAR_FILECACHE_THREADS 1
+#endif
 #define PAR_FILECACHE_IMPLEMENTATION
 #include "par_filecache.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 
-#if ENABLE_LZ4
+#if !PAR_FILECACHE_THREADS
+#define PREFIX "build/tfc.st."
+#elif ENABLE_LZ4
 #define PREFIX "build/tfc.lz4."
 #else
 #define PREFIX "build/tfc.unc."
 #endif
 
+#define NWORKERS 4
+#define NITEMS 64
+#define ITEMSIZE 1000
+
+#if PAR_FILECACHE_THREADS
+#include <pthread.h>
+
+static par_filecache_context* _shared = 0;
+static int _nmismatches = 0;
+
+// Each item's bytes are derived from its name, so any complete version of an
+// item is valid no matter which thread wrote it last.
+static void* hammer(void* arg)
+{
+    int seed = (int) (intptr_t) arg;
+    char name[32];
+    uint8_t payload[ITEMSIZE];
+    uint8_t received[ITEMSIZE];
+    for (int i = 0; i < 500; i++) {
+        int item = (seed * 7 + i * 13) % NITEMS;
+        sprintf(name, "mt%d", item);
+        if (i % 3 == 0) {
+            memset(payload, item, ITEMSIZE);
+            par_filecache_ctx_save(_shared, name, payload, ITEMSIZE, 0, 0);
+            continue;
+        }
+        int nbytes = 0;
+        if (par_filecache_ctx_load_into(_shared, name, received, ITEMSIZE,
+            &nbytes, 0, 0)) {
+            if (nbytes != ITEMSIZE || received[0] != item ||
+                received[ITEMSIZE - 1] != item) {
+                __sync_fetch_and_add(&_nmismatches, 1);
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
 int main()
 {
     describe("the basics") {
@@ -115,5 +159,145 @@ int main()
         }
     }
 
+    describe("zero-copy loads") {
+        it("should load multi-chunk payloads into a caller buffer") {
+            int size = 200 * 1024;
+            uint8_t* payload = malloc(size);
+            for (int i = 0; i < size; i++) {
+                payload[i] = (i * 7) ^ (i >> 9);
+            }
+            par_filecache_init(PREFIX, 1024 * 1024);
+            par_filecache_save("chunky", payload, size, (uint8_t*) "hdr", 3);
+            int nbytes = 0;
+            char header[3];
+            assert_equal(par_filecache_load_into("chunky", 0, 0, &nbytes,
+                (uint8_t*) header, 3), 0);
+            assert_equal(nbytes, size);
+            uint8_t* received = malloc(nbytes);
+            assert_ok(par_filecache_load_into("chunky", received, nbytes,
+                &nbytes, (uint8_t*) header, 3));
+            assert_ok(!memcmp(received, payload, size));
+            assert_ok(!memcmp(header, "hdr", 3));
+            par_filecache_view view;
+            assert_ok(par_filecache_map("chunky", &view, 3));
+            assert_equal(view.payloadsize, size);
+            assert_ok(!memcmp(view.payload, payload, size));
+            assert_ok(!memcmp(view.header, "hdr", 3));
+            par_filecache_unmap(&view);
+            assert_equal(par_filecache_map("absent", &view, 3), 0);
+            free(received);
+            free(payload);
+        }
+    }
+
+    describe("large tables") {
+        it("should hold thousands of entries") {
+            char name[32];
+            uint8_t payload[8] = {0};
+            par_filecache_init(PREFIX, 1024 * 1024);
+            par_filecache_evict_all();
+            for (int i = 0; i < 2000; i++) {
+                sprintf(name, "many%d", i);
+                par_filecache_save(name, payload, 8, 0, 0);
+            }
+            int nloaded = 0;
+            for (int i = 0; i < 2000; i++) {
+                uint8_t* received = 0;
+                int nbytes = 0;
+                sprintf(name, "many%d", i);
+                if (par_filecache_load(name, &received, &nbytes, 0, 0)) {
+                    nloaded++;
+                    free(received);
+                }
+            }
+            assert_equal(nloaded, 2000);
+            par_filecache_evict_all();
+        }
+        it("should survive compaction during heavy eviction") {
+            char name[32];
+            uint8_t payload[100];
+            par_filecache_context* ctx = par_filecache_create_context(
+                PREFIX "churn.", 1000);
+            par_filecache_ctx_evict_all(ctx);
+            for (int i = 0; i < 2000; i++) {
+                sprintf(name, "churn%d", i);
+                memset(payload, i, sizeof(payload));
+                par_filecache_ctx_save(ctx, name, payload, sizeof(payload),
+                    0, 0);
+            }
+            par_filecache_destroy_context(ctx);
+            ctx = par_filecache_create_context(PREFIX "churn.", 1000);
+            int nbytes = 0;
+            assert_ok(par_filecache_ctx_load_into(ctx, "churn1999", payload,
+                sizeof(payload), &nbytes, 0, 0));
+            assert_equal(nbytes, 100);
+            assert_equal(payload[0], 1999 % 256);
+            assert_equal(par_filecache_ctx_load_into(ctx, "churn0", payload,
+                sizeof(payload), &nbytes, 0, 0), 0);
+            par_filecache_ctx_evict_all(ctx);
+            par_filecache_destroy_context(ctx);
+        }
+    }
+
+    describe("contexts") {
+        it("should keep independent caches apart") {
+            par_filecache_context* a = par_filecache_create_context(
+                PREFIX "a.", 4096);
+            par_filecache_context* b = par_filecache_create_context(
+                PREFIX "b.", 4096);
+            par_filecache_ctx_evict_all(a);
+            par_filecache_ctx_evict_all(b);
+            par_filecache_ctx_save(a, "item", (uint8_t*) "aaaa", 4, 0, 0);
+            uint8_t* received = 0;
+            int nbytes = 0;
+            assert_equal(par_filecache_ctx_load(b, "item", &received, &nbytes,
+                0, 0), 0);
+            assert_ok(par_filecache_ctx_load(a, "item", &received, &nbytes,
+                0, 0));
+            assert_ok(!memcmp(received, "aaaa", 4));
+            free(received);
+            par_filecache_destroy_context(b);
+            par_filecache_destroy_context(a);
+            a = par_filecache_create_context(PREFIX "a.", 4096);
+            assert_ok(par_filecache_ctx_load(a, "item", &received, &nbytes,
+                0, 0));
+            free(received);
+            par_filecache_ctx_evict_all(a);
+            par_filecache_destroy_context(a);
+        }
+        #if PAR_FILECACHE_THREADS
+        it("should support concurrent readers and writers") {
+            _shared = par_filecache_create_context(PREFIX "mt.",
+                ITEMSIZE * NITEMS / 2);
+            par_filecache_ctx_evict_all(_shared);
+            pthread_t workers[NWORKERS];
+            for (int i = 0; i < NWORKERS; i++) {
+                pthread_create(workers + i, 0, hammer, (void*) (intptr_t) i);
+            }
+            for (int i = 0; i < NWORKERS; i++) {
+                pthread_join(workers[i], 0);
+            }
+            par_filecache_ctx_flush(_shared);
+            assert_equal(_nmismatches, 0);
+            int nfound = 0;
+            char name[32];
+            for (int i = 0; i < NITEMS; i++) {
+                sprintf(name, "mt%d", i);
+                int nbytes = 0;
+                if (par_filecache_ctx_load_into(_shared, name, 0, 0, &nbytes,
+                    0, 0) || nbytes > 0) {
+                    nfound++;
+                }
+            }
+            assert_ok(nfound > 0);
+            #if !ENABLE_LZ4
+            assert_ok(nfound * ITEMSIZE <= ITEMSIZE * NITEMS / 2);
+            #endif
+            par_filecache_ctx_evict_all(_shared);
+            par_filecache_destroy_context(_shared);
+        }
+        #endif
+    }
+
     return assert_failures();
 }
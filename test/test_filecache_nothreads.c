@@ -0,0 +1,2 @@
+#define PAR_FILECACHE_THREADS 0
+#include "test_filecache.c"
@@ -7,12 +7,12 @@
 #define PAR_BLUENOISE_IMPLEMENTATION
 #include "par_bluenoise.h"
 
-#define PAR_EASYCURL_IMPLEMENTATION
-#include "par_easycurl.h"
-
 #define PAR_FILECACHE_IMPLEMENTATION
 #include "par_filecache.h"
 
+#define PAR_EASYCURL_IMPLEMENTATION
+#include "par_easycurl.h"
+
 #define PAR_BUBBLES_IMPLEMENTATION
 #include "par_bubbles.h"
 
@@ -2,7 +2,10 @@
 #include "lodepng.h"
 
 #define PAR_MSQUARES_IMPLEMENTATION
+#define PAR_MSQUARES_THREADS 1
+#define PAR_MSQUARES_NTHREADS 3
 #include "par_msquares.h"
+#include <math.h>
 
 #define CELLSIZE 32
 #define IMGWIDTH 1024
@@ -34,7 +37,7 @@ static void svg_write_path(FILE* svgfile, par_msquares_mesh const* mesh,
         float const* chain = polygon->chains[c];
         int length = (int) polygon->lengths[c];
         uint16_t first = 1;
-        for (uint16_t s = 0; s < length; s++) {
+        for (int s = 0; s < length; s++) {
             fprintf(svgfile, "%c%f,%f", first ? 'M' : 'L', chain[s * 2],
                 chain[s * 2 + 1]);
             first = 0;
@@ -50,7 +53,7 @@ static void test_multi()
     unsigned dims[2] = {0, 0};
     int offset;
     unsigned char* pixels;
-    uint16_t* index;
+    PAR_MSQUARES_T* index;
     float* pt;
     par_msquares_meshlist* mlist;
     par_msquares_mesh const* mesh;
@@ -198,7 +201,7 @@ static void test_color()
     assert(dims[1] == IMGHEIGHT);
 
     int flags, i;
-    uint16_t* index;
+    PAR_MSQUARES_T* index;
     float* pt;
     par_msquares_meshlist* mlist;
     par_msquares_mesh const* mesh;
@@ -303,7 +306,7 @@ static void test_grayscale()
     asset_get("msquares_island.1024.bin", (par_byte**) &pixels, &nbytes);
 
     int flags, i;
-    uint16_t* index;
+    PAR_MSQUARES_T* index;
     float* pt;
     par_msquares_meshlist* mlist;
     par_msquares_mesh const* mesh;
@@ -624,8 +627,491 @@ static void test_grayscale()
     free(pixels);
 }
 
+static void assert_same_meshes(par_msquares_meshlist* a,
+    par_msquares_meshlist* b)
+{
+    assert(par_msquares_get_count(a) == par_msquares_get_count(b));
+    for (int m = 0; m < par_msquares_get_count(a); m++) {
+        par_msquares_mesh const* ma = par_msquares_get_mesh(a, m);
+        par_msquares_mesh const* mb = par_msquares_get_mesh(b, m);
+        assert(ma->dim == mb->dim);
+        assert(ma->npoints == mb->npoints);
+        assert(ma->ntriangles == mb->ntriangles);
+        assert(!memcmp(ma->points, mb->points,
+            sizeof(float) * ma->npoints * ma->dim));
+        assert(!memcmp(ma->triangles, mb->triangles,
+            sizeof(PAR_MSQUARES_T) * ma->ntriangles * 3));
+    }
+}
+
+static float* create_waves(int width, int height)
+{
+    float* pixels = malloc(sizeof(float) * width * height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            float x = (float) i / width, y = (float) j / height;
+            pixels[i + j * width] = sinf(x * 9) * cosf(y * 7) +
+                0.5f * sinf((x + y) * 23);
+        }
+    }
+    return pixels;
+}
+
+static void test_parallel()
+{
+    int width = 256, height = 192;
+    float* pixels = create_waves(width, height);
+    int flagsets[] = {
+        0,
+        PAR_MSQUARES_DUAL | PAR_MSQUARES_HEIGHTS | PAR_MSQUARES_SNAP,
+        PAR_MSQUARES_DUAL | PAR_MSQUARES_HEIGHTS | PAR_MSQUARES_CONNECT,
+        PAR_MSQUARES_SIMPLIFY | PAR_MSQUARES_HEIGHTS | PAR_MSQUARES_CONNECT,
+    };
+    for (int f = 0; f < 4; f++) {
+        for (int cellsize = 2; cellsize <= 8; cellsize *= 2) {
+            int flags = flagsets[f];
+            par_msquares_meshlist* serial = par_msquares_grayscale(pixels,
+                width, height, cellsize, 0.1f, flags);
+            par_msquares_meshlist* parallel = par_msquares_grayscale(pixels,
+                width, height, cellsize, 0.1f, flags | PAR_MSQUARES_PARALLEL);
+            assert_same_meshes(serial, parallel);
+            par_msquares_free(serial);
+            par_msquares_free(parallel);
+        }
+    }
+    free(pixels);
+}
+
+typedef struct {
+    float const* pixels;
+    float lower;
+    float upper;
+} band_context;
+
+static int band_inside(int location, void* contextptr)
+{
+    band_context* context = (band_context*) contextptr;
+    float val = context->pixels[location];
+    return val >= context->lower && val < context->upper;
+}
+
+static void test_multi_levels()
+{
+    int width = 256, height = 192, cellsize = 4;
+    float* pixels = create_waves(width, height);
+    float thresholds[] = {-0.5f, 0.0f, 0.0f, 0.7f};
+    int flagsets[] = {0, PAR_MSQUARES_SIMPLIFY};
+    for (int f = 0; f < 2; f++) {
+        par_msquares_meshlist* mlist = par_msquares_grayscale_multi(pixels,
+            width, height, cellsize, thresholds, 4, flagsets[f]);
+        assert(par_msquares_get_count(mlist) == 5);
+        band_context context = {pixels, -FLT_MAX, thresholds[0]};
+        for (int m = 0; m < 5; m++) {
+            par_msquares_meshlist* level = par_msquares_function(width,
+                height, cellsize, flagsets[f], &context, band_inside, 0);
+            par_msquares_mesh const* expected = par_msquares_get_mesh(level, 0);
+            par_msquares_mesh const* actual = par_msquares_get_mesh(mlist, m);
+            assert(actual->npoints == expected->npoints);
+            assert(actual->ntriangles == expected->ntriangles);
+            assert(!memcmp(actual->points, expected->points,
+                sizeof(float) * actual->npoints * actual->dim));
+            assert(!memcmp(actual->triangles, expected->triangles,
+                sizeof(PAR_MSQUARES_T) * actual->ntriangles * 3));
+            par_msquares_free(level);
+            context.lower = context.upper;
+            context.upper = m < 3 ? thresholds[m + 1] : FLT_MAX;
+        }
+        par_msquares_meshlist* parallel = par_msquares_grayscale_multi(pixels,
+            width, height, cellsize, thresholds, 4,
+            flagsets[f] | PAR_MSQUARES_PARALLEL);
+        assert_same_meshes(mlist, parallel);
+        par_msquares_free(parallel);
+        par_msquares_free(mlist);
+    }
+    free(pixels);
+}
+
+typedef struct {
+    float const* pixels;
+    int width;
+    int height;
+    par_msquares_mesh const* expected;
+    int nchunks;
+    int ntriangles;
+} stream_context;
+
+static int stream_inside(int location, void* contextptr)
+{
+    stream_context* context = (stream_context*) contextptr;
+    return context->pixels[location] > 0.1f;
+}
+
+static float stream_height(float x, float y, void* contextptr)
+{
+    stream_context* context = (stream_context*) contextptr;
+    int i = PAR_CLAMP(context->width * x, 0, context->width - 1);
+    int j = PAR_CLAMP(context->height * y, 0, context->height - 1);
+    return context->pixels[i + j * context->width];
+}
+
+static void stream_row(int row, par_byte* inside, void* contextptr)
+{
+    stream_context* context = (stream_context*) contextptr;
+    for (int col = 0; col < context->width; col++) {
+        inside[col] = stream_inside(row * context->width + col, context);
+    }
+}
+
+static void stream_chunk(par_msquares_mesh const* mesh, int row0, int row1,
+    void* contextptr)
+{
+    stream_context* context = (stream_context*) contextptr;
+    par_msquares_mesh const* expected = context->expected;
+    context->nchunks++;
+    if (expected) {
+        assert(mesh->npoints == expected->npoints);
+        assert(mesh->ntriangles == expected->ntriangles);
+        assert(!memcmp(mesh->points, expected->points,
+            sizeof(float) * mesh->npoints * mesh->dim));
+        assert(!memcmp(mesh->triangles, expected->triangles,
+            sizeof(PAR_MSQUARES_T) * mesh->ntriangles * 3));
+    }
+    context->ntriangles += mesh->ntriangles;
+}
+
+static void test_stream()
+{
+    int width = 256, height = 192, cellsize = 4;
+    float* pixels = create_waves(width, height);
+    int flagsets[] = {
+        0,
+        PAR_MSQUARES_INVERT | PAR_MSQUARES_HEIGHTS,
+        PAR_MSQUARES_HEIGHTS | PAR_MSQUARES_CONNECT,
+    };
+    for (int f = 0; f < 3; f++) {
+        stream_context context = {pixels, width, height};
+        par_msquares_meshlist* mlist = par_msquares_function(width, height,
+            cellsize, flagsets[f], &context, stream_inside, stream_height);
+        context.expected = par_msquares_get_mesh(mlist, 0);
+
+        // A single chunk should be identical to the non-streaming mesh.
+        par_msquares_stream(width, height, cellsize, height / cellsize,
+            flagsets[f], &context, stream_row, stream_height, stream_chunk);
+        assert(context.nchunks == 1);
+
+        // Smaller chunks should produce the same number of triangles.
+        context.expected = 0;
+        context.nchunks = context.ntriangles = 0;
+        par_msquares_stream(width, height, cellsize, 5, flagsets[f], &context,
+            stream_row, stream_height, stream_chunk);
+        assert(context.nchunks == 10);
+        assert(context.ntriangles ==
+            par_msquares_get_mesh(mlist, 0)->ntriangles);
+        par_msquares_free(mlist);
+    }
+    free(pixels);
+}
+
+static void test_split()
+{
+    int width = 1024, height = 768, cellsize = 1;
+    float* pixels = create_waves(width, height);
+    stream_context context = {pixels, width, height};
+    par_msquares_stream(width, height, cellsize, 64, 0, &context, stream_row,
+        stream_height, stream_chunk);
+    par_msquares_meshlist* mlist = par_msquares_function(width, height,
+        cellsize, PAR_MSQUARES_SPLIT, &context, stream_inside, 0);
+    int ntriangles = 0;
+    assert(par_msquares_get_count(mlist) > 1);
+    for (int m = 0; m < par_msquares_get_count(mlist); m++) {
+        par_msquares_mesh const* mesh = par_msquares_get_mesh(mlist, m);
+        for (int i = 0; i < mesh->ntriangles * 3; i++) {
+            assert(mesh->triangles[i] < mesh->npoints);
+        }
+        ntriangles += mesh->ntriangles;
+    }
+    assert(ntriangles == context.ntriangles);
+    par_msquares_free(mlist);
+    free(pixels);
+}
+
+typedef struct {
+    par_byte const* pixels;
+    par_byte key[4];
+    int bpp;
+} colorkey_context;
+
+static int colorkey_inside(int location, void* contextptr)
+{
+    colorkey_context* context = (colorkey_context*) contextptr;
+    par_byte const* pixel = context->pixels + location * context->bpp;
+    return !memcmp(pixel, context->key, context->bpp);
+}
+
+static void test_kernels()
+{
+    int width = 100, height = 96;
+    float* pixels = create_waves(width, height);
+    par_byte* colors = malloc(width * height * 4);
+    for (int i = 0; i < width * height; i++) {
+        par_byte value = pixels[i] > 0.1f ? 0x80 : 0x40;
+        colors[i * 4 + 0] = colors[i * 4 + 1] = colors[i * 4 + 2] = value;
+        colors[i * 4 + 3] = 0xff;
+    }
+    stream_context gray = {pixels, width, height};
+    colorkey_context color = {colors, {0x80, 0x80, 0x80, 0xff}, 4};
+    int flagsets[] = {0, PAR_MSQUARES_INVERT, PAR_MSQUARES_DUAL};
+    for (int f = 0; f < 3; f++) {
+        for (int cellsize = 1; cellsize <= 4; cellsize *= 2) {
+            int flags = flagsets[f];
+            par_msquares_meshlist* expected = par_msquares_function(width,
+                height, cellsize, flags, &gray, stream_inside, 0);
+            par_msquares_meshlist* actual = par_msquares_grayscale(pixels,
+                width, height, cellsize, 0.1f, flags);
+            assert_same_meshes(expected, actual);
+            par_msquares_free(actual);
+            for (int bpp = 3; bpp <= 4; bpp++) {
+                color.bpp = bpp;
+                actual = par_msquares_color(colors, width, height, cellsize,
+                    0xff808080, bpp, flags);
+                par_msquares_meshlist* keyed = par_msquares_function(width,
+                    height, cellsize, flags, &color, colorkey_inside, 0);
+                assert_same_meshes(keyed, actual);
+                par_msquares_free(keyed);
+                par_msquares_free(actual);
+            }
+            par_msquares_free(expected);
+        }
+    }
+    int rowflags[] = {
+        0,
+        PAR_MSQUARES_INVERT | PAR_MSQUARES_SIMPLIFY,
+        PAR_MSQUARES_DUAL | PAR_MSQUARES_HEIGHTS | PAR_MSQUARES_SNAP,
+        PAR_MSQUARES_HEIGHTS | PAR_MSQUARES_CONNECT,
+    };
+    for (int f = 0; f < 4; f++) {
+        for (int cellsize = 1; cellsize <= 4; cellsize *= 2) {
+            int flags = rowflags[f];
+            par_msquares_meshlist* expected = par_msquares_function(width,
+                height, cellsize, flags, &gray, stream_inside, stream_height);
+            par_msquares_meshlist* actual = par_msquares_function_rows(width,
+                height, cellsize, flags, &gray, stream_row, stream_height);
+            assert_same_meshes(expected, actual);
+            par_msquares_free(actual);
+            par_msquares_free(expected);
+        }
+    }
+    free(colors);
+    free(pixels);
+}
+
+static void test_many_colors()
+{
+    int width = 128, height = 128, blocksize = 4;
+    int nblocks = width / blocksize;
+    par_byte* pixels = malloc(width * height * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int block = (y / blocksize) * nblocks + x / blocksize;
+            par_byte* pixel = pixels + (y * width + x) * 3;
+            pixel[0] = block >> 8;
+            pixel[1] = block & 0xff;
+            pixel[2] = 0x20;
+        }
+    }
+    par_msquares_meshlist* mlist = par_msquares_color_multi(pixels, width,
+        height, 2, 3, PAR_MSQUARES_SIMPLIFY);
+    assert(par_msquares_get_count(mlist) == nblocks * nblocks);
+    for (int m = 0; m < par_msquares_get_count(mlist); m++) {
+        par_msquares_mesh const* mesh = par_msquares_get_mesh(mlist, m);
+        assert(mesh->color == (uint32_t) ((m << 8) | 0x20));
+        assert(mesh->ntriangles > 0);
+    }
+    par_msquares_free(mlist);
+    free(pixels);
+}
+
+static float total_area(par_msquares_meshlist* mlist)
+{
+    float area = 0;
+    for (int m = 0; m < par_msquares_get_count(mlist); m++) {
+        par_msquares_mesh const* mesh = par_msquares_get_mesh(mlist, m);
+        PAR_MSQUARES_T const* tri = mesh->triangles;
+        for (int t = 0; t < mesh->ntriangles; t++, tri += 3) {
+            float const* a = mesh->points + tri[0] * mesh->dim;
+            float const* b = mesh->points + tri[1] * mesh->dim;
+            float const* c = mesh->points + tri[2] * mesh->dim;
+            area += 0.5f * ((b[0] - a[0]) * (c[1] - a[1]) -
+                (c[0] - a[0]) * (b[1] - a[1]));
+        }
+    }
+    return area;
+}
+
+typedef struct {
+    float x0, y0, x1, y1;
+} directed_edge;
+
+static int cmp_edges(void const* a, void const* b)
+{
+    return memcmp(a, b, sizeof(directed_edge));
+}
+
+// Counts the edges that have no partner running the other way in any mesh,
+// ignoring those along the border of the image.
+static int count_open_edges(par_msquares_meshlist* mlist)
+{
+    int nedges = 0;
+    for (int m = 0; m < par_msquares_get_count(mlist); m++) {
+        nedges += par_msquares_get_mesh(mlist, m)->ntriangles * 3;
+    }
+    directed_edge* edges = malloc(sizeof(directed_edge) * nedges);
+    directed_edge* edge = edges;
+    float minx = 1, miny = 1, maxx = 0, maxy = 0;
+    for (int m = 0; m < par_msquares_get_count(mlist); m++) {
+        par_msquares_mesh const* mesh = par_msquares_get_mesh(mlist, m);
+        PAR_MSQUARES_T const* tris = mesh->triangles;
+        for (int c = 0; c < mesh->ntriangles * 3; c++, edge++) {
+            float const* a = mesh->points + tris[c] * mesh->dim;
+            float const* b = mesh->points +
+                tris[c - c % 3 + (c + 1) % 3] * mesh->dim;
+            edge->x0 = a[0];
+            edge->y0 = a[1];
+            edge->x1 = b[0];
+            edge->y1 = b[1];
+            minx = PAR_MIN(minx, a[0]);
+            miny = PAR_MIN(miny, a[1]);
+            maxx = PAR_MAX(maxx, a[0]);
+            maxy = PAR_MAX(maxy, a[1]);
+        }
+    }
+    qsort(edges, nedges, sizeof(directed_edge), cmp_edges);
+    int nopen = 0;
+    for (int e = 0; e < nedges; e++) {
+        directed_edge d = edges[e];
+        directed_edge reversed = {d.x1, d.y1, d.x0, d.y0};
+        if (bsearch(&reversed, edges, nedges, sizeof(directed_edge),
+            cmp_edges)) {
+            continue;
+        }
+        int border = (d.x0 == d.x1 && (d.x0 == minx || d.x0 == maxx)) ||
+            (d.y0 == d.y1 && (d.y0 == miny || d.y0 == maxy));
+        nopen += !border;
+    }
+    free(edges);
+    return nopen;
+}
+
+static void test_tjunctions()
+{
+    int width = 96, height = 64, nlevels = 5;
+    float* waves = create_waves(width, height);
+    par_byte* pixels = malloc(width * height);
+    for (int i = 0; i < width * height; i++) {
+        int level = (waves[i] + 1.5f) / 3.0f * nlevels;
+        pixels[i] = PAR_CLAMP(level, 0, nlevels - 1);
+    }
+    for (int cellsize = 4; cellsize <= 8; cellsize *= 2) {
+        par_msquares_meshlist* plain = par_msquares_color_multi(pixels, width,
+            height, cellsize, 1, 0);
+        par_msquares_meshlist* clean = par_msquares_color_multi(pixels, width,
+            height, cellsize, 1, PAR_MSQUARES_CLEAN);
+        int nplain = 0, nclean = 0;
+        for (int m = 0; m < par_msquares_get_count(plain); m++) {
+            nplain += par_msquares_get_mesh(plain, m)->ntriangles;
+            nclean += par_msquares_get_mesh(clean, m)->ntriangles;
+        }
+        assert(nclean > nplain);
+        assert(fabsf(total_area(plain) - total_area(clean)) < 1e-4f);
+        assert(count_open_edges(plain) > 0);
+        assert(count_open_edges(clean) == 0);
+        par_msquares_free(plain);
+        par_msquares_free(clean);
+    }
+    free(pixels);
+    free(waves);
+}
+
+// Crosses the 16-bit limit with a single color, so that its mesh is split
+// into bands while the rest of the colors keep one mesh each.
+static void test_split_multi()
+{
+    int width = 1024, height = 768, nlevels = 3;
+    float* waves = create_waves(width, height);
+    par_byte* pixels = malloc(width * height);
+    for (int i = 0; i < width * height; i++) {
+        int level = (waves[i] + 1.5f) / 3.0f * nlevels;
+        pixels[i] = PAR_CLAMP(level, 0, nlevels - 1);
+    }
+    par_msquares_meshlist* mlist = par_msquares_color_multi(pixels, width,
+        height, 1, 1, PAR_MSQUARES_SPLIT);
+    int nmeshes = par_msquares_get_count(mlist), ncolors = 1;
+    assert(nmeshes > nlevels);
+    for (int m = 0; m < nmeshes; m++) {
+        par_msquares_mesh const* mesh = par_msquares_get_mesh(mlist, m);
+        assert(mesh->npoints <= 65536);
+        for (int i = 0; i < mesh->ntriangles * 3; i++) {
+            assert(mesh->triangles[i] < mesh->npoints);
+        }
+        if (m > 0) {
+            uint32_t prev = par_msquares_get_mesh(mlist, m - 1)->color;
+            assert(mesh->color >= prev);
+            ncolors += mesh->color != prev;
+        }
+    }
+    assert(ncolors == nlevels);
+    float expected = (float) height / width;
+    assert(fabsf(total_area(mlist) - expected) < 1e-3f);
+    par_msquares_free(mlist);
+    free(pixels);
+    free(waves);
+}
+
+static float boundary_area(par_msquares_boundary const* polygon)
+{
+    float area = 0;
+    for (int c = 0; c < polygon->nchains; c++) {
+        float const* pt = polygon->chains[c];
+        for (int i = 0; i + 1 < polygon->lengths[c]; i++, pt += 2) {
+            area += 0.5f * (pt[0] * pt[3] - pt[2] * pt[1]);
+        }
+    }
+    return area;
+}
+
+static void test_contours()
+{
+    int width = 256, height = 192;
+    float* pixels = create_waves(width, height);
+    for (int f = 0; f < 2; f++) {
+        int flags = f ? PAR_MSQUARES_INVERT : 0;
+        par_msquares_meshlist* mlist = par_msquares_grayscale(pixels, width,
+            height, 4, 0.1f, flags);
+        par_msquares_boundary* expected = par_msquares_extract_boundary(
+            par_msquares_get_mesh(mlist, 0));
+        par_msquares_boundary* actual = par_msquares_grayscale_boundary(
+            pixels, width, height, 4, 0.1f, flags);
+        assert(actual->nchains == expected->nchains);
+        assert(actual->npoints == expected->npoints);
+        assert(fabsf(boundary_area(actual) - boundary_area(expected)) < 1e-5f);
+        par_msquares_free_boundary(expected);
+        par_msquares_free_boundary(actual);
+        par_msquares_free(mlist);
+    }
+    free(pixels);
+}
+
 int main(int argc, char* argv[])
 {
+    test_parallel();
+    test_multi_levels();
+    test_stream();
+    test_split();
+    test_kernels();
+    test_many_colors();
+    test_tjunctions();
+    test_split_multi();
+    test_contours();
     asset_init();
     test_color();
     test_grayscale();
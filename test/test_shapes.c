@@ -1,6 +1,8 @@
 #include "describe.h"
 
 #define PAR_SHAPES_IMPLEMENTATION
+#define PAR_SHAPES_THREADS 1
+#define PAR_SHAPES_NTHREADS 3
 #include "par_shapes.h"
 
 #include <fcntl.h>
@@ -8,6 +10,21 @@
 
 #define STRINGIFY(A) #A
 
+static void wavy_surface(float const* uv, float* xyz, void* userdata)
+{
+    xyz[0] = uv[0];
+    xyz[1] = uv[1];
+    xyz[2] = sinf(uv[0] * 10) * cosf(uv[1] * 10) * 0.1f;
+}
+
+static void wavy_batch(float const* uvs, float* xyzs, int count,
+    void* userdata)
+{
+    for (int i = 0; i < count; i++) {
+        wavy_surface(uvs + i * 2, xyzs + i * 3, userdata);
+    }
+}
+
 int main()
 {
     describe("cylinders and spheres") {
@@ -62,6 +79,224 @@ int main()
         }
     }
 
+    describe("par_shapes_generate_parametric") {
+        it("should match par_shapes_create_torus when interleaved") {
+            int slices = 20, stacks = 15, npoints, ntriangles;
+            float radius = 0.25;
+            par_shapes_query_parametric(slices, stacks, &npoints, &ntriangles);
+            par_shapes_mesh* m = par_shapes_create_torus(slices, stacks,
+                radius);
+            assert_equal(m->npoints, npoints);
+            assert_equal(m->ntriangles, ntriangles);
+            float* verts = malloc(npoints * 8 * sizeof(float));
+            uint32_t* indices = malloc(ntriangles * 3 * sizeof(uint32_t));
+            par_shapes_buffers dst = {
+                verts, 32, verts + 3, 32, verts + 6, 32, indices, 4
+            };
+            par_shapes_fn fn = par_shapes_surface_fn(PAR_SHAPES_TORUS);
+            assert_ok(par_shapes_generate_parametric(fn, slices, stacks,
+                &radius, &dst));
+            int mismatches = 0;
+            for (int i = 0; i < npoints; i++) {
+                float const* v = verts + i * 8;
+                for (int c = 0; c < 3; c++) {
+                    mismatches += v[c] != m->points[i * 3 + c];
+                    mismatches += fabs(v[3 + c] - m->normals[i * 3 + c]) >
+                        0.001;
+                }
+                mismatches += v[6] != m->tcoords[i * 2];
+                mismatches += v[7] != m->tcoords[i * 2 + 1];
+            }
+            for (int i = 0; i < ntriangles * 3; i++) {
+                mismatches += indices[i] != m->triangles[i];
+            }
+            assert_equal(mismatches, 0);
+            free(verts);
+            free(indices);
+            par_shapes_free_mesh(m);
+        }
+        it("should give the same results when batched or threaded") {
+            int slices = 300, stacks = 200, npoints, ntriangles;
+            par_shapes_query_parametric(slices, stacks, &npoints, &ntriangles);
+            int nfloats = npoints * 8;
+            float* expected = malloc(nfloats * sizeof(float));
+            float* actual = malloc(nfloats * sizeof(float));
+            par_shapes_buffers dst = {
+                expected, 32, expected + 3, 32, expected + 6, 32, 0, 4
+            };
+            assert_ok(par_shapes_generate_parametric(wavy_surface, slices,
+                stacks, 0, &dst));
+            int mismatches = 0;
+            for (int njobs = 1; njobs <= 5; njobs += 2) {
+                par_shapes__grid_job job = {0, wavy_batch, 0, 0, slices,
+                    stacks};
+                dst.points = actual;
+                dst.normals = actual + 3;
+                dst.tcoords = actual + 6;
+                assert_ok(par_shapes__generate_grid(job, &dst, njobs));
+                mismatches += memcmp(expected, actual, nfloats * 4) != 0;
+            }
+
+            // Tightly packed points are written straight from the batch.
+            float* points = malloc(npoints * 3 * sizeof(float));
+            par_shapes_buffers packed = {points, 0, 0, 0, 0, 0, 0, 4};
+            assert_ok(par_shapes_generate_parametric_batch(wavy_batch, slices,
+                stacks, 0, &packed));
+            for (int i = 0; i < npoints * 3; i++) {
+                mismatches += points[i] != expected[i / 3 * 8 + i % 3];
+            }
+            assert_equal(mismatches, 0);
+            free(points);
+            free(actual);
+            free(expected);
+        }
+        it("should reject 16-bit indices that cannot address every point") {
+            uint16_t index;
+            par_shapes_buffers dst = {0, 0, 0, 0, 0, 0, &index, 2};
+            par_shapes_fn fn = par_shapes_surface_fn(PAR_SHAPES_PLANE);
+            assert_equal(par_shapes_generate_parametric(fn, 300, 300, 0, &dst),
+                false);
+        }
+    }
+
+    describe("par_shapes_create_parametric_batch") {
+        it("should match the per-vertex callback") {
+            par_shapes_mesh* a = par_shapes_create_parametric(wavy_surface,
+                200, 150, 0);
+            par_shapes_mesh* b = par_shapes_create_parametric_batch(wavy_batch,
+                200, 150, 0);
+            assert_equal(a->npoints, b->npoints);
+            assert_equal(a->ntriangles, b->ntriangles);
+            int mismatches = 0;
+            for (int i = 0; i < a->npoints * 3; i++) {
+                mismatches += a->points[i] != b->points[i];
+                mismatches += a->normals[i] != b->normals[i];
+            }
+            assert_equal(mismatches, 0);
+            par_shapes_free_mesh(a);
+            par_shapes_free_mesh(b);
+        }
+        it("should compute the same normals with any number of jobs") {
+            par_shapes_mesh* m = par_shapes_create_parametric_batch(wavy_batch,
+                250, 250, 0);
+            par_shapes__compute_normals(m, 1);
+            float* expected = m->normals;
+            m->normals = 0;
+            int mismatches = 0, nbytes = m->npoints * 3 * sizeof(float);
+            for (int njobs = 2; njobs <= 7; njobs++) {
+                par_shapes__compute_normals(m, njobs);
+                mismatches += memcmp(expected, m->normals, nbytes) != 0;
+            }
+            par_shapes_compute_normals(m);
+            mismatches += memcmp(expected, m->normals, nbytes) != 0;
+            assert_equal(mismatches, 0);
+            free(expected);
+            par_shapes_free_mesh(m);
+        }
+        it("should compute unit normals across several threads") {
+            par_shapes_mesh* m = par_shapes_create_parametric_batch(wavy_batch,
+                250, 250, 0);
+            par_shapes_compute_normals(m);
+            int mismatches = 0;
+            for (int i = 0; i < m->npoints; i++) {
+                float const* n = m->normals + i * 3;
+                float len2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+                mismatches += fabs(len2 - 1) > 0.001;
+            }
+            assert_equal(mismatches, 0);
+            par_shapes_free_mesh(m);
+        }
+    }
+
+    describe("par_shapes_weld") {
+        it("should restore the topology of an unwelded mesh") {
+            par_shapes_mesh* m = par_shapes_create_cube();
+            int npoints = m->npoints, ntriangles = m->ntriangles;
+            par_shapes_unweld(m, true);
+            PAR_SHAPES_T* mapping = malloc(m->npoints * sizeof(PAR_SHAPES_T));
+            par_shapes_mesh* w = par_shapes_weld(m, 0.01, mapping);
+            assert_equal(w->npoints, npoints);
+            assert_equal(w->ntriangles, ntriangles);
+            int mismatches = 0;
+            for (int i = 0; i < m->npoints; i++) {
+                float const* a = m->points + i * 3;
+                float const* b = w->points + mapping[i] * 3;
+                mismatches += a[0] != b[0] || a[1] != b[1] || a[2] != b[2];
+            }
+            assert_equal(mismatches, 0);
+            free(mapping);
+            par_shapes_free_mesh(w);
+            par_shapes_free_mesh(m);
+        }
+    }
+
+    describe("par_shapes_optimize") {
+        it("should reduce the ACMR of a rock without changing its shape") {
+            par_shapes_mesh* m = par_shapes_create_rock(3, 3);
+            int npoints = m->npoints, ntriangles = m->ntriangles;
+            float before = par_shapes_compute_acmr(m, 32);
+            double centroid[2][3] = {{0}};
+            for (int pass = 0; pass < 2; pass++) {
+                if (pass == 1) {
+                    float after = par_shapes_optimize(m, 32);
+                    assert_ok(after < before);
+                    assert_ok(after == par_shapes_compute_acmr(m, 32));
+                }
+                for (int i = 0; i < m->ntriangles * 3; i++) {
+                    float const* pt = m->points + m->triangles[i] * 3;
+                    for (int c = 0; c < 3; c++) {
+                        centroid[pass][c] += pt[c];
+                    }
+                }
+            }
+            assert_equal(m->npoints, npoints);
+            assert_equal(m->ntriangles, ntriangles);
+            for (int c = 0; c < 3; c++) {
+                assert_ok(fabs(centroid[0][c] - centroid[1][c]) < 0.01);
+            }
+            par_shapes_free_mesh(m);
+        }
+
+        it("should keep the triangle order but renumber the verts") {
+            par_shapes_mesh* m = par_shapes_create_torus(50, 50, 0.5);
+            par_shapes_mesh* original = par_shapes_clone(m, 0);
+            float before = par_shapes_compute_acmr(m, 4);
+            float after = par_shapes_optimize(m, 4);
+            assert_ok(after == before);
+            assert_ok(after == par_shapes_compute_acmr(m, 4));
+            int nmoved = 0, nunordered = 0, nused = 0;
+            for (int i = 0; i < m->ntriangles * 3; i++) {
+                float const* a = m->points + m->triangles[i] * 3;
+                float const* b = original->points + original->triangles[i] * 3;
+                nmoved += memcmp(a, b, sizeof(float) * 3) != 0;
+                nunordered += m->triangles[i] > nused;
+                nused += m->triangles[i] == nused;
+            }
+            assert_equal(nmoved, 0);
+            assert_equal(nunordered, 0);
+            par_shapes_free_mesh(original);
+            par_shapes_free_mesh(m);
+        }
+
+        it("should lose to strips only when the cache cannot hold a fan") {
+            int cachesizes[3] = {4, 8, 16};
+            int torus_wins[3] = {0, 1, 1}, rock_wins[3] = {1, 1, 1};
+            for (int i = 0; i < 3; i++) {
+                int cachesize = cachesizes[i];
+                par_shapes_mesh* m = par_shapes_create_torus(50, 50, 0.5);
+                float before = par_shapes_compute_acmr(m, cachesize);
+                int won = par_shapes_optimize(m, cachesize) < before;
+                assert_equal(won, torus_wins[i]);
+                par_shapes_free_mesh(m);
+                m = par_shapes_create_rock(1, 3);
+                before = par_shapes_compute_acmr(m, cachesize);
+                won = par_shapes_optimize(m, cachesize) < before;
+                assert_equal(won, rock_wins[i]);
+                par_shapes_free_mesh(m);
+            }
+        }
+    }
+
     describe("par_shapes_export") {
         it("should generate an OBJ file") {
             par_shapes_mesh* m;
@@ -272,6 +507,39 @@ int main()
             par_shapes_export(mesh, "build/lsystem.obj");
             par_shapes_free_mesh(mesh);
         }
+        it("should place instances where the merged tubes would be") {
+            char const* program = STRINGIFY(
+            sx 2 sy 0.5
+            shape tube rx 30 tz 1
+            call limb
+            rule limb
+                sa 0.9 ry 45 tz 1
+                shape tube
+                call limb
+            );
+            par_shapes_mesh* mesh = par_shapes_create_lsystem(program, 5, 8);
+            par_shapes_instances* inst = par_shapes_create_lsystem_instances(
+                program, 5, 8);
+            par_shapes_mesh const* tube = inst->prototype;
+            assert_equal(inst->ninstances, 8);
+            assert_equal(mesh->npoints, inst->ninstances * tube->npoints);
+            int mismatches = 0;
+            float const* expected = mesh->points;
+            for (int i = 0; i < inst->ninstances; i++) {
+                float const* m = inst->transforms + i * 16;
+                for (int p = 0; p < tube->npoints; p++, expected += 3) {
+                    float const* pt = tube->points + p * 3;
+                    for (int c = 0; c < 3; c++) {
+                        float v = m[c] * pt[0] + m[4 + c] * pt[1] +
+                            m[8 + c] * pt[2] + m[12 + c];
+                        mismatches += fabs(v - expected[c]) > 0.0001;
+                    }
+                }
+            }
+            assert_equal(mismatches, 0);
+            par_shapes_free_instances(inst);
+            par_shapes_free_mesh(mesh);
+        }
     }
 
     return assert_failures();
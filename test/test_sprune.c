@@ -1,4 +1,5 @@
 #define PAR_SPRUNE_IMPLEMENTATION
+#define PAR_SPRUNE_THREADS 1
 #include "par_sprune.h"
 #include "describe.h"
 
@@ -148,6 +149,211 @@ int main()
 
             par_sprune_free_context(context);
         }
+
+        it("should update incrementally and report deltas") {
+            int nboxes = 500;
+            float* boxes = malloc(sizeof(float) * nboxes * 4);
+            srand(1);
+            for (int i = 0; i < nboxes; i++) {
+                float x = (float) rand() / RAND_MAX;
+                float y = (float) rand() / RAND_MAX;
+                float w = 0.01f + 0.04f * rand() / RAND_MAX;
+                float h = 0.01f + 0.02f * rand() / RAND_MAX;
+                boxes[i * 4 + 0] = x;
+                boxes[i * 4 + 1] = y;
+                boxes[i * 4 + 2] = x + w;
+                boxes[i * 4 + 3] = y + h;
+            }
+            par_sprune_context* incremental = par_sprune_overlap(boxes,
+                nboxes, 0);
+            par_sprune_context* expected = 0;
+            int npairs = incremental->ncollision_pairs;
+            int mismatches = 0;
+            for (int frame = 0; frame < 20; frame++) {
+                for (int i = 0; i < nboxes; i++) {
+                    float dx = 0.005f * rand() / RAND_MAX - 0.0025f;
+                    float dy = 0.005f * rand() / RAND_MAX - 0.0025f;
+                    boxes[i * 4 + 0] += dx;
+                    boxes[i * 4 + 1] += dy;
+                    boxes[i * 4 + 2] += dx;
+                    boxes[i * 4 + 3] += dy;
+                }
+                bool changed = par_sprune_update(incremental);
+                expected = par_sprune_overlap(boxes, nboxes, expected);
+                int nexpected = expected->ncollision_pairs;
+                mismatches += incremental->ncollision_pairs != nexpected;
+                for (int i = 0; i < nexpected * 2 && !mismatches; i++) {
+                    mismatches += incremental->collision_pairs[i] !=
+                        expected->collision_pairs[i];
+                }
+                assert_equal(changed, (incremental->nadded_pairs +
+                    incremental->nremoved_pairs > 0));
+                npairs += incremental->nadded_pairs;
+                npairs -= incremental->nremoved_pairs;
+                mismatches += npairs != nexpected;
+            }
+            assert_equal(mismatches, 0);
+            par_sprune_free_context(incremental);
+            par_sprune_free_context(expected);
+            free(boxes);
+        }
+
+        it("should cull by priority without leaving overlaps") {
+            int nboxes = 2000;
+            float* boxes = malloc(sizeof(float) * nboxes * 4);
+            float* priorities = malloc(sizeof(float) * nboxes);
+            srand(3);
+            for (int i = 0; i < nboxes; i++) {
+                float x = (float) rand() / RAND_MAX;
+                float y = (float) rand() / RAND_MAX;
+                boxes[i * 4 + 0] = x;
+                boxes[i * 4 + 1] = y;
+                boxes[i * 4 + 2] = x + 0.04f;
+                boxes[i * 4 + 3] = y + 0.01f;
+                priorities[i] = (float) rand() / RAND_MAX;
+            }
+            par_sprune_context* ctx = par_sprune_overlap(boxes, nboxes, 0);
+            int strategies[] = {PAR_SPRUNE_CULL_GREEDY,
+                PAR_SPRUNE_CULL_MAXIMAL};
+            int nculled[2];
+            for (int s = 0; s < 2; s++) {
+                par_sprune_cull_priority(ctx, priorities, strategies[s]);
+                nculled[s] = ctx->nculled;
+                char* culled = calloc(nboxes, 1);
+                for (int i = 0; i < ctx->nculled; i++) {
+                    culled[ctx->culled[i]] = 1;
+                }
+                int survivors = 0;
+                for (int i = 0; i < ctx->ncollision_pairs * 2; i += 2) {
+                    int a = ctx->collision_pairs[i];
+                    int b = ctx->collision_pairs[i + 1];
+                    survivors += !culled[a] && !culled[b];
+                }
+                assert_equal(survivors, 0);
+                free(culled);
+            }
+            assert_ok(nculled[1] <= nculled[0]);
+
+            float pair[] = {0.0, 0.0, 0.2, 0.2, 0.1, 0.1, 0.3, 0.3};
+            float pairpriorities[] = {2.0, 1.0};
+            par_sprune_overlap(pair, 2, ctx);
+            par_sprune_cull_priority(ctx, pairpriorities,
+                PAR_SPRUNE_CULL_MAXIMAL);
+            assert_equal(ctx->nculled, 1);
+            assert_equal(ctx->culled[0], 1);
+            par_sprune_cull(ctx);
+            assert_equal(ctx->culled[0], 0);
+            par_sprune_free_context(ctx);
+            free(priorities);
+            free(boxes);
+        }
+
+        it("should support adding, removing, and moving boxes") {
+            int capacity = 400;
+            float* boxes = calloc(capacity * 4, sizeof(float));
+            char* alive = calloc(capacity, 1);
+            srand(4);
+            for (int i = 0; i < 200; i++) {
+                float x = (float) rand() / RAND_MAX;
+                float y = (float) rand() / RAND_MAX;
+                boxes[i * 4 + 0] = x;
+                boxes[i * 4 + 1] = y;
+                boxes[i * 4 + 2] = x + 0.05f;
+                boxes[i * 4 + 3] = y + 0.05f;
+                alive[i] = 1;
+            }
+            float* client = malloc(sizeof(float) * 200 * 4);
+            memcpy(client, boxes, sizeof(float) * 200 * 4);
+            par_sprune_context* ctx = par_sprune_overlap(client, 200, 0);
+            int npairs = ctx->ncollision_pairs;
+            int mismatches = 0;
+            for (int frame = 0; frame < 20; frame++) {
+                for (int n = 0; n < 10; n++) {
+                    int box = rand() % capacity;
+                    if (alive[box]) {
+                        par_sprune_remove(ctx, box);
+                        alive[box] = 0;
+                    }
+                }
+                for (int n = 0; n < 12; n++) {
+                    float x = (float) rand() / RAND_MAX;
+                    float y = (float) rand() / RAND_MAX;
+                    float aabb[] = {x, y, x + 0.05f, y + 0.05f};
+                    int box = par_sprune_add(ctx, aabb);
+                    assert_ok(box < capacity && !alive[box]);
+                    memcpy(boxes + box * 4, aabb, sizeof(aabb));
+                    alive[box] = 1;
+                }
+                for (int box = 0; box < capacity; box++) {
+                    if (alive[box] && rand() % 4 == 0) {
+                        boxes[box * 4 + 0] += 0.01f;
+                        boxes[box * 4 + 2] += 0.01f;
+                        par_sprune_move(ctx, box, boxes + box * 4);
+                    }
+                }
+                par_sprune_update(ctx);
+                npairs += ctx->nadded_pairs - ctx->nremoved_pairs;
+                mismatches += npairs != ctx->ncollision_pairs;
+                int k = 0;
+                for (int a = 0; a < capacity; a++) {
+                    for (int b = a + 1; b < capacity && alive[a]; b++) {
+                        float const* p = boxes + a * 4;
+                        float const* q = boxes + b * 4;
+                        if (!alive[b] || p[0] >= q[2] || q[0] >= p[2] ||
+                            p[1] >= q[3] || q[1] >= p[3]) {
+                            continue;
+                        }
+                        bool found = k < ctx->ncollision_pairs &&
+                            ctx->collision_pairs[k * 2] == a &&
+                            ctx->collision_pairs[k * 2 + 1] == b;
+                        mismatches += !found;
+                        k++;
+                    }
+                }
+                mismatches += k != ctx->ncollision_pairs;
+            }
+            assert_equal(mismatches, 0);
+            par_sprune_free_context(ctx);
+            free(client);
+            free(alive);
+            free(boxes);
+        }
+
+        it("should match the default sweep in low-memory mode") {
+            int nboxes = 1000;
+            float* boxes = malloc(sizeof(float) * nboxes * 4);
+            srand(2);
+            for (int i = 0; i < nboxes; i++) {
+                float x = (float) rand() / RAND_MAX;
+                float y = (float) rand() / RAND_MAX;
+                float w = 0.1f + 0.5f * rand() / RAND_MAX;
+                float h = 0.002f + 0.01f * rand() / RAND_MAX;
+                boxes[i * 4 + 0] = x;
+                boxes[i * 4 + 1] = y;
+                boxes[i * 4 + 2] = x + w;
+                boxes[i * 4 + 3] = y + h;
+            }
+            par_sprune_context* expected = par_sprune_overlap(boxes,
+                nboxes, 0);
+            par_sprune_context* lowmem = par_sprune_overlap_lowmem(boxes,
+                nboxes, 0);
+            int npairs = expected->ncollision_pairs;
+            assert_equal(lowmem->ncollision_pairs, npairs);
+            int mismatches = 0;
+            for (int i = 0; i < npairs * 2; i++) {
+                mismatches += lowmem->collision_pairs[i] !=
+                    expected->collision_pairs[i];
+            }
+            assert_equal(mismatches, 0);
+            boxes[0] += 0.5f;
+            boxes[2] += 0.5f;
+            par_sprune_update(lowmem);
+            par_sprune_overlap(boxes, nboxes, expected);
+            assert_equal(lowmem->ncollision_pairs, expected->ncollision_pairs);
+            par_sprune_free_context(lowmem);
+            par_sprune_free_context(expected);
+            free(boxes);
+        }
     }
 
     return assert_failures();